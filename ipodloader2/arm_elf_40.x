@@ -4,19 +4,37 @@ OUTPUT_FORMAT("elf32-littlearm", "elf32-bigarm",
 OUTPUT_ARCH(arm)
 ENTRY(_start)
 
-SECTIONS
+/*
+ * The loader runs from IRAM (Fast RAM), see startup.s. All iPods have at
+ * least 96KB of it. The top 0x1000 bytes hold the IRQ stack and what the
+ * Flash ROM uses, and the SVC stack grows down from 0x40017000 - we keep
+ * 8KB free for it. Everything else is ours, and the link fails with
+ * "region `IRAM' overflowed" if the loader doesn't fit any more.
+ */
+MEMORY
 {
-  . = 0x40000000;
+  IRAM (rwx) : ORIGIN = 0x40000000, LENGTH = 0x17000 - 0x2000
+}
 
-  .text : { *(.text) }
+SECTIONS
+{
+  .text : {
+     *(.text)
+     *(.iram_text)
+  } > IRAM
 
   __data_start__ = . ;
-  .data : { *(.data) *(.rodata) }
+  .data : {
+     *(.data)
+     *(.iram_data)
+     *(.rodata)
+     *(.rodata.*)
+  } > IRAM
 
   __bss_start__ = .;
   .bss : {
      *(.bss);
      __bss_end__ = . ;
-   }
-}
+  } > IRAM
 
+}
@@ -39,11 +39,12 @@ unsigned int pio_reg_addrs[14];
  * 8K of cache divided into 16 x 512 byte blocks.
  * When doing >512 byte reads, the drive will overwrite multiple blocks of cache,
  * and then the cache lookup table will be updated to reflect this.
+ * The blocks themselves are in SDRAM, the lookup tables are small enough for IRAM.
 */
 #define CACHE_NUMBLOCKS 16
 static uint8  *cachedata;
-static uint32 *cacheaddr;
-static uint32 *cachetick;
+static uint32  cacheaddr[CACHE_NUMBLOCKS] IRAM_DATA; // sector number of each cache block
+static uint32  cachetick[CACHE_NUMBLOCKS] IRAM_DATA; // age of each cache block, for finding LRU
 static uint32  cacheticks;
 
 /* These track the last command sent, so that if an error occurs the details can be printed. */
@@ -80,7 +81,7 @@ static inline int create_cache_entry(uint32 sector);
 static inline int find_cache_entry(uint32 sector);
 static inline inline void *get_cache_entry_buffer(int cacheindex);
 static void ata_send_read_command(uint32 lba, uint16 count);
-static uint32 ata_transfer_block(void *ptr, uint32 count);
+static uint32 ata_transfer_block(void *ptr, uint32 count) IRAM_TEXT;
 static uint32 ata_receive_read_data(void *dst, uint32 count);
 static int ata_readblock2(void *dst, uint32 sector, int useCache);
 
@@ -198,10 +199,6 @@ uint32 ata_init(void) {
 
   // cachedata holds the actual data read from the device, in CACHE_BLOCKSIZE byte blocks.
   cachedata  = (uint8 *)mlc_malloc(CACHE_NUMBLOCKS * BLOCK_SIZE);
-  // cacheaddr maps each index of the cachedata array to its sector number
-  cacheaddr  = (uint32*)mlc_malloc(CACHE_NUMBLOCKS * sizeof(uint32));
-  // cachetick maps each index of the cachedata array to its age, for finding LRU
-  cachetick  = (uint32*)mlc_malloc(CACHE_NUMBLOCKS * sizeof(uint32));
   
   /* Initialize cache */
   clear_cache();
@@ -281,6 +278,76 @@ void ata_standby(int cmd_variation)
   ata_clear_intr();
 }
 
+/*
+ * Sends a non-data command that takes its parameter in the sector count register.
+ * If wait is set, waits for its completion and returns the sector count register afterwards.
+ */
+static int ata_power_command(uint8 cmd, uint8 count, int wait)
+{
+  spinwait_drive_busy();
+  pio_outbyte( REG_DEVICEHEAD, 0xA0 | DEVICE_0 );
+  DELAY400NS;
+  pio_outbyte( REG_FEATURES  , 0 );
+  pio_outbyte( REG_SECT_COUNT, count );
+  ata_command( cmd );
+  DELAY400NS;
+  if (!wait) return 0;
+
+  spinwait_drive_busy();
+  if (pio_inbyte( REG_STATUS ) & STATUS_ERR) { // this also clears a pending interrupt
+    return -1;
+  }
+  return pio_inbyte( REG_SECT_COUNT );
+}
+
+/*
+ * Returns one of the ATA_POWER_xxx values, without waking up the drive
+ */
+int ata_check_power_mode(void)
+{
+  int mode = ata_power_command( COMMAND_CHECK_POWER_MODE, 0, 1 );
+  if (mode < 0) mode = ATA_POWER_ACTIVE; // not supported - assume the worst
+  return mode;
+}
+
+/*
+ * Lets the drive idle and has it spin down by itself after standby_secs
+ * without a command. Nothing is sent if it's already in standby, because
+ * that would spin it up again.
+ */
+void ata_idle(int standby_secs)
+{
+  int count;
+  if (ata_check_power_mode() == ATA_POWER_STANDBY) return;
+  if (standby_secs <= 0) {
+    count = 0;
+  } else if (standby_secs <= 240*5) {
+    count = (standby_secs + 4) / 5;
+  } else {
+    count = 240 + (standby_secs + 1799) / 1800;
+    if (count > 251) count = 251;
+  }
+  ata_power_command( COMMAND_IDLE, count, 1 );
+  ata_clear_intr();
+}
+
+/*
+ * Starts spinning up the drive if it's in standby, but does not wait for it.
+ * The next command waits for the drive to become ready, and ata_busy() tells
+ * whether that would take a while.
+ */
+void ata_wakeup(void)
+{
+  if (ata_check_power_mode() == ATA_POWER_STANDBY) {
+    ata_power_command( COMMAND_IDLE_IMMEDIATE, 0, 0 );
+  }
+}
+
+int ata_busy(void)
+{
+  return (pio_inbyte( REG_ALTSTATUS ) & STATUS_BSY) != 0;
+}
+
 void ata_sleep() {
   ata_command( COMMAND_SLEEP );
   DELAY400NS; DELAY400NS;
@@ -544,6 +611,9 @@ static void ata_send_read_command(uint32 lba, uint16 count) {
   last_sector = lba;
   last_sector_count = count;
 
+  /* The drive may still be spinning up after ata_wakeup() */
+  spinwait_drive_busy();
+
  /*
   * REG_DEVICEHEAD bits are:
   *
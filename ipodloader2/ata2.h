@@ -13,4 +13,14 @@ int    ata_readblocks_uncached(void *dst,uint32 sector,uint32 count);	// these r
 void   ata_standby (int cmd_variation);
 void   ata_sleep();
 
+// power modes, as returned by ata_check_power_mode()
+#define ATA_POWER_STANDBY 0x00
+#define ATA_POWER_IDLE    0x80
+#define ATA_POWER_ACTIVE  0xFF
+
+int    ata_check_power_mode (void);
+void   ata_idle (int standby_secs);	// idles the drive, which spins down after standby_secs without commands
+void   ata_wakeup (void);	// starts spinning up the drive, without waiting for it
+int    ata_busy (void);
+
 #endif
@@ -173,6 +173,27 @@
 */
 #define COMMAND_STANDBY               0xE0
 
+/* IDLE IMMEDIATE E1h
+ *
+ * This command causes the device to enter the Idle mode. A device in Standby mode spins up for this.
+*/
+#define COMMAND_IDLE_IMMEDIATE        0xE1
+
+/* IDLE E3h
+ *
+ * This command causes the device to enter the Idle mode and sets the Standby timer from the Sector Count
+ * register: 0 disables it, 1-240 mean multiples of 5 s, 241-251 mean (value - 240) * 30 min.
+ * Once the timer runs out without the device having seen a command, it enters the Standby mode by itself.
+*/
+#define COMMAND_IDLE                  0xE3
+
+/* CHECK POWER MODE E5h
+ *
+ * Returns the current power mode in the Sector Count register, without changing it:
+ * 00h Standby, 80h Idle, FFh Active or Idle.
+*/
+#define COMMAND_CHECK_POWER_MODE      0xE5
+
 /* SLEEP E6h
  *
  * This command is the only way to cause the device to enter Sleep mode.
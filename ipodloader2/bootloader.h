@@ -1,6 +1,24 @@
 #ifndef _BOOTLOADER_H_
 #define _BOOTLOADER_H_
 
+#if ONPC
+/*
+ * On a PC (e.g. with the filesystem drivers built into ipodpatcher) long
+ * may well be 64 bits wide, so take the sizes from the host's headers -
+ * the on-disk structs below depend on them.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint64_t uint64;
+typedef uint32_t uint32;
+typedef uint16_t uint16;
+typedef uint8_t  uint8;
+typedef int64_t  int64;
+typedef int32_t  int32;
+typedef int16_t  int16;
+typedef int8_t   int8;
+#else
 typedef unsigned long long uint64;
 typedef unsigned long      uint32;
 typedef unsigned short     uint16;
@@ -11,6 +29,7 @@ typedef   signed short     int16;
 typedef   signed char      int8;
 
 typedef unsigned long size_t;
+#endif
 
 #undef NULL
 #define NULL ((void*)0x0)
@@ -22,6 +41,20 @@ typedef unsigned long size_t;
 #define inb(a) (*(volatile unsigned char *) (a))
 #define outb(a,b) (*(volatile unsigned char *) (b) = (a))
 
+/*
+ * The whole loader runs from IRAM (see startup.s and arm_elf_40.x), but
+ * IRAM is small. Code and data that are hot enough to deserve it are
+ * marked with these, so that they stay there should the rest ever have
+ * to move out. Large buffers belong into SDRAM, i.e. get mlc_malloc'd.
+ */
+#if ONPC
+#define IRAM_TEXT
+#define IRAM_DATA
+#else
+#define IRAM_TEXT __attribute__ ((section (".iram_text")))
+#define IRAM_DATA __attribute__ ((section (".iram_data")))
+#endif
+
 typedef struct  {
 	uint8	status;
 	uint8	chs_start[3];
@@ -0,0 +1,104 @@
+/*
+ * cache.c
+ *
+ * Cache handling for the PP502x, following what Rockbox does in its
+ * system-pp502x.c.
+ */
+
+#include "bootloader.h"
+#include "ipodhw.h"
+#include "interrupts.h"
+#include "cache.h"
+
+#define PP5020_CACHE_CTL       0x6000c000
+#define PP5020_CACHE_MASK      0xf000f040
+#define PP5020_CACHE_OPERATION 0xf000f044
+
+#define CACHE_CTL_ENABLE       0x00000001
+#define CACHE_CTL_RUN          0x00000002
+#define CACHE_CTL_INIT         0x00000004
+#define CACHE_CTL_BUSY         0x00008000
+
+#define CACHE_OP_FLUSH         0x0002
+#define CACHE_OP_INVALIDATE    0x0004
+
+// enable_irqs() maps this much of SDRAM to address 0, and that's all the cache covers
+#define CACHED_SIZE            0x02000000
+
+static int cache_on = 0;
+static uint32 orig_ctl, orig_mask, orig_op;
+static uint32 sdram_base, sdram_size;
+
+static void cache_wait (void)
+{
+  while (inl (PP5020_CACHE_CTL) & CACHE_CTL_BUSY) { }
+  asm volatile ("nop\n nop\n nop\n nop\n");
+}
+
+void cache_init (void)
+{
+  ipod_t *ipod = ipod_get_hwinfo ();
+
+  if (cache_on || ipod->hw_ver <= 3 || !irqs_enabled ()) return;
+
+  sdram_base = ipod->mem_base;
+  sdram_size = ipod->mem_size < CACHED_SIZE ? ipod->mem_size : CACHED_SIZE;
+
+  // remember what the Flash ROM left us, so that we can leave it the same way.
+  // Rockbox, for one, won't start if it finds the cache already set up.
+  orig_ctl  = inl (PP5020_CACHE_CTL);
+  orig_mask = inl (PP5020_CACHE_MASK);
+  orig_op   = inl (PP5020_CACHE_OPERATION);
+
+  outl (orig_ctl & ~CACHE_CTL_RUN, PP5020_CACHE_CTL);
+  outl (inl (PP5020_CACHE_CTL) | CACHE_CTL_INIT, PP5020_CACHE_CTL);
+
+  // cache 0x00000000 - 0x03ffffff (and 0x20000000 - 0x23ffffff, which is the Flash ROM then)
+  outl (0x00001c00, PP5020_CACHE_MASK);
+  outl (0xfc0, PP5020_CACHE_OPERATION);
+
+  outl (inl (PP5020_CACHE_CTL) | CACHE_CTL_INIT | CACHE_CTL_ENABLE | CACHE_CTL_RUN, PP5020_CACHE_CTL);
+  asm volatile ("nop\n nop\n nop\n nop\n");
+  cache_on = 1;
+}
+
+void cache_flush (void)
+{
+  if (cache_on) {
+    outl (inl (PP5020_CACHE_OPERATION) | CACHE_OP_FLUSH, PP5020_CACHE_OPERATION);
+    cache_wait ();
+  }
+}
+
+void cache_invalidate (void)
+{
+  if (cache_on) {
+    outl (inl (PP5020_CACHE_OPERATION) | CACHE_OP_FLUSH | CACHE_OP_INVALIDATE, PP5020_CACHE_OPERATION);
+    cache_wait ();
+  }
+}
+
+void cache_exit (void)
+{
+  if (cache_on) {
+    cache_invalidate ();
+    // the image we're about to start must be all in SDRAM before the
+    // controller goes back to the Flash ROM's settings
+    cache_wait ();
+    outl (orig_ctl & ~CACHE_CTL_RUN, PP5020_CACHE_CTL);
+    outl (orig_mask, PP5020_CACHE_MASK);
+    outl (orig_op & ~(CACHE_OP_FLUSH | CACHE_OP_INVALIDATE), PP5020_CACHE_OPERATION);
+    outl (orig_ctl, PP5020_CACHE_CTL);
+    asm volatile ("nop\n nop\n nop\n nop\n");
+    cache_on = 0;
+  }
+}
+
+void *cache_addr (void *p)
+{
+  uint32 a = (uint32) p;
+  if (cache_on && a >= sdram_base && a < sdram_base + sdram_size) {
+    return (void*) (a - sdram_base);
+  }
+  return p;
+}
@@ -0,0 +1,20 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "bootloader.h"
+
+/*
+ * PP502x cache controller.
+ *
+ * The cache only covers the logical addresses from 0, where enable_irqs()
+ * maps the start of SDRAM to. So, to get cached access to an SDRAM buffer,
+ * go through cache_addr().
+ */
+
+void  cache_init (void);       // enables the cache (PP502x only, and only if SDRAM is mapped to 0)
+void  cache_exit (void);       // writes back and discards everything, then restores the original state
+void  cache_flush (void);      // writes dirty lines back to SDRAM
+void  cache_invalidate (void); // writes dirty lines back, then discards all lines
+void *cache_addr (void *p);    // returns the cached alias of an SDRAM address, or p if there's none
+
+#endif
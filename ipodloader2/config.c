@@ -137,6 +137,7 @@ void config_init(void)
     config.beep_time = 50;
     config.beep_period = 30;
     config.disable_boot_tune = 0;
+    config.fast_clock = 1;
 	 config.boot_tune = (char *)find_somewhere (tunenames, "boot tune", NULL);
 
     {
@@ -261,6 +262,8 @@ void config_init(void)
                 config.boot_tune = value;
             } else if (!mlc_strcmp (p, "ata_standby_code")) {
                 config.ata_standby_code = mlc_atoi (value);
+            } else if (!mlc_strcmp (p, "fast_clock")) {
+                config.fast_clock = mlc_atoi (value);
             } else {
                 // it's a menu item
                 if (firstitem) {
@@ -29,6 +29,7 @@ typedef struct {
   char *boot_tune;
   int16 disable_boot_tune;
   int16 ata_standby_code;
+  int16 fast_clock;
 } config_t;
 
 void      config_init(void);
@@ -10,6 +10,9 @@
 // not used currently: #include "fontsmall.h"
 
 
+// the LCD is updated at most this often while text is being printed
+#define CONSOLE_UPDATE_INTERVAL 50000 // 50ms
+
 int font_lines;
 int font_height, font_width;
 int console_printcount = 0;
@@ -30,6 +33,8 @@ static struct {
   char    cls_pending;
   char    scroll_pending;
   char    scrollMode;
+  char    update_pending;
+  unsigned long last_update;
 
   ipod_t *ipod;
 } console;
@@ -54,11 +59,28 @@ int console_suppress_fbupdate (int modify) {
   // once the counter goes back to 0, a fb_update is performed
   console_suppress_fbupdate_cnt += modify;
   if (!console_suppress_fbupdate_cnt) {
-    fb_update (console.fb);
+    console.update_pending = 1;
+    console_flush (1);
   }
   return console_suppress_fbupdate_cnt;
 }
 
+void console_flush (int force) {
+  // pushes new lines to the LCD - unless forced, only if the last update
+  // was long enough ago, so that a burst of output doesn't redraw the
+  // whole screen for every line
+  if (console.update_pending && !console_suppress_fbupdate_cnt &&
+      (force || timer_passed (console.last_update, CONSOLE_UPDATE_INTERVAL))) {
+    console.update_pending = 0;
+    fb_update (console.fb);
+    console.last_update = timer_get_current ();
+    #ifdef MSGDELAY // actually, such a delay can now be achieved using the debug option in the config file
+      unsigned int start = inl (0x60005010);
+      while (inl (0x60005010) < start + MSGDELAY) {}
+    #endif
+  }
+}
+
 void console_home()
 {
   console.cursor.x = 0;
@@ -120,13 +142,8 @@ static void console_linefeed () {
       console.cls_pending = 1; // we must delay fb_cls or we'd never see the just printed line!
     }
   }
-  if (!console_suppress_fbupdate_cnt) {
-    fb_update(console.fb);
-    #ifdef MSGDELAY // actually, such a delay can now be achieved using the debug option in the config file
-      unsigned int start = inl (0x60005010);
-      while (inl (0x60005010) < start + MSGDELAY) {}
-    #endif
-  }
+  console.update_pending = 1;
+  console_flush (0);
 }
 
 void console_putchar(char ch) {
@@ -168,6 +185,12 @@ again:
   }
 }
 
+void console_write(const char *str, int len) {
+  while (len-- > 0) {
+    console_putchar(*str++);
+  }
+}
+
 void console_puts(volatile char *str) {
   while(*str != 0) {
     console_putchar(*str);
@@ -200,6 +223,8 @@ void console_init(uint16 *fb)
   console.scrollMode  = 1;
   console.cls_pending = 1;
   console.scroll_pending = 0;
+  console.update_pending = 0;
+  console.last_update = timer_get_current ();
 
   console.fb = fb;
 }
@@ -10,6 +10,7 @@ extern const uint8 font_small[];
 void console_init(uint16 *fb);
 void console_putchar(char ch);
 void console_puts(volatile char *str);
+void console_write(const char *str, int len);
 void console_putsXY(int x,int y,volatile char *str);
 void console_printf (const char *format, ...);
 
@@ -21,6 +22,7 @@ const uint8* console_currentfont (void);
 void console_home();
 void console_clear();
 int console_suppress_fbupdate (int modify);
+void console_flush (int force);
 
 extern int font_width, font_height;
 extern int console_printcount;
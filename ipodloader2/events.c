@@ -0,0 +1,99 @@
+#include "bootloader.h"
+#include "events.h"
+
+#if !ONPC
+#include "ipodhw.h"
+#include "interrupts.h"
+#include "keypad.h"
+
+static int tick_usecs;
+static unsigned long last_tick;
+static int last_hold;
+
+static void tick_interrupt (int irq, void *dev_id, struct pt_regs *regs)
+{
+  // nothing to do - the IRQ has been acked already and we only need the wakeup
+}
+
+void events_init (int usecs)
+{
+  tick_usecs = usecs;
+  last_tick = timer_get_current ();
+  last_hold = -1; // makes the first call report the hold state
+  timer_tick_start (tick_usecs, tick_interrupt); // if this fails, events_get() simply polls
+}
+
+void events_exit (void)
+{
+  timer_tick_stop ();
+}
+
+int events_get (event_t *ev, int wait)
+{
+  for (;;) {
+    ev->time = timer_get_current ();
+    ev->hold = isHoldEngaged ();
+    ev->key = 0;
+    if (ev->hold != last_hold) {
+      last_hold = ev->hold;
+      return ev->type = EVENT_HOLD;
+    }
+    if ((ev->key = keypad_getkey ()) != 0) {
+      return ev->type = EVENT_KEY;
+    }
+    if (timer_passed (last_tick, tick_usecs)) {
+      last_tick = ev->time;
+      return ev->type = EVENT_TICK;
+    }
+    if (!wait) {
+      return ev->type = EVENT_NONE;
+    }
+    wait_for_irq (); // key IRQ or timer tick, or returns at once if we have to poll
+  }
+}
+
+#else // ONPC
+
+/*
+ * On the PC the events come from a script instead, so that the menu
+ * logic can be run with a defined sequence of keys and times. Events
+ * with the same time as the one before count as already queued up,
+ * later ones are only handed out when the caller waits.
+ */
+
+static const event_t *script;
+static int script_len, script_pos;
+
+void events_script (const event_t *s, int count)
+{
+  script = s;
+  script_len = count;
+  script_pos = 0;
+}
+
+void events_init (int usecs)
+{
+}
+
+void events_exit (void)
+{
+}
+
+int events_get (event_t *ev, int wait)
+{
+  if (script_pos < script_len &&
+      (wait || !script_pos || script[script_pos].time <= script[script_pos-1].time)) {
+    *ev = script[script_pos++];
+  } else if (script_pos < script_len) {
+    *ev = script[script_pos-1];
+    ev->type = EVENT_NONE;
+    ev->key = 0;
+  } else {
+    if (script_len) *ev = script[script_len-1]; // keeps the last time and hold state
+    ev->type = wait ? EVENT_END : EVENT_NONE;
+    ev->key = 0;
+  }
+  return ev->type;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include "bootloader.h"
+
+/*
+ * Event source for the menu loop. Instead of spinning on the keypad and
+ * the timer, the loop asks for the next event and the CPU sleeps until a
+ * key IRQ or the timer tick wakes it up.
+ */
+
+#define EVENT_NONE 0 // nothing pending (only returned if not waiting)
+#define EVENT_KEY  1 // a key was pressed, see "key"
+#define EVENT_HOLD 2 // the hold switch changed, see "hold" (also sent once at start)
+#define EVENT_TICK 3 // a tick interval passed, time to check the timeouts
+#define EVENT_END  4 // the event script ran out (ONPC only)
+
+typedef struct {
+  int type;
+  int key;            // IPOD_KEY_xxx for EVENT_KEY
+  int hold;           // current state of the hold switch
+  unsigned long time; // timer value at the time of the event
+} event_t;
+
+void events_init (int tick_usecs);
+void events_exit (void);
+int  events_get (event_t *ev, int wait); // returns ev->type
+
+#if ONPC
+void events_script (const event_t *script, int count);
+#endif
+
+#endif
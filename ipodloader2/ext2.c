@@ -158,7 +158,13 @@ static void ext2_getinode(inode_t *ptr,uint32 num) {
   group = num / ext2->super.s_inodes_per_group;
   num  %= ext2->super.s_inodes_per_group;
 
-  group_offset = (num * sizeof(inode_t));
+  /* revision 0 filesystems always have 128 byte inodes, later ones say
+     how big they are (mke2fs makes them 256 bytes nowadays) */
+  if( ext2->super.s_rev_level >= 1 && ext2->super.s_inode_size != 0 ) {
+    group_offset = num * ext2->super.s_inode_size;
+  } else {
+    group_offset = (num * sizeof(inode_t));
+  }
   block = ext2->groups[group].bg_inode_table + group_offset / (1024 << ext2->super.s_log_block_size);
   off   = group_offset % (1024 << ext2->super.s_log_block_size);
 
@@ -179,7 +185,7 @@ static void ext2_getblockgroup(void) {  /* gets our groups of blocks descriptor
 
   if (!buff) buff = mlc_malloc (512);
 
-  while(read < numgroups * sizeof(group_t))
+  while(read < numgroups * (int)sizeof(group_t))
     {
       ata_readblocks(buff, block++, 1);
       mlc_memcpy(dest + read, buff, ext2_min(512, (numgroups * sizeof(group_t)) - read));
@@ -227,6 +233,45 @@ static ext2_file *ext2_findfile(char *fname) {
   return(ret);
 }
 
+static int ext2_listdir(void *fsdata, char *dirname, vfs_dir_callback cb, void *ctx) {
+  ext2_file *dir;
+  dir_t      d;
+  inode_t    inode;
+  uint32     diroff;
+  char       name[256];
+  vfs_dirent entry;
+
+  (void)fsdata; /* we only support one ext2 partition - see ext2_newfs */
+
+  dir = ext2_findfile(dirname);
+  if( dir == NULL || (dir->inode.i_mode & 0xF000) != 0x4000 ) {
+    return(-1);
+  }
+
+  diroff = 0;
+  while( diroff < dir->inode.i_size ) {
+    ext2_readdata(&dir->inode,&d,diroff,sizeof(d));
+    if( d.rec_len == 0 ) break;
+
+    if( d.inode != 0 && !(d.name_len == 1 && d.name[0] == '.') &&
+        !(d.name_len == 2 && d.name[0] == '.' && d.name[1] == '.') ) {
+      ext2_getinode(&inode,d.inode);
+
+      mlc_memcpy(name,d.name,d.name_len);
+      name[d.name_len] = 0;
+
+      entry.name  = name;
+      entry.size  = inode.i_size;
+      entry.isdir = (inode.i_mode & 0xF000) == 0x4000;
+      if( cb(ctx,&entry) ) break;
+    }
+
+    diroff += d.rec_len;
+  }
+
+  return(0);
+}
+
 static int ext2_open(void *fsdata,char *fname) {
   ext2_t    *fs;
   ext2_file *file;
@@ -249,7 +294,7 @@ static int ext2_open(void *fsdata,char *fname) {
 static void ext2_close (void *fsdata, int fd)
 {
   ext2_t *fs = (ext2_t*)fsdata;
-  if (fd == fs->numHandles-1) {
+  if (fd == (int)fs->numHandles-1) {
     --fs->numHandles;
   }
 }
@@ -331,6 +376,7 @@ void ext2_newfs(uint8 part,uint32 offset) {
   myfs.tell       = ext2_tell;
   myfs.read       = ext2_read;
   myfs.getinfo    = 0;
+  myfs.listdir    = ext2_listdir;
   myfs.partnum    = part;
   myfs.type       = EXT2;
 
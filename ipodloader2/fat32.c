@@ -55,6 +55,7 @@ typedef struct {
 static fat_t fat;
 
 static uint8 *clusterBuffer = NULL;
+static uint32 clusterBufferSize = 0;
 
 /*
  * This caches a single FAT sector and is at least the length of the FAT sector size.
@@ -306,7 +307,7 @@ static int getNextCompleteEntry (dir_state *dstate, char* *shortnameOut, char* *
        * in the output file name string.
        */
       int offset = 13 * ((slot->seq & 0x1F) - 1);
-      if (offset >= 0 && offset < ((sizeof(longname) - 1) - 13) && !(slot->seq & 0x80)) {
+      if (offset >= 0 && offset < (int)((sizeof(longname) - 1) - 13) && !(slot->seq & 0x80)) {
         if (slot->seq & 0x40) {
           /*
            * 0x40 bit set indicates we have discovered the first physical
@@ -415,6 +416,87 @@ static fat32_file *fat32_findfile(uint32 startCluster, int isRoot, char *fname)
   return 0; // end of dir
 }
 
+/*
+ * Finds the directory at the given path ("" for the root directory) and
+ * returns its first cluster.
+ */
+static int fat32_finddir(fat_t *fs, char *dirname, uint32 *dirCluster, int *isRoot)
+{
+  uint32 flength, cluster;
+  uint8  ftype;
+  char *shortname, *longname;
+
+  *dirCluster = fs->root_dir_first_cluster;
+  *isRoot = 1;
+
+  while (*dirname) {
+    char *next = mlc_strchr( dirname, '/' );
+    int len = next ? next - dirname : (int)mlc_strlen( dirname );
+    dir_state dstate = {*isRoot, 0, *dirCluster, 0};
+    int found = 0;
+
+    while ( getNextCompleteEntry (&dstate, &shortname, &longname, &cluster, &flength, &ftype) ) {
+      if ( (ftype & 0x18) == 0x10 &&
+           ((mlc_strncasecmp( shortname, dirname, len ) == 0 && shortname[len] == '\0')
+            || (mlc_strncasecmp( longname, dirname, len ) == 0 && longname[len] == '\0')) ) {
+        found = 1;
+        break;
+      }
+    }
+    if (!found) return -1;
+
+    if (cluster == 0) {
+      // a ".." entry pointing back at the root directory
+      *dirCluster = fs->root_dir_first_cluster;
+      *isRoot = 1;
+    } else {
+      *dirCluster = cluster;
+      *isRoot = 0;
+    }
+
+    dirname += len;
+    if (*dirname == '/') dirname++;
+  }
+
+  return 0;
+}
+
+/*
+ * Lists a directory. The callback must not access the filesystem, as the
+ * directory is read through the shared cluster buffer.
+ */
+static int fat32_listdir(void *fsdata, char *dirname, vfs_dir_callback cb, void *ctx)
+{
+  fat_t *fs = (fat_t*)fsdata;
+  uint32 dirCluster, flength, cluster;
+  uint8  ftype;
+  int    isRoot;
+  char *shortname, *longname;
+  vfs_dirent entry;
+
+  if (fat32_finddir (fs, dirname, &dirCluster, &isRoot) < 0) {
+    return -1;
+  }
+
+  dir_state dstate = {isRoot, 0, dirCluster, 0};
+  while ( getNextCompleteEntry (&dstate, &shortname, &longname, &cluster, &flength, &ftype) ) {
+    if (*shortname == 0 || (ftype & 0x08)) {
+      // deleted entry or volume label
+      continue;
+    }
+    if (mlc_strcmp (shortname, ".") == 0 || mlc_strcmp (shortname, "..") == 0) {
+      continue;
+    }
+
+    entry.name  = longname[0] ? longname : shortname;
+    entry.size  = flength;
+    entry.isdir = (ftype & 0x10) != 0;
+    if (cb (ctx, &entry)) break;
+  }
+
+  return 0;
+}
+
 static int fat32_open(void *fsdata,char *fname) {
   fat_t      *fs;
   fat32_file *file;
@@ -439,7 +521,7 @@ static int fat32_open(void *fsdata,char *fname) {
 static void fat32_close (void *fsdata, int fd)
 {
   fat_t *fs = (fat_t*)fsdata;
-  if (fd == fs->numHandles-1) {
+  if (fd == (int)fs->numHandles-1) {
     --fs->numHandles;
   }
   /* If mlc_free existed, we would mlc_free(fs->filehandles[fd]) here */
@@ -455,9 +537,10 @@ static size_t fat32_read(void *fsdata,void *ptr,size_t size,size_t nmemb,int fd)
 
   read   = 0;
   toRead = size*nmemb;
-  if( toRead > (fs->filehandles[fd]->length + fs->filehandles[fd]->position) ) {
-    toRead = fs->filehandles[fd]->length + fs->filehandles[fd]->position;
+  if( toRead > (fs->filehandles[fd]->length - fs->filehandles[fd]->position) ) {
+    toRead = fs->filehandles[fd]->length - fs->filehandles[fd]->position;
   }
+  if( toRead == 0 ) return 0;
 
   /*
    * FFWD to the cluster we're positioned at
@@ -485,7 +568,7 @@ static size_t fat32_read(void *fsdata,void *ptr,size_t size,size_t nmemb,int fd)
   read += toReadInCluster;
 
   /* Loops through all complete clusters */
-  while(read < ((toRead / fs->bytes_per_cluster)*fs->bytes_per_cluster) ) {
+  while( toRead - read >= fs->bytes_per_cluster ) {
     cluster = fat32_findnextcluster( cluster );
     lba = calc_lba (cluster, 0);
     ata_readblocks( clusterBuffer, lba, fs->blks_per_cluster );
@@ -692,8 +775,10 @@ void fat32_newfs(uint8 part,uint32 offset) {
    */
   gFATSectorBuf = bpb;
 
-  if( clusterBuffer == NULL ) {
+  /* A partition mounted again may have larger clusters than the last one */
+  if( clusterBufferSize < fat.bytes_per_cluster ) {
     clusterBuffer = (uint8*)mlc_malloc( fat.bytes_per_cluster );
+    clusterBufferSize = fat.bytes_per_cluster;
   }
 
   /* TODO: MyFS Should be malloc'd every time! Otherwise it gets overwritten by any other FAT parititon */
@@ -704,6 +789,7 @@ void fat32_newfs(uint8 part,uint32 offset) {
   myfs.seek    = fat32_seek;
   myfs.read    = fat32_read;
   myfs.getinfo = 0;
+  myfs.listdir = fat32_listdir;
   myfs.fsdata  = (void*)&fat;
   myfs.partnum = part;
   myfs.type    = FAT32;
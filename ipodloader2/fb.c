@@ -1,5 +1,7 @@
 #include "bootloader.h"
 #include "ipodhw.h"
+#include "minilibc.h"
+#include "fb.h"
 
 #define R_START_OSC             0x00
 #define R_DRV_OUTPUT_CONTROL    0x01
@@ -78,27 +80,47 @@ static unsigned lcd_bcm_read32(unsigned address) {
   return inw(0x30000000) | inw(0x30000000) << 16;
 }
 
+/*
+ * The BCM takes a while to move a new frame to the LCD. Instead of waiting
+ * for that right after sending the pixels, we only start it and wait before
+ * the next access to the BCM, so that the time overlaps with whatever the
+ * loader does next (e.g. reading the next chunk of an image).
+ */
+static int bcm_update_pending = 0;
+
 static void lcd_bcm_finishup(void) {
-  unsigned data; 
   outw(0x31, 0x30030000); 
   lcd_bcm_read32(0x1FC);
-  do {
-    data = lcd_bcm_read32(0x1F8);
-  } while (data == 0xFFFA0005 || data == 0xFFFF);
-  lcd_bcm_read32(0x1FC);
+  bcm_update_pending = 1;
 }
 
-
-static uint8 LUMA565(uint16 val) {
-  uint16 calc; 
-  calc  = (val>>11)<<3;
-  calc += ((val>>5)&0x3F)<<2;
-  calc += (val&0x1F)<<3;
-  calc = calc / 3;
-  if (calc > 0xFF) calc = 0xFF;
-  return calc;
+static void lcd_bcm_wait_update(void) {
+  unsigned data; 
+  if (bcm_update_pending) {
+    do {
+      data = lcd_bcm_read32(0x1F8);
+    } while (data == 0xFFFA0005 || data == 0xFFFF);
+    lcd_bcm_read32(0x1FC);
+    bcm_update_pending = 0;
+  }
 }
 
+
+/*
+ * RGB565 to 2bpp conversion for the grayscale LCDs.
+ *
+ * The luma is ((r<<3) + (g<<2) + (b<<3)) / 3, and we keep its top 2 bits,
+ * which comes down to (2r + g + 2b) / 48. So the channels only need to be
+ * masked and added, and a small table does the division.
+ */
+static uint8 gray2_lut[2*31 + 63 + 2*31 + 1] IRAM_DATA;
+
+#define GRAY2(val) gray2_lut[(((val) >> 10) & 0x3e) + (((val) >> 5) & 0x3f) + (((val) & 0x1f) << 1)]
+
+// what the LCD currently shows, as 16 bit words of 8 pixels each
+static uint16 *shadow_2bpp;
+static int shadow_2bpp_valid;
+
 uint16 fb_rgb(int r, int g, int b) {
   uint16 rgb;
   if (r < 0) r = 0;
@@ -184,6 +206,7 @@ static void fb_565_bitblt(uint16 *x, int sx, int sy, int mx, int my) {
     lcd_send_lo(0x22);
   } else { /* 5G */
     unsigned count = (width * height) << 1;
+    lcd_bcm_wait_update();
     lcd_bcm_setup_rect(0x34, rect1, rect2, rect3, rect4, count);
   }
   
@@ -249,37 +272,85 @@ static void fb_565_bitblt(uint16 *x, int sx, int sy, int mx, int my) {
 
 static void fb_2bpp_bitblt(uint16 *fb, int sx, int sy, int mx, int my) {
   int y;
+  int words = ipod->lcd_width >> 3;
 
   sx >>= 3;
   mx >>= 3;
   
   for ( y = sy; y < my; y++ ) {
-    int x;
+    int x, last = -1;
+    uint16 *src = fb + y * ipod->lcd_width + (sx << 3);
+    uint16 *shadow = shadow_2bpp + y * words;
 
-    lcd_cmd_and_data16(R_RAM_ADDR_SET, (y << 5) + 20); // sets the cursor
-    lcd_prepare_cmd(R_RAM_DATA); // intro for the data to come
-    
+    /* RGB565 to 2BPP downsampling, noting the last word that changed */
     for ( x = sx; x < mx; x++ ) {
-      uint16 pix = 0;
-
-      /* RGB565 to 2BPP downsampling */
-      for (unsigned i = 0; i < 8; ++i) {
-        uint8 v = LUMA565( *fb++ ) >> 6;
-        pix = (pix << 2) | v;
+      uint16 pix;
+      pix = (GRAY2(src[0]) << 14) | (GRAY2(src[1]) << 12) |
+            (GRAY2(src[2]) << 10) | (GRAY2(src[3]) <<  8) |
+            (GRAY2(src[4]) <<  6) | (GRAY2(src[5]) <<  4) |
+            (GRAY2(src[6]) <<  2) |  GRAY2(src[7]);
+      src += 8;
+      if (pix != shadow[x] || !shadow_2bpp_valid) {
+        shadow[x] = pix;
+        last = x;
       }
+    }
 
-      /* send 2 bytes (8 pixels) */
-      lcd_send_data(pix >> 8, pix & 0xFF);
+    if (last < sx) {
+      continue; // nothing changed in this row
     }
+
+    lcd_cmd_and_data16(R_RAM_ADDR_SET, (y << 5) + 20); // sets the cursor
+    lcd_prepare_cmd(R_RAM_DATA); // intro for the data to come
+    
+    /* send 2 bytes (8 pixels) at a time, up to the last changed one -
+       the rest of the row is already on the LCD */
+    for ( x = sx; x <= last; x++ ) {
+      lcd_send_data(shadow[x] >> 8, shadow[x] & 0xFF);
+    }
+  }
+
+  if (sx == 0 && sy == 0 && mx == words && my == ipod->lcd_height) {
+    shadow_2bpp_valid = 1;
   }
 }
 
 
 void fb_update(uint16 *x) {
-  if( ipod->lcd_is_grayscale ) 
-    fb_2bpp_bitblt(x,0,0,ipod->lcd_width,ipod->lcd_height);
-  else
-    fb_565_bitblt(x,0,0,ipod->lcd_width,ipod->lcd_height);
+  fb_update_rect(x,0,0,ipod->lcd_width,ipod->lcd_height);
+}
+
+void fb_update_rect(uint16 *x, int left, int top, int width, int height) {
+  int right = left + width;
+  int bottom = top + height;
+
+  if (left < 0) left = 0;
+  if (top < 0) top = 0;
+  if (right > ipod->lcd_width) right = ipod->lcd_width;
+  if (bottom > ipod->lcd_height) bottom = ipod->lcd_height;
+
+  if( ipod->lcd_is_grayscale ) {
+    // whole rows - the LCD cursor can only be set to the start of a row,
+    // and the shadow buffer keeps unchanged words from being sent anyway
+    left = 0;
+    right = ipod->lcd_width;
+    if (left < right && top < bottom)
+      fb_2bpp_bitblt(x,left,top,right,bottom);
+  } else {
+    // pixels are sent in pairs
+    left &= ~1;
+    right = (right + 1) & ~1;
+    if (left < right && top < bottom)
+      fb_565_bitblt(x,left,top,right,bottom);
+  }
+}
+
+void fb_sync(void) {
+  // makes sure the last update has reached the LCD, e.g. before we hand
+  // over to another program
+  if (ipod->lcd_type == 5) {
+    lcd_bcm_wait_update();
+  }
 }
 
 
@@ -297,6 +368,15 @@ void fb_init(void) {
   ipod = ipod_get_hwinfo();
   hw_ver = ipod->hw_ver;
 
+  if (ipod->lcd_is_grayscale) {
+    int i;
+    for (i = 0; i < sizeof (gray2_lut); i++) {
+      gray2_lut[i] = i / 48;
+    }
+    shadow_2bpp = (uint16*)mlc_malloc ((ipod->lcd_width >> 3) * ipod->lcd_height * 2);
+    shadow_2bpp_valid = 0;
+  }
+
   if (hw_ver == 0x4 || hw_ver == 0x7) {
     /* driver output control - 160x112 (ipod mini) */
     lcd_cmd_and_data_hi_lo(0x1, 0x1, 0xd);
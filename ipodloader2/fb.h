@@ -10,6 +10,8 @@
 void fb_init(void);
 
 void fb_update(uint16 *x);
+void fb_update_rect(uint16 *x, int left, int top, int width, int height);
+void fb_sync(void); // waits for an update still in progress
 void fb_cls(uint16 *x,uint16 val);
 uint16 fb_rgb(int r, int g, int b); // takes values between 0 and 255
 void fb_rgbsplit (uint16 rgb, uint8 *r, uint8 *g, uint8 *b);
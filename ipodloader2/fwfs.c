@@ -103,7 +103,7 @@ static int fwfs_open(void *fsdata,char *fname) {
 static void fwfs_close (void *fsdata, int fd)
 {
   fwfs_t *fs = (fwfs_t*)fsdata;
-  if (fd == fs->numHandles-1) {
+  if (fd == (int)fs->numHandles-1) {
     --fs->numHandles;
   }
 }
@@ -116,6 +116,9 @@ static size_t fwfs_read(void *fsdata,void *ptr,size_t size,size_t nmemb,int fd)
 
   read   = 0;
   toRead = size * nmemb;
+  if( toRead > fs->filehandle[fd].length - fs->filehandle[fd].position ) {
+    toRead = fs->filehandle[fd].length - fs->filehandle[fd].position;
+  }
   off    = fs->filehandle[fd].devOffset + fs->filehandle[fd].position + (fs->offset * 512);
   if (fs->head.version == 3) {
     off += 512;
@@ -126,8 +129,9 @@ static size_t fwfs_read(void *fsdata,void *ptr,size_t size,size_t nmemb,int fd)
 
   if( off != 0 ) { /* Need to read a partial block at first */
     ata_readblocks( gBlkBuf, block, 1 );
-    mlc_memcpy( ptr, gBlkBuf + off, 512 - off );
-    read += 512 - off;
+    read = 512 - off;
+    if( read > toRead ) read = toRead;
+    mlc_memcpy( ptr, gBlkBuf + off, read );
     block++;
   }
 
@@ -137,10 +141,12 @@ static size_t fwfs_read(void *fsdata,void *ptr,size_t size,size_t nmemb,int fd)
     read  += 512;
     block++;
   }
-  ata_readblocks( gBlkBuf, block, 1 );
-  mlc_memcpy( (uint8*)ptr+read, gBlkBuf, toRead - read );
+  if( read < toRead ) {
+    ata_readblocks( gBlkBuf, block, 1 );
+    mlc_memcpy( (uint8*)ptr+read, gBlkBuf, toRead - read );
 
-  read += (toRead - read);
+    read += (toRead - read);
+  }
 
   fs->filehandle[fd].position += read;
 
@@ -181,6 +187,32 @@ static int fwfs_seek(void *fsdata,int fd,long offset,int whence) {
   return 0;
 }
 
+/* The firmware partition has no directories, just the images */
+static int fwfs_listdir (void *fsdata, char *dirname, vfs_dir_callback cb, void *ctx) {
+  fwfs_t *fs;
+  uint32 i;
+  char name[5];
+  vfs_dirent entry;
+
+  fs = (fwfs_t*)fsdata;
+
+  if( *dirname ) return(-1);
+
+  for(i=0;i<MAX_IMAGES;i++) {
+    if( (fs->image[i].type == 0xFFFFFFFF) || (fs->image[i].type == 0x0) ) continue;
+
+    mlc_memcpy( name, &fs->image[i].type, 4 );
+    name[4] = 0;
+
+    entry.name  = name;
+    entry.size  = fs->image[i].len;
+    entry.isdir = 0;
+    if( cb(ctx,&entry) ) break;
+  }
+
+  return(0);
+}
+
 static int fwfs_getinfo (void *fsdata, int fd, long *out_chksum) {
   fwfs_t *fs;
   fs = (fwfs_t*)fsdata;
@@ -243,6 +275,7 @@ void fwfs_newfs(uint8 part,uint32 offset) {
   myfs.seek    = fwfs_seek;
   myfs.read    = fwfs_read;
   myfs.getinfo = fwfs_getinfo;
+  myfs.listdir = fwfs_listdir;
   myfs.fsdata  = (void*)&fwfs;
   myfs.partnum = part;
   myfs.type    = FWFS;
@@ -108,6 +108,11 @@ struct irqdesc irq_desc[NR_IRQS];
 #define PP5020_TIMER2_ACK   0x6000500c
 #define PP5020_TIMER_STATUS 0x60005010
 
+#define PP5002_CPU_CTL      0xcf004054
+#define PP5002_PROC_SLEEP   0xca
+#define PP5020_CPU_CTL      0x60007000
+#define PP5020_PROC_SLEEP   0x80000000
+
 
 static void pp5002_unmask_irq(unsigned int irq)
 {
@@ -366,6 +371,7 @@ void enable_irq (unsigned int irq)
 
 static int intrs_enabled = 0;
 static int intrs_inited = 0;
+static int tick_irq = -1;
 
 int irqs_enabled ()
 {
@@ -377,6 +383,7 @@ void init_irqs (void)
   int ipod_hw_ver = ipod_get_hwinfo()->hw_ver;
   cpu_is_502x = ipod_hw_ver > 3;
   mlc_memset (irq_desc, 0, sizeof (irq_desc));
+  tick_irq = -1;
   ipod_init_irq (ipod_hw_ver); // assigns interrupt masking handlers
   intrs_inited = 1;
 }
@@ -391,11 +398,54 @@ void enable_irqs (void)
   }
 }
 
+int timer_tick_start (int usecs, handle_irq handler)
+// Runs TIMER1 as a periodic interrupt every "usecs" microseconds.
+// The IRQ gets acknowledged by mask_ack, so the handler needs to do nothing but note the tick.
+{
+  unsigned long timer = cpu_is_502x ? PP5020_TIMER1 : PP5002_TIMER1;
+  int irq = cpu_is_502x ? PP5020_TIMER1_IRQ : PP5002_TIMER1_IRQ;
+
+  if (!intrs_enabled || usecs <= 0) return -1;
+  outl (0, timer);
+  inl (timer + 4); // clears a pending tick
+  if (tick_irq < 0) {
+    if (request_irq (irq, handler, 0, 0) < 0) return -1;
+    tick_irq = irq;
+  } else {
+    enable_irq (tick_irq);
+  }
+  outl (0xc0000000 | (usecs - 1), timer); // enable, repeat
+  return 0;
+}
+
+void timer_tick_stop (void)
+{
+  if (tick_irq >= 0) {
+    disable_irq (tick_irq);
+    outl (0, cpu_is_502x ? PP5020_TIMER1 : PP5002_TIMER1);
+  }
+}
+
+void wait_for_irq (void)
+// Puts the CPU to sleep until the next interrupt arrives.
+// The ARM7TDMI has no WFI instruction, but the PP's CPU control register can halt the core.
+// Without an IRQ handler in place nothing would wake us up again, so we return right away then.
+{
+  if (!intrs_enabled) return;
+  if (cpu_is_502x) {
+    outl (PP5020_PROC_SLEEP, PP5020_CPU_CTL);
+  } else {
+    outb (PP5002_PROC_SLEEP, PP5002_CPU_CTL);
+  }
+  asm volatile ("nop\n nop\n nop\n");
+}
+
 void exit_irqs (void)
 {
   int i;
   __cli();
   intrs_inited = 0;
+  timer_tick_stop ();
   for (i = 0; i < NR_IRQS; ++i) disable_irq (i);
   restore_intr_handler ();
   remap_memory (0);
@@ -57,4 +57,8 @@ void exit_irqs (void);
 void enable_irqs (void);
 int  irqs_enabled (); // returns boolean whether the irq system is initialized
 
+int  timer_tick_start (int usecs, handle_irq handler); // periodic TIMER1 interrupt, returns <0 if not possible
+void timer_tick_stop (void);
+void wait_for_irq (void); // sleeps until the next interrupt, returns at once if IRQs are not enabled
+
 #endif
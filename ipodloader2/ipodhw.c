@@ -1,6 +1,7 @@
 #include "bootloader.h"
 #include "ipodhw.h"
 #include "minilibc.h"
+#include "console.h"
 
 #define LCD_DATA 0x10
 #define LCD_CMD  0x08
@@ -250,6 +251,7 @@ void pcf_standby_mode(void)
 void ipod_beep(int duration_ms, int period)
   // period: 40=2286Hz, 30=3024Hz, 20=4465Hz, 10=8547Hz
 {
+  console_flush (1); // let the user see what was printed while we spin below
   if (ipod.hw_ver >= 4) {
     if (duration_ms == 0 && period == 0) {
       // both values 0 -> make a click
@@ -271,6 +273,103 @@ void ipod_beep(int duration_ms, int period)
 }
 
 
+/*
+ * CPU clock
+ *
+ * The Flash ROM leaves the PLL at a slow default. While we load images,
+ * we run at the chip's safe maximum and put back exactly what we found
+ * before the loaded image gets started. All our delays are based on the
+ * usec timer, which doesn't depend on the CPU clock, so nothing needs to
+ * be recalibrated.
+ */
+
+#define PP5002_CLOCK_BASE     0xcf005000
+#define PP5020_CLOCK_SOURCE   0x60006020
+#define PP5020_PLL_CONTROL    0x60006034
+#define PP5020_PLL_STATUS     0x6000603c
+
+static const struct {
+  uint32 pll_control;
+  uint32 pll_unlock;  // written to PLL_STATUS to allow more than 66MHz, 0 to wait for the lock bit instead
+} pp502x_fast_clock[2] = {
+  { 0x8a020a03, 0xd19b }, // PP5020: 80MHz = 24MHz * 10/3
+  { 0x8a121403, 0      }, // PP5022: 80MHz = 24MHz * 20/3 / 2
+};
+
+// PP5002: 75MHz = 24MHz / 8 * 25
+#define PP5002_FAST_PREDIV    8
+#define PP5002_FAST_POSTMULT  25
+
+static int    clock_raised = 0;
+static uint32 saved_clock[5];
+
+static void pp502x_wait_pll (uint32 unlock)
+{
+  if (unlock) {
+    mlc_delay_us (500);
+  } else {
+    unsigned long start = timer_get_current ();
+    while (!(inl (PP5020_PLL_STATUS) & 0x80000000) && !timer_passed (start, 10000)) { }
+  }
+}
+
+static void pp502x_set_pll (uint32 pll, uint32 unlock)
+{
+  outl (pll, PP5020_PLL_CONTROL);
+  if (unlock) {
+    outl (unlock, PP5020_PLL_STATUS);
+    outl (pll, PP5020_PLL_CONTROL); // needs to be repeated after the unlock
+  }
+  if (pll & 0x80000000) pp502x_wait_pll (unlock);
+}
+
+void ipod_set_fast_clock (void)
+{
+  if (clock_raised) return;
+  if (ipod.hw_ver > 3) {
+    int i = ipod_is_pp5022 ();
+    saved_clock[0] = inl (PP5020_CLOCK_SOURCE);
+    saved_clock[1] = inl (PP5020_PLL_CONTROL);
+    outl ((saved_clock[0] & 0x0fffff0f) | 0x20000020, PP5020_CLOCK_SOURCE); // run from 24MHz while the PLL changes
+    pp502x_set_pll (pp502x_fast_clock[i].pll_control, pp502x_fast_clock[i].pll_unlock);
+    outl ((saved_clock[0] & 0x0fffff0f) | 0x20000070, PP5020_CLOCK_SOURCE); // run from the PLL
+  } else {
+    saved_clock[0] = inl (PP5002_CLOCK_BASE + 0x08);
+    saved_clock[1] = inl (PP5002_CLOCK_BASE + 0x0c);
+    saved_clock[2] = inl (PP5002_CLOCK_BASE + 0x10);
+    saved_clock[3] = inl (PP5002_CLOCK_BASE + 0x18);
+    saved_clock[4] = inl (PP5002_CLOCK_BASE + 0x1c);
+    outl (0x02, PP5002_CLOCK_BASE + 0x08);
+    outl (0x55, PP5002_CLOCK_BASE + 0x0c); // run from 24MHz while the PLL changes
+    outl (0x6000, PP5002_CLOCK_BASE + 0x10);
+    outl (PP5002_FAST_PREDIV, PP5002_CLOCK_BASE + 0x18);
+    outl (PP5002_FAST_POSTMULT, PP5002_CLOCK_BASE + 0x1c);
+    outl (0xe000, PP5002_CLOCK_BASE + 0x10);
+    mlc_delay_us (2000); // wait for the PLL to lock
+    outl (0xa8, PP5002_CLOCK_BASE + 0x0c); // run from the PLL
+  }
+  clock_raised = 1;
+}
+
+void ipod_restore_clock (void)
+{
+  if (!clock_raised) return;
+  if (ipod.hw_ver > 3) {
+    outl ((inl (PP5020_CLOCK_SOURCE) & 0x0fffff0f) | 0x20000020, PP5020_CLOCK_SOURCE);
+    pp502x_set_pll (saved_clock[1], pp502x_fast_clock[ipod_is_pp5022 ()].pll_unlock);
+    outl (saved_clock[0], PP5020_CLOCK_SOURCE);
+  } else {
+    outl (0x55, PP5002_CLOCK_BASE + 0x0c);
+    outl (saved_clock[3], PP5002_CLOCK_BASE + 0x18);
+    outl (saved_clock[4], PP5002_CLOCK_BASE + 0x1c);
+    outl (saved_clock[2], PP5002_CLOCK_BASE + 0x10);
+    mlc_delay_us (2000);
+    outl (saved_clock[0], PP5002_CLOCK_BASE + 0x08);
+    outl (saved_clock[1], PP5002_CLOCK_BASE + 0x0c);
+  }
+  clock_raised = 0;
+}
+
 /* wait for LCD with timeout */
 void lcd_wait_ready(void) {
   if ((inl(ipod.lcd_base) & ipod.lcd_busy_mask) != 0) {
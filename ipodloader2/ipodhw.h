@@ -140,5 +140,7 @@ void ipod_reboot (void);
 void pcf_standby_mode(void);
 void ipod_i2c_init(void);
 void ipod_beep(int duration_ms, int period);
+void ipod_set_fast_clock(void);
+void ipod_restore_clock(void);
 
 #endif
@@ -6,22 +6,46 @@
 #include "console.h"
 #include "keypad.h"
 
-static uint8 kbd_state = 0;
+static volatile uint8 kbd_state = 0;
 static int ipod_hw_ver;
 
-static uint8 kbdbuf[4];
-static int kbdbufelems = 0;
+/*
+ * Key buffer - a ring with a single producer (add_keypress, which runs in
+ * the keyboard IRQ handlers) and a single consumer (keypad_getkey). Each
+ * side only writes its own index, so no locking is needed. The indices
+ * run freely and are masked when used.
+ */
+#define KBDBUF_SIZE 4 // must be a power of 2
+static volatile uint8 kbdbuf[KBDBUF_SIZE];
+static volatile unsigned int kbdbuf_head = 0; // written by add_keypress only
+static volatile unsigned int kbdbuf_tail = 0; // written by keypad_getkey only
+
+// without IRQs the keys are polled, but no more often than this
+#define KBD_POLL_INTERVAL 5000 // 5ms
+static unsigned long last_poll;
+static int polled = 0;
 
 static void kbd_poll ();
 
+static void kbd_poll_cached (void)
+{
+  if (!irqs_enabled()) {
+    if (!polled || timer_passed (last_poll, KBD_POLL_INTERVAL)) {
+      kbd_poll ();
+      last_poll = timer_get_current ();
+      polled = 1;
+    }
+  }
+}
+
 uint8 keypad_getstate(void) {
-  if (!irqs_enabled()) kbd_poll ();
+  kbd_poll_cached ();
   return kbd_state;
 }
 
 int isHoldEngaged (void)
 {
-  if (!irqs_enabled()) kbd_poll ();
+  kbd_poll_cached ();
   return (kbd_state & 0x20) != 0;
 }
 
@@ -33,24 +57,24 @@ void keypad_flush(void)
 int keypad_getkey(void)
   // fetch a key from the buffer
 {
-  int i, key = 0;
-  if (!irqs_enabled()) kbd_poll ();
-  if (kbdbufelems > 0) {
-    key = kbdbuf[0];
-    --kbdbufelems;
-    for (i = 0; i < kbdbufelems; ++i) {
-      kbdbuf[i] = kbdbuf[i+1];
-    }
+  int key = 0;
+  unsigned int tail = kbdbuf_tail;
+  kbd_poll_cached ();
+  if (tail != kbdbuf_head) {
+    key = kbdbuf[tail & (KBDBUF_SIZE-1)];
+    kbdbuf_tail = tail + 1; // only now the producer may reuse the slot
   }
   return key;
 }
 
 static void add_keypress (uint8 key)
-  // add key to buffer
+  // add key to buffer - if it is full, the key is dropped
 {
+  unsigned int head = kbdbuf_head;
   if (key) {
-    if (kbdbufelems < sizeof(kbdbuf)) {
-      kbdbuf[kbdbufelems++] = key;
+    if (head - kbdbuf_tail < KBDBUF_SIZE) {
+      kbdbuf[head & (KBDBUF_SIZE-1)] = key;
+      kbdbuf_head = head + 1; // publish the key after it has been stored
     }
   }
 }
@@ -477,7 +501,7 @@ void keypad_test (void)
   while (kbd_state & 0x1f) {
     mlc_delay_ms(10);
   } // wait for buttons being released again
-  kbdbufelems = 0;
+  kbdbuf_tail = kbdbuf_head;
   console_printcount = 0;
 }
 
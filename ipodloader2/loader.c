@@ -8,8 +8,11 @@
 #include "ipodhw.h"
 #include "vfs.h"
 #include "menu.h"
+#include "menuloop.h"
 #include "config.h"
 #include "interrupts.h"
+#include "events.h"
+#include "cache.h"
 
 #define LOADERNAME "iPL " VERSION // VERSION is set in the Makefile
 
@@ -18,9 +21,13 @@ static int orig_contrast;
 
 static void shutdown_loader (void)
 {
+  console_flush (1);
+  fb_sync ();
   keypad_exit ();
   ata_exit ();
+  cache_exit (); // must happen before exit_irqs() unmaps the cached SDRAM alias
   exit_irqs ();
+  ipod_restore_clock (); // the loaded image expects the clock the Flash ROM set up
 }
 
 static void standby (void)
@@ -33,11 +40,36 @@ static void standby (void)
   pcf_standby_mode ();
 }
 
+#define MENU_DISK_STANDBY_SECS 10
+
 static void spindown_disk (void)
 {
   config_t *conf = config_get();
-  if (conf->ata_standby_code >= 0) {
-    ata_standby (conf->ata_standby_code);	// stop the disk (spin it down)
+  if (conf->ata_standby_code == 0) {
+    ata_idle (MENU_DISK_STANDBY_SECS);	// the disk spins down by itself unless we keep using it
+  } else if (conf->ata_standby_code > 0 && ata_check_power_mode () != ATA_POWER_STANDBY) {
+    ata_standby (conf->ata_standby_code);	// stop the disk (spin it down) with the command the user chose
+  }
+}
+
+static void prefetch_image (config_image_t *image)
+// Reads the start of the image, so that the disk spins up and the directory and
+// FAT sectors are in the cache by the time the user actually selects it.
+{
+  static char *buf = 0;
+  char path[128];
+  int fd, i;
+
+  if (image->type != CONFIG_IMAGE_BINARY && image->type != CONFIG_IMAGE_ROCKBOX) return;
+  for (i = 0; i < sizeof(path)-1 && image->path[i] && image->path[i] != ' '; ++i) {
+    path[i] = image->path[i]; // the name ends with the first blank, then come the args
+  }
+  path[i] = 0;
+  if (!buf) buf = mlc_malloc (512);
+  fd = vfs_open (path);
+  if (fd >= 0) {
+    vfs_read (buf, 1, 512, fd);
+    vfs_close (fd);
   }
 }
 
@@ -276,6 +308,7 @@ static int userconfirm ()
     if (conf->debug & 2) {
       keypad_flush ();
       mlc_printf ("-Press a key-\n");
+      console_flush (1);
       do { } while (!keypad_getkey());
       shown = 1;
     } else if (conf->debug) {
@@ -330,12 +363,7 @@ static int is_linux_img (char *firstblock) {
 uint32 calc_checksum_fw (char* dest, int size); // we call this in config.c
 uint32 calc_checksum_fw (char* dest, int size) {
   // Calculate checksum the way the firmware images are doing it
-  uint32 sum = 0;
-  long i;
-  for (i = 0; i < size; i++) {
-      sum += (uint8) *dest++;
-  }
-  return sum;
+  return mlc_bytesum (0, dest, size);
 }
 
 
@@ -347,7 +375,6 @@ static void load_rockbox(ipod_t *ipod, int fd, uint32 fsize, uint32 read, void *
   uint8 header[12];
   unsigned long chksum;
   unsigned long sum;
-  int i;
 
   // since the first block is already read to memory, we need to move it a bit around
   mlc_memcpy (header, firstblock, 8);
@@ -429,26 +456,21 @@ static void load_rockbox(ipod_t *ipod, int fd, uint32 fsize, uint32 read, void *
   userconfirm ();
 
   // checksum the first block
-  for (i = 0; i < read; i++) {
-    sum += ((uint8*)firstblock)[i];
-  }
+  sum = mlc_bytesum (sum, firstblock, read);
 
   // Read the rest of Rockbox
   while(read < fsize) {
-    long n = fsize - read, i;
-    uint8 *p = (uint8*)entry + read;
+    long n = fsize - read;
+    uint8 *p = cache_addr ((uint8*)entry + read); // load and checksum through the cache
     if( n > (128*1024) ) {
       n = 128*1024;
     }
     vfs_read( p, n, 1, fd );
     // checksum the blocks we just read
-    for (i = 0; i < n; i++) {
-      sum += *p++;
-    }
+    sum = mlc_bytesum (sum, p, n);
     read += n;
 
     menu_drawprogress(framebuffer,(read * 255) / fsize);
-    fb_update(framebuffer);
   }
   
   console_setcolor (WHITE, BLACK, 1);
@@ -566,6 +588,7 @@ static void *loader_handleImage (ipod_t *ipod, char *imagename, int forceRockbox
       mlc_clear_screen();
       mlc_set_output_options (0, 0);
       mlc_printf("\nRelease HOLD to continue\n");
+      console_flush (1); // we spin below without going through mlc_delay_ms()
       ipod_set_backlight (1);
       if (conf->beep_time) ipod_beep (conf->beep_time, conf->beep_period);
       int starttime = timer_get_current();
@@ -595,16 +618,16 @@ static void *loader_handleImage (ipod_t *ipod, char *imagename, int forceRockbox
 
   uint32 read = 512;
   while (read < fsize) {
+    void *p = cache_addr ((uint8*)entry + read); // shutdown_loader() writes it back to SDRAM
     if( (fsize-read) > (128*1024) ) { /* More than 128K to read */
-      vfs_read( (void*)((uint8*)entry + read), 128*1024, 1, fd );
+      vfs_read( p, 128*1024, 1, fd );
       read += 128 * 1024;
     } else { /* Last part of the file */
-      vfs_read( (void*)((uint8*)entry + read), fsize-read, 1, fd );
+      vfs_read( p, fsize-read, 1, fd );
       read = fsize;
     }
 
     menu_drawprogress(framebuffer,(read * 255) / fsize);
-    fb_update(framebuffer);
   }
 
   console_setcolor (WHITE, BLACK, 1);
@@ -620,8 +643,10 @@ static void *loader_handleImage (ipod_t *ipod, char *imagename, int forceRockbox
 //  main entry of loader2
 // -----------------------
 
+static const menu_loop_hooks menu_hooks = { spindown_disk, prefetch_image, standby };
+
 void *loader(void) {
-  int menuPos, done;
+  int menuPos;
   uint32 ret;
   ipod_t *ipod;
   config_t *conf;
@@ -691,6 +716,8 @@ void *loader(void) {
   config_init();
   conf = config_get();
 
+  if (conf->fast_clock) ipod_set_fast_clock (); // speeds up loading, shutdown_loader() undoes it
+
   if (conf->debug) {
     // any non-zero debug value turns on printf console output
     // furthermore, the debug value's bits have the following meaning:
@@ -716,6 +743,7 @@ void *loader(void) {
 
   if (!(conf->debug & 4096)) {
     enable_irqs ();
+    cache_init (); // needs SDRAM mapped to 0, which enable_irqs() did
   } else {
     mlc_printf("IRQs NOT enabled\n");
   }
@@ -751,102 +779,11 @@ void *loader(void) {
 
   keypad_flush (); // discard buttons that were already pressed at start
 
-  /*---------------------------------------
-   * This is the "event loop" for the menu
-   */
 redoMenu:
-  menuPos = conf->def - 1;
-  if (menuPos < 0) menuPos = 0;
-  done    = 0;
-
   userconfirm ();
   mlc_clear_screen ();
 
-  int startTime = timer_get_current ();
-  char needsupdate = 1;
-  int last_second = 0;
-  int lastHold = 0;
-  int idle_starttime = -1;
-  int did_beep = 0;
-  int did_blacklight_off = 0;
-
-  if (conf->beep_time) ipod_beep (conf->beep_time, conf->beep_period);
-
-  while(!done) {
-
-    int key, isHold = isHoldEngaged();
-
-    while ((key = keypad_getkey()) != 0) {
-      // keep looping as long as we get keys so we can catch up
-      // (keys may have queued up while we were updating the menu)
-      if( key == IPOD_KEY_REW || key == IPOD_KEY_MENU ) {
-        if (menuPos>0) menuPos--;
-      } else if( key == IPOD_KEY_FWD || key == IPOD_KEY_PLAY ) {
-        if (menuPos<(conf->items-1)) menuPos++;
-      } else if( key == IPOD_KEY_SELECT ) {
-        done = 1;
-      }
-      conf->timeout = 0; // user has pressed a key -> stop auto-selection timer
-      needsupdate = 1;
-    }
-    if (isHold != lastHold) {
-      if (!isHold && lastHold) conf->timeout = 0; // user has unlocked -> stop auto-selection timer
-      lastHold = isHold;
-      needsupdate = 1;
-    }
-    
-    char timeLeft[4];
-    timeLeft[0] = 0;
-    if (conf->timeout) {
-      int t = conf->timeout - (timer_get_current() - startTime) / TIMER_SECOND;
-      if (t < 0) t = 0;
-      if (t != last_second) {
-        last_second = t;
-        needsupdate = 1;
-      }
-      // show two digits
-      timeLeft[1] = (t % 10) + '0';
-      t /= 10;
-      timeLeft[0] = t ? t+'0' : ' ';
-      timeLeft[2] = 0;
-      if (timer_passed (startTime, conf->timeout * TIMER_SECOND)) {
-        // timed out
-        done = 1;
-      }
-    }
-
-    if (needsupdate) {
-      if (conf->beep_time) keypad_enable_wheelclicks (menuPos, conf->items-menuPos-1);
-      if (conf->backlight) ipod_set_backlight (1);
-      needsupdate = 0;
-      menu_redraw(framebuffer, menuPos, LOADERNAME, timeLeft, isHold);
-      fb_update(framebuffer);
-      spindown_disk ();
-      idle_starttime = timer_get_current();
-      did_blacklight_off = 0;
-      did_beep = 0;
-    }
-
-    if (!did_blacklight_off && timer_passed (idle_starttime, 10*TIMER_SECOND)) {
-      // if nothing happened for 10 seconds, then turn off backlight to save power
-      ipod_set_backlight (0);
-      did_blacklight_off = 1;
-    }
-    if (!did_beep && timer_passed (idle_starttime, 1*TIMER_MINUTE)) {
-      // if nothing happened for one minute, issue a beep as a reminder
-      if (conf->beep_time) ipod_beep (conf->beep_time, conf->beep_period);
-      did_beep = 1;
-    }
-    if (timer_passed (idle_starttime, 2*TIMER_MINUTE)) {
-      // if nothing happened for two minutes, then put iPod to sleep to save power
-      standby ();
-    }
-
-  }
-  /*
-   * End of the "event loop" for the menu
-   *--------------------------------------
-   */
+  menuPos = menu_loop (conf, framebuffer, LOADERNAME, &menu_hooks);
 
   menu_cls(framebuffer);
   fb_update(framebuffer);
@@ -678,6 +678,7 @@ static void hfsplus_newfs (uint8 part, uint32 offset) {
 	myfs.seek	= hfsplus_seek;
 	myfs.read	= hfsplus_read;
 	myfs.getinfo	= 0;
+	myfs.listdir	= 0;
 	myfs.fsdata	= (void*)fsData;
 	myfs.partnum	= part;
 	myfs.type	= HFSPLUS;
@@ -9,6 +9,7 @@
 
 static struct {
   ipod_t *ipod;
+  int    progress;  // right end of the drawn progress bar, -1 if not drawn
   int    numItems;
   char   *string[MAX_MENU_ITEMS];
   int    x,y,w,h,fh;
@@ -18,6 +19,7 @@ static struct {
 /* Clears the screen to a nice black to blue gradient */
 void menu_cls(uint16 *fb) {
   int x,y;
+  menu.progress = -1;
   if (menu.ipod->lcd_is_grayscale) {
     fb_cls (fb, 0);
   } else if (!menu.conf->usegradient) {
@@ -129,6 +131,7 @@ void menu_init() {
   menu.ipod = ipod_get_hwinfo();
   menu.conf = config_get ();
   menu.numItems = 0;
+  menu.progress = -1;
 }
 
 void menu_additem(char *text) {
@@ -145,21 +148,34 @@ void menu_additem(char *text) {
 
 void menu_drawprogress(uint16 *fb,uint8 completed) {
   uint16 pbarWidth;
+  int top, right;
+  uint16 color = (menu.ipod->lcd_is_grayscale? WHITE : menu.conf->hicolor);
   static char tmpBuff[40];
 
   pbarWidth = (menu.ipod->lcd_width - 20);
+  top = (menu.ipod->lcd_height>>1)-5;
+  right = 10+(completed*pbarWidth)/255;
+
+  if (menu.progress >= 0 && right >= menu.progress) {
+    // the bar only grew - draw and send just the new part of it
+    menu_drawrect( fb,menu.progress,top,right,top+10,color );
+    fb_update_rect(fb,menu.progress,top,right-menu.progress+1,11);
+    menu.progress = right;
+    return;
+  }
 
   menu_cls(fb);
 
-  menu_drawrect( fb,10,(menu.ipod->lcd_height>>1)-5,
-		 10+pbarWidth,(menu.ipod->lcd_height>>1)+5,
+  menu_drawrect( fb,10,top,
+		 10+pbarWidth,top+10,
                  BLACK );
-  menu_drawrect( fb,10,(menu.ipod->lcd_height>>1)-5,
-                 10+(completed*pbarWidth)/255,(menu.ipod->lcd_height>>1)+5,
-                 (menu.ipod->lcd_is_grayscale? WHITE : menu.conf->hicolor) );
+  menu_drawrect( fb,10,top,
+                 right,top+10,
+                 color );
 
   console_putsXY(1,1,tmpBuff);
   fb_update(fb);
+  menu.progress = right;
 }
 
 void menu_redraw(uint16 *fb, int selectedItem, char *title, char *countDown, int drawLock) {
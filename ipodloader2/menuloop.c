@@ -0,0 +1,125 @@
+#include "bootloader.h"
+#include "ata2.h"
+#include "fb.h"
+#include "ipodhw.h"
+#include "keypad.h"
+#include "menu.h"
+#include "events.h"
+#include "menuloop.h"
+
+int menu_loop (config_t *conf, uint16 *framebuffer, char *title, const menu_loop_hooks *hooks)
+{
+  int menuPos = conf->def - 1;
+  int done = 0;
+
+  if (menuPos < 0) menuPos = 0;
+
+  unsigned long startTime = timer_get_current ();
+  char needsupdate = 1;
+  int last_second = 0;
+  int isHold = 0;
+  unsigned long idle_starttime = startTime;
+  int did_beep = 0;
+  int did_blacklight_off = 0;
+  int prefetch = 0; // 1: waiting for the disk to spin up, 2: done
+
+  if (conf->beep_time) ipod_beep (conf->beep_time, conf->beep_period);
+  hooks->spindown ();
+
+  // the tick only needs to be fast enough for the countdown, keys wake us up by themselves
+  events_init (TIMER_SECOND / 10);
+
+  while(!done) {
+
+    event_t ev;
+    unsigned long now;
+
+    events_get (&ev, 1); // sleeps until something happens
+    do {
+      // keep taking events as long as there are some so we can catch up
+      // (keys may have queued up while we were updating the menu)
+      if (ev.type == EVENT_KEY) {
+        if( ev.key == IPOD_KEY_REW || ev.key == IPOD_KEY_MENU ) {
+          if (menuPos>0) menuPos--;
+        } else if( ev.key == IPOD_KEY_FWD || ev.key == IPOD_KEY_PLAY ) {
+          if (menuPos<(conf->items-1)) menuPos++;
+        } else if( ev.key == IPOD_KEY_SELECT ) {
+          done = 1;
+        }
+        conf->timeout = 0; // user has pressed a key -> stop auto-selection timer
+        needsupdate = 1;
+        if (!prefetch && conf->ata_standby_code >= 0) {
+          ata_wakeup (); // let the disk spin up while the user navigates
+          prefetch = 1;
+        }
+      } else if (ev.type == EVENT_HOLD) {
+        if (!ev.hold && isHold) conf->timeout = 0; // user has unlocked -> stop auto-selection timer
+        isHold = ev.hold;
+        needsupdate = 1;
+      } else if (ev.type == EVENT_END) {
+        done = 1;
+      }
+      now = ev.time;
+    } while (!done && events_get (&ev, 0) != EVENT_NONE);
+
+    if (prefetch == 1 && !done && !ata_busy ()) {
+      hooks->prefetch (&conf->image[conf->def > 0 ? conf->def-1 : 0]);
+      prefetch = 2;
+    }
+
+    char timeLeft[4];
+    timeLeft[0] = 0;
+    if (conf->timeout) {
+      int t = conf->timeout - (now - startTime) / TIMER_SECOND;
+      if (t < 0) t = 0;
+      if (t != last_second) {
+        last_second = t;
+        needsupdate = 1;
+      }
+      // show two digits
+      timeLeft[1] = (t % 10) + '0';
+      t /= 10;
+      timeLeft[0] = t ? t+'0' : ' ';
+      timeLeft[2] = 0;
+      if (now - startTime >= conf->timeout * TIMER_SECOND) {
+        // timed out
+        done = 1;
+      }
+    }
+
+    if (needsupdate) {
+      // only redraw if something visible has changed
+      if (conf->beep_time) keypad_enable_wheelclicks (menuPos, conf->items-menuPos-1);
+      if (conf->backlight) ipod_set_backlight (1);
+      needsupdate = 0;
+      menu_redraw(framebuffer, menuPos, title, timeLeft, isHold);
+      fb_update(framebuffer);
+      idle_starttime = now;
+      did_blacklight_off = 0;
+      did_beep = 0;
+    }
+
+    if (!did_blacklight_off && now - idle_starttime >= 10*TIMER_SECOND) {
+      // if nothing happened for 10 seconds, then turn off backlight to save power
+      ipod_set_backlight (0);
+      if (prefetch) {
+        hooks->spindown (); // the disk was woken up for the prefetch
+        prefetch = 0; // so that the next key spins it up and prefetches again
+      }
+      did_blacklight_off = 1;
+    }
+    if (!did_beep && now - idle_starttime >= 1*TIMER_MINUTE) {
+      // if nothing happened for one minute, issue a beep as a reminder
+      if (conf->beep_time) ipod_beep (conf->beep_time, conf->beep_period);
+      did_beep = 1;
+    }
+    if (now - idle_starttime >= 2*TIMER_MINUTE) {
+      // if nothing happened for two minutes, then put iPod to sleep to save power
+      hooks->standby ();
+    }
+
+  }
+  events_exit ();
+
+  return menuPos;
+}
@@ -0,0 +1,24 @@
+#ifndef _MENULOOP_H_
+#define _MENULOOP_H_
+
+#include "bootloader.h"
+#include "config.h"
+
+/*
+ * The menu's event loop: shows the menu, counts down the timeout and
+ * saves power while the user makes up their mind. It lives apart from
+ * loader() so that it can be built with ONPC and driven by an event
+ * script (see events_script()).
+ *
+ * What it does to the disk and the iPod as a whole is up to the caller.
+ */
+typedef struct {
+  void (*spindown) (void);                  // let the disk spin down
+  void (*prefetch) (config_image_t *image); // read from the image while the disk spins
+  void (*standby) (void);                   // put the iPod to sleep - doesn't return on the iPod
+} menu_loop_hooks;
+
+// returns the index of the chosen (or timed out) item
+int menu_loop (config_t *conf, uint16 *framebuffer, char *title, const menu_loop_hooks *hooks);
+
+#endif
@@ -74,19 +74,34 @@ mod:	N	near ptr				DONE
 /* largest number handled is 2^32-1, lowest radix handled is 8.
 2^32-1 in base 8 has 11 digits (add 5 for trailing NUL and for slop) */
 #define	PR_BUFLEN	16
-
-typedef int (*fnptr_t)(unsigned c, void **helper);
+/* output is collected in a buffer of this size and handed to the sink in
+one go, so that e.g. the console only has to update the LCD once per call */
+#define	PR_OUTLEN	64
+
+#define	PR_PUT(C)	do {					\
+	if(outlen == PR_OUTLEN)					\
+	{							\
+		fn((const char *)out, outlen, &ptr);		\
+		outlen = 0;					\
+	}							\
+	out[outlen++] = (unsigned char)(C);			\
+	count++;						\
+} while(0)
+
+typedef int (*fnptr_t)(const char *str, int len, void **helper);
 /*****************************************************************************
 name:	do_printf
 action:	minimal subfunction for ?printf, calls function
-	'fn' with arg 'ptr' for each character to be output
+	'fn' with arg 'ptr' for each run of characters to be output
 returns:total number of characters output
 *****************************************************************************/
 static int mlc_do_printf(const char *fmt, mlc_va_list args, fnptr_t fn, void *ptr)
 {
 	unsigned flags, actual_wd, count, given_wd;
 	unsigned char *where, buf[PR_BUFLEN];
+	unsigned char out[PR_OUTLEN];
 	unsigned char state, radix;
+	int outlen = 0;
 	long num;
 
 	state = flags = count = given_wd = 0;
@@ -99,8 +114,7 @@ static int mlc_do_printf(const char *fmt, mlc_va_list args, fnptr_t fn, void *pt
 		case 0:
 			if(*fmt != '%')	/* not %... */
 			{
-				fn(*fmt, &ptr);	/* ...just echo it */
-				count++;
+				PR_PUT(*fmt);	/* ...just echo it */
 				break;
 			}
 /* found %, get next char and advance state to check if next char is a flag */
@@ -111,8 +125,7 @@ static int mlc_do_printf(const char *fmt, mlc_va_list args, fnptr_t fn, void *pt
 		case 1:
 			if(*fmt == '%')	/* %% */
 			{
-				fn(*fmt, &ptr);
-				count++;
+				PR_PUT(*fmt);
 				state = flags = given_wd = 0;
 				break;
 			}
@@ -256,31 +269,27 @@ EMIT:
 				if((flags & (PR_WS | PR_LZ)) ==
 					(PR_WS | PR_LZ))
 				{
-					fn('-', &ptr);
-					count++;
+					PR_PUT('-');
 				}
 /* pad on left with spaces or zeroes (for right justify) */
 EMIT2:				if((flags & PR_LJ) == 0)
 				{
 					while(given_wd > actual_wd)
 					{
-						fn(flags & PR_LZ ?
-							'0' : ' ', &ptr);
-						count++;
+						PR_PUT(flags & PR_LZ ?
+							'0' : ' ');
 						given_wd--;
 					}
 				}
 /* if we pad left with SPACES, do the sign now */
 				if((flags & (PR_WS | PR_LZ)) == PR_WS)
 				{
-					fn('-', &ptr);
-					count++;
+					PR_PUT('-');
 				}
 /* emit string/char/converted number */
 				while(*where != '\0')
 				{
-					fn(*where++, &ptr);
-					count++;
+					PR_PUT(*where++);
 				}
 /* pad on right with spaces (for left justify) */
 				if(given_wd < actual_wd)
@@ -288,8 +297,7 @@ EMIT2:				if((flags & PR_LJ) == 0)
 				else given_wd -= actual_wd;
 				for(; given_wd; given_wd--)
 				{
-					fn(' ', &ptr);
-					count++;
+					PR_PUT(' ');
 				}
 				break;
 			default:
@@ -300,6 +308,8 @@ EMIT2:				if((flags & PR_LJ) == 0)
 			break;
 		}
 	}
+	if(outlen)
+		fn((const char *)out, outlen, &ptr);
 	return count;
 }
 
@@ -307,11 +317,12 @@ EMIT2:				if((flags & PR_LJ) == 0)
 /*****************************************************************************
 SPRINTF
 *****************************************************************************/
-static int mlc_vsprintf_help(unsigned c, void **ptr) {
+static int mlc_vsprintf_help(const char *str, int len, void **ptr) {
 	char *dst;
 
 	dst = *ptr;
-	*dst++ = (char)c;
+	mlc_memcpy(dst, str, len);
+	dst += len;
 	*ptr = dst;
 	return 0 ;
 }
@@ -341,11 +352,11 @@ int mlc_sprintf(char *buf, const char *fmt, ...) {
 PRINTF
 You must write your own putchar()
 *****************************************************************************/
-static int print_to_console(unsigned c, void **ptr) {
+static int print_to_console(const char *str, int len, void **ptr) {
   #if ONPC
-    putchar(c);
+    fwrite(str, 1, len, stdout);
   #else
-    console_putchar(c);
+    console_write(str, len);
   #endif
   return 0;
 }
@@ -354,16 +365,22 @@ static int do_buffered_printf = 0;  // boolean flag
 static int do_slow_printf = 0;      // boolean flag
 static const int printf_buffer_size = 512; // 512 should be enough for what we use it for
 static uint8 *printf_buffer = 0;
+static int printf_bufstart = 0;     // ring buffer: index of the oldest char
 static int printf_buflen = 0;       // this is the used amount in the buffer
 
 // alternative, used with buffered output
-static int print_to_buffer(unsigned c, void **ptr) {
-  if (printf_buflen >= printf_buffer_size) {
-    // make room (discard older output)
-    printf_buflen -= 40;
-    mlc_memcpy (printf_buffer, printf_buffer+40, printf_buflen);
+static int print_to_buffer(const char *str, int len, void **ptr) {
+  while (len-- > 0) {
+    int pos = printf_bufstart + printf_buflen;
+    if (pos >= printf_buffer_size) pos -= printf_buffer_size;
+    printf_buffer[pos] = *str++;
+    if (printf_buflen < printf_buffer_size) {
+      printf_buflen++;
+    } else if (++printf_bufstart == printf_buffer_size) {
+      // full - the oldest output gets overwritten
+      printf_bufstart = 0;
+    }
   }
-  printf_buffer[printf_buflen++] = c;
   return 0;
 }
 /*****************************************************************************
@@ -393,7 +410,9 @@ int mlc_printf(const char *fmt, ...) {
 *****************************************************************************/
 #endif
 
+#if !ONPC
 static uint32 malloc_top;
+#endif
 
 void mlc_malloc_init(void) {
   #if !ONPC
@@ -533,7 +552,7 @@ void *memcpy (void *dest, const void *src, size_t n)
 }
 #endif
 
-void *mlc_memcpy(void *dest, const void *src, size_t n) {
+IRAM_TEXT void *mlc_memcpy(void *dest, const void *src, size_t n) {
   // rewrite by TT 31Mar06, taking odd dest into account
 
   if( ((uint32)src & 3) != ((uint32)dest & 3) ) {
@@ -570,6 +589,39 @@ void *mlc_memcpy(void *dest, const void *src, size_t n) {
   return (dest);
 }
 
+/*
+ * Adds all bytes of buf to sum, the way the firmware images are checksummed.
+ * The aligned middle part is done a word at a time: each of the two
+ * accumulators holds two 16-bit lanes, one for each byte position, which
+ * can take 257 words before they might overflow. We fold them well before that.
+ */
+IRAM_TEXT uint32 mlc_bytesum (uint32 sum, const void *buf, size_t len) {
+  const uint8 *p = buf;
+
+  while (((uint32)p & 3) && len) {
+    sum += *p++;
+    len--;
+  }
+  while (len >= 4) {
+    const uint32 *w = (const uint32*)p;
+    size_t n = len / 4;
+    uint32 even = 0, odd = 0;
+    if (n > 256) n = 256;
+    p += n * 4;
+    len -= n * 4;
+    while (n--) {
+      uint32 v = *w++;
+      even += v & 0x00ff00ff;
+      odd  += (v >> 8) & 0x00ff00ff;
+    }
+    sum += (even & 0xffff) + (even >> 16) + (odd & 0xffff) + (odd >> 16);
+  }
+  while (len--) {
+    sum += *p++;
+  }
+  return sum;
+}
+
 void *mlc_memset (void *dest, int c, size_t n) 
 {
     uint8 *d = dest;
@@ -600,6 +652,9 @@ char *mlc_strrchr(const char *s,int c) {
 }
 
 void mlc_delay_ms (long time_in_ms) {
+  #if !ONPC
+	console_flush (1); // let the user see what was printed before we wait
+  #endif
 	mlc_delay_us(time_in_ms * 1000);
 }
 
@@ -655,7 +710,7 @@ uint16 mlc_atorgb (const char *str, uint16 dft) {
 
 void mlc_clear_screen () {
   // sets the cursor home and clears the screen
-  printf_buflen = 0;
+  printf_bufstart = printf_buflen = 0;
   #if !ONPC
     console_clear();
   #endif
@@ -672,13 +727,13 @@ void mlc_set_output_options (int buffered, int slow) {
       printf_buffer = mlc_malloc (printf_buffer_size * sizeof (*printf_buffer));
     }
     if (!buffered && printf_buflen) {
-      // flush the buffered data to console
-      int i;
+      // flush the buffered data to console, in two parts if it wrapped around
+      int first = printf_buffer_size - printf_bufstart;
+      if (first > printf_buflen) first = printf_buflen;
       console_suppress_fbupdate (1);
-      for (i = 0; i < printf_buflen; i++) {
-        print_to_console (printf_buffer[i], 0);
-      }
-      printf_buflen = 0;
+      print_to_console ((char*)printf_buffer + printf_bufstart, first, 0);
+      print_to_console ((char*)printf_buffer, printf_buflen - first, 0);
+      printf_bufstart = printf_buflen = 0;
       console_suppress_fbupdate (-1);
     }
     do_buffered_printf = buffered;
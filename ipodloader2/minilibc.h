@@ -48,6 +48,7 @@ size_t mlc_strlcpy(char *dest,const char *src,size_t count);
 size_t mlc_strlcat(char *dest,const char *src,size_t count);
 void  *mlc_memcpy(void *dest,const void *src,size_t n);
 void  *mlc_memset(void *dest,int c,size_t n);
+uint32 mlc_bytesum(uint32 sum,const void *buf,size_t len);
 char  *mlc_strchr(const char *s,int c);
 char  *mlc_strrchr(const char *s,int c);
 int    mlc_memcmp(const void *sv1,const void *sv2,size_t length);
@@ -0,0 +1,87 @@
+/*
+ * Host test for mlc_bytesum() in minilibc.c.
+ *
+ * The word-at-a-time sum must give the same result as adding up the
+ * bytes one by one, whatever the data, the length and the alignment of
+ * the start. All-0xff data is the worst case for the 16 bit lanes it
+ * sums into, so it gets its own runs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bootloader.h"
+#include "ipodhw.h"
+#include "minilibc.h"
+
+/* minilibc.c calls these on the error paths, which aren't run here */
+static ipod_t fake_ipod;
+
+ipod_t *ipod_get_hwinfo (void) { return &fake_ipod; }
+void ipod_set_backlight (int on) { }
+void pcf_standby_mode (void) { }
+void keypad_flush (void) { }
+void ata_sleep (void) { }
+void exit_irqs (void) { }
+uint16 fb_rgb (int r, int g, int b) { return 0; }
+
+static uint32 bytesum (uint32 sum, const uint8 *p, size_t len)
+{
+  while (len--) sum += *p++;
+  return sum;
+}
+
+static uint8 buf[8192 + 8];
+static int errors;
+
+static void check (const char *what, uint32 seed, size_t start, size_t len)
+{
+  uint32 got = mlc_bytesum (seed, buf + start, len);
+  uint32 want = bytesum (seed, buf + start, len);
+  if (got != want && errors++ < 10) {
+    printf ("FAIL: %s, start %u, length %u: 0x%08x, expected 0x%08x\n",
+            what, (unsigned)start, (unsigned)len, got, want);
+  }
+}
+
+int main (void)
+{
+  size_t start, len;
+  int i;
+
+  srand (1);
+  for (i = 0; i < (int)sizeof (buf); i++) buf[i] = rand ();
+
+  /* every start within a word, every short length and a few long ones
+     around the 256 word blocks the lanes are flushed after */
+  for (start = 0; start < 8; start++) {
+    for (len = 0; len < 64; len++) {
+      check ("random", 0, start, len);
+    }
+    for (len = 1020; len < 1032; len++) {
+      check ("random", 0, start, len);
+    }
+    check ("random", 0x12345678, start, 8192);
+  }
+
+  /* random lengths and starts, carrying the sum on */
+  for (i = 0; i < 10000; i++) {
+    start = rand () % 8;
+    len = rand () % (sizeof (buf) - start);
+    check ("random", rand (), start, len);
+  }
+
+  for (i = 0; i < (int)sizeof (buf); i++) buf[i] = 0xff;
+  for (start = 0; start < 8; start++) {
+    for (len = 8192 - 8; len <= 8192; len++) {
+      check ("0xff", 0, start, len);
+    }
+    check ("0xff", 0xffffff00, start, 1027); // the sum wraps around
+  }
+
+  if (errors) {
+    printf ("bytesum: %d errors\n", errors);
+    return 1;
+  }
+  printf ("bytesum: OK\n");
+  return 0;
+}
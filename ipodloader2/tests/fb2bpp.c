@@ -0,0 +1,161 @@
+/*
+ * Host test for the 2bpp output of fb.c (grayscale iPods).
+ *
+ * fb.c is built with ONPC and talks to a fake LCD below, which keeps the
+ * words sent to it per row. Every RGB565 value is drawn once and the
+ * result compared with the per-pixel LUMA565() routine fb.c used before
+ * the lookup table, bit for bit. The shadow buffer is checked too: only
+ * changed rows may be sent, and only up to their last changed word.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootloader.h"
+#include "ipodhw.h"
+#include "minilibc.h"
+#include "fb.h"
+
+#define WIDTH  160
+#define HEIGHT 128
+#define WORDS  (WIDTH / 8)
+
+static ipod_t fake_ipod;
+
+/* the fake LCD */
+static uint16 lcd_ram[HEIGHT][WORDS];
+static int lcd_row, lcd_col;
+static int lcd_rows_sent, lcd_words_sent;
+
+ipod_t *ipod_get_hwinfo (void)
+{
+  return &fake_ipod;
+}
+
+void *mlc_malloc (size_t size)
+{
+  return malloc (size);
+}
+
+void lcd_wait_ready (void)
+{
+}
+
+void lcd_cmd_and_data_hi_lo (int cmd, int data_hi, int data_lo)
+{
+}
+
+void lcd_cmd_and_data16 (int cmd, uint16 data)
+{
+  if (cmd == 0x11) { // R_RAM_ADDR_SET, as fb_2bpp_bitblt() sets it
+    lcd_row = (data - 20) >> 5;
+    lcd_col = 0;
+    lcd_rows_sent++;
+  }
+}
+
+void lcd_prepare_cmd (int cmd)
+{
+}
+
+void lcd_send_data (int data_hi, int data_lo)
+{
+  if (lcd_row < 0 || lcd_row >= HEIGHT || lcd_col >= WORDS) {
+    printf ("FAIL: write outside the LCD at row %d word %d\n", lcd_row, lcd_col);
+    exit (1);
+  }
+  lcd_ram[lcd_row][lcd_col++] = (data_hi << 8) | data_lo;
+  lcd_words_sent++;
+}
+
+/* the conversion fb.c did before the table, per pixel */
+static uint8 LUMA565 (uint16 val)
+{
+  uint16 calc;
+  calc  = (val>>11)<<3;
+  calc += ((val>>5)&0x3F)<<2;
+  calc += (val&0x1F)<<3;
+  calc = calc / 3;
+  if (calc > 0xFF) calc = 0xFF;
+  return calc;
+}
+
+static int lcd_pixel (int x, int y)
+{
+  return (lcd_ram[y][x >> 3] >> (14 - 2 * (x & 7))) & 3;
+}
+
+static uint16 fb[WIDTH * HEIGHT];
+
+int main (void)
+{
+  int base, i, x, y, errors = 0;
+
+  fake_ipod.hw_ver = 0x3;
+  fake_ipod.lcd_width = WIDTH;
+  fake_ipod.lcd_height = HEIGHT;
+  fake_ipod.lcd_format = IPOD_LCD_FORMAT_2BPP;
+  fake_ipod.lcd_is_grayscale = 1;
+  fb_init ();
+
+  /* whatever was on the LCD before, e.g. the Apple logo - the first
+     update must replace all of it, even where the new screen is black */
+  memset (lcd_ram, 0x55, sizeof (lcd_ram));
+  fb_cls (fb, BLACK);
+  fb_update (fb);
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WORDS; x++) {
+      if (lcd_ram[y][x] != 0 && errors++ < 10) {
+        printf ("FAIL: word %d of row %d not sent by the first update\n", x, y);
+      }
+    }
+  }
+
+  /* every RGB565 value, a screenful at a time */
+  for (base = 0; base < 0x10000; base += WIDTH * HEIGHT) {
+    for (i = 0; i < WIDTH * HEIGHT; i++) {
+      fb[i] = (base + i) & 0xffff;
+    }
+    fb_update (fb);
+
+    for (i = 0; i < WIDTH * HEIGHT; i++) {
+      uint16 val = fb[i];
+      int got = lcd_pixel (i % WIDTH, i / WIDTH);
+      int want = LUMA565 (val) >> 6;
+      if (got != want && errors++ < 10) {
+        printf ("FAIL: 0x%04x shows as %d, LUMA565 gives %d\n", val, got, want);
+      }
+    }
+  }
+
+  /* nothing changed - nothing may be sent */
+  lcd_rows_sent = lcd_words_sent = 0;
+  fb_update (fb);
+  if (lcd_rows_sent || lcd_words_sent) {
+    printf ("FAIL: unchanged screen sent %d rows, %d words\n", lcd_rows_sent, lcd_words_sent);
+    errors++;
+  }
+
+  /* one pixel in word 5 of row 77: that row, words 0 to 5 */
+  fb[77 * WIDTH + 5 * 8 + 3] ^= 0xffff;
+  lcd_rows_sent = lcd_words_sent = 0;
+  fb_update (fb);
+  if (lcd_rows_sent != 1 || lcd_words_sent != 6) {
+    printf ("FAIL: one changed pixel sent %d rows, %d words\n", lcd_rows_sent, lcd_words_sent);
+    errors++;
+  }
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++) {
+      if (lcd_pixel (x, y) != LUMA565 (fb[y * WIDTH + x]) >> 6) {
+        if (errors++ < 10) printf ("FAIL: pixel %d,%d is wrong after a partial update\n", x, y);
+      }
+    }
+  }
+
+  if (errors) {
+    printf ("fb2bpp: %d errors\n", errors);
+    return 1;
+  }
+  printf ("fb2bpp: OK\n");
+  return 0;
+}
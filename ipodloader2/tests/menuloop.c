@@ -0,0 +1,244 @@
+/*
+ * Host test for the menu loop (menuloop.c), driven by event scripts
+ * through the ONPC side of events.c. The hardware it touches is faked
+ * below and only counts what happened.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "bootloader.h"
+#include "config.h"
+#include "events.h"
+#include "ipodhw.h"
+#include "keypad.h"
+#include "menuloop.h"
+
+#define SEC TIMER_SECOND
+
+static int redraws, last_pos;
+static int locks[8]; // the lock icon state of the first redraws
+static int spindowns, prefetches, standbys, wakeups;
+
+/* The disk takes this many ata_busy() polls to spin up after
+   ata_wakeup(), standing in for the seconds a real one takes */
+static int spinup_polls, busy_polls;
+
+unsigned long timer_get_current (void)
+{
+  return 0;
+}
+
+void ipod_beep (int duration_ms, int period)
+{
+}
+
+void ipod_set_backlight (int on)
+{
+}
+
+void keypad_enable_wheelclicks (int rew_left, int fwd_left)
+{
+}
+
+void ata_wakeup (void)
+{
+  wakeups++;
+  busy_polls = spinup_polls;
+}
+
+int ata_busy (void)
+{
+  if (busy_polls) {
+    busy_polls--;
+    return 1;
+  }
+  return 0;
+}
+
+void fb_update (uint16 *x)
+{
+}
+
+void menu_redraw (uint16 *fb, int selectedItem, char *title, char *countDown, int drawLock)
+{
+  if (redraws < 8) locks[redraws] = drawLock;
+  redraws++;
+  last_pos = selectedItem;
+}
+
+static void spindown (void)
+{
+  spindowns++;
+}
+
+static void prefetch (config_image_t *image)
+{
+  prefetches++;
+}
+
+static void standby (void)
+{
+  standbys++;
+}
+
+static const menu_loop_hooks hooks = { spindown, prefetch, standby };
+
+static config_image_t images[3] = {
+  { CONFIG_IMAGE_SPECIAL, "Apple OS", "osos" },
+  { CONFIG_IMAGE_BINARY,  "Linux",    "(hd0,1)/linux.bin" },
+  { CONFIG_IMAGE_ROCKBOX, "Rockbox",  "(hd0,1)/rockbox.ipod" },
+};
+
+static int errors;
+
+#define CHECK(cond, ...) do { \
+  if (!(cond)) { printf ("FAIL: " __VA_ARGS__); printf ("\n"); errors++; } \
+} while (0)
+
+static int run (config_t *conf, const event_t *script, int count)
+{
+  uint16 fb[1];
+
+  redraws = spindowns = prefetches = standbys = wakeups = busy_polls = 0;
+  events_script (script, count);
+  return menu_loop (conf, fb, "test", &hooks);
+}
+
+static void init_conf (config_t *conf, int timeout)
+{
+  memset (conf, 0, sizeof (*conf));
+  conf->image = images;
+  conf->items = 3;
+  conf->def = 1;
+  conf->timeout = timeout;
+  conf->ata_standby_code = -1;
+}
+
+int main (void)
+{
+  config_t conf;
+  int pos;
+
+  // the timeout picks the default
+  {
+    static const event_t script[] = {
+      { EVENT_HOLD, 0, 0, 0 },
+      { EVENT_TICK, 0, 0, 1*SEC },
+      { EVENT_TICK, 0, 0, 2*SEC },
+      { EVENT_TICK, 0, 0, 3*SEC },
+      { EVENT_KEY, IPOD_KEY_FWD, 0, 4*SEC }, // too late
+    };
+    init_conf (&conf, 3);
+    conf.def = 2;
+    pos = run (&conf, script, sizeof (script) / sizeof (*script));
+    CHECK (pos == 1, "timeout chose item %d, not the default 1", pos);
+  }
+
+  // a key press stops the timeout
+  {
+    static const event_t script[] = {
+      { EVENT_HOLD, 0, 0, 0 },
+      { EVENT_KEY, IPOD_KEY_FWD, 0, 1*SEC },
+      { EVENT_TICK, 0, 0, 5*SEC },
+      { EVENT_TICK, 0, 0, 9*SEC },
+      { EVENT_KEY, IPOD_KEY_FWD, 0, 9*SEC },
+      { EVENT_TICK, 0, 0, 12*SEC },
+    };
+    init_conf (&conf, 3);
+    pos = run (&conf, script, sizeof (script) / sizeof (*script));
+    CHECK (pos == 2, "ended on item %d after two keys, not 2", pos);
+    CHECK (conf.timeout == 0, "timeout still %d after a key", conf.timeout);
+  }
+
+  // toggling hold redraws with and without the lock icon, and unlocking
+  // stops the timeout
+  {
+    static const event_t script[] = {
+      { EVENT_HOLD, 0, 1, 0 },
+      { EVENT_TICK, 0, 1, 1*SEC },
+      { EVENT_HOLD, 0, 0, 1*SEC + 1 },
+      { EVENT_HOLD, 0, 1, 1*SEC + 2 },
+      { EVENT_TICK, 0, 1, 30*SEC },
+    };
+    init_conf (&conf, 5);
+    pos = run (&conf, script, sizeof (script) / sizeof (*script));
+    CHECK (redraws == 4, "%d redraws, expected 4 (start, countdown, two hold changes)", redraws);
+    CHECK (locks[0] == 1 && locks[1] == 1 && locks[2] == 0 && locks[3] == 1,
+           "lock icon sequence %d %d %d %d", locks[0], locks[1], locks[2], locks[3]);
+    CHECK (conf.timeout == 0, "unlocking didn't stop the timeout");
+    CHECK (pos == 0, "ended on item %d, not the default 0", pos);
+  }
+
+  // the end of the script ends the loop, without a timeout or a key
+  {
+    static const event_t script[] = {
+      { EVENT_HOLD, 0, 0, 0 },
+      { EVENT_TICK, 0, 0, 1*SEC },
+    };
+    init_conf (&conf, 0);
+    conf.def = 3;
+    pos = run (&conf, script, sizeof (script) / sizeof (*script));
+    CHECK (pos == 2, "EVENT_END left item %d, not the default 2", pos);
+    CHECK (redraws == 1, "%d redraws for one visible change", redraws);
+    CHECK (standbys == 0, "went into standby");
+  }
+
+  // a key spins the disk up, the prefetch waits until it is ready, and
+  // after the backlight went off the next key does both again
+  {
+    static const event_t script[] = {
+      { EVENT_HOLD, 0, 0, 0 },
+      { EVENT_KEY, IPOD_KEY_FWD, 0, 1*SEC },
+      { EVENT_TICK, 0, 0, 2*SEC },  // still spinning up
+      { EVENT_TICK, 0, 0, 3*SEC },  // ready
+      { EVENT_KEY, IPOD_KEY_REW, 0, 4*SEC },
+      { EVENT_TICK, 0, 0, 20*SEC }, // backlight off, disk spun down
+      { EVENT_KEY, IPOD_KEY_FWD, 0, 21*SEC },
+      { EVENT_TICK, 0, 0, 22*SEC },
+      { EVENT_TICK, 0, 0, 23*SEC },
+    };
+    init_conf (&conf, 0);
+    conf.ata_standby_code = 0;
+    spinup_polls = 2;
+    run (&conf, script, sizeof (script) / sizeof (*script));
+    spinup_polls = 0;
+    CHECK (wakeups == 2, "%d wakeups, expected one per spin-down", wakeups);
+    CHECK (prefetches == 2, "%d prefetches, expected one per wakeup", prefetches);
+    CHECK (spindowns == 2, "%d spin-downs, expected on entry and at backlight off", spindowns);
+  }
+
+  // the prefetch only starts once the disk is ready
+  {
+    static const event_t script[] = {
+      { EVENT_HOLD, 0, 0, 0 },
+      { EVENT_KEY, IPOD_KEY_FWD, 0, 1*SEC },
+      { EVENT_TICK, 0, 0, 2*SEC },
+    };
+    init_conf (&conf, 0);
+    conf.ata_standby_code = 0;
+    spinup_polls = 5;
+    run (&conf, script, sizeof (script) / sizeof (*script));
+    spinup_polls = 0;
+    CHECK (wakeups == 1 && prefetches == 0, "prefetched from a disk still spinning up");
+  }
+
+  // two idle minutes put the iPod to sleep
+  {
+    static const event_t script[] = {
+      { EVENT_HOLD, 0, 0, 0 },
+      { EVENT_TICK, 0, 0, 2*60*SEC },
+    };
+    init_conf (&conf, 0);
+    run (&conf, script, sizeof (script) / sizeof (*script));
+    // standby() returns here, unlike on the iPod, so the loop may call it
+    // again on its way out
+    CHECK (standbys >= 1, "no standby after two idle minutes");
+  }
+
+  if (errors) {
+    printf ("menuloop: %d errors\n", errors);
+    return 1;
+  }
+  printf ("menuloop: OK\n");
+  return 0;
+}
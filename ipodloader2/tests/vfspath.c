@@ -0,0 +1,167 @@
+/*
+ * Host test for the partition scan and path parsing of vfs.c.
+ *
+ * A fake disk with a firmware, a FAT32 and an ext2 partition is handed
+ * to vfs_init(). The filesystem drivers are replaced by stubs that only
+ * remember which partition was mounted where and which path they were
+ * asked to open, so vfs_open() can be checked with the paths loader.cfg
+ * uses, and a few it must reject.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "bootloader.h"
+#include "minilibc.h"
+#include "vfs.h"
+#include "fat32.h"
+#include "ext2.h"
+#include "fwfs.h"
+#include "macpartitions.h"
+
+#define FW_OFFSET   1
+#define FAT_OFFSET  100
+#define EXT2_OFFSET 1000
+
+static uint8 disk[EXT2_OFFSET + 4][512];
+static int critical_errors;
+
+/* the fake filesystems */
+static filesystem fake_fs[3];
+static uint32 mounted_at[3];
+static char opened[256];
+
+void ata_readblocks (void *dst, uint32 sector, uint32 count)
+{
+  if (sector + count > sizeof (disk) / sizeof (*disk)) {
+    memset (dst, 0, count * 512);
+    return;
+  }
+  memcpy (dst, disk[sector], count * 512);
+}
+
+void *mlc_malloc (size_t size) { return calloc (1, size); }
+int mlc_printf (const char *fmt, ...) { return 0; }
+void mlc_hexdump (void *addr, int len) { }
+void mlc_show_critical_error (void) { critical_errors++; }
+char *mlc_strchr (const char *s, int c) { return strchr (s, c); }
+int mlc_strncmp (const char *s1, const char *s2, size_t n) { return strncmp (s1, s2, n); }
+void check_mac_partitions (uint8 *blk0) { }
+
+static int fake_open (void *fsdata, char *fname)
+{
+  snprintf (opened, sizeof (opened), "%s", fname);
+  return 0;
+}
+
+static void mount (int type, vfs_type vtype, uint8 part, uint32 offset)
+{
+  fake_fs[type].open = fake_open;
+  fake_fs[type].partnum = part;
+  fake_fs[type].type = vtype;
+  mounted_at[type] = offset;
+  vfs_registerfs (&fake_fs[type]);
+}
+
+void fwfs_newfs (uint8 part, uint32 offset) { mount (0, FWFS, part, offset); }
+void fat32_newfs (uint8 part, uint32 offset) { mount (1, FAT32, part, offset); }
+void ext2_newfs (uint8 part, uint32 offset) { mount (2, EXT2, part, offset); }
+
+static void make_disk (void)
+{
+  mbr_t *mbr = (mbr_t *)disk[0];
+  fs_header_t *hdr;
+
+  mbr->code[12] = 2; // sector size hint: 512 bytes
+  mbr->partition_table[0].type = 0x00;
+  mbr->partition_table[0].lba_offset = FW_OFFSET;
+  mbr->partition_table[1].type = 0x0b;
+  mbr->partition_table[1].lba_offset = FAT_OFFSET;
+  mbr->partition_table[2].type = 0x83;
+  mbr->partition_table[2].lba_offset = EXT2_OFFSET;
+  mbr->MBR_signature = 0xAA55;
+
+  hdr = (fs_header_t *)disk[FW_OFFSET];
+  memcpy (hdr->fwfsmagic, "]ih[", 4);
+  hdr = (fs_header_t *)disk[FAT_OFFSET];
+  hdr->fat32magic = 0xAA55;
+  hdr = (fs_header_t *)disk[EXT2_OFFSET + 2];
+  hdr->ext2magic = 0xEF53;
+}
+
+static int errors;
+
+/* want_part is the partition the path must end up on, -1 if it must be
+   rejected */
+static void check_path (const char *path, int want_part, const char *want_name)
+{
+  char buf[256];
+  int fd;
+
+  snprintf (buf, sizeof (buf), "%s", path);
+  opened[0] = 1;
+  fd = vfs_open (buf);
+
+  if (want_part < 0) {
+    if (fd >= 0) {
+      printf ("FAIL: \"%s\" was opened as \"%s\"\n", path, opened);
+      errors++;
+      vfs_close (fd);
+    }
+    return;
+  }
+
+  if (fd < 0) {
+    printf ("FAIL: \"%s\" not opened\n", path);
+    errors++;
+    return;
+  }
+  if (strcmp (opened, want_name)) {
+    printf ("FAIL: \"%s\" opened \"%s\", not \"%s\"\n", path, opened, want_name);
+    errors++;
+  }
+  vfs_close (fd);
+}
+
+int main (void)
+{
+  make_disk ();
+  vfs_init ();
+
+  if (critical_errors) {
+    printf ("FAIL: %d critical errors while scanning the partitions\n", critical_errors);
+    errors++;
+  }
+  if (vfs_find_part (FWFS) != 0 || mounted_at[0] != FW_OFFSET) {
+    printf ("FAIL: firmware partition with a valid header not mounted\n");
+    errors++;
+  }
+  if (vfs_find_part (FAT32) != 1 || vfs_find_part (EXT2) != 2) {
+    printf ("FAIL: FAT32 on %d, ext2 on %d\n", vfs_find_part (FAT32), vfs_find_part (EXT2));
+    errors++;
+  }
+
+  check_path ("(hd0,1)/boot/loader.cfg", 1, "boot/loader.cfg");
+  check_path ("(hd0,1)loader.cfg",       1, "loader.cfg");
+  check_path ("(hd0,2)/vmlinux",         2, "vmlinux");
+  check_path ("(hd0,0)/osos",            0, "osos");
+  check_path ("[fat]/Notes/loader.cfg",  1, "Notes/loader.cfg");
+  check_path ("[vfat]",                  1, "");
+  check_path ("[linux]/boot/vmlinux",    2, "boot/vmlinux");
+  check_path ("[ext2]vmlinux",           2, "vmlinux");
+
+  check_path ("(hd0,12)/loader.cfg",     -1, 0); // only single digits
+  check_path ("(hd0,9)/loader.cfg",      -1, 0); // no such partition
+  check_path ("(hd0,",                   -1, 0);
+  check_path ("[fat",                    -1, 0);
+  check_path ("[hfs]/loader.cfg",        -1, 0); // not mounted
+  check_path ("loader.cfg",              -1, 0);
+
+  if (errors) {
+    printf ("vfspath: %d errors\n", errors);
+    return 1;
+  }
+  printf ("vfspath: OK\n");
+  return 0;
+}
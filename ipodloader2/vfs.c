@@ -33,11 +33,11 @@ int vfs_find_part(vfs_type type) {
   return (-1);
 }
 
-int vfs_open(char *fname) {
-  int8 part;
-  int  i;
-
-  part = -1;
+/* Splits a path like "[fat]/dir/file" or "(hd0,1)/dir/file" into the
+   index of the filesystem and the path within it */
+static int vfs_parse_path(char **fnamep) {
+  char *fname = *fnamep;
+  int   part = -1;
 
   /* FAT32: [dos], [fat], [win], [vfat], [fat32]
      EXT2:  [ext], [ext2], [linux]
@@ -56,15 +56,30 @@ int vfs_open(char *fname) {
           (part == -1 && !mlc_strncmp(fname,"[linux]",7)) ){
           part = vfs_find_part(HFSPLUS);
       }
-      /* [xxx]/ == position of ] + 2 chars */
-      fname = mlc_strchr(fname, ']') + 2;
+      fname = mlc_strchr(fname, ']');
+      if( !fname ) return(-1);
+      fname++;
   }
-  else if( !mlc_strncmp(fname,"(hd0,",5) ){
+  else if( !mlc_strncmp(fname,"(hd0,",5) && fname[5] && fname[6] == ')' ){
       part = fname[5] - '0'; /* atoi, the old-fashioned way */
-      /* (hd0,0)/ == 8 chars */
-      fname = fname + 8;
+      /* (hd0,0) == 7 chars */
+      fname = fname + 7;
   }
 
+  /* the root directory may be given with or without the / */
+  if( *fname == '/' ) fname++;
+
+  if( part < 0 || part >= MAX_FS ) return(-1);
+
+  *fnamep = fname;
+  return(part);
+}
+
+int vfs_open(char *fname) {
+  int  part;
+  int  i;
+
+  part = vfs_parse_path(&fname);
   if( part == -1 ) return(-1);
 
   if (fs[part]) {
@@ -129,6 +144,15 @@ size_t vfs_read(void *ptr,size_t size, size_t nmemb,int fd) {
   return( fs[part]->read( fs[part]->fsdata,ptr,size,nmemb,vfs_handle[fd].fd) );
 }
 
+int vfs_listdir(char *dirname, vfs_dir_callback cb, void *ctx) {
+  int part;
+
+  part = vfs_parse_path(&dirname);
+  if( part == -1 || !fs[part] || !fs[part]->listdir ) return(-1);
+
+  return( fs[part]->listdir( fs[part]->fsdata, dirname, cb, ctx ) );
+}
+
 void vfs_registerfs( filesystem *newfs ) {
   fs[newfs->partnum] = newfs;
 }
@@ -190,13 +214,13 @@ void vfs_init( void) {
           if(i == 0) {
             /* Technically this is an "Empty partition entry", but Apple uses it for the proprietary firmware partition at partition 0 */
             ata_readblocks(fs_header, offset, 1);
-            if( mlc_strncmp((void*)(fs_header->fwfsmagic),"]ih[", 4) ) {
+            if( !mlc_strncmp((void*)(fs_header->fwfsmagic),"]ih[", 4) ) {
               offset = offset;
               validoffset = 1;
             }
             else if(logBlkMultiplier > 1) {
               ata_readblocks(fs_header, offset*logBlkMultiplier, 1);
-              if( mlc_strncmp((void*)(fs_header->fwfsmagic),"]ih[", 4) )
+              if( !mlc_strncmp((void*)(fs_header->fwfsmagic),"]ih[", 4) )
               {
                 offset = offset * logBlkMultiplier;
                 validoffset = 1;
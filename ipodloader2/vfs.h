@@ -12,6 +12,16 @@ typedef enum _vfs_type {
   HFSPLUS
 } vfs_type;
 
+/* One entry of a directory, as passed to a vfs_dir_callback */
+typedef struct {
+  char  *name;
+  uint32 size;
+  uint8  isdir;
+} vfs_dirent;
+
+/* Called for each entry by vfs_listdir - return non-zero to stop */
+typedef int (*vfs_dir_callback)(void *ctx, vfs_dirent *entry);
+
 typedef struct {
   int    (*open)(void *fsdata,char *fname);
   void   (*close)(void *fsdata, int fd);
@@ -19,6 +29,7 @@ typedef struct {
   int    (*seek)(void *fsdata,int fd,long offset,int whence);
   size_t (*read)(void *fsdata,void *ptr,size_t size,size_t nmemb,int fd);
   int    (*getinfo)(void *fsdata, int fd, long *out_chksum);
+  int    (*listdir)(void *fsdata, char *dirname, vfs_dir_callback cb, void *ctx);
 
   void *fsdata;
   uint8 partnum;
@@ -34,5 +45,6 @@ long vfs_tell(int fd);
 size_t vfs_read(void *ptr,size_t size, size_t nmemb,int fd);
 int vfs_getinfo(int fd, long *out_chksum);
 void vfs_close(int fd);
+int vfs_listdir(char *dirname, vfs_dir_callback cb, void *ctx);
 
 #endif
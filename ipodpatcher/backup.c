@@ -0,0 +1,779 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+/*
+   Container layout (all fields little-endian):
+
+   Header (16 bytes)
+       "IPBK", version, chunk size, sector size
+
+   Chunk data, in partition order
+
+   Index (24 bytes per chunk)
+       file offset (64 bit), stored length, uncompressed length,
+       type (stored/lz/zero), CRC-32 of the uncompressed data
+
+   Trailer (24 bytes)
+       index offset (64 bit), partition image size (64 bit),
+       number of chunks, "IPBX"
+
+   The index is written last so that a container can be written to a
+   pipe, and the trailer is at a fixed offset from the end so that a
+   reader can find any chunk without scanning the file.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "ipodio.h"
+#include "ipodpatcher.h"
+#include "backup.h"
+#include "pipeline.h"
+#include "crc32.h"
+#include "lz.h"
+#include "fwdir.h"
+#include "verify.h"
+
+#define BACKUP_VERSION      1
+#define BACKUP_HEADER_SIZE  16
+#define BACKUP_INDEX_SIZE   24
+#define BACKUP_TRAILER_SIZE 24
+
+/* The manifest is filled in one chunk at a time */
+#if BACKUP_CHUNK_SIZE != MANIFEST_CHUNK_SIZE
+#error Backup and manifest chunk sizes differ
+#endif
+
+#define CHUNK_STORED 0
+#define CHUNK_LZ     1
+#define CHUNK_ZERO   2
+
+struct backup_chunk_t {
+    uint64_t offset;
+    uint32_t len;      /* Length in the container */
+    uint32_t ulen;     /* Uncompressed length */
+    uint32_t type;
+    uint32_t crc;
+};
+
+struct backup_index_t {
+    uint32_t chunksize;
+    uint32_t sector_size; /* Of the ipod the backup was made from */
+    uint64_t size;
+    uint32_t nchunks;
+    struct backup_chunk_t* chunks;
+};
+
+struct backup_ctx_t {
+    struct ipod_t* ipod;
+    int fd;
+    struct backup_index_t index;
+    struct manifest_t* manifest;
+    uint64_t bytesleft;
+    uint64_t fileoffset;
+};
+
+static inline void put_uint32le(uint32_t x, unsigned char* p)
+{
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+    p[2] = (x >> 16) & 0xff;
+    p[3] = (x >> 24) & 0xff;
+}
+
+static inline void put_uint64le(uint64_t x, unsigned char* p)
+{
+    put_uint32le(x & 0xffffffff, p);
+    put_uint32le(x >> 32, p + 4);
+}
+
+static inline uint32_t get_uint32le(unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_uint64le(unsigned char* p)
+{
+    return get_uint32le(p) | ((uint64_t)get_uint32le(p + 4) << 32);
+}
+
+static int write_all(int fd, unsigned char* buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n <= 0) {
+            perror("[ERR]  Write failed");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_at(int fd, uint64_t offset, unsigned char* buf, int len)
+{
+    int n;
+
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static bool is_zero(unsigned char* buf, int len)
+{
+    return (buf[0] == 0) && (memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+/* Read and check the trailer and index.  Returns 1 if fd is a
+   container, 0 if it isn't, -1 if it is but is damaged. */
+static int read_index(int fd, struct backup_index_t* index)
+{
+    unsigned char buf[BACKUP_TRAILER_SIZE];
+    unsigned char* p;
+    unsigned char* indexbuf;
+    off_t end;
+    uint64_t indexoffset;
+    uint64_t expected;
+    uint32_t i;
+
+    memset(index, 0, sizeof(*index));
+
+    if ((read_at(fd, 0, buf, BACKUP_HEADER_SIZE) < 0) ||
+        (memcmp(buf, "IPBK", 4) != 0)) {
+        return 0;
+    }
+
+    if (get_uint32le(buf + 4) != BACKUP_VERSION) {
+        fprintf(stderr,"[ERR]  Unsupported backup version %d\n",
+                       get_uint32le(buf + 4));
+        return -1;
+    }
+    index->chunksize = get_uint32le(buf + 8);
+    index->sector_size = get_uint32le(buf + 12);
+
+    end = lseek(fd, 0, SEEK_END);
+    if ((end < BACKUP_HEADER_SIZE + BACKUP_TRAILER_SIZE) ||
+        (read_at(fd, end - BACKUP_TRAILER_SIZE, buf, BACKUP_TRAILER_SIZE) < 0) ||
+        (memcmp(buf + 20, "IPBX", 4) != 0)) {
+        fprintf(stderr,"[ERR]  Backup file is truncated\n");
+        return -1;
+    }
+
+    indexoffset = get_uint64le(buf);
+    index->size = get_uint64le(buf + 8);
+    index->nchunks = get_uint32le(buf + 16);
+
+    if ((index->sector_size < 512) || (index->sector_size > 4096) ||
+        (index->sector_size & (index->sector_size - 1))) {
+        fprintf(stderr,"[ERR]  Bad backup sector size %d\n", index->sector_size);
+        return -1;
+    }
+
+    /* Chunks are written to the ipod a whole number of sectors at a time */
+    if ((index->chunksize == 0) || (index->chunksize > BACKUP_CHUNK_SIZE) ||
+        (index->chunksize % index->sector_size != 0)) {
+        fprintf(stderr,"[ERR]  Bad backup chunk size %d\n", index->chunksize);
+        return -1;
+    }
+
+    expected = (index->size + index->chunksize - 1) / index->chunksize;
+    if ((index->nchunks != expected) ||
+        (indexoffset + (uint64_t)index->nchunks * BACKUP_INDEX_SIZE + 
+         BACKUP_TRAILER_SIZE != (uint64_t)end)) {
+        fprintf(stderr,"[ERR]  Bad backup file index\n");
+        return -1;
+    }
+
+    indexbuf = malloc(index->nchunks * BACKUP_INDEX_SIZE + 1);
+    index->chunks = malloc((index->nchunks + 1) * sizeof(struct backup_chunk_t));
+    if ((indexbuf == NULL) || (index->chunks == NULL)) {
+        fprintf(stderr,"[ERR]  Could not allocate memory for backup index\n");
+        free(indexbuf);
+        free(index->chunks);
+        return -1;
+    }
+
+    if (read_at(fd, indexoffset, indexbuf, index->nchunks * BACKUP_INDEX_SIZE) < 0) {
+        fprintf(stderr,"[ERR]  Could not read backup index\n");
+        free(indexbuf);
+        free(index->chunks);
+        return -1;
+    }
+
+    p = indexbuf;
+    for (i = 0; i < index->nchunks; i++) {
+        index->chunks[i].offset = get_uint64le(p);
+        index->chunks[i].len = get_uint32le(p + 8);
+        index->chunks[i].ulen = get_uint32le(p + 12);
+        index->chunks[i].type = get_uint32le(p + 16);
+        index->chunks[i].crc = get_uint32le(p + 20);
+        p += BACKUP_INDEX_SIZE;
+
+        if ((index->chunks[i].len > index->chunksize) ||
+            (index->chunks[i].ulen != ((i == index->nchunks - 1) ?
+                 index->size - (uint64_t)i * index->chunksize : index->chunksize)) ||
+            (index->chunks[i].type > CHUNK_ZERO) ||
+            (index->chunks[i].offset + index->chunks[i].len > indexoffset)) {
+            fprintf(stderr,"[ERR]  Bad backup index entry for chunk %d\n", i);
+            free(indexbuf);
+            free(index->chunks);
+            return -1;
+        }
+    }
+
+    free(indexbuf);
+    return 1;
+}
+
+int backup_probe(int fd, uint64_t* size)
+{
+    struct backup_index_t index;
+    int res;
+
+    res = read_index(fd, &index);
+    if (res == 1) {
+        if (size != NULL) {
+            *size = index.size;
+        }
+        free(index.chunks);
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    return res;
+}
+
+/* Decode one chunk into out.  "in" holds its stored data. */
+static int decode_chunk(struct backup_chunk_t* chunk, int n,
+                        unsigned char* in, unsigned char* out)
+{
+    switch (chunk->type) {
+        case CHUNK_ZERO:
+            memset(out, 0, chunk->ulen);
+            return 0;
+        case CHUNK_STORED:
+            if (chunk->len != chunk->ulen) {
+                fprintf(stderr,"[ERR]  Chunk %d of backup is corrupt\n", n);
+                return -1;
+            }
+            memcpy(out, in, chunk->ulen);
+            break;
+        default:
+            if (lz_decompress(in, chunk->len, out, chunk->ulen) != (int)chunk->ulen) {
+                fprintf(stderr,"[ERR]  Chunk %d of backup is corrupt\n", n);
+                return -1;
+            }
+            break;
+    }
+
+    if (crc32_update(0, out, chunk->ulen) != chunk->crc) {
+        fprintf(stderr,"[ERR]  Checksum error in chunk %d of backup\n", n);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Creating a backup: read device -> compress -> write file */
+
+static int create_produce(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct backup_ctx_t* b = ctx;
+    int n;
+
+    if (b->bytesleft == 0) {
+        return 0;
+    }
+
+    slot->inlen = (b->bytesleft > b->index.chunksize) ? 
+                  b->index.chunksize : b->bytesleft;
+
+    n = ipod_read(b->ipod, slot->inbuf, slot->inlen);
+    if (n < slot->inlen) {
+        fprintf(stderr,"[ERR]  Short read - requested %d, got %d\n",
+                       slot->inlen, n);
+        return -1;
+    }
+
+    b->bytesleft -= n;
+    return 1;
+}
+
+static int create_work(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct backup_ctx_t* b = ctx;
+
+    slot->checksum = crc32_update(0, slot->inbuf, slot->inlen);
+
+    if (b->manifest != NULL) {
+        slot->hash = manifest_hash(slot->inbuf, slot->inlen);
+    }
+
+    if (is_zero(slot->inbuf, slot->inlen)) {
+        slot->flags = CHUNK_ZERO;
+        slot->outlen = 0;
+        return 0;
+    }
+
+    /* Only keep the compressed version if it is actually smaller */
+    slot->outlen = lz_compress(slot->inbuf, slot->inlen,
+                               slot->outbuf, slot->inlen - 1);
+    slot->flags = (slot->outlen > 0) ? CHUNK_LZ : CHUNK_STORED;
+    return 0;
+}
+
+static int create_consume(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct backup_ctx_t* b = ctx;
+    struct backup_chunk_t* chunk = &b->index.chunks[slot->seq];
+    unsigned char* buf;
+
+    chunk->offset = b->fileoffset;
+    chunk->ulen = slot->inlen;
+    chunk->type = slot->flags;
+    chunk->crc = slot->checksum;
+
+    if (b->manifest != NULL) {
+        b->manifest->hashes[slot->seq] = slot->hash;
+    }
+
+    switch (slot->flags) {
+        case CHUNK_ZERO:   buf = NULL;          chunk->len = 0;            break;
+        case CHUNK_LZ:     buf = slot->outbuf;  chunk->len = slot->outlen; break;
+        default:           buf = slot->inbuf;   chunk->len = slot->inlen;  break;
+    }
+
+    if ((chunk->len > 0) && (write_all(b->fd, buf, chunk->len) < 0)) {
+        return -1;
+    }
+
+    b->fileoffset += chunk->len;
+    return 0;
+}
+
+int backup_create(struct ipod_t* ipod, int outfile, struct manifest_t* manifest)
+{
+    struct backup_ctx_t b;
+    struct pipeline_t p;
+    unsigned char buf[BACKUP_TRAILER_SIZE];
+    unsigned char* indexbuf;
+    uint64_t stored = 0;
+    uint32_t i;
+    int res;
+
+    memset(&b, 0, sizeof(b));
+    b.ipod = ipod;
+    b.fd = outfile;
+    b.manifest = manifest;
+    b.index.chunksize = BACKUP_CHUNK_SIZE;
+    b.index.size = (uint64_t)ipod->pinfo[0].size * ipod->sector_size;
+    b.index.nchunks = (b.index.size + b.index.chunksize - 1) / b.index.chunksize;
+    b.bytesleft = b.index.size;
+
+    b.index.chunks = calloc(b.index.nchunks, sizeof(struct backup_chunk_t));
+    indexbuf = malloc(b.index.nchunks * BACKUP_INDEX_SIZE);
+    if ((b.index.chunks == NULL) || (indexbuf == NULL)) {
+        fprintf(stderr,"[ERR]  Could not allocate memory for backup index\n");
+        free(b.index.chunks);
+        free(indexbuf);
+        return -1;
+    }
+
+    memcpy(buf, "IPBK", 4);
+    put_uint32le(BACKUP_VERSION, buf + 4);
+    put_uint32le(b.index.chunksize, buf + 8);
+    put_uint32le(ipod->sector_size, buf + 12);
+    if (write_all(outfile, buf, BACKUP_HEADER_SIZE) < 0) {
+        res = -1;
+        goto done;
+    }
+    b.fileoffset = BACKUP_HEADER_SIZE;
+
+    if (ipod_seek(ipod, ipod->start) < 0) {
+        res = -1;
+        goto done;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.nthreads = pipeline_default_threads();
+    p.inbufsize = b.index.chunksize;
+    p.outbufsize = b.index.chunksize;
+    p.produce = create_produce;
+    p.work = create_work;
+    p.consume = create_consume;
+    p.ctx = &b;
+
+    fprintf(stderr,"[INFO] Compressing %d sectors with %d threads\n",
+                   ipod->pinfo[0].size, p.nthreads);
+
+    if ((res = pipeline_run(&p)) < 0) {
+        goto done;
+    }
+
+    for (i = 0; i < b.index.nchunks; i++) {
+        unsigned char* q = indexbuf + i * BACKUP_INDEX_SIZE;
+
+        put_uint64le(b.index.chunks[i].offset, q);
+        put_uint32le(b.index.chunks[i].len, q + 8);
+        put_uint32le(b.index.chunks[i].ulen, q + 12);
+        put_uint32le(b.index.chunks[i].type, q + 16);
+        put_uint32le(b.index.chunks[i].crc, q + 20);
+        stored += b.index.chunks[i].len;
+    }
+
+    put_uint64le(b.fileoffset, buf);
+    put_uint64le(b.index.size, buf + 8);
+    put_uint32le(b.index.nchunks, buf + 16);
+    memcpy(buf + 20, "IPBX", 4);
+
+    if ((write_all(outfile, indexbuf, b.index.nchunks * BACKUP_INDEX_SIZE) < 0) ||
+        (write_all(outfile, buf, BACKUP_TRAILER_SIZE) < 0)) {
+        res = -1;
+        goto done;
+    }
+
+    fprintf(stderr,"[INFO] Compressed %lu bytes to %lu bytes in %d chunks\n",
+                   (unsigned long)b.index.size, (unsigned long)stored,
+                   b.index.nchunks);
+
+done:
+    free(b.index.chunks);
+    free(indexbuf);
+    return res;
+}
+
+/* Restoring a backup: read file -> decompress -> write device */
+
+static int restore_produce(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct backup_ctx_t* b = ctx;
+    struct backup_chunk_t* chunk;
+
+    if (slot->seq == b->index.nchunks) {
+        return 0;
+    }
+
+    chunk = &b->index.chunks[slot->seq];
+    slot->inlen = chunk->len;
+
+    if ((chunk->len > 0) && 
+        (read_at(b->fd, chunk->offset, slot->inbuf, chunk->len) < 0)) {
+        fprintf(stderr,"[ERR]  Could not read chunk %d of backup\n",
+                       (int)slot->seq);
+        return -1;
+    }
+
+    return 1;
+}
+
+static int restore_work(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct backup_ctx_t* b = ctx;
+    struct ipod_t* ipod = b->ipod;
+    struct backup_chunk_t* chunk = &b->index.chunks[slot->seq];
+
+    if (chunk->type == CHUNK_ZERO) {
+        return 0;
+    }
+
+    if (decode_chunk(chunk, slot->seq, slot->inbuf, slot->outbuf) < 0) {
+        return -1;
+    }
+
+    /* Partitions are a whole number of sectors, but be careful anyway */
+    slot->outlen = (chunk->ulen + ipod->sector_size - 1) & ~(ipod->sector_size - 1);
+    memset(slot->outbuf + chunk->ulen, 0, slot->outlen - chunk->ulen);
+
+    if (ipod->verify != NULL) {
+        verify_crcs(ipod->sector_size, slot->outbuf, slot->outlen, slot->crcs);
+    }
+
+    return 0;
+}
+
+static int restore_consume(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct backup_ctx_t* b = ctx;
+    struct ipod_t* ipod = b->ipod;
+    struct backup_chunk_t* chunk = &b->index.chunks[slot->seq];
+    uint64_t offset = ipod->start + slot->seq * b->index.chunksize;
+    int len;
+    int n;
+
+    if (chunk->type == CHUNK_ZERO) {
+        len = (chunk->ulen + ipod->sector_size - 1) & ~(ipod->sector_size - 1);
+        if (ipod_zero_range(ipod, offset / ipod->sector_size,
+                            len / ipod->sector_size) < 0) {
+            ipod_print_error(" Error zeroing disk: ");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (ipod_seek(ipod, offset) < 0) {
+        fprintf(stderr,"[ERR]  Seek failed\n");
+        return -1;
+    }
+
+    len = slot->outlen;
+    if (ipod->verify != NULL) {
+        verify_expect(ipod->verify, slot->outbuf, slot->crcs, len);
+    }
+
+    n = ipod_write(ipod, slot->outbuf, len);
+    if (n < len) {
+        ipod_print_error(" Error writing to disk: ");
+        return -1;
+    }
+
+    return 0;
+}
+
+int backup_restore(struct ipod_t* ipod, int infile)
+{
+    struct backup_ctx_t b;
+    struct pipeline_t p;
+    int res;
+
+    memset(&b, 0, sizeof(b));
+    b.ipod = ipod;
+    b.fd = infile;
+
+    if (read_index(infile, &b.index) != 1) {
+        return -1;
+    }
+
+    if (b.index.size > (uint64_t)ipod->pinfo[0].size * ipod->sector_size) {
+        fprintf(stderr,"[ERR]  Backup is too large for firmware partition\n");
+        free(b.index.chunks);
+        return -1;
+    }
+
+    /* restore_work() pads the last chunk to a whole sector */
+    if (b.index.chunksize % ipod->sector_size != 0) {
+        fprintf(stderr,"[ERR]  Backup chunk size %d is not a multiple of the sector size\n",
+                       b.index.chunksize);
+        free(b.index.chunks);
+        return -1;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.nthreads = pipeline_default_threads();
+    p.inbufsize = b.index.chunksize;
+    p.outbufsize = b.index.chunksize;
+    p.ncrcs = b.index.chunksize / ipod->sector_size;
+    p.produce = restore_produce;
+    p.work = restore_work;
+    p.consume = restore_consume;
+    p.ctx = &b;
+
+    fprintf(stderr,"[INFO] Restoring %lu bytes from compressed backup with %d threads\n",
+                   (unsigned long)b.index.size, p.nthreads);
+
+    res = pipeline_run(&p);
+
+    free(b.index.chunks);
+    return res;
+}
+
+/* Read len bytes at offset in the partition image held by infile */
+static int read_range(int infile, struct backup_index_t* index,
+                      uint64_t offset, unsigned char* buf, int len)
+{
+    struct backup_chunk_t* chunk;
+    unsigned char* in = NULL;
+    unsigned char* out = NULL;
+    uint32_t i;
+    int skip;
+    int n;
+    int res = -1;
+
+    if (offset + len > index->size) {
+        fprintf(stderr,"[ERR]  Read beyond end of backup\n");
+        return -1;
+    }
+
+    in = malloc(index->chunksize);
+    out = malloc(index->chunksize);
+    if ((in == NULL) || (out == NULL)) {
+        goto done;
+    }
+
+    while (len > 0) {
+        i = offset / index->chunksize;
+        skip = offset % index->chunksize;
+        chunk = &index->chunks[i];
+
+        if ((chunk->len > 0) && 
+            (read_at(infile, chunk->offset, in, chunk->len) < 0)) {
+            goto done;
+        }
+        if (decode_chunk(chunk, i, in, out) < 0) {
+            goto done;
+        }
+
+        n = chunk->ulen - skip;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf, out + skip, n);
+
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    res = 0;
+
+done:
+    free(in);
+    free(out);
+    return res;
+}
+
+int backup_read_range(int infile, uint64_t offset,
+                      unsigned char* buf, int len)
+{
+    struct backup_index_t index;
+    int res;
+
+    if (read_index(infile, &index) != 1) {
+        return -1;
+    }
+
+    res = read_range(infile, &index, offset, buf, len);
+
+    free(index.chunks);
+    return res;
+}
+
+/* Size of the pieces backup_extract_image() reads at a time */
+#define EXTRACT_SIZE BACKUP_CHUNK_SIZE
+
+int backup_extract_image(int infile, const char* name, int outfile)
+{
+    struct backup_index_t index;
+    unsigned char hdr[512];
+    unsigned char dir[FWDIR_ENTRY_SIZE * MAX_IMAGES];
+    unsigned char* entry = NULL;
+    unsigned char* buf = NULL;
+    char ondisk[4];
+    uint64_t diroffset, fwoffset, offset;
+    uint32_t len, n;
+    int version, nimages, i;
+    int res = -1;
+
+    if (strlen(name) != 4) {
+        fprintf(stderr,"[ERR]  Image names are 4 characters, e.g. osos\n");
+        return -1;
+    }
+
+    /* The directory holds the names backwards */
+    for (i = 0; i < 4; i++) {
+        ondisk[i] = name[3 - i];
+    }
+
+    if (read_index(infile, &index) != 1) {
+        return -1;
+    }
+
+    /* Find the directory as read_directory() does */
+    if (read_range(infile, &index, 0, hdr, sizeof(hdr)) < 0) {
+        goto done;
+    }
+    if (memcmp(hdr + 0x100, "]ih[", 4) != 0) {
+        fprintf(stderr,"[ERR]  Backup doesn't hold a firmware partition\n");
+        goto done;
+    }
+    version = hdr[0x10a] | (hdr[0x10b] << 8);
+    diroffset = get_uint32le(hdr + 0x104) + 0x200;
+
+    if (read_range(infile, &index, diroffset, dir, sizeof(dir)) < 0) {
+        goto done;
+    }
+
+    /* 2nd gen Nano */
+    if (dir[0] == 0) {
+        diroffset += index.sector_size - (diroffset % index.sector_size);
+        if (read_range(infile, &index, diroffset, dir, sizeof(dir)) < 0) {
+            goto done;
+        }
+    }
+
+    for (nimages = 0; nimages < MAX_IMAGES; nimages++) {
+        unsigned char* p = dir + nimages * FWDIR_ENTRY_SIZE;
+
+        if ((memcmp(p, "!ATA", 4) != 0) && (memcmp(p, "DNAN", 4) != 0)) {
+            break;
+        }
+        if ((entry == NULL) && (memcmp(p + FWDIR_NAME, ondisk, 4) == 0)) {
+            entry = p;
+        }
+    }
+
+    if (entry == NULL) {
+        fprintf(stderr,"[ERR]  No %s image in backup\n", name);
+        goto done;
+    }
+
+    /* The 3g firmware starts at the beginning of the partition */
+    fwoffset = ((nimages > 1) && (version == 2)) ? 0 : index.sector_size;
+    offset = fwoffset + get_uint32le(entry + FWDIR_DEVOFFSET);
+    len = get_uint32le(entry + FWDIR_LEN);
+
+    buf = malloc(EXTRACT_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr,"[ERR]  Buffer allocation failed\n");
+        goto done;
+    }
+
+    while (len > 0) {
+        n = (len > EXTRACT_SIZE) ? EXTRACT_SIZE : len;
+
+        if ((read_range(infile, &index, offset, buf, n) < 0) ||
+            (write_all(outfile, buf, n) < 0)) {
+            goto done;
+        }
+
+        offset += n;
+        len -= n;
+    }
+    res = 0;
+
+done:
+    free(buf);
+    free(index.chunks);
+    return res;
+}
@@ -0,0 +1,54 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __BACKUP_H
+#define __BACKUP_H
+
+#include <stdint.h>
+
+#include "ipodio.h"
+#include "manifest.h"
+
+/* Compressed partition backups ("ipbk" containers) */
+
+/* Size of the independently compressed chunks */
+#define BACKUP_CHUNK_SIZE (1024*1024)
+
+/* Returns 1 if fd is a backup container (and sets *size to the size of
+   the partition image it holds, if size isn't NULL), 0 if it isn't,
+   or -1 on error. */
+int backup_probe(int fd, uint64_t* size);
+
+/* Write the firmware partition to outfile as a container, and record
+   the chunk hashes in manifest if it isn't NULL */
+int backup_create(struct ipod_t* ipod, int outfile, struct manifest_t* manifest);
+
+/* Write the partition image in the container infile to the ipod */
+int backup_restore(struct ipod_t* ipod, int infile);
+
+/* Random access - read len bytes at offset in the partition image,
+   decompressing only the chunks that are needed. */
+int backup_read_range(int infile, uint64_t offset,
+                      unsigned char* buf, int len);
+
+/* Write the firmware image called name ("osos", "rsrc", ...) in the
+   container infile to outfile, without needing the ipod */
+int backup_extract_image(int infile, const char* name, int outfile);
+
+#endif
@@ -0,0 +1,62 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chksum.h"
+
+#define LOW_BYTES 0x00ff00ff00ff00ffULL
+
+/* Words summed before the 16-bit lanes could overflow - each word adds
+   at most 2*255 to a lane */
+#define MAX_WORDS 128
+
+uint32_t chksum_update(uint32_t sum, const unsigned char* buf, int len)
+{
+    uint64_t acc;
+    uint64_t w;
+    int n;
+    int i;
+
+    /* Add eight bytes at a time, as four 16-bit lanes of a 64-bit word */
+    while (len >= 8) {
+        n = len / 8;
+        if (n > MAX_WORDS) {
+            n = MAX_WORDS;
+        }
+
+        acc = 0;
+        for (i = 0; i < n; i++) {
+            memcpy(&w, buf + i * 8, 8);
+            acc += (w & LOW_BYTES) + ((w >> 8) & LOW_BYTES);
+        }
+
+        sum += (acc & 0xffff) + ((acc >> 16) & 0xffff) +
+               ((acc >> 32) & 0xffff) + (acc >> 48);
+        buf += n * 8;
+        len -= n * 8;
+    }
+
+    while (len-- > 0) {
+        sum += *buf++;
+    }
+
+    return sum;
+}
@@ -0,0 +1,534 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "ipodio.h"
+#include "ipodpatcher.h"
+#include "fwdir.h"
+#include "compact.h"
+#include "pipeline.h"
+
+/* Size of the reads and writes used to move images */
+#define COMPACT_CHUNK_SIZE (4*1024*1024)
+
+/* The Nano 2G keeps 0x800 bytes of hashes in front of each image */
+#define PREFIX_SIZE(ipod) ((ipod)->modelnum == 62 ? 0x800 : 0)
+
+/* Where each image is now, in devOffset terms, including the prefix
+   and rounded up to whole sectors */
+struct region_t {
+    uint32_t start;
+    uint32_t len;
+};
+
+struct layout_t {
+    struct fwdir_t* dir;
+    int n;
+    int target;
+    uint32_t prefix;
+    uint32_t limit;        /* End of the partition */
+    uint32_t dirend;       /* End of the directory sector */
+    uint32_t need;         /* Region size of the target after growing */
+    uint32_t keep;         /* Region bytes of the target to preserve */
+    struct region_t r[MAX_IMAGES];
+    int order[MAX_IMAGES]; /* Images other than the target, by position */
+    int nother;
+};
+
+static uint32_t align_up(uint32_t x, uint32_t align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+static void image_name(struct fwdir_t* dir, int i, char* name)
+{
+    unsigned char* p = dir->entries + i * FWDIR_ENTRY_SIZE + FWDIR_NAME;
+    int j;
+
+    /* Names are stored byte-reversed ("soso" is OSOS) */
+    for (j = 0; j < 4; j++) {
+        name[j] = toupper(p[3 - j]);
+    }
+    name[4] = 0;
+}
+
+/* Fill in the moves and byte count for new region starts "start" and
+   check the result fits the partition without overlapping itself */
+static int evaluate(struct layout_t* l, uint32_t* start, const char* method,
+                    struct compact_plan_t* plan)
+{
+    struct compact_plan_t p;
+    uint32_t len_i, len_j;
+    int i, j;
+
+    for (i = 0; i < l->n; i++) {
+        len_i = (i == l->target) ? l->need : l->r[i].len;
+        if ((uint64_t)start[i] + len_i > l->limit) {
+            return -1;
+        }
+        for (j = i + 1; j < l->n; j++) {
+            len_j = (j == l->target) ? l->need : l->r[j].len;
+            if ((start[i] < start[j] + len_j) && (start[j] < start[i] + len_i)) {
+                return -1;
+            }
+        }
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.target = l->target;
+    p.method = method;
+
+    for (i = 0; i < l->n; i++) {
+        p.offset[i] = start[i] + l->prefix;
+
+        if (start[i] == l->r[i].start) {
+            continue;
+        }
+
+        if ((i == l->target) && (l->keep == 0)) {
+            /* Nothing worth keeping - the caller rewrites it */
+            continue;
+        }
+
+        p.moves[p.nmoves].image = i;
+        p.moves[p.nmoves].from = l->r[i].start;
+        p.moves[p.nmoves].to = start[i];
+        p.moves[p.nmoves].len = (i == l->target) ? l->keep : l->r[i].len;
+        p.bytesmoved += p.moves[p.nmoves].len;
+        p.nmoves++;
+    }
+
+    /* Keep the first layout found of any that move the same amount */
+    if ((plan->method == NULL) || (p.bytesmoved < plan->bytesmoved)) {
+        memcpy(plan, &p, sizeof(p));
+    }
+
+    return 0;
+}
+
+/* Put the other images next to each other from the start of the first
+   one, followed by the target (if any) */
+static void plan_pack(struct layout_t* l, struct compact_plan_t* plan)
+{
+    uint32_t start[MAX_IMAGES];
+    uint32_t pos;
+    int i;
+
+    /* Start straight after the directory sector (Apple put the first
+       image there), or wherever the first image is if that's earlier */
+    pos = l->dirend;
+    for (i = 0; i < l->n; i++) {
+        if (l->r[i].start < pos) {
+            pos = l->r[i].start;
+        }
+    }
+
+    for (i = 0; i < l->nother; i++) {
+        start[l->order[i]] = pos;
+        pos += l->r[l->order[i]].len;
+    }
+
+    if (l->target >= 0) {
+        start[l->target] = pos;
+        evaluate(l, start, "pack the other images and put the target last", plan);
+    } else {
+        evaluate(l, start, "pack all images together", plan);
+    }
+}
+
+/* Leave everything where it is, or move the images after the target up
+   just far enough to make room */
+static void plan_shift(struct layout_t* l, struct compact_plan_t* plan)
+{
+    uint32_t start[MAX_IMAGES];
+    uint32_t tstart = l->r[l->target].start;
+    uint32_t next = l->limit;
+    uint32_t delta;
+    int i;
+
+    for (i = 0; i < l->n; i++) {
+        start[i] = l->r[i].start;
+        if ((i != l->target) && (start[i] > tstart) && (start[i] < next)) {
+            next = start[i];
+        }
+    }
+
+    if (tstart + l->need <= next) {
+        evaluate(l, start, "no images need to move", plan);
+        return;
+    }
+
+    delta = tstart + l->need - next;
+    for (i = 0; i < l->n; i++) {
+        if ((i != l->target) && (start[i] > tstart)) {
+            start[i] += delta;
+        }
+    }
+
+    evaluate(l, start, "move the following images up", plan);
+}
+
+/* Move just the target, to the first gap big enough for it */
+static void plan_relocate(struct layout_t* l, struct compact_plan_t* plan)
+{
+    uint32_t start[MAX_IMAGES];
+    uint32_t pos;
+    uint32_t end;
+    int i;
+
+    for (i = 0; i < l->n; i++) {
+        start[i] = l->r[i].start;
+    }
+
+    for (i = 0; i < l->nother; i++) {
+        pos = l->r[l->order[i]].start + l->r[l->order[i]].len;
+        end = (i + 1 < l->nother) ? l->r[l->order[i+1]].start : l->limit;
+
+        if (pos + l->need <= end) {
+            start[l->target] = pos;
+            evaluate(l, start, "move the target to a free gap", plan);
+            return;
+        }
+    }
+}
+
+/* Can move j be done next, with moves first..nmoves-1 still to do? */
+static int move_is_safe(struct compact_plan_t* plan, int first, int j)
+{
+    struct compact_move_t* m = &plan->moves[j];
+    struct compact_move_t* o;
+    int k;
+
+    for (k = first; k < plan->nmoves; k++) {
+        o = &plan->moves[k];
+        if ((k != j) && (o->image != plan->target) &&
+            (m->to < o->from + o->len) && (o->from < m->to + m->len)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void layout_init(struct fwdir_t* dir, int target, uint32_t size,
+                        uint32_t keep, struct layout_t* l)
+{
+    struct ipod_t* ipod = dir->ipod;
+    uint32_t ss = ipod->sector_size;
+    int i, j;
+
+    memset(l, 0, sizeof(*l));
+    l->dir = dir;
+    l->n = dir->nentries;
+    l->target = target;
+    l->prefix = PREFIX_SIZE(ipod);
+    l->limit = (uint64_t)ipod->pinfo[0].size * ss - (ipod->fwoffset - ipod->start);
+    l->dirend = ipod->diroffset - (ipod->diroffset % ss) + ss;
+    l->need = align_up(l->prefix + size, ss);
+    l->keep = (keep > 0) ? align_up(l->prefix + keep, ss) : 0;
+
+    for (i = 0; i < l->n; i++) {
+        l->r[i].start = fwdir_get(dir, i, FWDIR_DEVOFFSET) - l->prefix;
+        l->r[i].len = align_up(l->prefix + fwdir_get(dir, i, FWDIR_LEN), ss);
+
+        if (i == target) {
+            continue;
+        }
+
+        /* Insertion sort by position - there are at most MAX_IMAGES */
+        for (j = l->nother; j > 0 && l->r[l->order[j-1]].start > l->r[i].start; j--) {
+            l->order[j] = l->order[j-1];
+        }
+        l->order[j] = i;
+        l->nother++;
+    }
+}
+
+int compact_plan(struct fwdir_t* dir, int target, uint32_t size,
+                 uint32_t keep, struct compact_plan_t* plan)
+{
+    struct layout_t l;
+    struct compact_move_t tmp;
+    int i, j;
+
+    layout_init(dir, target, size, keep, &l);
+
+    memset(plan, 0, sizeof(*plan));
+
+    if (target >= 0) {
+        plan_shift(&l, plan);
+        plan_relocate(&l, plan);
+    }
+    plan_pack(&l, plan);
+
+    if (plan->method == NULL) {
+        fprintf(stderr,"[ERR]  Not enough space in the firmware partition\n");
+        return -1;
+    }
+
+    for (i = 0; i < plan->nmoves; i++) {
+        if ((plan->moves[i].from % dir->ipod->sector_size) != 0) {
+            fprintf(stderr,"[ERR]  Image %d is not sector aligned - can not move it\n",
+                    plan->moves[i].image);
+            return -1;
+        }
+    }
+
+    /* Order the moves so that nothing is overwritten before it has been
+       copied.  The target is read into memory before anything moves, so
+       its old position never gets in the way. */
+    for (i = 0; i < plan->nmoves; i++) {
+        for (j = i; j < plan->nmoves; j++) {
+            if (move_is_safe(plan, i, j)) {
+                break;
+            }
+        }
+
+        if (j == plan->nmoves) {
+            fprintf(stderr,"[ERR]  Can not find a safe order to move the images in\n");
+            return -1;
+        }
+
+        tmp = plan->moves[i];
+        plan->moves[i] = plan->moves[j];
+        plan->moves[j] = tmp;
+    }
+
+    return 0;
+}
+
+int compact_find_space(struct fwdir_t* dir, uint32_t size, uint32_t* devOffset)
+{
+    struct layout_t l;
+    uint32_t pos;
+    uint32_t end;
+    int i;
+
+    layout_init(dir, -1, size, 0, &l);
+
+    for (i = 0; i < l.nother; i++) {
+        pos = align_up(l.r[l.order[i]].start + l.r[l.order[i]].len, dir->ipod->sector_size);
+        end = (i + 1 < l.nother) ? l.r[l.order[i+1]].start : l.limit;
+
+        if (pos + l.need <= end) {
+            *devOffset = pos + l.prefix;
+            return 0;
+        }
+    }
+
+    fprintf(stderr,"[ERR]  Not enough space in the firmware partition\n");
+    return -1;
+}
+
+void compact_print(struct fwdir_t* dir, struct compact_plan_t* plan)
+{
+    char name[5];
+    int i;
+
+    fprintf(stderr,"[INFO] Firmware layout: %s\n", plan->method);
+
+    for (i = 0; i < plan->nmoves; i++) {
+        image_name(dir, plan->moves[i].image, name);
+        fprintf(stderr,"[INFO]   Move %s from 0x%08x to 0x%08x (%u bytes)\n",
+                name, plan->moves[i].from, plan->moves[i].to, plan->moves[i].len);
+    }
+
+    fprintf(stderr,"[INFO] %" PRIu64 " bytes to move\n", plan->bytesmoved);
+}
+
+/* Copying one image - overlapped reads and writes through a pipeline */
+
+struct copy_ctx_t {
+    struct ipod_t* ipod;
+    uint64_t from;
+    uint64_t to;
+    uint32_t len;
+    uint32_t remaining;
+};
+
+static int copy_produce(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct copy_ctx_t* c = ctx;
+    uint32_t chunk;
+    uint32_t offset;
+    int n;
+
+    if (c->remaining == 0) {
+        return 0;
+    }
+
+    chunk = (c->remaining > COMPACT_CHUNK_SIZE) ? COMPACT_CHUNK_SIZE : c->remaining;
+
+    /* Copy from the end when moving up, so that we never overwrite
+       data we haven't read yet */
+    if (c->to > c->from) {
+        offset = c->remaining - chunk;
+    } else {
+        offset = c->len - c->remaining;
+    }
+    c->remaining -= chunk;
+
+    slot->hash = offset;
+    slot->inlen = chunk;
+
+    n = ipod_read_at(c->ipod, slot->inbuf, chunk, c->from + offset);
+    if (n != (int)chunk) {
+        fprintf(stderr,"[ERR]  Short read - requested %u bytes, received %d\n", chunk, n);
+        return -1;
+    }
+
+    return 1;
+}
+
+static int copy_consume(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct copy_ctx_t* c = ctx;
+    int n;
+
+    n = ipod_write_at(c->ipod, slot->inbuf, slot->inlen, c->to + slot->hash);
+    if (n != slot->inlen) {
+        ipod_print_error(" Error writing to disk: ");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int copy_image(struct ipod_t* ipod, struct compact_move_t* m)
+{
+    struct copy_ctx_t c;
+    struct pipeline_t p;
+
+    memset(&c, 0, sizeof(c));
+    c.ipod = ipod;
+    c.from = ipod->fwoffset + m->from;
+    c.to = ipod->fwoffset + m->to;
+    c.len = m->len;
+    c.remaining = m->len;
+
+    memset(&p, 0, sizeof(p));
+    p.nthreads = 0;
+    p.nslots = 2;
+    p.inbufsize = COMPACT_CHUNK_SIZE;
+    p.produce = copy_produce;
+    p.consume = copy_consume;
+    p.ctx = &c;
+
+    return pipeline_run(&p);
+}
+
+int compact_apply(struct fwdir_t* dir, struct compact_plan_t* plan)
+{
+    struct ipod_t* ipod = dir->ipod;
+    struct compact_move_t* m;
+    unsigned char* staged = NULL;
+    int n;
+    int i;
+
+    for (i = 0; i < plan->nmoves; i++) {
+        m = &plan->moves[i];
+
+        if (m->image == plan->target) {
+            /* The target can only move after the others have moved out
+               of its way, but they may be moving into its old space */
+            if (ipod_alloc_buffer(&staged, m->len) < 0) {
+                fprintf(stderr,"[ERR]  Buffer allocation failed\n");
+                return -1;
+            }
+
+            n = ipod_read_at(ipod, staged, m->len, ipod->fwoffset + m->from);
+            if (n != (int)m->len) {
+                fprintf(stderr,"[ERR]  Short read - requested %u bytes, received %d\n",
+                        m->len, n);
+                ipod_free_buffer(staged);
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < plan->nmoves; i++) {
+        m = &plan->moves[i];
+
+        if (ipod_verbose) {
+            fprintf(stderr,"[VERB] Copying %08x bytes from %08x to %08x\n",
+                    m->len, m->from, m->to);
+        }
+
+        if (m->image == plan->target) {
+            n = ipod_write_at(ipod, staged, m->len, ipod->fwoffset + m->to);
+            if (n != (int)m->len) {
+                ipod_print_error(" Error writing to disk: ");
+                ipod_free_buffer(staged);
+                return -1;
+            }
+        } else if (copy_image(ipod, m) < 0) {
+            fprintf(stderr,"[ERR]  Image movement failed.\n");
+            if (staged != NULL) {
+                ipod_free_buffer(staged);
+            }
+            return -1;
+        }
+    }
+
+    if (staged != NULL) {
+        ipod_free_buffer(staged);
+    }
+
+    for (i = 0; i < dir->nentries; i++) {
+        fwdir_set(dir, i, FWDIR_DEVOFFSET, plan->offset[i]);
+    }
+
+    return 0;
+}
+
+/* --compact: remove the gaps between images */
+int compact_partition(struct ipod_t* ipod, int dryrun)
+{
+    struct fwdir_t dir;
+    struct compact_plan_t plan;
+
+    if (fwdir_load(ipod, &dir) < 0) {
+        return -1;
+    }
+
+    if (compact_plan(&dir, -1, 0, 0, &plan) < 0) {
+        fwdir_free(&dir);
+        return -1;
+    }
+
+    compact_print(&dir, &plan);
+
+    if (dryrun || (plan.nmoves == 0)) {
+        fwdir_free(&dir);
+        return 0;
+    }
+
+    if (compact_apply(&dir, &plan) < 0) {
+        fwdir_free(&dir);
+        return -1;
+    }
+
+    return fwdir_commit(&dir);
+}
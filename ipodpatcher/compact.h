@@ -0,0 +1,79 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __COMPACT_H
+#define __COMPACT_H
+
+#include <stdint.h>
+
+#include "ipodio.h"
+#include "fwdir.h"
+
+/* Firmware partition layout planning.
+
+   compact_plan() works out where each image should go so that one of
+   them (the "target") has room to grow, choosing whichever of these
+   moves the fewest bytes:
+
+     - leave everything where it is, if the target already fits
+     - move the images after the target up to make room
+     - move the target into a gap (or past the last image)
+     - pack all the other images together and put the target last
+
+   With no target it just packs the images together, removing any gaps
+   left by earlier installs.  compact_apply() then copies the data and
+   updates the devOffset fields in a directory transaction - the caller
+   commits it once the target image itself has been written. */
+
+struct compact_move_t {
+    int image;             /* Index in the directory */
+    uint32_t from;         /* Start of the image's data (devOffset based) */
+    uint32_t to;
+    uint32_t len;          /* Bytes to copy */
+};
+
+struct compact_plan_t {
+    int target;            /* -1 for plain compaction */
+    const char* method;    /* Description of the layout chosen */
+    uint32_t offset[MAX_IMAGES];   /* New devOffset of each image */
+    struct compact_move_t moves[MAX_IMAGES];
+    int nmoves;
+    uint64_t bytesmoved;
+};
+
+/* Plan room for image "target" to hold "size" bytes (its new "len"
+   field).  The first "keep" bytes of the target's data are preserved if
+   it has to move.  Returns -1 if there is no layout that fits. */
+int compact_plan(struct fwdir_t* dir, int target, uint32_t size,
+                 uint32_t keep, struct compact_plan_t* plan);
+
+/* Find the first gap after an existing image that can hold a new image
+   of "size" bytes, and return the devOffset it should have */
+int compact_find_space(struct fwdir_t* dir, uint32_t size, uint32_t* devOffset);
+
+void compact_print(struct fwdir_t* dir, struct compact_plan_t* plan);
+
+/* Move the data and update dir - the directory is not committed */
+int compact_apply(struct fwdir_t* dir, struct compact_plan_t* plan);
+
+/* Pack the images in the firmware partition together, or with dryrun
+   set just report what would be moved */
+int compact_partition(struct ipod_t* ipod, int dryrun);
+
+#endif
@@ -0,0 +1,303 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ipodpatcher.h"
+#include "ipodio.h"
+#include "devcache.h"
+#include "fwdir.h"
+#include "crc32.h"
+
+/* Bump this when the file format or the meaning of a field changes */
+#define DEVCACHE_VERSION 1
+
+struct devcache_entry_t {
+    int version;
+    int sector_size;
+    int macpod;
+    struct partinfo_t pinfo[4];
+    int nparts;
+    uint64_t diroffset;
+    uint64_t fwoffset;
+    uint32_t dircrc;
+    int ramsize;
+};
+
+/* Read the serial number into ipod->serial, keeping only the characters
+   that are safe in a file name */
+static int get_serial(struct ipod_t* ipod)
+{
+    unsigned char buf[255];
+    int i, n, len;
+
+    if (ipod->serial[0] != 0) {
+        return 0;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    if (ipod_scsi_inquiry(ipod, 0x80, buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+
+    /* The device may have rejected the command without the ioctl failing */
+    if (buf[1] != 0x80) {
+        return -1;
+    }
+
+    len = buf[3];
+    if (len > (int)sizeof(buf) - 4) {
+        len = sizeof(buf) - 4;
+    }
+
+    n = 0;
+    for (i = 0; (i < len) && (n < (int)sizeof(ipod->serial) - 1); i++) {
+        if (isalnum(buf[4 + i]) || (buf[4 + i] == '-') || (buf[4 + i] == '_')) {
+            ipod->serial[n++] = buf[4 + i];
+        }
+    }
+    ipod->serial[n] = 0;
+
+    return (n > 0) ? 0 : -1;
+}
+
+static int make_dir(const char* path)
+{
+#ifdef __WIN32__
+    if (mkdir(path) < 0 && errno != EEXIST) {
+#else
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+#endif
+        return -1;
+    }
+    return 0;
+}
+
+/* The name of the cache file, creating the directories if create is set */
+static int cache_path(struct ipod_t* ipod, char* path, int size, int create)
+{
+    const char* base;
+    const char* sub = "";
+    int n;
+
+    base = getenv("XDG_CACHE_HOME");
+    if ((base == NULL) || (base[0] == 0)) {
+#ifdef __WIN32__
+        base = getenv("LOCALAPPDATA");
+#else
+        base = getenv("HOME");
+        sub = "/.cache";
+#endif
+    }
+    if ((base == NULL) || (base[0] == 0)) {
+        return -1;
+    }
+
+    if (create) {
+        n = snprintf(path, size, "%s%s", base, sub);
+        if ((n >= size) || (make_dir(path) < 0)) {
+            return -1;
+        }
+
+        n = snprintf(path, size, "%s%s/ipodpatcher", base, sub);
+        if ((n >= size) || (make_dir(path) < 0)) {
+            return -1;
+        }
+    }
+
+    n = snprintf(path, size, "%s%s/ipodpatcher/%s", base, sub, ipod->serial);
+    return (n >= size) ? -1 : 0;
+}
+
+static int read_entry(const char* path, struct devcache_entry_t* e)
+{
+    FILE* f;
+    char line[256];
+    unsigned int i, start, size, type;
+    unsigned long long x;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    memset(e, 0, sizeof(*e));
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "part %u %u %u %u", &i, &start, &size, &type) == 4) {
+            if (i < 4) {
+                e->pinfo[i].start = start;
+                e->pinfo[i].size = size;
+                e->pinfo[i].type = type;
+                e->nparts++;
+            }
+        } else if (sscanf(line, "diroffset %llu", &x) == 1) {
+            e->diroffset = x;
+        } else if (sscanf(line, "fwoffset %llu", &x) == 1) {
+            e->fwoffset = x;
+        } else {
+            sscanf(line, "version %d", &e->version);
+            sscanf(line, "sector_size %d", &e->sector_size);
+            sscanf(line, "macpod %d", &e->macpod);
+            sscanf(line, "dircrc %x", &e->dircrc);
+            sscanf(line, "ramsize %d", &e->ramsize);
+        }
+    }
+    fclose(f);
+
+    return (e->version == DEVCACHE_VERSION) && (e->nparts == 4) ? 0 : -1;
+}
+
+static int read_dircrc(struct ipod_t* ipod, uint32_t* crc, struct fwdir_t* dir)
+{
+    if (fwdir_load(ipod, dir) < 0) {
+        return -1;
+    }
+
+    *crc = crc32_update(0, dir->buf, ipod->sector_size);
+    return 0;
+}
+
+int devcache_load(struct ipod_t* ipod)
+{
+    char path[4096];
+    struct devcache_entry_t e;
+    struct fwdir_t dir;
+    uint32_t crc;
+    off_t diroffset;
+    int i;
+
+    if ((get_serial(ipod) < 0) ||
+        (cache_path(ipod, path, sizeof(path), 0) < 0) ||
+        (read_entry(path, &e) < 0)) {
+        return -1;
+    }
+
+    /* read_partinfo() has just read the partition table again */
+    if ((e.sector_size != ipod->sector_size) || (e.macpod != ipod->macpod)) {
+        return -1;
+    }
+    for (i = 0; i < 4; i++) {
+        if ((e.pinfo[i].start != ipod->pinfo[i].start) ||
+            (e.pinfo[i].size != ipod->pinfo[i].size) ||
+            (e.pinfo[i].type != ipod->pinfo[i].type)) {
+            return -1;
+        }
+    }
+
+    /* The partition header must still be Apple's and point at the cached
+       directory - or one sector on, as read_directory() does for the 2nd
+       gen Nano */
+    if (read_fw_header(ipod, &diroffset, 0) < 0) {
+        return -1;
+    }
+    if ((e.diroffset != (uint64_t)diroffset) &&
+        (e.diroffset != (uint64_t)(diroffset + ipod->sector_size -
+                                   diroffset % ipod->sector_size))) {
+        if (ipod_verbose) {
+            fprintf(stderr,"[INFO] Firmware partition header has changed since it was cached\n");
+        }
+        return -1;
+    }
+
+    /* fwdir_parse() needs fwoffset to spot 3g firmware */
+    ipod->diroffset = e.diroffset;
+    ipod->fwoffset = e.fwoffset;
+
+    if (read_dircrc(ipod, &crc, &dir) < 0) {
+        return -1;
+    }
+
+    if (crc != e.dircrc) {
+        if (ipod_verbose) {
+            fprintf(stderr,"[INFO] Firmware directory has changed since it was cached\n");
+        }
+        fwdir_free(&dir);
+        return -1;
+    }
+
+    fwdir_parse(&dir);
+    fwdir_free(&dir);
+
+    if (ipod->ososimage < 0) {
+        return -1;
+    }
+
+    ipod->ramsize = e.ramsize;
+
+    if (ipod_verbose) {
+        fprintf(stderr,"[INFO] Using cached device information from %s\n", path);
+    }
+
+    return 0;
+}
+
+void devcache_save(struct ipod_t* ipod)
+{
+    char path[4096];
+    char tmppath[4096 + 8];
+    struct fwdir_t dir;
+    uint32_t crc;
+    FILE* f;
+    int i;
+
+    if ((get_serial(ipod) < 0) ||
+        (cache_path(ipod, path, sizeof(path), 1) < 0) ||
+        (read_dircrc(ipod, &crc, &dir) < 0)) {
+        return;
+    }
+    fwdir_free(&dir);
+
+    /* Write a new file and rename it, so that another ipodpatcher never
+       sees half a cache file */
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    f = fopen(tmppath, "w");
+    if (f == NULL) {
+        return;
+    }
+
+    fprintf(f, "version %d\n", DEVCACHE_VERSION);
+    fprintf(f, "sector_size %d\n", ipod->sector_size);
+    fprintf(f, "macpod %d\n", ipod->macpod);
+    for (i = 0; i < 4; i++) {
+        fprintf(f, "part %d %u %u %u\n", i, ipod->pinfo[i].start,
+                ipod->pinfo[i].size, ipod->pinfo[i].type);
+    }
+    fprintf(f, "diroffset %llu\n", (unsigned long long)ipod->diroffset);
+    fprintf(f, "fwoffset %llu\n", (unsigned long long)ipod->fwoffset);
+    fprintf(f, "dircrc %08x\n", crc);
+    fprintf(f, "ramsize %d\n", ipod->ramsize);
+
+    if (fclose(f) != 0) {
+        remove(tmppath);
+        return;
+    }
+
+#ifdef __WIN32__
+    remove(path);
+#endif
+    if (rename(tmppath, path) < 0) {
+        remove(tmppath);
+    }
+}
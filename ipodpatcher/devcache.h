@@ -0,0 +1,49 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __DEVCACHE_H
+#define __DEVCACHE_H
+
+#include "ipodio.h"
+
+/* A cache of what was found out about an ipod on an earlier run, kept in
+   $XDG_CACHE_HOME/ipodpatcher (~/.cache/ipodpatcher by default) and
+   named after the serial number the ipod reports in SCSI INQUIRY page
+   0x80.
+
+   It saves reading the XML device information - one INQUIRY per page.
+   The partition table must already have been read with read_partinfo();
+   if it matches the cached one, the firmware partition header is read
+   and must still point at the cached directory, and the directory
+   sector is read and checked against the cached CRC.  Only then is the
+   cache used.
+
+   The model is not cached: getmodel() works it out from the directory,
+   which is read anyway.  The RAM size is the only thing taken from the
+   XML, so it is cached instead of the XML. */
+
+/* Fill in the directory, diroffset, fwoffset and ramsize from the cache.
+   Returns 0 on success, -1 if there is no cache for this ipod or it is
+   out of date. */
+int devcache_load(struct ipod_t* ipod);
+
+/* Save the cache after a full read of the ipod */
+void devcache_save(struct ipod_t* ipod);
+
+#endif
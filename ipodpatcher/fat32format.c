@@ -38,6 +38,8 @@
 #include <stdint.h>
 
 #include "ipodio.h"
+#include "ioplan.h"
+#include "fat32write.h"
 
 static inline uint16_t swap16(uint16_t value)
 {
@@ -96,7 +98,8 @@ extern unsigned char* ipod_sectorbuf;
 static int sectors_per_cluster = 0;
 
 /* Recommended values */
-static uint32_t ReservedSectCount = 32;
+#define MIN_RESERVED_SECTORS 32
+static uint32_t ReservedSectCount = MIN_RESERVED_SECTORS;
 static uint32_t NumFATs = 2;
 static uint32_t BackupBootSect = 6;
 static uint32_t VolumeId=0; /* calculated before format */
@@ -104,6 +107,8 @@ static uint32_t VolumeId=0; /* calculated before format */
 /* Calculated later */
 static uint32_t FatSize=0; 
 static uint32_t BytesPerSect=0;
+static uint32_t AlignSectors=1;
+static uint32_t UsedClusters=1;   /* The root directory */
 static uint32_t SectorsPerCluster=0;
 static uint32_t TotalSectors=0;
 static uint32_t SystemAreaSize=0;
@@ -156,37 +161,6 @@ struct FAT_FSINFO {
 } __attribute__((packed));
 
 
-/* Write "count" zero sectors, starting at sector "sector" */
-static int zero_sectors(struct ipod_t* ipod, uint64_t sector, int count)
-{
-    int n;
-
-    if (ipod_seek(ipod, sector * ipod->sector_size) < 0) {
-        fprintf(stderr,"[ERR]  Seek failed\n");
-        return -1;
-    }
-
-    memset(ipod_sectorbuf, 0, 128 * ipod->sector_size);
-
-    /* Write 128 sectors at a time */
-    while (count) {
-        if (count >= 128)
-            n = 128;
-        else
-            n = count;
-
-        if (ipod_write(ipod,ipod_sectorbuf,n * ipod->sector_size) < 0) {
-            perror("[ERR]  Write failed in zero_sectors\n");
-            return -1;
-        }
-
-        count -= n;
-    }
-
-    return 0;
-}
-
-
 /*
 28.2  CALCULATING THE VOLUME SERIAL NUMBER
 
@@ -320,7 +294,7 @@ static void create_boot_sector(unsigned char* buf,
     pFAT32BootSect->wFATSz16 = rb_htole16(0);
     pFAT32BootSect->wSecPerTrk = rb_htole16(ipod->sectors_per_track);
     pFAT32BootSect->wNumHeads = rb_htole16(ipod->num_heads);
-    pFAT32BootSect->dHiddSec = rb_htole16(ipod->pinfo[partition].start);
+    pFAT32BootSect->dHiddSec = rb_htole32(ipod->pinfo[partition].start);
     pFAT32BootSect->dTotSec32 = rb_htole32(TotalSectors);
     pFAT32BootSect->dFATSz32 = rb_htole32(FatSize);
     pFAT32BootSect->wExtFlags = rb_htole16(0);
@@ -349,10 +323,11 @@ static void create_fsinfo(unsigned char* buf)
     pFAT32FsInfo->dFree_Count = rb_htole32((uint32_t) -1);
     pFAT32FsInfo->dNxt_Free = rb_htole32((uint32_t) -1);
     pFAT32FsInfo->dTrailSig = rb_htole32(0xaa550000);
-    pFAT32FsInfo->dFree_Count = rb_htole32((UserAreaSize/SectorsPerCluster)-1);
+    pFAT32FsInfo->dFree_Count = rb_htole32((UserAreaSize/SectorsPerCluster)-UsedClusters);
 
-    /* clusters 0-1 reserved, we used cluster 2 for the root dir */
-    pFAT32FsInfo->dNxt_Free = rb_htole32(3); 
+    /* clusters 0-1 reserved, the root dir (and anything copied in) is
+       allocated contiguously from cluster 2 */
+    pFAT32FsInfo->dNxt_Free = rb_htole32(2 + UsedClusters);
 }
 
 static void create_firstfatsector(unsigned char* buf)
@@ -365,22 +340,132 @@ static void create_firstfatsector(unsigned char* buf)
     p[2] = rb_htole32(0x0fffffff); /* end of cluster chain for root dir */
 }
 
-int format_partition(struct ipod_t* ipod, int partition)
+/* Pad the reserved area so that the first FAT starts on an AlignSectors
+   boundary of the disk (not just of the partition, which may itself be
+   misaligned). */
+static uint32_t get_reserved_sectors(uint32_t PartStart)
+{
+    uint32_t rsv = MIN_RESERVED_SECTORS;
+    uint32_t misalign = (PartStart + rsv) % AlignSectors;
+
+    if (misalign)
+        rsv += AlignSectors - misalign;
+
+    return rsv;
+}
+
+static int write_filesystem(struct ipod_t* ipod, int partition,
+                            struct fat32_tree_t* tree)
 {
     uint32_t i;
+    int res;
+
+    fprintf(stderr,"[INFO] Formatting partition %d:...\n",partition);
+
+    /* Once zero_sectors has run, any data on the drive is basically lost... */
+    fprintf(stderr,"[INFO] Clearing out %d sectors for Reserved sectors, fats and root cluster...\n", SystemAreaSize );
+
+    if (ipod_zero_range(ipod, ipod->pinfo[partition].start, SystemAreaSize) < 0) {
+        ipod_print_error(" Error zeroing disk: ");
+        return -1;
+    }
+
+    fprintf(stderr,"[INFO] Initialising reserved sectors and FATs...\n" );
+
+    /* Create the first FAT sector */
+    memset(ipod_sectorbuf, 0, BytesPerSect);
+    create_firstfatsector(ipod_sectorbuf);
+    
+    /* Write the first fat sector in the right places */
+    for ( i=0; i<NumFATs; i++ ) {
+        int SectorStart = ReservedSectCount + (i * FatSize );
+
+        if (ipod_seek(ipod, (ipod->pinfo[partition].start + SectorStart) * ipod->sector_size) < 0) {
+            fprintf(stderr,"[ERR]  Seek failed\n");
+            return -1;
+        }
+
+        if (ipod_write(ipod,ipod_sectorbuf,BytesPerSect) < 0) {
+            perror("[ERR]  Write failed (first copy of bootsect/fsinfo)\n");
+            return -1;
+        }
+    }
+
+    /* Copy in the initial contents, if any.  The boot sector is written
+       last, so the partition doesn't look formatted until this is done. */
+    if (tree != NULL) {
+        res = fat32_populate(ipod, tree);
+        if (res < 0) {
+            return -1;
+        }
+        UsedClusters = res;
+    }
+
+    /* Create the boot sector structure */
+    memset(ipod_sectorbuf, 0, BytesPerSect * 2);
+    create_boot_sector(ipod_sectorbuf, ipod, partition);
+    create_fsinfo(ipod_sectorbuf + BytesPerSect);
+
+    /* Write boot sector and fsinfo at start of partition */
+    if (ipod_seek(ipod, ipod->pinfo[partition].start * ipod->sector_size) < 0) {
+        fprintf(stderr,"[ERR]  Seek failed\n");
+        return -1;
+    }
+    if (ipod_write(ipod,ipod_sectorbuf,BytesPerSect * 2) < 0) {
+        perror("[ERR]  Write failed (first copy of bootsect/fsinfo)\n");
+        return -1;
+    }
+
+    /* Write backup copy of boot sector and fsinfo */
+    if (ipod_seek(ipod, (ipod->pinfo[partition].start + BackupBootSect) * ipod->sector_size) < 0) {
+        fprintf(stderr,"[ERR]  Seek failed\n");
+        return -1;
+    }
+    if (ipod_write(ipod,ipod_sectorbuf,BytesPerSect * 2) < 0) {
+        perror("[ERR]  Write failed (first copy of bootsect/fsinfo)\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* align is the physical sector or erase block size in bytes that the
+   FATs and the data area should start on, or 0 to use the physical
+   sector size reported by the disk.  If srcdir is not NULL, the tree
+   it names is copied into the new filesystem. */
+int format_partition(struct ipod_t* ipod, int partition, int align,
+                     const char* srcdir)
+{
+    struct fat32_volume_t vol;
+    struct fat32_tree_t* tree = NULL;
+    struct ioplan_t plan;
+    int res;
     uint64_t qTotalSectors=0;
     uint64_t FatNeeded;
 
     VolumeId = get_volume_id( );
+    UsedClusters = 1;
 
-    /* Only support hard disks at the moment */
-    if ( ipod->sector_size != 512 )
+    /* FAT allows 512 to 4096 bytes per sector */
+    if ((ipod->sector_size < 512) || (ipod->sector_size > 4096) ||
+        (ipod->sector_size & (ipod->sector_size - 1)))
     {
-        fprintf(stderr,"[ERR]  Only disks with 512 bytes per sector are supported.\n");
+        fprintf(stderr,"[ERR]  Unsupported sector size %d\n",ipod->sector_size);
         return -1;
     }
     BytesPerSect = ipod->sector_size;
 
+    if (align == 0)
+        align = ipod->phys_sector_size;
+
+    if ((align <= 0) || (align & (align - 1)))
+    {
+        fprintf(stderr,"[ERR]  Alignment must be a power of two, not %d\n",align);
+        return -1;
+    }
+
+    AlignSectors = (align > ipod->sector_size) ? align / BytesPerSect : 1;
+
     /* Checks on Disk Size */
     qTotalSectors = ipod->pinfo[partition].size;
 
@@ -418,9 +503,18 @@ int format_partition(struct ipod_t* ipod, int partition)
 
     TotalSectors = (uint32_t)  qTotalSectors;
 
+    ReservedSectCount = get_reserved_sectors(ipod->pinfo[partition].start);
+    if (ReservedSectCount > 0xffff) {
+        fprintf(stderr,"[ERR]  Alignment of %d bytes is too large\n",align);
+        return -1;
+    }
+
     FatSize = get_fat_size_sectors(TotalSectors, ReservedSectCount, 
                                    SectorsPerCluster, NumFATs, BytesPerSect );
 
+    /* Round each FAT up so that the second one and cluster 2 stay aligned */
+    FatSize = ((FatSize + AlignSectors - 1) / AlignSectors) * AlignSectors;
+
     UserAreaSize = TotalSectors - ReservedSectCount - (NumFATs*FatSize);
 
     /* First zero out ReservedSect + FatSize * NumFats + SectorsPerCluster */
@@ -460,7 +554,7 @@ int format_partition(struct ipod_t* ipod, int partition)
        Sector 6 Backup boot sector
        Sector 7 Backup FSInfo sector
        Sector 8 Backup 'more boot code'
-       zero'd sectors upto ReservedSectCount
+       zero'd sectors upto ReservedSectCount, padded to align FAT1
        FAT1  ReservedSectCount to ReservedSectCount + FatSize
        ...
        FATn  ReservedSectCount to ReservedSectCount + FatSize
@@ -470,61 +564,38 @@ int format_partition(struct ipod_t* ipod, int partition)
     fprintf(stderr,"[INFO] Heads - %d, sectors/track = %d\n",ipod->num_heads,ipod->sectors_per_track);
     fprintf(stderr,"[INFO] Size : %lluGB %u sectors\n", ((uint64_t)ipod->pinfo[partition].size * (uint64_t)ipod->sector_size) / (1000*1000*1000), TotalSectors );
     fprintf(stderr,"[INFO] %d Bytes Per Sector, Cluster size %d bytes\n", BytesPerSect, SectorsPerCluster*BytesPerSect );
+    fprintf(stderr,"[INFO] FATs and data area aligned to %d bytes\n", AlignSectors*BytesPerSect );
     fprintf(stderr,"[INFO] Volume ID is %x:%x\n", VolumeId>>16, VolumeId&0xffff );
     fprintf(stderr,"[INFO] %d Reserved Sectors, %d Sectors per FAT, %d fats\n", ReservedSectCount, FatSize, NumFATs );
     fprintf (stderr,"[INFO] %d Total clusters\n", UserAreaSize/SectorsPerCluster );
 
-    fprintf(stderr,"[INFO] Formatting partition %d:...\n",partition);
-
-    /* Once zero_sectors has run, any data on the drive is basically lost... */
-    fprintf(stderr,"[INFO] Clearing out %d sectors for Reserved sectors, fats and root cluster...\n", SystemAreaSize );
-
-    zero_sectors(ipod, ipod->pinfo[partition].start, SystemAreaSize);
-
-    fprintf(stderr,"[INFO] Initialising reserved sectors and FATs...\n" );
-
-    /* Create the boot sector structure */
-    create_boot_sector(ipod_sectorbuf, ipod, partition);
-    create_fsinfo(ipod_sectorbuf + 512);
-
-    /* Write boot sector and fsinfo at start of partition */
-    if (ipod_seek(ipod, ipod->pinfo[partition].start * ipod->sector_size) < 0) {
-        fprintf(stderr,"[ERR]  Seek failed\n");
-        return -1;
-    }
-    if (ipod_write(ipod,ipod_sectorbuf,512 * 2) < 0) {
-        perror("[ERR]  Write failed (first copy of bootsect/fsinfo)\n");
-        return -1;
+    /* Read the new contents first, so that nothing has been erased if
+       they can't be copied */
+    if (srcdir != NULL) {
+        vol.start = ipod->pinfo[partition].start;
+        vol.bytes_per_sect = BytesPerSect;
+        vol.sectors_per_cluster = SectorsPerCluster;
+        vol.reserved_sects = ReservedSectCount;
+        vol.num_fats = NumFATs;
+        vol.fat_size = FatSize;
+        vol.clusters = UserAreaSize/SectorsPerCluster;
+
+        tree = fat32_scan(&vol, srcdir);
+        if (tree == NULL) {
+            return -1;
+        }
     }
 
-    /* Write backup copy of boot sector and fsinfo */
-    if (ipod_seek(ipod, (ipod->pinfo[partition].start + BackupBootSect) * ipod->sector_size) < 0) {
-        fprintf(stderr,"[ERR]  Seek failed\n");
-        return -1;
+    /* The populate part of the plan uses the tree, so run it first */
+    ioplan_begin(ipod, &plan);
+    res = ioplan_end(ipod, &plan, write_filesystem(ipod, partition, tree));
+    if (tree != NULL) {
+        fat32_free(tree);
     }
-    if (ipod_write(ipod,ipod_sectorbuf,512 * 2) < 0) {
-        perror("[ERR]  Write failed (first copy of bootsect/fsinfo)\n");
+    if (res < 0) {
         return -1;
     }
 
-    /* Create the first FAT sector */
-    create_firstfatsector(ipod_sectorbuf);
-    
-    /* Write the first fat sector in the right places */
-    for ( i=0; i<NumFATs; i++ ) {
-        int SectorStart = ReservedSectCount + (i * FatSize );
-
-        if (ipod_seek(ipod, (ipod->pinfo[partition].start + SectorStart) * ipod->sector_size) < 0) {
-            fprintf(stderr,"[ERR]  Seek failed\n");
-            return -1;
-        }
-
-        if (ipod_write(ipod,ipod_sectorbuf,512) < 0) {
-            perror("[ERR]  Write failed (first copy of bootsect/fsinfo)\n");
-            return -1;
-        }
-    }
-
     fprintf(stderr,"[INFO] Format successful\n");
 
     return 0;
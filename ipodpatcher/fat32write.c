@@ -0,0 +1,987 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "ipodio.h"
+#include "ioplan.h"
+#include "fat32write.h"
+#include "pipeline.h"
+
+/* Size of the writes to the data area */
+#define POPULATE_CHUNK_SIZE (4*1024*1024)
+
+/* Deep enough for any real tree, and stops symlink loops */
+#define MAX_DEPTH 64
+
+#define DIRENT_SIZE     32
+#define MAX_DIR_ENTRIES 65536
+#define MAX_LFN         255
+#define LFN_CHARS       13   /* UTF-16 characters per LFN entry */
+
+#define ATTR_LFN        0x0f
+#define ATTR_DIRECTORY  0x10
+#define ATTR_ARCHIVE    0x20
+
+#define FAT_MEDIA       0x0ffffff8
+#define FAT_EOC         0x0fffffff
+
+struct fatnode_t {
+    char* path;                   /* Host path */
+    const char* name;             /* Last component of path */
+    int isdir;
+    uint32_t size;                /* File size, or bytes of directory entries */
+    time_t mtime;
+    uint16_t* lfn;                /* Name in UTF-16 */
+    int lfnlen;
+    int nlfn;                     /* LFN entries, 0 for a plain 8.3 name */
+    unsigned char shortname[11];
+    uint32_t cluster;             /* First cluster, 0 for empty files */
+    uint32_t nclusters;
+    struct fatnode_t* parent;
+    struct fatnode_t** children;  /* Sorted by name, ignoring case */
+    int nchildren;
+    struct fatnode_t* nextalloc;  /* Next node in the data area */
+};
+
+static void put16(unsigned char* p, uint16_t x)
+{
+    p[0] = x & 0xff;
+    p[1] = x >> 8;
+}
+
+static void put32(unsigned char* p, uint32_t x)
+{
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+    p[2] = (x >> 16) & 0xff;
+    p[3] = x >> 24;
+}
+
+/* Names */
+
+/* Decode a UTF-8 name into UTF-16, returning its length or -1 if it is
+   malformed or too long for an LFN */
+static int utf8_to_utf16(const char* s, uint16_t* out)
+{
+    const unsigned char* p = (const unsigned char*)s;
+    uint32_t c;
+    int extra;
+    int n = 0;
+
+    while (*p) {
+        if (*p < 0x80) {
+            c = *p++;
+            extra = 0;
+        } else if ((*p & 0xe0) == 0xc0) {
+            c = *p++ & 0x1f;
+            extra = 1;
+        } else if ((*p & 0xf0) == 0xe0) {
+            c = *p++ & 0x0f;
+            extra = 2;
+        } else if ((*p & 0xf8) == 0xf0) {
+            c = *p++ & 0x07;
+            extra = 3;
+        } else {
+            return -1;
+        }
+
+        while (extra--) {
+            if ((*p & 0xc0) != 0x80)
+                return -1;
+            c = (c << 6) | (*p++ & 0x3f);
+        }
+
+        if (c >= 0x10000) {
+            if (n + 2 > MAX_LFN)
+                return -1;
+            c -= 0x10000;
+            out[n++] = 0xd800 | (c >> 10);
+            out[n++] = 0xdc00 | (c & 0x3ff);
+        } else {
+            if (n + 1 > MAX_LFN)
+                return -1;
+            out[n++] = c;
+        }
+    }
+
+    return n;
+}
+
+/* Names Windows can't create */
+static int valid_long_name(const char* name)
+{
+    const char* p;
+    size_t len = strlen(name);
+
+    if ((len == 0) || (name[len-1] == '.') || (name[len-1] == ' '))
+        return 0;
+
+    for (p = name; *p; p++) {
+        if (((unsigned char)*p < 0x20) || strchr("\\/:*?\"<>|", *p))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int valid_short_char(int c)
+{
+    return ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) ||
+           ((c >= 0x20) && (c < 0x80) && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+/* If name is already an upper-case 8.3 name, store it in sn */
+static int plain_short_name(const char* name, unsigned char* sn)
+{
+    const char* dot = strchr(name, '.');
+    size_t baselen = dot ? (size_t)(dot - name) : strlen(name);
+    size_t extlen = dot ? strlen(dot + 1) : 0;
+    const char* p;
+
+    if ((baselen < 1) || (baselen > 8) || (extlen > 3) || (dot && extlen == 0))
+        return 0;
+
+    for (p = name; *p; p++) {
+        if ((p != dot) && !valid_short_char(*p))
+            return 0;
+    }
+
+    memset(sn, ' ', 11);
+    memcpy(sn, name, baselen);
+    if (dot)
+        memcpy(sn + 8, dot + 1, extlen);
+
+    return 1;
+}
+
+/* Map a name character to the short name character set.  UTF-8
+   continuation bytes are dropped, so each non-ASCII character becomes a
+   single '_'. */
+static int short_char(unsigned char c, int* lossy)
+{
+    if ((c >= 'a') && (c <= 'z'))
+        return c - 'a' + 'A';
+    if ((c & 0xc0) == 0x80) {
+        *lossy = 1;
+        return 0;
+    }
+    if (!valid_short_char(c)) {
+        *lossy = 1;
+        return '_';
+    }
+    return c;
+}
+
+/* The short name "basis" of the FAT spec - the name upper-cased, with
+   spaces and extra dots removed and invalid characters replaced.  Sets
+   lossy if the basis doesn't fully represent the name. */
+static int make_basis(const char* name, unsigned char* sn, int* lossy)
+{
+    const char* dot;
+    const char* p;
+    int baselen = 0;
+    int extlen = 0;
+    int c;
+
+    memset(sn, ' ', 11);
+    *lossy = 0;
+
+    while (*name == '.') {
+        name++;
+        *lossy = 1;
+    }
+    dot = strrchr(name, '.');
+
+    for (p = name; *p && (p != dot); p++) {
+        if ((*p == ' ') || (*p == '.')) {
+            *lossy = 1;
+        } else if ((c = short_char(*p, lossy)) != 0) {
+            if (baselen == 8) {
+                *lossy = 1;
+                break;
+            }
+            sn[baselen++] = c;
+        }
+    }
+
+    if (dot) {
+        for (p = dot + 1; *p; p++) {
+            if (*p == ' ') {
+                *lossy = 1;
+            } else if ((c = short_char(*p, lossy)) != 0) {
+                if (extlen == 3) {
+                    *lossy = 1;
+                    break;
+                }
+                sn[8 + extlen++] = c;
+            }
+        }
+    }
+
+    if (baselen == 0) {
+        sn[baselen++] = '_';
+        *lossy = 1;
+    }
+
+    return baselen;
+}
+
+/* The short names in use in one directory */
+struct nameset_t {
+    const unsigned char** slot;
+    uint32_t mask;
+};
+
+static uint32_t name_hash(const unsigned char* sn)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 11; i++) {
+        h = (h ^ sn[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Add sn to the set, or return 0 if it is already there */
+static int nameset_add(struct nameset_t* set, const unsigned char* sn)
+{
+    uint32_t i = name_hash(sn) & set->mask;
+
+    while (set->slot[i] != NULL) {
+        if (memcmp(set->slot[i], sn, 11) == 0)
+            return 0;
+        i = (i + 1) & set->mask;
+    }
+    set->slot[i] = sn;
+    return 1;
+}
+
+/* Give every child of dir a unique short name.  Names that are already
+   valid 8.3 names are taken first, so a generated "~n" name can never
+   clash with one of them. */
+static int assign_short_names(struct fatnode_t* dir)
+{
+    struct nameset_t set;
+    struct fatnode_t* node;
+    unsigned char basis[11];
+    char tail[8];
+    int baselen;
+    int lossy;
+    int keep;
+    int i, n;
+
+    set.mask = 1;
+    while (set.mask < (uint32_t)dir->nchildren * 2) {
+        set.mask <<= 1;
+    }
+    set.slot = calloc(set.mask, sizeof(*set.slot));
+    if (set.slot == NULL) {
+        fprintf(stderr,"[ERR]  Out of memory\n");
+        return -1;
+    }
+    set.mask--;
+
+    for (i = 0; i < dir->nchildren; i++) {
+        node = dir->children[i];
+        if (plain_short_name(node->name, node->shortname)) {
+            nameset_add(&set, node->shortname);
+        } else {
+            node->nlfn = (node->lfnlen + LFN_CHARS - 1) / LFN_CHARS;
+        }
+    }
+
+    for (i = 0; i < dir->nchildren; i++) {
+        node = dir->children[i];
+        if (node->nlfn == 0)
+            continue;
+
+        baselen = make_basis(node->name, basis, &lossy);
+        memcpy(node->shortname, basis, 11);
+        if (!lossy && nameset_add(&set, node->shortname))
+            continue;
+
+        for (n = 1; ; n++) {
+            if (n > 999999) {
+                fprintf(stderr,"[ERR]  No short name left for %s\n", node->path);
+                free(set.slot);
+                return -1;
+            }
+            sprintf(tail, "~%d", n);
+            keep = 8 - strlen(tail);
+            if (keep > baselen)
+                keep = baselen;
+            memcpy(node->shortname, basis, 8);
+            memset(node->shortname + keep, ' ', 8 - keep);
+            memcpy(node->shortname + keep, tail, strlen(tail));
+            if (nameset_add(&set, node->shortname))
+                break;
+        }
+    }
+
+    free(set.slot);
+    return 0;
+}
+
+/* Scanning the host tree */
+
+struct fat32_tree_t {
+    struct ipod_t* ipod;
+    struct fat32_volume_t vol;
+    struct fatnode_t* root;
+    uint32_t clustersize;
+    uint64_t datastart;           /* Byte offset of cluster 2 on the disk */
+    uint32_t nextcluster;
+    struct fatnode_t* allochead;
+    struct fatnode_t* alloctail;
+    int nfiles;
+    int ndirs;
+    uint64_t filebytes;
+
+    /* Writing the data area */
+    struct fatnode_t* node;       /* Node being written */
+    uint32_t nodepos;             /* Bytes of node written */
+    unsigned char* dirbuf;        /* Entries of node, if it is a directory */
+    FILE* file;                   /* Contents of node, if it is a file */
+    uint64_t pos;                 /* Offset in the data area */
+    uint64_t end;
+};
+
+/* Upper-case a UTF-16 character for comparing long names.  FAT
+   compares them without regard to case; only ASCII, Latin-1, Greek and
+   Cyrillic letters are folded here. */
+static uint16_t fold_char(uint16_t c)
+{
+    if (((c >= 'a') && (c <= 'z')) ||
+        ((c >= 0xe0) && (c <= 0xfe) && (c != 0xf7)) ||
+        ((c >= 0x3b1) && (c <= 0x3cb) && (c != 0x3c2)) ||
+        ((c >= 0x430) && (c <= 0x44f)))
+        return c - 0x20;
+    if ((c >= 0x450) && (c <= 0x45f))
+        return c - 0x50;
+    return c;
+}
+
+static int compare_long_names(const struct fatnode_t* a,
+                              const struct fatnode_t* b)
+{
+    int i;
+
+    for (i = 0; (i < a->lfnlen) && (i < b->lfnlen); i++) {
+        if (fold_char(a->lfn[i]) != fold_char(b->lfn[i]))
+            return (int)fold_char(a->lfn[i]) - (int)fold_char(b->lfn[i]);
+    }
+    return a->lfnlen - b->lfnlen;
+}
+
+/* Names that differ only in case end up next to each other */
+static int compare_nodes(const void* a, const void* b)
+{
+    const struct fatnode_t* na = *(struct fatnode_t* const*)a;
+    const struct fatnode_t* nb = *(struct fatnode_t* const*)b;
+    int res = compare_long_names(na, nb);
+
+    return res ? res : strcmp(na->name, nb->name);
+}
+
+static void free_tree(struct fatnode_t* node)
+{
+    int i;
+
+    for (i = 0; i < node->nchildren; i++) {
+        free_tree(node->children[i]);
+    }
+    free(node->children);
+    free(node->lfn);
+    free(node->path);
+    free(node);
+}
+
+static struct fatnode_t* new_node(struct fatnode_t* parent, const char* name)
+{
+    struct fatnode_t* node;
+    size_t len;
+
+    node = calloc(1, sizeof(*node));
+    if (node == NULL)
+        return NULL;
+
+    if (parent == NULL) {
+        node->path = strdup(name);
+        node->name = node->path;
+    } else {
+        len = strlen(parent->path);
+        node->path = malloc(len + strlen(name) + 2);
+        if (node->path != NULL) {
+            sprintf(node->path, "%s/%s", parent->path, name);
+            node->name = node->path + len + 1;
+        }
+    }
+
+    if (node->path == NULL) {
+        free(node);
+        return NULL;
+    }
+
+    node->parent = parent;
+    return node;
+}
+
+static int scan_dir(struct fat32_tree_t* c, struct fatnode_t* dir, int depth)
+{
+    DIR* d;
+    struct dirent* de;
+    struct stat st;
+    struct fatnode_t* node;
+    struct fatnode_t** children;
+    uint16_t lfn[MAX_LFN];
+    uint32_t entries;
+    int max = 0;
+    int i, n;
+
+    if (depth > MAX_DEPTH) {
+        fprintf(stderr,"[ERR]  %s is nested too deeply\n", dir->path);
+        return -1;
+    }
+
+    d = opendir(dir->path);
+    if (d == NULL) {
+        perror(dir->path);
+        return -1;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0))
+            continue;
+
+        node = new_node(dir, de->d_name);
+        if (node == NULL) {
+            fprintf(stderr,"[ERR]  Out of memory\n");
+            closedir(d);
+            return -1;
+        }
+
+        if (stat(node->path, &st) < 0) {
+            perror(node->path);
+            free_tree(node);
+            closedir(d);
+            return -1;
+        }
+
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            fprintf(stderr,"[INFO] Skipping %s - not a file or directory\n", node->path);
+            free_tree(node);
+            continue;
+        }
+
+        node->lfnlen = utf8_to_utf16(node->name, lfn);
+        if ((node->lfnlen < 0) || !valid_long_name(node->name)) {
+            fprintf(stderr,"[INFO] Skipping %s - the name isn't valid on FAT32\n", node->path);
+            free_tree(node);
+            continue;
+        }
+
+        if ((uint64_t)st.st_size > 0xffffffff) {
+            fprintf(stderr,"[ERR]  %s is too large for FAT32\n", node->path);
+            free_tree(node);
+            closedir(d);
+            return -1;
+        }
+
+        node->lfn = malloc(node->lfnlen * sizeof(uint16_t));
+        if ((node->lfn == NULL) && (node->lfnlen > 0)) {
+            fprintf(stderr,"[ERR]  Out of memory\n");
+            free_tree(node);
+            closedir(d);
+            return -1;
+        }
+        memcpy(node->lfn, lfn, node->lfnlen * sizeof(uint16_t));
+
+        node->isdir = S_ISDIR(st.st_mode);
+        node->size = node->isdir ? 0 : (uint32_t)st.st_size;
+        node->mtime = st.st_mtime;
+
+        if (dir->nchildren == max) {
+            max = max ? max * 2 : 16;
+            children = realloc(dir->children, max * sizeof(*children));
+            if (children == NULL) {
+                fprintf(stderr,"[ERR]  Out of memory\n");
+                free_tree(node);
+                closedir(d);
+                return -1;
+            }
+            dir->children = children;
+        }
+        dir->children[dir->nchildren++] = node;
+    }
+    closedir(d);
+
+    qsort(dir->children, dir->nchildren, sizeof(*dir->children), compare_nodes);
+
+    /* Of names that differ only in case, only the first can be written */
+    for (i = 0, n = 0; i < dir->nchildren; i++) {
+        node = dir->children[i];
+        if ((n > 0) && (compare_long_names(dir->children[n-1], node) == 0)) {
+            fprintf(stderr,"[INFO] Skipping %s - FAT32 doesn't tell its name from %s\n",
+                    node->path, dir->children[n-1]->name);
+            free_tree(node);
+            continue;
+        }
+        dir->children[n++] = node;
+    }
+    dir->nchildren = n;
+
+    if (assign_short_names(dir) < 0)
+        return -1;
+
+    /* Everything except the root has "." and ".." entries */
+    entries = (dir->parent != NULL) ? 2 : 0;
+    for (i = 0; i < dir->nchildren; i++) {
+        entries += 1 + dir->children[i]->nlfn;
+    }
+    if (entries > MAX_DIR_ENTRIES) {
+        fprintf(stderr,"[ERR]  Too many entries in %s\n", dir->path);
+        return -1;
+    }
+    dir->size = entries * DIRENT_SIZE;
+
+    for (i = 0; i < dir->nchildren; i++) {
+        node = dir->children[i];
+        if (node->isdir) {
+            c->ndirs++;
+            if (scan_dir(c, node, depth + 1) < 0)
+                return -1;
+        } else {
+            c->nfiles++;
+            c->filebytes += node->size;
+        }
+    }
+
+    return 0;
+}
+
+/* Allocation - each directory, then the files in it, then its
+   subdirectories, so that a directory's files are next to it */
+
+static void alloc_node(struct fat32_tree_t* c, struct fatnode_t* node)
+{
+    node->nclusters = (node->size + c->clustersize - 1) / c->clustersize;
+    if (node->isdir && (node->nclusters == 0))
+        node->nclusters = 1;   /* An empty root directory */
+
+    if (node->nclusters == 0)
+        return;
+
+    node->cluster = c->nextcluster;
+    c->nextcluster += node->nclusters;
+
+    if (c->alloctail)
+        c->alloctail->nextalloc = node;
+    else
+        c->allochead = node;
+    c->alloctail = node;
+}
+
+static void alloc_dir(struct fat32_tree_t* c, struct fatnode_t* dir)
+{
+    int i;
+
+    alloc_node(c, dir);
+
+    for (i = 0; i < dir->nchildren; i++) {
+        if (!dir->children[i]->isdir)
+            alloc_node(c, dir->children[i]);
+    }
+
+    for (i = 0; i < dir->nchildren; i++) {
+        if (dir->children[i]->isdir)
+            alloc_dir(c, dir->children[i]);
+    }
+}
+
+static uint64_t count_clusters(struct fat32_tree_t* c, struct fatnode_t* node)
+{
+    uint64_t n = (node->size + c->clustersize - 1) / c->clustersize;
+    int i;
+
+    if (node->isdir && (n == 0))
+        n = 1;
+
+    for (i = 0; i < node->nchildren; i++) {
+        n += count_clusters(c, node->children[i]);
+    }
+    return n;
+}
+
+/* Directory contents */
+
+static void fat_time(time_t t, uint16_t* fattime, uint16_t* fatdate)
+{
+    struct tm* tm = localtime(&t);
+
+    if ((tm == NULL) || (tm->tm_year < 80)) {
+        *fattime = 0;
+        *fatdate = (1 << 5) | 1;   /* 1980-01-01 */
+        return;
+    }
+
+    *fattime = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+    *fatdate = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+}
+
+static void put_dirent(unsigned char* p, const unsigned char* name, int attr,
+                       uint32_t cluster, uint32_t size, time_t mtime)
+{
+    uint16_t fattime, fatdate;
+
+    fat_time(mtime, &fattime, &fatdate);
+
+    memset(p, 0, DIRENT_SIZE);
+    memcpy(p, name, 11);
+    p[11] = attr;
+    put16(p + 14, fattime);       /* Creation time */
+    put16(p + 16, fatdate);
+    put16(p + 18, fatdate);       /* Last access date */
+    put16(p + 20, cluster >> 16);
+    put16(p + 22, fattime);       /* Write time */
+    put16(p + 24, fatdate);
+    put16(p + 26, cluster & 0xffff);
+    put32(p + 28, size);
+}
+
+static uint8_t lfn_checksum(const unsigned char* sn)
+{
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + sn[i];
+    }
+    return sum;
+}
+
+/* The LFN entries for node, last part of the name first */
+static unsigned char* put_lfn(unsigned char* p, struct fatnode_t* node)
+{
+    static const int offsets[LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20,
+                                            22, 24, 28, 30 };
+    uint8_t sum = lfn_checksum(node->shortname);
+    uint16_t ch;
+    int seq, i, j;
+
+    for (seq = node->nlfn; seq > 0; seq--) {
+        memset(p, 0, DIRENT_SIZE);
+        p[0] = seq | ((seq == node->nlfn) ? 0x40 : 0);
+        p[11] = ATTR_LFN;
+        p[13] = sum;
+
+        for (i = 0; i < LFN_CHARS; i++) {
+            j = (seq - 1) * LFN_CHARS + i;
+            if (j < node->lfnlen)
+                ch = node->lfn[j];
+            else if (j == node->lfnlen)
+                ch = 0;
+            else
+                ch = 0xffff;
+            put16(p + offsets[i], ch);
+        }
+        p += DIRENT_SIZE;
+    }
+
+    return p;
+}
+
+static unsigned char* build_dir(struct fatnode_t* dir)
+{
+    static const unsigned char dotname[11] = ".          ";
+    static const unsigned char dotdotname[11] = "..         ";
+    unsigned char* buf;
+    unsigned char* p;
+    struct fatnode_t* node;
+    int i;
+
+    buf = malloc(dir->size ? dir->size : 1);
+    if (buf == NULL)
+        return NULL;
+    p = buf;
+
+    if (dir->parent != NULL) {
+        put_dirent(p, dotname, ATTR_DIRECTORY, dir->cluster, 0, dir->mtime);
+        p += DIRENT_SIZE;
+        /* ".." points at cluster 0 when the parent is the root */
+        put_dirent(p, dotdotname, ATTR_DIRECTORY,
+                   dir->parent->parent ? dir->parent->cluster : 0, 0,
+                   dir->mtime);
+        p += DIRENT_SIZE;
+    }
+
+    for (i = 0; i < dir->nchildren; i++) {
+        node = dir->children[i];
+        p = put_lfn(p, node);
+        put_dirent(p, node->shortname,
+                   node->isdir ? ATTR_DIRECTORY : ATTR_ARCHIVE,
+                   node->cluster, node->isdir ? 0 : node->size, node->mtime);
+        p += DIRENT_SIZE;
+    }
+
+    return buf;
+}
+
+/* Writing the data area - one sequential stream from cluster 2, with
+   the host files read while the previous chunk is being written */
+
+static int populate_produce(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct fat32_tree_t* c = ctx;
+    struct fatnode_t* node;
+    uint32_t nodebytes;
+    uint32_t len;
+    int filled = 0;
+
+    if (c->pos == c->end) {
+        return 0;
+    }
+
+    while ((filled < POPULATE_CHUNK_SIZE) && ((node = c->node) != NULL)) {
+        nodebytes = node->nclusters * c->clustersize;
+
+        if (c->nodepos == 0) {
+            if (node->isdir) {
+                c->dirbuf = build_dir(node);
+                if (c->dirbuf == NULL) {
+                    fprintf(stderr,"[ERR]  Out of memory\n");
+                    return -1;
+                }
+            } else {
+                c->file = fopen(node->path, "rb");
+                if (c->file == NULL) {
+                    perror(node->path);
+                    return -1;
+                }
+            }
+        }
+
+        len = POPULATE_CHUNK_SIZE - filled;
+        if (c->nodepos < node->size) {
+            /* The contents */
+            if (len > node->size - c->nodepos)
+                len = node->size - c->nodepos;
+
+            if (node->isdir) {
+                memcpy(slot->inbuf + filled, c->dirbuf + c->nodepos, len);
+            } else if (fread(slot->inbuf + filled, 1, len, c->file) != len) {
+                fprintf(stderr,"[ERR]  %s changed while it was being copied\n",
+                               node->path);
+                return -1;
+            }
+        } else {
+            /* Zeros to the end of the last cluster */
+            if (len > nodebytes - c->nodepos)
+                len = nodebytes - c->nodepos;
+            memset(slot->inbuf + filled, 0, len);
+        }
+
+        filled += len;
+        c->nodepos += len;
+
+        if (c->nodepos == nodebytes) {
+            free(c->dirbuf);
+            c->dirbuf = NULL;
+            if (c->file) {
+                fclose(c->file);
+                c->file = NULL;
+            }
+            c->node = node->nextalloc;
+            c->nodepos = 0;
+        }
+    }
+
+    slot->hash = c->pos;
+    slot->inlen = filled;
+    c->pos += filled;
+
+    return 1;
+}
+
+static int populate_consume(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct fat32_tree_t* c = ctx;
+    int n;
+
+    n = ipod_write_at(c->ipod, slot->inbuf, slot->inlen, c->datastart + slot->hash);
+    if (n != slot->inlen) {
+        ipod_print_error(" Error writing to disk: ");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The FATs only need writing up to the last cluster used - the rest
+   was zeroed by the format */
+static int write_fats(struct fat32_tree_t* c)
+{
+    const struct fat32_volume_t* vol = &c->vol;
+    struct fatnode_t* node;
+    unsigned char* fat;
+    uint32_t bytes;
+    uint32_t i;
+    int n;
+
+    bytes = c->nextcluster * 4;
+    bytes = (bytes + vol->bytes_per_sect - 1) / vol->bytes_per_sect * vol->bytes_per_sect;
+
+    fat = calloc(1, bytes);
+    if (fat == NULL) {
+        fprintf(stderr,"[ERR]  Out of memory\n");
+        return -1;
+    }
+
+    put32(fat, FAT_MEDIA);
+    put32(fat + 4, FAT_EOC);
+
+    for (node = c->allochead; node != NULL; node = node->nextalloc) {
+        for (i = 0; i < node->nclusters - 1; i++) {
+            put32(fat + (node->cluster + i) * 4, node->cluster + i + 1);
+        }
+        put32(fat + (node->cluster + i) * 4, FAT_EOC);
+    }
+
+    for (i = 0; i < vol->num_fats; i++) {
+        n = ipod_write_at(c->ipod, fat, bytes,
+                          (vol->start + vol->reserved_sects + i * vol->fat_size) *
+                          vol->bytes_per_sect);
+        if (n != (int)bytes) {
+            ipod_print_error(" Error writing FAT: ");
+            free(fat);
+            return -1;
+        }
+    }
+
+    free(fat);
+    return 0;
+}
+
+struct fat32_tree_t* fat32_scan(const struct fat32_volume_t* vol,
+                                const char* srcdir)
+{
+    struct fat32_tree_t* c;
+    uint64_t needed;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        fprintf(stderr,"[ERR]  Out of memory\n");
+        return NULL;
+    }
+    c->vol = *vol;
+    c->clustersize = vol->sectors_per_cluster * vol->bytes_per_sect;
+    c->datastart = (vol->start + vol->reserved_sects +
+                    (uint64_t)vol->num_fats * vol->fat_size) * vol->bytes_per_sect;
+    c->nextcluster = 2;
+
+    c->root = new_node(NULL, srcdir);
+    if (c->root == NULL) {
+        fprintf(stderr,"[ERR]  Out of memory\n");
+        free(c);
+        return NULL;
+    }
+    c->root->isdir = 1;
+
+    fprintf(stderr,"[INFO] Scanning %s...\n", srcdir);
+    if (scan_dir(c, c->root, 0) < 0) {
+        fat32_free(c);
+        return NULL;
+    }
+
+    needed = count_clusters(c, c->root);
+    if (needed > vol->clusters) {
+        fprintf(stderr,"[ERR]  %s needs %" PRIu64 " clusters, but the partition only has %u\n",
+                       srcdir, needed, vol->clusters);
+        fat32_free(c);
+        return NULL;
+    }
+
+    alloc_dir(c, c->root);
+    c->node = c->allochead;
+    c->end = (uint64_t)(c->nextcluster - 2) * c->clustersize;
+
+    fprintf(stderr,"[INFO] %d files in %d directories (%" PRIu64 " bytes, %u clusters) to copy\n",
+                   c->nfiles, c->ndirs, c->filebytes, c->nextcluster - 2);
+
+    return c;
+}
+
+/* Write the data area, as a deferred write of the I/O plan if there is
+   one - it is too big to keep a copy of */
+static int populate_data(struct ipod_t* ipod, void* ctx)
+{
+    struct fat32_tree_t* tree = ctx;
+    struct pipeline_t p;
+
+    tree->ipod = ipod;
+
+    fprintf(stderr,"[INFO] Copying files...\n");
+
+    memset(&p, 0, sizeof(p));
+    p.nthreads = 0;
+    p.nslots = 2;
+    p.inbufsize = POPULATE_CHUNK_SIZE;
+    p.produce = populate_produce;
+    p.consume = populate_consume;
+    p.ctx = tree;
+
+    return pipeline_run(&p);
+}
+
+int fat32_populate(struct ipod_t* ipod, struct fat32_tree_t* tree)
+{
+    int res;
+
+    if (ipod->plan != NULL) {
+        res = ioplan_defer(ipod->plan, tree->datastart, tree->end,
+                           populate_data, tree);
+    } else {
+        res = populate_data(ipod, tree);
+    }
+    if (res < 0)
+        return -1;
+
+    tree->ipod = ipod;
+    if (write_fats(tree) < 0)
+        return -1;
+
+    return tree->nextcluster - 2;
+}
+
+void fat32_free(struct fat32_tree_t* tree)
+{
+    free(tree->dirbuf);
+    if (tree->file)
+        fclose(tree->file);
+    free_tree(tree->root);
+    free(tree);
+}
@@ -0,0 +1,64 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __FAT32WRITE_H
+#define __FAT32WRITE_H
+
+#include <stdint.h>
+
+#include "ipodio.h"
+
+/* Populating a freshly formatted FAT32 volume from a host directory.
+
+   The volume must be empty - only the root directory in cluster 2 is
+   in use - so nothing is read back from the disk.  Every directory and
+   file is given a contiguous run of clusters, in the order they are
+   written, and the data area is then written as one sequential stream
+   followed by the FATs.  The caller updates the FSInfo sector with the
+   number of clusters used.
+
+   The tree is read and checked against the volume size by fat32_scan()
+   before the caller starts formatting, so a tree that doesn't fit is
+   rejected while the old filesystem is still intact. */
+
+struct fat32_volume_t {
+    uint64_t start;                /* First sector of the partition */
+    uint32_t bytes_per_sect;
+    uint32_t sectors_per_cluster;
+    uint32_t reserved_sects;
+    uint32_t num_fats;
+    uint32_t fat_size;             /* Sectors per FAT */
+    uint32_t clusters;             /* Data clusters, from cluster 2 */
+};
+
+struct fat32_tree_t;
+
+/* Read the tree at srcdir and lay it out on the volume, without touching
+   the disk.  Returns NULL if it can't be read or doesn't fit. */
+struct fat32_tree_t* fat32_scan(const struct fat32_volume_t* vol,
+                                const char* srcdir);
+
+/* Write the tree into the root directory of the volume.  Returns the
+   number of clusters used (including the root directory), or -1 on
+   error. */
+int fat32_populate(struct ipod_t* ipod, struct fat32_tree_t* tree);
+
+void fat32_free(struct fat32_tree_t* tree);
+
+#endif
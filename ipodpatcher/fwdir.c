@@ -0,0 +1,298 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "ipodio.h"
+#include "fwdir.h"
+
+static inline void put_uint32le(uint32_t x, unsigned char* p)
+{
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+    p[2] = (x >> 16) & 0xff;
+    p[3] = (x >> 24) & 0xff;
+}
+
+static inline uint32_t get_uint32le(unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool is_entry(unsigned char* p)
+{
+    return (memcmp(p,"!ATA",4)==0) || (memcmp(p,"DNAN",4)==0);
+}
+
+static unsigned char* entry(struct fwdir_t* dir, int i)
+{
+    return dir->entries + i * FWDIR_ENTRY_SIZE;
+}
+
+int fwdir_load(struct ipod_t* ipod, struct fwdir_t* dir)
+{
+    /* diroffset may not be sector-aligned */
+    int x = ipod->diroffset % ipod->sector_size;
+    int n;
+
+    memset(dir, 0, sizeof(*dir));
+    dir->ipod = ipod;
+
+    if (ipod_alloc_buffer(&dir->buf, ipod->sector_size) < 0) {
+        fprintf(stderr,"[ERR]  Buffer allocation failed\n");
+        return -1;
+    }
+
+    n = ipod_read_at(ipod, dir->buf, ipod->sector_size,
+                     ipod->start + ipod->diroffset - x);
+    if (n != ipod->sector_size) {
+        fprintf(stderr,"[ERR]  Read of directory failed.\n");
+        fwdir_free(dir);
+        return -1;
+    }
+
+    dir->entries = dir->buf + x;
+    dir->maxentries = (ipod->sector_size - x) / FWDIR_ENTRY_SIZE;
+    if (dir->maxentries > MAX_IMAGES) {
+        dir->maxentries = MAX_IMAGES;
+    }
+
+    while ((dir->nentries < dir->maxentries) && is_entry(entry(dir, dir->nentries))) {
+        dir->nentries++;
+    }
+
+    return 0;
+}
+
+void fwdir_free(struct fwdir_t* dir)
+{
+    if (dir->buf != NULL) {
+        ipod_free_buffer(dir->buf);
+        dir->buf = NULL;
+    }
+}
+
+int fwdir_find(struct fwdir_t* dir, const char* name)
+{
+    int i;
+
+    for (i = 0; i < dir->nentries; i++) {
+        if (memcmp(entry(dir, i) + FWDIR_NAME, name, 4) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+uint32_t fwdir_get(struct fwdir_t* dir, int i, int field)
+{
+    return get_uint32le(entry(dir, i) + field);
+}
+
+void fwdir_set(struct fwdir_t* dir, int i, int field, uint32_t value)
+{
+    put_uint32le(value, entry(dir, i) + field);
+}
+
+int fwdir_rename(struct fwdir_t* dir, const char* from, const char* to)
+{
+    int i = fwdir_find(dir, from);
+
+    if (i < 0) {
+        fprintf(stderr,"[ERR]  Unexpected error - no \"%s\" image!\n", from);
+        return -1;
+    }
+
+    memcpy(entry(dir, i) + FWDIR_NAME, to, 4);
+    return 0;
+}
+
+int fwdir_delete(struct fwdir_t* dir, const char* name)
+{
+    int i = fwdir_find(dir, name);
+
+    if (i < 0) {
+        fprintf(stderr,"[ERR]  Unexpected error - no \"%s\" image!\n", name);
+        return -1;
+    }
+
+    /* The Apple bootloader stops at the first empty entry, so close the gap */
+    memmove(entry(dir, i), entry(dir, i + 1),
+            (dir->nentries - i - 1) * FWDIR_ENTRY_SIZE);
+    dir->nentries--;
+    memset(entry(dir, dir->nentries), 0, FWDIR_ENTRY_SIZE);
+
+    return 0;
+}
+
+int fwdir_add(struct fwdir_t* dir, const char* name, int copy)
+{
+    int i = dir->nentries;
+
+    if (i == dir->maxentries) {
+        fprintf(stderr,"[ERR]  No room for another image in the firmware directory\n");
+        return -1;
+    }
+
+    memcpy(entry(dir, i), entry(dir, copy), FWDIR_ENTRY_SIZE);
+    memcpy(entry(dir, i) + FWDIR_NAME, name, 4);
+    dir->nentries++;
+
+    return i;
+}
+
+/* Check the edited directory is something the ipod can boot - exactly
+   one OSOS image, no duplicate names, and no two images overlapping or
+   extending past the end of the partition. */
+int fwdir_validate(struct fwdir_t* dir)
+{
+    struct ipod_t* ipod = dir->ipod;
+    uint64_t partsize = (uint64_t)ipod->pinfo[0].size * ipod->sector_size;
+    uint64_t base = ipod->fwoffset - ipod->start;
+    uint64_t start_i, end_i, start_j, end_j;
+    int i, j;
+
+    if (fwdir_find(dir, "soso") < 0) {
+        fprintf(stderr,"[ERR]  Firmware directory has no OSOS image\n");
+        return -1;
+    }
+
+    for (i = 0; i < dir->nentries; i++) {
+        start_i = fwdir_get(dir, i, FWDIR_DEVOFFSET);
+        end_i = start_i + fwdir_get(dir, i, FWDIR_LEN);
+
+        if (base + end_i > partsize) {
+            fprintf(stderr,"[ERR]  Image %d extends past the end of the partition\n", i);
+            return -1;
+        }
+
+        for (j = i + 1; j < dir->nentries; j++) {
+            if (memcmp(entry(dir, i) + FWDIR_NAME, entry(dir, j) + FWDIR_NAME, 4) == 0) {
+                fprintf(stderr,"[ERR]  Images %d and %d have the same name\n", i, j);
+                return -1;
+            }
+
+            start_j = fwdir_get(dir, j, FWDIR_DEVOFFSET);
+            end_j = start_j + fwdir_get(dir, j, FWDIR_LEN);
+
+            if ((start_i < end_j) && (start_j < end_i)) {
+                fprintf(stderr,"[ERR]  Images %d and %d overlap\n", i, j);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void fwdir_parse(struct fwdir_t* dir)
+{
+    struct ipod_t* ipod = dir->ipod;
+    struct ipod_directory_t* d;
+    unsigned char* p;
+    int i;
+
+    ipod->nimages = 0;
+    ipod->ososimage = -1;
+
+    for (i = 0; i < dir->nentries; i++) {
+        p = entry(dir, i);
+        d = &ipod->ipod_directory[i];
+
+        if (memcmp(p + FWDIR_NAME,"soso",4)==0) {
+            d->ftype=FTYPE_OSOS;
+            ipod->ososimage = i;
+        } else if (memcmp(p + FWDIR_NAME,"crsr",4)==0) {
+            d->ftype=FTYPE_RSRC;
+        } else if (memcmp(p + FWDIR_NAME,"dpua",4)==0) {
+            d->ftype=FTYPE_AUPD;
+        } else if (memcmp(p + FWDIR_NAME,"kbso",4)==0) {
+            d->ftype=FTYPE_OSBK;
+        } else if (memcmp(p + FWDIR_NAME,"ebih",4)==0) {
+            d->ftype=FTYPE_HIBE;
+        } else {
+            fprintf(stderr,"[ERR]  Unknown image type %c%c%c%c\n",
+                           p[4],p[5],p[6],p[7]);
+        }
+
+        d->id = get_uint32le(p + FWDIR_ID);
+        d->devOffset = get_uint32le(p + FWDIR_DEVOFFSET);
+        d->len = get_uint32le(p + FWDIR_LEN);
+        d->addr = get_uint32le(p + FWDIR_ADDR);
+        d->entryOffset = get_uint32le(p + FWDIR_ENTRYOFFSET);
+        d->chksum = get_uint32le(p + FWDIR_CHKSUM);
+        d->vers = get_uint32le(p + FWDIR_VERS);
+        d->loadAddr = get_uint32le(p + FWDIR_LOADADDR);
+        ipod->nimages++;
+    }
+
+    /* The 3g firmware image doesn't appear to have a version, so let's
+       make one up - see read_directory() for how fwoffset spots it.  This
+       is never written back to the ipod, so it's OK to do. */
+    if ((ipod->fwoffset == ipod->start) && (ipod->ososimage >= 0) &&
+        (ipod->ipod_directory[ipod->ososimage].vers == 0)) {
+        ipod->ipod_directory[ipod->ososimage].vers = 3;
+    }
+}
+
+int fwdir_commit(struct fwdir_t* dir)
+{
+    struct ipod_t* ipod = dir->ipod;
+    int x = ipod->diroffset % ipod->sector_size;
+    int n;
+
+    if (fwdir_validate(dir) < 0) {
+        fprintf(stderr,"[ERR]  Not writing invalid firmware directory\n");
+        fwdir_free(dir);
+        return -1;
+    }
+
+    /* All the image data must be on the disk before the directory
+       that points at it */
+    if (ipod_sync(ipod) < 0) {
+        fprintf(stderr,"[ERR]  Could not flush image data to disk\n");
+        fwdir_free(dir);
+        return -1;
+    }
+
+    n = ipod_write_at(ipod, dir->buf, ipod->sector_size,
+                      ipod->start + ipod->diroffset - x);
+    if (n != ipod->sector_size) {
+        fprintf(stderr,"[ERR]  Write of directory failed.\n");
+        fwdir_free(dir);
+        return -1;
+    }
+
+    if (ipod_sync(ipod) < 0) {
+        fprintf(stderr,"[ERR]  Could not flush directory to disk\n");
+        fwdir_free(dir);
+        return -1;
+    }
+
+    /* Keep our copy of the directory in step with the disk */
+    fwdir_parse(dir);
+    fwdir_free(dir);
+
+    return 0;
+}
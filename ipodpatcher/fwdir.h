@@ -0,0 +1,81 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __FWDIR_H
+#define __FWDIR_H
+
+#include <stdint.h>
+
+#include "ipodio.h"
+
+/* In-memory editing of the firmware partition directory.
+
+   fwdir_load() reads the directory sector once, the edit functions
+   change the copy in memory, and fwdir_commit() checks the result and
+   writes it back with a single sector write - after flushing any image
+   data written in the meantime, so the directory never points at data
+   that isn't on the disk yet. */
+
+/* Byte offsets of the fields in a 40-byte directory entry */
+#define FWDIR_ENTRY_SIZE   40
+#define FWDIR_TYPE         0
+#define FWDIR_NAME         4
+#define FWDIR_ID           8
+#define FWDIR_DEVOFFSET    12
+#define FWDIR_LEN          16
+#define FWDIR_ADDR         20
+#define FWDIR_ENTRYOFFSET  24
+#define FWDIR_CHKSUM       28
+#define FWDIR_VERS         32
+#define FWDIR_LOADADDR     36
+
+struct fwdir_t {
+    struct ipod_t* ipod;
+    unsigned char* buf;       /* Copy of the directory sector */
+    unsigned char* entries;   /* First entry within buf */
+    int nentries;
+    int maxentries;           /* Entries that fit in the rest of the sector */
+};
+
+int fwdir_load(struct ipod_t* ipod, struct fwdir_t* dir);
+void fwdir_free(struct fwdir_t* dir);
+
+/* Returns the index of the image called name ("soso", "kbso", ...) or -1 */
+int fwdir_find(struct fwdir_t* dir, const char* name);
+
+uint32_t fwdir_get(struct fwdir_t* dir, int i, int field);
+void fwdir_set(struct fwdir_t* dir, int i, int field, uint32_t value);
+
+int fwdir_rename(struct fwdir_t* dir, const char* from, const char* to);
+int fwdir_delete(struct fwdir_t* dir, const char* name);
+
+/* Add a new entry called name at the end of the directory, copying the
+   other fields from entry "copy".  Returns the index of the new entry. */
+int fwdir_add(struct fwdir_t* dir, const char* name, int copy);
+
+int fwdir_validate(struct fwdir_t* dir);
+
+/* Validate, write the directory and update ipod->ipod_directory.  The
+   fwdir_t is freed whether or not the commit succeeds. */
+int fwdir_commit(struct fwdir_t* dir);
+
+/* Parse the entries in dir into ipod->ipod_directory */
+void fwdir_parse(struct fwdir_t* dir);
+
+#endif
@@ -0,0 +1,380 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "ipodio.h"
+#include "ipodpatcher.h"
+#include "ioplan.h"
+
+/* How much to read when measuring the disk speed */
+#define MEASURE_SIZE  (16*1024*1024)
+#define MEASURE_CHUNK (1024*1024)
+
+/* Plans longer than this are only listed in full with --verbose */
+#define MAX_LISTED 32
+
+static const char* opname[] = { "read", "write", "zero", "flush", "write" };
+
+void ioplan_init(struct ioplan_t* plan, int dryrun)
+{
+    memset(plan, 0, sizeof(*plan));
+    plan->dryrun = dryrun;
+    pthread_mutex_init(&plan->lock, NULL);
+}
+
+void ioplan_free(struct ioplan_t* plan)
+{
+    int i;
+
+    for (i = 0; i < plan->nentries; i++) {
+        if (plan->entries[i].data != NULL) {
+            ipod_free_buffer(plan->entries[i].data);
+        }
+    }
+    pthread_mutex_destroy(&plan->lock);
+    free(plan->entries);
+    memset(plan, 0, sizeof(*plan));
+}
+
+/* Returns a new entry, or NULL if we ran out of memory.  Called with
+   the lock held. */
+static struct ioplan_entry_t* add_entry(struct ioplan_t* plan, int op,
+                                        uint64_t pos, uint64_t len)
+{
+    struct ioplan_entry_t* e;
+    int newsize;
+
+    if (plan->nentries == plan->allocated) {
+        newsize = (plan->allocated == 0) ? 256 : plan->allocated * 2;
+        e = realloc(plan->entries, newsize * sizeof(struct ioplan_entry_t));
+        if (e == NULL) {
+            plan->failed = 1;
+            return NULL;
+        }
+        plan->entries = e;
+        plan->allocated = newsize;
+    }
+
+    e = &plan->entries[plan->nentries++];
+    memset(e, 0, sizeof(*e));
+    e->op = op;
+    e->pos = pos;
+    e->len = len;
+    plan->total[op] += len;
+
+    return e;
+}
+
+void ioplan_read(struct ioplan_t* plan, uint64_t pos, unsigned char* buf, uint64_t len)
+{
+    struct ioplan_entry_t* e;
+    uint64_t start, end;
+    int i;
+
+    if (len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&plan->lock);
+
+    /* Later entries replace earlier ones, so apply them in order */
+    for (i = 0; i < plan->nentries; i++) {
+        e = &plan->entries[i];
+        start = (e->pos > pos) ? e->pos : pos;
+        end = (e->pos + e->len < pos + len) ? e->pos + e->len : pos + len;
+        if (start >= end) {
+            continue;
+        }
+
+        if (e->op == IOPLAN_WRITE) {
+            memcpy(buf + (start - pos), e->data + (start - e->pos), end - start);
+        } else if (e->op == IOPLAN_ZERO) {
+            memset(buf + (start - pos), 0, end - start);
+        }
+    }
+
+    add_entry(plan, IOPLAN_READ, pos, len);
+
+    pthread_mutex_unlock(&plan->lock);
+}
+
+int ioplan_write(struct ioplan_t* plan, uint64_t pos, const unsigned char* buf, uint64_t len)
+{
+    struct ioplan_entry_t* e;
+    unsigned char* data;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    /* Aligned, as the executor may write it to a device opened for
+       unbuffered I/O */
+    if (ipod_alloc_buffer(&data, len) < 0) {
+        pthread_mutex_lock(&plan->lock);
+        plan->failed = 1;
+        pthread_mutex_unlock(&plan->lock);
+        return -1;
+    }
+    memcpy(data, buf, len);
+
+    pthread_mutex_lock(&plan->lock);
+    e = add_entry(plan, IOPLAN_WRITE, pos, len);
+    if (e != NULL) {
+        e->data = data;
+    }
+    pthread_mutex_unlock(&plan->lock);
+
+    if (e == NULL) {
+        ipod_free_buffer(data);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int add_locked(struct ioplan_t* plan, int op, uint64_t pos, uint64_t len,
+                      ioplan_fn fn, void* ctx)
+{
+    struct ioplan_entry_t* e;
+
+    pthread_mutex_lock(&plan->lock);
+    e = add_entry(plan, op, pos, len);
+    if (e != NULL) {
+        e->fn = fn;
+        e->ctx = ctx;
+    }
+    pthread_mutex_unlock(&plan->lock);
+
+    return (e == NULL) ? -1 : 0;
+}
+
+int ioplan_zero(struct ioplan_t* plan, uint64_t pos, uint64_t len)
+{
+    return (len == 0) ? 0 : add_locked(plan, IOPLAN_ZERO, pos, len, NULL, NULL);
+}
+
+int ioplan_sync(struct ioplan_t* plan)
+{
+    return add_locked(plan, IOPLAN_SYNC, 0, 0, NULL, NULL);
+}
+
+int ioplan_defer(struct ioplan_t* plan, uint64_t pos, uint64_t len,
+                 ioplan_fn fn, void* ctx)
+{
+    return add_locked(plan, IOPLAN_DEFER, pos, len, fn, ctx);
+}
+
+void ioplan_begin(struct ipod_t* ipod, struct ioplan_t* plan)
+{
+    memset(plan, 0, sizeof(*plan));
+
+    if (ipod->plan == NULL) {
+        ioplan_init(plan, 0);
+        ipod->plan = plan;
+    }
+}
+
+int ioplan_end(struct ipod_t* ipod, struct ioplan_t* plan, int res)
+{
+    if (ipod->plan != plan) {
+        /* Someone else's plan - they will run it */
+        return res;
+    }
+
+    ipod->plan = NULL;
+
+    if (plan->failed) {
+        fprintf(stderr,"[ERR]  Out of memory planning the I/O - nothing written\n");
+        res = -1;
+    }
+
+    if (res == 0) {
+        res = ioplan_execute(ipod, plan);
+    }
+
+    ioplan_free(plan);
+    return res;
+}
+
+int ioplan_execute(struct ipod_t* ipod, struct ioplan_t* plan)
+{
+    struct ioplan_entry_t* e;
+    int i;
+
+    if (ipod_verbose) {
+        fprintf(stderr,"[VERB] Running I/O plan - %" PRIu64 " bytes to write, %" PRIu64 " to zero\n",
+                plan->total[IOPLAN_WRITE] + plan->total[IOPLAN_DEFER],
+                plan->total[IOPLAN_ZERO]);
+    }
+
+    for (i = 0; i < plan->nentries; i++) {
+        e = &plan->entries[i];
+
+        switch (e->op) {
+            case IOPLAN_WRITE:
+                if (ipod_write_at(ipod, e->data, e->len, e->pos) != (ssize_t)e->len) {
+                    ipod_print_error(" Error writing to disk: ");
+                    return -1;
+                }
+                break;
+            case IOPLAN_ZERO:
+                if (ipod_zero_range(ipod, e->pos / ipod->sector_size,
+                                    e->len / ipod->sector_size) < 0) {
+                    ipod_print_error(" Error zeroing disk: ");
+                    return -1;
+                }
+                break;
+            case IOPLAN_SYNC:
+                if (ipod_sync(ipod) < 0) {
+                    fprintf(stderr,"[ERR]  Could not flush writes to disk\n");
+                    return -1;
+                }
+                break;
+            case IOPLAN_DEFER:
+                if (e->fn(ipod, e->ctx) < 0) {
+                    return -1;
+                }
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+double ioplan_measure(struct ipod_t* ipod)
+{
+    struct ipod_t uncached;
+    unsigned char* buf;
+    uint64_t size = (uint64_t)ipod->pinfo[0].size * ipod->sector_size;
+    uint64_t done = 0;
+    double start;
+    double elapsed;
+    int n;
+
+    if (size > MEASURE_SIZE) {
+        size = MEASURE_SIZE;
+    }
+
+    if (ipod_open_uncached(ipod, &uncached) < 0) {
+        return 0;
+    }
+    uncached.plan = NULL;
+
+    if (ipod_alloc_buffer(&buf, MEASURE_CHUNK) < 0) {
+        ipod_close(&uncached);
+        return 0;
+    }
+
+    start = now();
+    while (done + MEASURE_CHUNK <= size) {
+        n = ipod_read_at(&uncached, buf, MEASURE_CHUNK, ipod->start + done);
+        if (n != MEASURE_CHUNK) {
+            break;
+        }
+        done += n;
+    }
+    elapsed = now() - start;
+
+    ipod_free_buffer(buf);
+    ipod_close(&uncached);
+
+    if ((done == 0) || (elapsed <= 0)) {
+        return 0;
+    }
+
+    return done / elapsed;
+}
+
+void ioplan_print(struct ipod_t* ipod, struct ioplan_t* plan, double throughput)
+{
+    struct ioplan_entry_t* e;
+    uint64_t pos, len;
+    uint64_t bytes;
+    int listed = 0;
+    int op;
+    int i;
+
+    if (plan->failed) {
+        fprintf(stderr,"[ERR]  Out of memory planning the I/O - totals are incomplete\n");
+    }
+
+    fprintf(stderr,"[INFO] Dry run - nothing has been written.  I/O plan:\n");
+
+    for (i = 0; i < plan->nentries; i++) {
+        e = &plan->entries[i];
+        op = e->op;
+        pos = e->pos;
+        len = e->len;
+
+        /* List contiguous reads, writes and zeros as one */
+        while ((op != IOPLAN_SYNC) && (op != IOPLAN_DEFER) &&
+               (i + 1 < plan->nentries) && (e[1].op == op) &&
+               (e[1].pos == pos + len)) {
+            len += e[1].len;
+            e++;
+            i++;
+        }
+
+        if ((listed == MAX_LISTED) && !ipod_verbose) {
+            fprintf(stderr,"[INFO]   ... more (use -v to list them all)\n");
+            break;
+        }
+        listed++;
+
+        if (op == IOPLAN_SYNC) {
+            fprintf(stderr,"[INFO]   flush\n");
+        } else {
+            fprintf(stderr,"[INFO]   %-5s sectors %" PRIu64 "-%" PRIu64 " (%" PRIu64 " bytes%s)\n",
+                    opname[op], pos / ipod->sector_size,
+                    (pos + len - 1) / ipod->sector_size, len,
+                    (op == IOPLAN_DEFER) ? ", copied from the host" : "");
+        }
+    }
+
+    fprintf(stderr,"[INFO] Total: %" PRIu64 " bytes read, %" PRIu64 " bytes written, "
+                   "%" PRIu64 " bytes zeroed\n",
+            plan->total[IOPLAN_READ],
+            plan->total[IOPLAN_WRITE] + plan->total[IOPLAN_DEFER],
+            plan->total[IOPLAN_ZERO]);
+
+    if (throughput > 0) {
+        /* Zeroing is usually done by the device itself, and is too
+           device-dependent to guess, so it is left out */
+        bytes = plan->total[IOPLAN_READ] + plan->total[IOPLAN_WRITE] +
+                plan->total[IOPLAN_DEFER];
+        fprintf(stderr,"[INFO] Measured read speed %.1f MB/s - estimated time %.1f seconds,\n"
+                       "[INFO] if writes are as fast as reads and not counting the zeroing\n",
+                throughput / (1024*1024), bytes / throughput);
+    } else {
+        fprintf(stderr,"[INFO] Could not measure disk speed - no time estimate\n");
+    }
+}
@@ -0,0 +1,109 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __IOPLAN_H
+#define __IOPLAN_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ipodio.h"
+
+/* I/O plans.
+
+   add_bootloader(), delete_bootloader(), write_firmware(),
+   write_partition() and format_partition() don't write to the disk
+   directly.  While ipod->plan is set, the ipodio layer turns every write,
+   zero and flush into an entry of the plan, with a copy of the data, and
+   only reads reach the disk.  Once the operation has decided everything
+   it is going to do, ioplan_execute() runs the plan's entries in order -
+   or, with --dry-run, the plan is printed instead.
+
+   A read of sectors the plan is going to write returns the planned data,
+   so the operation sees the disk as it will be, e.g. when it reads back
+   an image it has just moved.
+
+   The one write whose data isn't copied is the data area of a populated
+   FAT32 partition, which can be as big as the disk.  It is planned as a
+   deferred write, a function the executor calls to write it, and must
+   not be read back while planning. */
+
+#define IOPLAN_READ  0     /* Already done while planning */
+#define IOPLAN_WRITE 1
+#define IOPLAN_ZERO  2
+#define IOPLAN_SYNC  3     /* Flush everything before it to the disk */
+#define IOPLAN_DEFER 4     /* A write done by a function - see above */
+
+typedef int (*ioplan_fn)(struct ipod_t* ipod, void* ctx);
+
+struct ioplan_entry_t {
+    int op;
+    uint64_t pos;          /* Bytes from the start of the disk */
+    uint64_t len;
+    unsigned char* data;   /* IOPLAN_WRITE only */
+    ioplan_fn fn;          /* IOPLAN_DEFER only */
+    void* ctx;
+};
+
+struct ioplan_t {
+    struct ioplan_entry_t* entries;
+    int nentries;
+    int allocated;
+    uint64_t total[5];     /* Bytes for each op */
+    int dryrun;            /* Only printed, never executed */
+    int failed;            /* Ran out of memory */
+    pthread_mutex_t lock;  /* Pipelines read and write from different threads */
+};
+
+void ioplan_init(struct ioplan_t* plan, int dryrun);
+void ioplan_free(struct ioplan_t* plan);
+
+/* Called by the ipodio layer while ipod->plan is set.  ioplan_read() is
+   called after the read from the disk and puts any planned data over
+   what was read. */
+void ioplan_read(struct ioplan_t* plan, uint64_t pos, unsigned char* buf, uint64_t len);
+int ioplan_write(struct ioplan_t* plan, uint64_t pos, const unsigned char* buf, uint64_t len);
+int ioplan_zero(struct ioplan_t* plan, uint64_t pos, uint64_t len);
+int ioplan_sync(struct ioplan_t* plan);
+
+/* Plan a write of len bytes at pos, done by fn(ipod, ctx) when the plan
+   is executed.  ctx must stay valid until then. */
+int ioplan_defer(struct ioplan_t* plan, uint64_t pos, uint64_t len,
+                 ioplan_fn fn, void* ctx);
+
+/* The five operations above run between these two.  ioplan_begin() sets
+   ipod->plan to plan, unless a plan is already being made (by --dry-run,
+   or by an operation calling another one).  ioplan_end() is passed the
+   result of the planning; if plan is the one ioplan_begin() set, it is
+   executed if the planning succeeded, and freed either way.  Returns the
+   result of the operation. */
+void ioplan_begin(struct ipod_t* ipod, struct ioplan_t* plan);
+int ioplan_end(struct ipod_t* ipod, struct ioplan_t* plan, int res);
+
+/* Run the writes, zeros, flushes and deferred writes of the plan, in
+   order.  ipod->plan must be NULL. */
+int ioplan_execute(struct ipod_t* ipod, struct ioplan_t* plan);
+
+/* Time a short uncached read from the firmware partition.  Returns the
+   throughput in bytes per second, or 0 if it couldn't be measured. */
+double ioplan_measure(struct ipod_t* ipod);
+
+void ioplan_print(struct ipod_t* ipod, struct ioplan_t* plan, double throughput);
+
+#endif
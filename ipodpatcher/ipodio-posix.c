@@ -19,6 +19,10 @@
  *
  ****************************************************************************/
 
+#if defined(linux) || defined (__linux)
+/* For O_DIRECT */
+#define _GNU_SOURCE
+#endif
 
 #include <stdio.h>
 #include <unistd.h>
@@ -28,9 +32,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <errno.h>
 
 #include "ipodio.h"
+#include "verify.h"
+#include "ioplan.h"
 
 #if defined(linux) || defined (__linux)
 #include <sys/mount.h>
@@ -39,6 +46,21 @@
 #include <scsi/sg.h>
 
 #define IPOD_SECTORSIZE_IOCTL BLKSSZGET
+#define IPOD_PHYSSECTORSIZE_IOCTL BLKPBSZGET
+
+/* Not all <sys/mount.h> versions define this one */
+#ifndef BLKPBSZGET
+#define BLKPBSZGET _IO(0x12,123)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
 
 static void get_geometry(struct ipod_t* ipod)
 {
@@ -132,6 +154,7 @@ int ipod_scsi_inquiry(struct ipod_t* ipod, int page_code,
 #include <IOKit/scsi-commands/SCSITaskLib.h>
 #include <IOKit/scsi-commands/SCSICommandOperationCodes.h>
 #define IPOD_SECTORSIZE_IOCTL DKIOCGETBLOCKSIZE
+#define IPOD_PHYSSECTORSIZE_IOCTL DKIOCGETPHYSICALBLOCKSIZE
 
 /* TODO: Implement this function for Mac OS X */
 static void get_geometry(struct ipod_t* ipod)
@@ -329,6 +352,19 @@ int ipod_open(struct ipod_t* ipod, int silent)
         }
     }
 
+    /* The physical sector size is only a hint for aligning the
+       filesystem, so silently fall back to the logical one. */
+    ipod->phys_sector_size = ipod->sector_size;
+#ifdef IPOD_PHYSSECTORSIZE_IOCTL
+    {
+        unsigned int pbsz;
+        if ((ioctl(ipod->dh,IPOD_PHYSSECTORSIZE_IOCTL,&pbsz) == 0) &&
+            ((int)pbsz > ipod->sector_size)) {
+            ipod->phys_sector_size = pbsz;
+        }
+    }
+#endif
+
     get_geometry(ipod);
 
     return 0;
@@ -337,6 +373,11 @@ int ipod_open(struct ipod_t* ipod, int silent)
 
 int ipod_reopen_rw(struct ipod_t* ipod)
 {
+    /* A dry run never writes, so it doesn't need write access */
+    if ((ipod->plan != NULL) && ipod->plan->dryrun) {
+        return 0;
+    }
+
 #if defined(__APPLE__) && defined(__MACH__)
     if (ipod_unmount(ipod) < 0)
         return -1;
@@ -351,6 +392,45 @@ int ipod_reopen_rw(struct ipod_t* ipod)
     return 0;
 }
 
+/* Open a second, read-only handle on the ipod which bypasses the OS
+   cache, so that reads return what is actually on the disk. */
+int ipod_open_uncached(struct ipod_t* ipod, struct ipod_t* uncached)
+{
+    memcpy(uncached, ipod, sizeof(struct ipod_t));
+    uncached->verify = NULL;
+    uncached->plan = NULL;
+
+#ifdef O_DIRECT
+    uncached->dh = open(ipod->diskname, O_RDONLY|O_DIRECT);
+    if (uncached->dh >= 0) {
+        return 0;
+    }
+#endif
+
+    /* Not all filesystems support O_DIRECT for image files */
+    uncached->dh = open(ipod->diskname, O_RDONLY);
+    if (uncached->dh < 0) {
+        perror(ipod->diskname);
+        return -1;
+    }
+
+#if defined(__APPLE__) && defined(__MACH__)
+    fcntl(uncached->dh, F_NOCACHE, 1);
+#elif defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(uncached->dh, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    return 0;
+}
+
+int ipod_sync(struct ipod_t* ipod)
+{
+    if (ipod->plan != NULL) {
+        return ioplan_sync(ipod->plan);
+    }
+    return fsync(ipod->dh);
+}
+
 int ipod_close(struct ipod_t* ipod)
 {
     close(ipod->dh);
@@ -359,13 +439,19 @@ int ipod_close(struct ipod_t* ipod)
 
 int ipod_alloc_buffer(unsigned char** sectorbuf, int bufsize)
 {
-    *sectorbuf=malloc(bufsize);
-    if (*sectorbuf == NULL) {
+    /* Page-aligned, so the buffer can be used with O_DIRECT */
+    if (posix_memalign((void**)sectorbuf, 4096, bufsize) != 0) {
+        *sectorbuf = NULL;
         return -1;
     }
     return 0;
 }
 
+void ipod_free_buffer(unsigned char* sectorbuf)
+{
+    free(sectorbuf);
+}
+
 int ipod_seek(struct ipod_t* ipod, unsigned long pos)
 {
     off_t res;
@@ -380,11 +466,152 @@ int ipod_seek(struct ipod_t* ipod, unsigned long pos)
 
 ssize_t ipod_read(struct ipod_t* ipod, unsigned char* buf, int nbytes)
 {
+    off_t pos;
+    ssize_t n;
+
+    if (ipod->plan != NULL) {
+        pos = lseek(ipod->dh, 0, SEEK_CUR);
+        n = read(ipod->dh, buf, nbytes);
+        if (n > 0) {
+            ioplan_read(ipod->plan, pos, buf, n);
+        }
+        return n;
+    }
     return read(ipod->dh, buf, nbytes);
 }
 
 ssize_t ipod_write(struct ipod_t* ipod, unsigned char* buf, int nbytes)
 {
+    if (ipod->plan != NULL) {
+        /* Move on as if we had written it */
+        if ((ioplan_write(ipod->plan, lseek(ipod->dh, 0, SEEK_CUR), buf, nbytes) < 0) ||
+            (lseek(ipod->dh, nbytes, SEEK_CUR) == -1)) {
+            return -1;
+        }
+        return nbytes;
+    }
+
+    if (ipod->verify != NULL) {
+        verify_add(ipod->verify, ipod->sector_size, 
+                   lseek(ipod->dh, 0, SEEK_CUR), buf, nbytes);
+    }
     return write(ipod->dh, buf, nbytes);
 }
 
+
+/* Positioned I/O - these don't move the file offset used by ipod_seek(),
+   so they can be used from several threads at once. */
+ssize_t ipod_read_at(struct ipod_t* ipod, unsigned char* buf, int nbytes,
+                     uint64_t pos)
+{
+    ssize_t n;
+
+    n = pread(ipod->dh, buf, nbytes, pos);
+    if ((ipod->plan != NULL) && (n > 0)) {
+        ioplan_read(ipod->plan, pos, buf, n);
+    }
+    return n;
+}
+
+ssize_t ipod_write_at(struct ipod_t* ipod, unsigned char* buf, int nbytes,
+                      uint64_t pos)
+{
+    if (ipod->plan != NULL) {
+        return (ioplan_write(ipod->plan, pos, buf, nbytes) < 0) ? -1 : nbytes;
+    }
+
+    if (ipod->verify != NULL) {
+        verify_add(ipod->verify, ipod->sector_size, pos, buf, nbytes);
+    }
+    return pwrite(ipod->dh, buf, nbytes, pos);
+}
+
+/* Zeroing with ordinary writes uses one shared zero buffer, handed to
+   pwritev() several times over so that each call covers ZERO_WRITE_SIZE. */
+#define ZERO_BUFFER_SIZE (1024*1024)
+#define ZERO_IOVECS      4
+#define ZERO_WRITE_SIZE  (ZERO_BUFFER_SIZE * ZERO_IOVECS)
+
+#if defined(linux) || defined (__linux) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define HAVE_PWRITEV
+#endif
+
+static int write_zeros(struct ipod_t* ipod, uint64_t pos, uint64_t bytesleft)
+{
+    static unsigned char* zerobuf = NULL;
+    ssize_t n;
+
+    if (zerobuf == NULL) {
+        if (ipod_alloc_buffer(&zerobuf, ZERO_BUFFER_SIZE) < 0) {
+            return -1;
+        }
+        memset(zerobuf, 0, ZERO_BUFFER_SIZE);
+    }
+
+    while (bytesleft > 0) {
+#ifdef HAVE_PWRITEV
+        struct iovec iov[ZERO_IOVECS];
+        uint64_t chunksize = 0;
+        int i;
+
+        for (i = 0; i < ZERO_IOVECS && chunksize < bytesleft; i++) {
+            iov[i].iov_base = zerobuf;
+            iov[i].iov_len = ZERO_BUFFER_SIZE;
+            if (bytesleft - chunksize < ZERO_BUFFER_SIZE) {
+                iov[i].iov_len = bytesleft - chunksize;
+            }
+            chunksize += iov[i].iov_len;
+        }
+        n = pwritev(ipod->dh, iov, i, pos);
+#else
+        n = pwrite(ipod->dh, zerobuf, bytesleft > ZERO_BUFFER_SIZE ?
+                   ZERO_BUFFER_SIZE : bytesleft, pos);
+#endif
+        /* A short write is fine as long as it ends on a sector boundary */
+        if ((n <= 0) || (n % ipod->sector_size) != 0) {
+            return -1;
+        }
+
+        pos += n;
+        bytesleft -= n;
+    }
+
+    return 0;
+}
+
+/* Zero "count" sectors, starting at sector "start".  On Linux block
+   devices we let the kernel do it - BLKZEROOUT first, then BLKDISCARD if
+   the device guarantees that discarded sectors read back as zeros.
+   Everything else (image files, other platforms) gets zeros written. */
+int ipod_zero_range(struct ipod_t* ipod, uint64_t start, uint64_t count)
+{
+    uint64_t bytes = count * ipod->sector_size;
+
+    if (ipod->plan != NULL) {
+        return ioplan_zero(ipod->plan, start * ipod->sector_size, bytes);
+    }
+
+    if (ipod->verify != NULL) {
+        verify_add(ipod->verify, ipod->sector_size, start * ipod->sector_size,
+                   NULL, bytes);
+    }
+
+#if defined(linux) || defined (__linux)
+    uint64_t range[2];
+    unsigned int zeroes = 0;
+
+    range[0] = start * ipod->sector_size;
+    range[1] = bytes;
+
+    if (ioctl(ipod->dh, BLKZEROOUT, range) == 0) {
+        return 0;
+    }
+
+    if ((ioctl(ipod->dh, BLKDISCARDZEROES, &zeroes) == 0) && zeroes &&
+        (ioctl(ipod->dh, BLKDISCARD, range) == 0)) {
+        return 0;
+    }
+#endif
+
+    return write_zeros(ipod, start * ipod->sector_size, bytes);
+}
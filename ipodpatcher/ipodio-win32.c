@@ -37,6 +37,8 @@
 #include <winioctl.h>
 
 #include "ipodio.h"
+#include "verify.h"
+#include "ioplan.h"
 
 static int lock_volume(HANDLE hDisk) 
 { 
@@ -71,6 +73,8 @@ int ipod_open(struct ipod_t* ipod, int silent)
 {
     DISK_GEOMETRY_EX diskgeometry_ex;
     DISK_GEOMETRY diskgeometry;
+    STORAGE_PROPERTY_QUERY query;
+    STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment;
     unsigned long n;
 
     ipod->dh = CreateFileA(ipod->diskname, GENERIC_READ,
@@ -123,11 +127,38 @@ int ipod_open(struct ipod_t* ipod, int silent)
         ipod->sectors_per_track = diskgeometry_ex.Geometry.SectorsPerTrack;
     }
 
+    /* Drives with 512-byte logical sectors may use 4K physical sectors.
+       Older Windows versions don't know this property, so fall back to
+       the logical size if the query fails. */
+    ipod->phys_sector_size = ipod->sector_size;
+
+    memset(&query, 0, sizeof(query));
+    query.PropertyId = StorageAccessAlignmentProperty;
+    query.QueryType = PropertyStandardQuery;
+
+    if (DeviceIoControl(ipod->dh,
+                        IOCTL_STORAGE_QUERY_PROPERTY,
+                        &query,
+                        sizeof(query),
+                        &alignment,
+                        sizeof(alignment),
+                        &n,
+                        NULL) &&
+        (n >= sizeof(alignment)) &&
+        ((int)alignment.BytesPerPhysicalSector > ipod->sector_size)) {
+        ipod->phys_sector_size = alignment.BytesPerPhysicalSector;
+    }
+
     return 0;
 }
 
 int ipod_reopen_rw(struct ipod_t* ipod)
 {
+    /* A dry run never writes, so it doesn't need write access */
+    if ((ipod->plan != NULL) && ipod->plan->dryrun) {
+        return 0;
+    }
+
     /* Close existing file and re-open for writing */
     unlock_volume(ipod->dh);
     CloseHandle(ipod->dh);
@@ -149,6 +180,40 @@ int ipod_reopen_rw(struct ipod_t* ipod)
     return 0;
 }
 
+/* Open a second, read-only handle on the ipod.  Our handles never use
+   the OS cache (FILE_FLAG_NO_BUFFERING), so reads return what is
+   actually on the disk. */
+int ipod_open_uncached(struct ipod_t* ipod, struct ipod_t* uncached)
+{
+    memcpy(uncached, ipod, sizeof(struct ipod_t));
+    uncached->verify = NULL;
+    uncached->plan = NULL;
+
+    uncached->dh = CreateFileA(ipod->diskname, GENERIC_READ,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                    FILE_FLAG_NO_BUFFERING, NULL);
+
+    if (uncached->dh == INVALID_HANDLE_VALUE) {
+        ipod_print_error(" Error opening disk: ");
+        return -1;
+    }
+
+    return 0;
+}
+
+int ipod_sync(struct ipod_t* ipod)
+{
+    if (ipod->plan != NULL) {
+        return ioplan_sync(ipod->plan);
+    }
+
+    if (!FlushFileBuffers(ipod->dh)) {
+        ipod_print_error(" Error flushing disk: ");
+        return -1;
+    }
+    return 0;
+}
+
 int ipod_close(struct ipod_t* ipod)
 {
     unlock_volume(ipod->dh);
@@ -168,6 +233,11 @@ int ipod_alloc_buffer(unsigned char** sectorbuf, int bufsize)
     return 0;
 }
 
+void ipod_free_buffer(unsigned char* sectorbuf)
+{
+    VirtualFree(sectorbuf, 0, MEM_RELEASE);
+}
+
 int ipod_seek(struct ipod_t* ipod, unsigned long pos)
 {
     if (SetFilePointer(ipod->dh, pos, NULL, FILE_BEGIN)==0xffffffff) {
@@ -177,21 +247,60 @@ int ipod_seek(struct ipod_t* ipod, unsigned long pos)
     return 0;
 }
 
+/* Current position of the file pointer */
+static uint64_t tell(struct ipod_t* ipod)
+{
+    LARGE_INTEGER zero;
+    LARGE_INTEGER pos;
+
+    zero.QuadPart = 0;
+    if (!SetFilePointerEx(ipod->dh, zero, &pos, FILE_CURRENT)) {
+        return 0;
+    }
+    return pos.QuadPart;
+}
+
 ssize_t ipod_read(struct ipod_t* ipod, unsigned char* buf, int nbytes)
 {
     unsigned long count;
+    uint64_t pos = 0;
+
+    if (ipod->plan != NULL) {
+        pos = tell(ipod);
+    }
 
     if (!ReadFile(ipod->dh, buf, nbytes, &count, NULL)) {
         ipod_print_error(" Error reading from disk: ");
         return -1;
     }
 
+    if (ipod->plan != NULL) {
+        ioplan_read(ipod->plan, pos, buf, count);
+    }
+
     return count;
 }
 
 ssize_t ipod_write(struct ipod_t* ipod, unsigned char* buf, int nbytes)
 {
     unsigned long count;
+    LARGE_INTEGER delta;
+
+    if (ipod->plan != NULL) {
+        /* Move on as if we had written it */
+        if (ioplan_write(ipod->plan, tell(ipod), buf, nbytes) < 0) {
+            return -1;
+        }
+        delta.QuadPart = nbytes;
+        if (!SetFilePointerEx(ipod->dh, delta, NULL, FILE_CURRENT)) {
+            return -1;
+        }
+        return nbytes;
+    }
+
+    if (ipod->verify != NULL) {
+        verify_add(ipod->verify, ipod->sector_size, tell(ipod), buf, nbytes);
+    }
 
     if (!WriteFile(ipod->dh, buf, nbytes, &count, NULL)) {
         ipod_print_error(" Error writing to disk: ");
@@ -201,3 +310,98 @@ ssize_t ipod_write(struct ipod_t* ipod, unsigned char* buf, int nbytes)
     return count;
 }
 
+
+/* Positioned I/O - the offset comes from the OVERLAPPED structure, so
+   these can be used from several threads at once. */
+ssize_t ipod_read_at(struct ipod_t* ipod, unsigned char* buf, int nbytes,
+                     uint64_t pos)
+{
+    OVERLAPPED ov;
+    unsigned long count;
+
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = pos & 0xffffffff;
+    ov.OffsetHigh = pos >> 32;
+
+    if (!ReadFile(ipod->dh, buf, nbytes, &count, &ov)) {
+        ipod_print_error(" Error reading from disk: ");
+        return -1;
+    }
+
+    if (ipod->plan != NULL) {
+        ioplan_read(ipod->plan, pos, buf, count);
+    }
+
+    return count;
+}
+
+ssize_t ipod_write_at(struct ipod_t* ipod, unsigned char* buf, int nbytes,
+                      uint64_t pos)
+{
+    OVERLAPPED ov;
+    unsigned long count;
+
+    if (ipod->plan != NULL) {
+        return (ioplan_write(ipod->plan, pos, buf, nbytes) < 0) ? -1 : nbytes;
+    }
+
+    if (ipod->verify != NULL) {
+        verify_add(ipod->verify, ipod->sector_size, pos, buf, nbytes);
+    }
+
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = pos & 0xffffffff;
+    ov.OffsetHigh = pos >> 32;
+
+    if (!WriteFile(ipod->dh, buf, nbytes, &count, &ov)) {
+        ipod_print_error(" Error writing to disk: ");
+        return -1;
+    }
+
+    return count;
+}
+
+/* Size of the buffer used when zeroing sectors */
+#define ZERO_BUFFER_SIZE (1024*1024)
+
+/* Zero "count" sectors, starting at sector "start" */
+int ipod_zero_range(struct ipod_t* ipod, uint64_t start, uint64_t count)
+{
+    static unsigned char* zerobuf = NULL;
+    uint64_t bytesleft = count * ipod->sector_size;
+    LARGE_INTEGER pos;
+    ssize_t n;
+    int chunksize;
+
+    if (ipod->plan != NULL) {
+        return ioplan_zero(ipod->plan, start * ipod->sector_size, bytesleft);
+    }
+
+    /* VirtualAlloc() returns zero-filled memory */
+    if ((zerobuf == NULL) && (ipod_alloc_buffer(&zerobuf, ZERO_BUFFER_SIZE) < 0)) {
+        return -1;
+    }
+
+    pos.QuadPart = start * ipod->sector_size;
+    if (!SetFilePointerEx(ipod->dh, pos, NULL, FILE_BEGIN)) {
+        ipod_print_error(" Seek error ");
+        return -1;
+    }
+
+    while (bytesleft > 0) {
+        if (bytesleft > ZERO_BUFFER_SIZE) {
+            chunksize = ZERO_BUFFER_SIZE;
+        } else {
+            chunksize = bytesleft;
+        }
+
+        n = ipod_write(ipod, zerobuf, chunksize);
+        if (n != chunksize) {
+            return -1;
+        }
+
+        bytesleft -= n;
+    }
+
+    return 0;
+}
@@ -64,10 +64,14 @@ struct partinfo_t {
   uint32_t type;
 };
 
+struct verify_t;
+struct ioplan_t;
+
 struct ipod_t {
     HANDLE dh;
     char diskname[4096];
     int sector_size;
+    int phys_sector_size; /* Physical sector size, >= sector_size */
     int sectors_per_track;
     int num_heads;
     struct ipod_directory_t ipod_directory[MAX_IMAGES];
@@ -85,6 +89,9 @@ struct ipod_t {
     char* xmlinfo;   /* The XML Device Information (if available) */
     int xmlinfo_len;
     int ramsize;     /* The amount of RAM in the ipod (if available) */
+    char serial[64]; /* From SCSI INQUIRY page 0x80 - empty if not read yet */
+    struct verify_t* verify; /* If not NULL, all writes are recorded here */
+    struct ioplan_t* plan;   /* If not NULL, writes are planned, not done - see ioplan.h */
 #ifdef WITH_BOOTOBJS
     unsigned char* bootloader;
     int bootloader_len;
@@ -94,15 +101,24 @@ struct ipod_t {
 void ipod_print_error(char* msg);
 int ipod_open(struct ipod_t* ipod, int silent);
 int ipod_reopen_rw(struct ipod_t* ipod);
+int ipod_open_uncached(struct ipod_t* ipod, struct ipod_t* uncached);
+int ipod_sync(struct ipod_t* ipod);
 int ipod_close(struct ipod_t* ipod);
 int ipod_seek(struct ipod_t* ipod, unsigned long pos);
 int ipod_scsi_inquiry(struct ipod_t* ipod, int page_code,
                       unsigned char* buf, int bufsize);
 ssize_t ipod_read(struct ipod_t* ipod, unsigned char* buf, int nbytes);
 ssize_t ipod_write(struct ipod_t* ipod, unsigned char* buf, int nbytes);
+ssize_t ipod_read_at(struct ipod_t* ipod, unsigned char* buf, int nbytes,
+                     uint64_t pos);
+ssize_t ipod_write_at(struct ipod_t* ipod, unsigned char* buf, int nbytes,
+                      uint64_t pos);
+int ipod_zero_range(struct ipod_t* ipod, uint64_t start, uint64_t count);
 int ipod_alloc_buffer(unsigned char** sectorbuf, int bufsize);
+void ipod_free_buffer(unsigned char* sectorbuf);
 
 /* In fat32format.c */
-int format_partition(struct ipod_t* ipod, int partition);
+int format_partition(struct ipod_t* ipod, int partition, int align,
+                     const char* srcdir);
 
 #endif
@@ -26,12 +26,22 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "parttypes.h"
 #include "ipodio.h"
 #include "ipodpatcher.h"
+#include "backup.h"
+#include "manifest.h"
+#include "pipeline.h"
+#include "fwdir.h"
+#include "compact.h"
+#include "chksum.h"
+#include "devcache.h"
+#include "verify.h"
+#include "ioplan.h"
 
 #ifdef WITH_BOOTOBJS
 #include "ipod1g2g.h"
@@ -107,6 +117,30 @@ off_t filesize(int fd) {
     }
 }
 
+/* Read len bytes, or until the end of the input.  Pipes return whatever
+   happens to be available, so a single read() may come back short. */
+static int read_full(int fd, unsigned char* buf, int len)
+{
+    int total = 0;
+    int n;
+
+    while (total < len) {
+        n = read(fd, buf + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+
+    return total;
+}
+
 /* Partition table parsing code taken from Rockbox */
 
 #define MAX_SECTOR_SIZE 2048
@@ -279,18 +313,38 @@ int read_partinfo(struct ipod_t* ipod, int silent)
     return 0;
 }
 
-int read_partition(struct ipod_t* ipod, int outfile)
+/* Granularity of the zero-block detection in read_partition() - this
+   should match the block size of the filesystem holding the backup. */
+#define SPARSE_BLOCK_SIZE 4096
+
+static bool is_zero_block(unsigned char* buf, int len)
+{
+    return (buf[0] == 0) && (memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+int read_partition(struct ipod_t* ipod, int outfile, struct manifest_t* manifest)
 {
     int res;
     ssize_t n;
     int bytesleft;
     int chunksize;
+    int blocksize;
+    int runstart;
+    int i;
+    bool sparse;
+    bool zero;
+    off_t holebytes = 0;
+    off_t outsize = 0;
     int count = ipod->pinfo[0].size;
 
     if (ipod_seek(ipod, ipod->start) < 0) {
         return -1;
     }
 
+    /* Zero blocks can only be skipped if the output file is seekable -
+       when writing to a pipe we write everything. */
+    sparse = (lseek(outfile, 0, SEEK_CUR) >= 0);
+
     fprintf(stderr,"[INFO] Writing %d sectors to output file\n",count);
 
     bytesleft = count * ipod->sector_size;
@@ -314,314 +368,558 @@ int read_partition(struct ipod_t* ipod, int outfile)
             return -1;
         }
 
+        if (manifest != NULL) {
+            manifest_add(manifest, (uint64_t)count * ipod->sector_size - bytesleft,
+                         ipod_sectorbuf, n);
+        }
+
         bytesleft -= n;
 
-        res = write(outfile,ipod_sectorbuf,n);
+        /* Split the chunk into runs of zero and non-zero blocks.  Zero
+           runs become holes in the output file, the rest is written. */
+        i = 0;
+        while (i < n) {
+            runstart = i;
+            blocksize = (n - i < SPARSE_BLOCK_SIZE) ? (n - i) : SPARSE_BLOCK_SIZE;
+            zero = sparse && is_zero_block(ipod_sectorbuf + i, blocksize);
+
+            while (i < n) {
+                blocksize = (n - i < SPARSE_BLOCK_SIZE) ? (n - i) : SPARSE_BLOCK_SIZE;
+                if ((sparse && is_zero_block(ipod_sectorbuf + i, blocksize)) != zero) {
+                    break;
+                }
+                i += blocksize;
+            }
 
-        if (res < 0) {
-            perror("[ERR]  write in disk_read");
-            return -1;
+            if (zero) {
+                if (lseek(outfile, i - runstart, SEEK_CUR) < 0) {
+                    perror("[ERR]  lseek in disk_read");
+                    return -1;
+                }
+                holebytes += i - runstart;
+                outsize += i - runstart;
+                continue;
+            }
+
+            res = write(outfile,ipod_sectorbuf + runstart,i - runstart);
+
+            if (res < 0) {
+                perror("[ERR]  write in disk_read");
+                return -1;
+            }
+
+            if (res != i - runstart) {
+                fprintf(stderr,
+                  "Short write - requested %d, received %d - aborting.\n",
+                  i - runstart,res);
+                return -1;
+            }
+            outsize += res;
         }
+    }
 
-        if (res != n) {
-            fprintf(stderr,
-              "Short write - requested %d, received %d - aborting.\n",(int)n,res);
+    /* If the partition ends with a hole, the file needs extending */
+    if (holebytes > 0) {
+        if (ftruncate(outfile, outsize) < 0) {
+            perror("[ERR]  ftruncate in disk_read");
             return -1;
         }
+        fprintf(stderr,"[INFO] Skipped %lu bytes of zeros (stored as holes)\n",
+                (unsigned long)holebytes);
     }
 
     fprintf(stderr,"[INFO] Done.\n");
     return 0;
 }
 
-int write_partition(struct ipod_t* ipod, int infile)
+int read_partition_compressed(struct ipod_t* ipod, int outfile,
+                              struct manifest_t* manifest)
+{
+    if (backup_create(ipod, outfile, manifest) < 0) {
+        return -1;
+    }
+
+    fprintf(stderr,"[INFO] Done.\n");
+    return 0;
+}
+
+/* Find the next extent of data in "fd" at or after "pos".  Returns the
+   start of the data and sets *dataend to the start of the following hole.
+   Anything in [pos, start) is known to read as zeros.  If the platform or
+   filesystem can't report holes, the whole of [pos, end) is data. */
+static off_t next_data_extent(int fd, off_t pos, off_t end, off_t* dataend)
+{
+    off_t data = pos;
+
+    *dataend = end;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    data = lseek(fd, pos, SEEK_DATA);
+    if (data < 0) {
+        /* ENXIO means there is no more data after pos */
+        if (errno == ENXIO) {
+            return end;
+        }
+        return pos;
+    }
+
+    *dataend = lseek(fd, data, SEEK_HOLE);
+    if ((*dataend < 0) || (*dataend > end)) {
+        *dataend = end;
+    }
+#else
+    (void)fd;
+#endif
+
+    return data;
+}
+
+static int plan_write_partition(struct ipod_t* ipod, int infile)
 {
     ssize_t res;
     int n;
-    int bytesread;
+    int chunksize;
     int byteswritten = 0;
-    int eof;
+    int byteszeroed = 0;
     int padding = 0;
+    off_t pos;
+    off_t end;
+    off_t data;
+    off_t dataend;
+
+    /* Compressed backups are restored by the container code */
+    switch (backup_probe(infile, NULL)) {
+        case 1:
+            return backup_restore(ipod, infile);
+        case -1:
+            return -1;
+    }
 
-    if (ipod_seek(ipod, ipod->start) < 0) {
+    end = filesize(infile);
+    if (end < 0) {
         return -1;
     }
 
     fprintf(stderr,"[INFO] Writing input file to device\n");
-    bytesread = 0;
-    eof = 0;
-    while (!eof) {
-        n = read(infile,ipod_sectorbuf,BUFFER_SIZE);
 
-        if (n < 0) {
-            perror("[ERR]  read in disk_write");
-            return -1;
-        }
+    pos = 0;
+    while (pos < end) {
+        data = next_data_extent(infile, pos, end, &dataend);
 
-        if (n < BUFFER_SIZE) {
-           eof = 1;
-           /* We need to pad the last write to a multiple of SECTOR_SIZE */
-           if ((n % ipod->sector_size) != 0) {
-               padding = (ipod->sector_size-(n % ipod->sector_size));
-               n += padding; 
-           }
+        /* Holes are only sector aligned if the filesystem block size is a
+           multiple of the sector size - round the hole inwards if not. */
+        data -= data % ipod->sector_size;
+        if (dataend < end) {
+            dataend += (ipod->sector_size - dataend % ipod->sector_size) % ipod->sector_size;
         }
 
-        bytesread += n;
-
-        res = ipod_write(ipod, ipod_sectorbuf, n);
+        if (data > pos) {
+            /* A hole in the input file - let the device zero it */
+            if (ipod_zero_range(ipod, (ipod->start + pos) / ipod->sector_size,
+                                (data - pos) / ipod->sector_size) < 0) {
+                ipod_print_error(" Error zeroing disk: ");
+                return -1;
+            }
+            byteszeroed += data - pos;
+        }
 
-        if (res < 0) {
-            ipod_print_error(" Error writing to disk: ");
-            fprintf(stderr,"Bytes written: %d\n",byteswritten);
-            return -1;
+        if (data >= end) {
+            break;
         }
 
-        if (res != n) {
-            fprintf(stderr,"[ERR]  Short write - requested %d, received %d - aborting.\n",n,(int)res);
+        if ((lseek(infile, data, SEEK_SET) < 0) ||
+            (ipod_seek(ipod, ipod->start + data) < 0)) {
             return -1;
         }
 
-        byteswritten += res;
+        pos = data;
+        while (pos < dataend) {
+            if (dataend - pos > BUFFER_SIZE) {
+                chunksize = BUFFER_SIZE;
+            } else {
+                chunksize = dataend - pos;
+            }
+
+            n = read(infile,ipod_sectorbuf,chunksize);
+
+            if (n < 0) {
+                perror("[ERR]  read in disk_write");
+                return -1;
+            }
+
+            if (n < chunksize) {
+                fprintf(stderr,"[ERR]  Short read - requested %d, received %d - aborting.\n",chunksize,n);
+                return -1;
+            }
+
+            pos += n;
+
+            /* We need to pad the last write to a multiple of SECTOR_SIZE */
+            if ((n % ipod->sector_size) != 0) {
+                padding = (ipod->sector_size-(n % ipod->sector_size));
+                memset(ipod_sectorbuf + n, 0, padding);
+                n += padding;
+            }
+
+            res = ipod_write(ipod, ipod_sectorbuf, n);
+
+            if (res < 0) {
+                ipod_print_error(" Error writing to disk: ");
+                fprintf(stderr,"Bytes written: %d\n",byteswritten);
+                return -1;
+            }
+
+            if (res != n) {
+                fprintf(stderr,"[ERR]  Short write - requested %d, received %d - aborting.\n",n,(int)res);
+                return -1;
+            }
+
+            byteswritten += res;
+        }
     }
 
     fprintf(stderr,"[INFO] Wrote %d bytes plus %d bytes padding.\n",
             byteswritten-padding,padding);
+    if (byteszeroed > 0) {
+        fprintf(stderr,"[INFO] Zeroed %d bytes for holes in the input file.\n",
+                byteszeroed);
+    }
     return 0;
 }
 
-char* ftypename[] = { "OSOS", "RSRC", "AUPD", "HIBE", "OSBK" };
+int write_partition(struct ipod_t* ipod, int infile)
+{
+    struct ioplan_t plan;
+
+    ioplan_begin(ipod, &plan);
+    return ioplan_end(ipod, &plan, plan_write_partition(ipod, infile));
+}
+
+/* Differential partition writes: compare -> write only what changed */
+
+struct diffwrite_ctx_t {
+    struct ipod_t* ipod;
+    int infile;
+    struct manifest_t* manifest;
+    off_t bytesleft;
+    int changed;
+    int nchunks;
+};
+
+/* Length of chunk seq of the partition, as hashed in the manifest */
+static int chunk_len(struct diffwrite_ctx_t* d, uint64_t seq)
+{
+    uint64_t left = d->manifest->size - seq * MANIFEST_CHUNK_SIZE;
+
+    return (left > MANIFEST_CHUNK_SIZE) ? MANIFEST_CHUNK_SIZE : (int)left;
+}
 
-int diskmove(struct ipod_t* ipod, int delta)
+static int diffwrite_produce(void* ctx, struct pipeline_slot_t* slot)
 {
-    int src_start;
-    int src_end;
-    int bytesleft;
-    int chunksize;
+    struct diffwrite_ctx_t* d = ctx;
+    struct ipod_t* ipod = d->ipod;
+    uint64_t offset = slot->seq * MANIFEST_CHUNK_SIZE;
     int n;
+    int len;
 
-    src_start = ipod->ipod_directory[1].devOffset;
-    src_end = (ipod->ipod_directory[ipod->nimages-1].devOffset + ipod->sector_size + 
-              ipod->ipod_directory[ipod->nimages-1].len + 
-              (ipod->sector_size-1)) & ~(ipod->sector_size-1);
-    bytesleft = src_end - src_start;
-
-    if (ipod_verbose) {
-        fprintf(stderr,"[INFO] Need to move images 2-%d forward %08x bytes\n", ipod->nimages,delta);
-        fprintf(stderr,"[VERB] src_start     = %08x\n",src_start);
-        fprintf(stderr,"[VERB] src_end       = %08x\n",src_end);
-        fprintf(stderr,"[VERB] dest_start    = %08x\n",src_start+delta);
-        fprintf(stderr,"[VERB] dest_end      = %08x\n",src_end+delta);
-        fprintf(stderr,"[VERB] bytes to copy = %08x\n",bytesleft);
+    if (d->bytesleft == 0) {
+        return 0;
     }
 
-    while (bytesleft > 0) {
-        if (bytesleft <= BUFFER_SIZE) {
-            chunksize = bytesleft;
-        } else {
-            chunksize = BUFFER_SIZE;
-        }
-
-        if (ipod_verbose) {
-            fprintf(stderr,"[VERB] Copying %08x bytes from %08x to %08x (absolute %08x to %08x)\n",
-                           chunksize,
-                           src_end-chunksize,
-                           src_end-chunksize+delta,
-                           (unsigned int)(ipod->start+src_end-chunksize),
-                           (unsigned int)(ipod->start+src_end-chunksize+delta));
-        }
+    len = (d->bytesleft > MANIFEST_CHUNK_SIZE) ? MANIFEST_CHUNK_SIZE : d->bytesleft;
 
+    n = read(d->infile, slot->inbuf, len);
+    if (n != len) {
+        fprintf(stderr,"[ERR]  Short read from input file - requested %d, got %d\n",
+                       len, n);
+        return -1;
+    }
+    d->bytesleft -= n;
 
-        if (ipod_seek(ipod, ipod->start+src_end-chunksize) < 0) {
-            fprintf(stderr,"[ERR]  Seek failed\n");
-            return -1;
-        }
+    /* Pad the last chunk to a whole number of sectors */
+    slot->inlen = (n + ipod->sector_size - 1) & ~(ipod->sector_size - 1);
+    memset(slot->inbuf + n, 0, slot->inlen - n);
 
-        if ((n = ipod_read(ipod,ipod_sectorbuf,chunksize)) < 0) {
-            perror("[ERR]  Write failed\n");
+    /* The manifest hashes whole chunks of the partition, so if the image
+       ends part way through one, hash what will be left after it too */
+    if ((d->manifest != NULL) && (chunk_len(d, slot->seq) > slot->inlen)) {
+        len = chunk_len(d, slot->seq) - slot->inlen;
+        n = ipod_read_at(ipod, slot->inbuf + slot->inlen, len,
+                         ipod->start + offset + slot->inlen);
+        if (n != len) {
+            fprintf(stderr,"[ERR]  Short read from device - requested %d, got %d\n",
+                           len, n);
             return -1;
         }
+    }
 
-        if (n < chunksize) {
-            fprintf(stderr,"[ERR]  Short read - requested %d bytes, received %d\n",
-                           chunksize,n);
+    /* Without a manifest, read back what is on the device now */
+    if (d->manifest == NULL) {
+        n = ipod_read_at(ipod, slot->outbuf, slot->inlen, ipod->start + offset);
+        if (n != slot->inlen) {
+            fprintf(stderr,"[ERR]  Short read from device - requested %d, got %d\n",
+                           slot->inlen, n);
             return -1;
         }
+    }
 
-        if (ipod_seek(ipod, ipod->start+src_end-chunksize+delta) < 0) {
-            fprintf(stderr,"[ERR]  Seek failed\n");
-            return -1;
-        }
+    return 1;
+}
 
-        if ((n = ipod_write(ipod,ipod_sectorbuf,chunksize)) < 0) {
-            perror("[ERR]  Write failed\n");
-            return -1;
-        }
+static int diffwrite_work(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct diffwrite_ctx_t* d = ctx;
+    struct manifest_t* m = d->manifest;
 
-        if (n < chunksize) {
-            fprintf(stderr,"[ERR]  Short write - requested %d bytes, received %d\n"
-                          ,chunksize,n);
-            return -1;
-        }
+    if (m == NULL) {
+        /* We have both copies in memory, so just compare them */
+        slot->flags = (memcmp(slot->inbuf, slot->outbuf, slot->inlen) != 0);
+    } else {
+        slot->hash = manifest_hash(slot->inbuf, chunk_len(d, slot->seq));
+        slot->flags = (slot->hash != m->hashes[slot->seq]);
+    }
 
-        src_end -= chunksize;
-        bytesleft -= chunksize;
+    if (slot->flags && (d->ipod->verify != NULL)) {
+        verify_crcs(d->ipod->sector_size, slot->inbuf, slot->inlen, slot->crcs);
     }
 
     return 0;
 }
 
-static int rename_image(struct ipod_t* ipod, char* from, char* to)
+static int diffwrite_consume(void* ctx, struct pipeline_slot_t* slot)
 {
+    struct diffwrite_ctx_t* d = ctx;
+    struct ipod_t* ipod = d->ipod;
     int n;
-    int x;
-    int found;
-    int i;
-    unsigned char* p;
 
-    /* diroffset may not be sector-aligned */
-    x = ipod->diroffset % ipod->sector_size;
+    d->nchunks++;
 
-    /* Read directory */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { 
-        fprintf(stderr,"[ERR]  Seek to diroffset (%08x) failed.\n",(unsigned)ipod->diroffset);
-        return -1;
+    if (!slot->flags) {
+        return 0;
     }
 
-    n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { 
-        fprintf(stderr,"[ERR]  Read of directory failed.\n");
-        return -1;
+    if (ipod_verbose) {
+        fprintf(stderr,"[VERB] Chunk %d differs - rewriting\n",(int)slot->seq);
     }
 
-    p = ipod_sectorbuf + x;
+    if (ipod->verify != NULL) {
+        verify_expect(ipod->verify, slot->inbuf, slot->crcs, slot->inlen);
+    }
 
-    /* A hack to detect 2nd gen Nanos - maybe there is a better way? */
-    if (p[0] == 0)
-    {
-        /* Adjust diroffset */
-        ipod->diroffset += ipod->sector_size - x;
+    n = ipod_write_at(ipod, slot->inbuf, slot->inlen,
+                      ipod->start + slot->seq * MANIFEST_CHUNK_SIZE);
+    if (n != slot->inlen) {
+        ipod_print_error(" Error writing to disk: ");
+        return -1;
+    }
 
-        n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-        if (n < 0) { 
-            fprintf(stderr,"[ERR]  Read of directory failed.\n");
-            return -1;
-        }
-        p = ipod_sectorbuf;
+    /* The manifest now describes what is on the device */
+    if (d->manifest != NULL) {
+        d->manifest->hashes[slot->seq] = slot->hash;
     }
 
-    found = 0;
-    for (i=0 ; !found && i < MAX_IMAGES; i++) {
-       if (memcmp(p + 4, from, 4) == 0) {
-           memcpy(p + 4, to, 4);
+    d->changed++;
+    return 0;
+}
 
-           found = 1;
-       }
-       p += 40;
-    }
+/* Write the image in infile to the firmware partition, skipping chunks
+   which are already correct.  If manifest is NULL the device is read
+   back and compared, otherwise the image is compared with the hashes
+   in the manifest (saved by an earlier --read-partition), and the
+   hashes of the chunks written are updated so the caller can save it
+   again.  The manifest must describe this ipod - see
+   manifest_check_device(). */
+int write_partition_diff(struct ipod_t* ipod, int infile, struct manifest_t* manifest)
+{
+    struct diffwrite_ctx_t d;
+    struct pipeline_t p;
 
-    if (!found) {
-        fprintf(stderr,"[ERR]  Unexpected error - no \"%s\" image!\n", from);
+    if (backup_probe(infile, NULL) != 0) {
+        fprintf(stderr,"[ERR]  Differential writes of compressed backups are not supported\n");
         return -1;
     }
 
-    /* Write directory back to disk */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { 
-        fprintf(stderr,"[ERR]  Seek to diroffset (%08x) failed.\n",(unsigned)ipod->diroffset);
+    memset(&d, 0, sizeof(d));
+    d.ipod = ipod;
+    d.infile = infile;
+    d.manifest = manifest;
+    d.bytesleft = filesize(infile);
+
+    if (d.bytesleft < 0) {
         return -1;
     }
 
-    n=ipod_write(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { 
-        fprintf(stderr,"[ERR]  Write of directory failed in rename_image.\n");
+    memset(&p, 0, sizeof(p));
+    p.nthreads = pipeline_default_threads();
+    p.inbufsize = MANIFEST_CHUNK_SIZE;
+    p.outbufsize = (manifest == NULL) ? MANIFEST_CHUNK_SIZE : 0;
+    p.ncrcs = MANIFEST_CHUNK_SIZE / ipod->sector_size;
+    p.produce = diffwrite_produce;
+    p.work = diffwrite_work;
+    p.consume = diffwrite_consume;
+    p.ctx = &d;
+
+    fprintf(stderr,"[INFO] Comparing input file with %s\n",
+                   (manifest == NULL) ? "device contents" : "manifest");
+
+    if (pipeline_run(&p) < 0) {
         return -1;
     }
 
+    fprintf(stderr,"[INFO] Rewrote %d of %d chunks (%d bytes each).\n",
+                   d.changed, d.nchunks, MANIFEST_CHUNK_SIZE);
     return 0;
 }
 
-static int delete_image(struct ipod_t* ipod, char* name)
+/* Streaming partition writes - the input is read from a pipe (or any
+   other non-seekable file) in chunks while earlier chunks are written */
+
+#define STREAM_CHUNK_SIZE (1024*1024)
+
+struct streamwrite_ctx_t {
+    struct ipod_t* ipod;
+    int infile;
+    uint64_t size;        /* Declared size of the stream, or 0 if unknown */
+    uint64_t maxsize;     /* Size of the partition */
+    uint64_t bytesread;
+    uint64_t byteswritten;
+};
+
+static int streamwrite_produce(void* ctx, struct pipeline_slot_t* slot)
 {
+    struct streamwrite_ctx_t* s = ctx;
+    struct ipod_t* ipod = s->ipod;
+    uint64_t limit = s->size ? s->size : s->maxsize;
+    int len = STREAM_CHUNK_SIZE;
+    unsigned char c;
     int n;
-    int x;
-    int found;
-    int i;
-    unsigned char* p;
 
-    /* diroffset may not be sector-aligned */
-    x = ipod->diroffset % ipod->sector_size;
+    if (s->bytesread == limit) {
+        if ((s->size == 0) && (read_full(s->infile, &c, 1) == 1)) {
+            fprintf(stderr,"[ERR]  Input is larger than the firmware partition, aborting.\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (limit - s->bytesread < (uint64_t)len) {
+        len = limit - s->bytesread;
+    }
 
-    /* Read directory */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { 
-        fprintf(stderr,"[ERR]  Seek to diroffset (%08x) failed.\n",(unsigned)ipod->diroffset);
+    n = read_full(s->infile, slot->inbuf, len);
+    if (n < 0) {
+        perror("[ERR]  read in streamwrite");
         return -1;
     }
 
-    n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { 
-        fprintf(stderr,"[ERR]  Read of directory failed.\n");
+    if (n < len) {
+        if (s->size != 0) {
+            fprintf(stderr,"[ERR]  Input ended after %" PRIu64 " of %" PRIu64 " bytes - aborting.\n",
+                           s->bytesread + n, s->size);
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+    }
+
+    /* Compressed backups can't be restored without seeking to their index */
+    if ((s->bytesread == 0) && (n >= 4) && (memcmp(slot->inbuf, "IPBK", 4) == 0)) {
+        fprintf(stderr,"[ERR]  Compressed backups can't be restored from standard input\n");
         return -1;
     }
 
-    p = ipod_sectorbuf + x;
+    slot->hash = s->bytesread;
+    s->bytesread += n;
 
-    /* A hack to detect 2nd gen Nanos - maybe there is a better way? */
-    if (p[0] == 0)
-    {
-        /* Adjust diroffset */
-        ipod->diroffset += ipod->sector_size - x;
+    /* Pad the last chunk to a whole number of sectors */
+    slot->inlen = (n + ipod->sector_size - 1) & ~(ipod->sector_size - 1);
+    memset(slot->inbuf + n, 0, slot->inlen - n);
 
-        n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-        if (n < 0) { 
-            fprintf(stderr,"[ERR]  Read of directory failed.\n");
-            return -1;
-        }
-        p = ipod_sectorbuf;
-    }
+    return 1;
+}
+
+static int streamwrite_consume(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct streamwrite_ctx_t* s = ctx;
+    struct ipod_t* ipod = s->ipod;
+    int n;
 
-    found = 0;
-    for (i=0 ; !found && i < MAX_IMAGES; i++) {
-       if (memcmp(p + 4, name, 4) == 0) {
-           memset(p, 0, 40);  /* Delete directory entry */
-           found = 1;
-       }
-       p += 40;
+    n = ipod_write_at(ipod, slot->inbuf, slot->inlen, ipod->start + slot->hash);
+    if (n < 0) {
+        ipod_print_error(" Error writing to disk: ");
+        fprintf(stderr,"Bytes written: %" PRIu64 "\n",s->byteswritten);
+        return -1;
     }
 
-    if (!found) {
-        fprintf(stderr,"[ERR]  Unexpected error - no \"%s\" image!\n", name);
+    if (n != slot->inlen) {
+        fprintf(stderr,"[ERR]  Short write - requested %d, received %d - aborting.\n",
+                       slot->inlen, n);
         return -1;
     }
 
-    /* Write directory back to disk */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { 
-        fprintf(stderr,"[ERR]  Seek to diroffset (%08x) failed.\n",(unsigned)ipod->diroffset);
+    s->byteswritten += n;
+    return 0;
+}
+
+/* Write an image read from a non-seekable input (e.g. stdin) to the
+   firmware partition.  If size is non-zero exactly that many bytes are
+   expected, otherwise the input is read until EOF.  Either way, nothing
+   is written beyond the end of the partition. */
+int write_partition_stream(struct ipod_t* ipod, int infile, uint64_t size)
+{
+    struct streamwrite_ctx_t s;
+    struct pipeline_t p;
+
+    memset(&s, 0, sizeof(s));
+    s.ipod = ipod;
+    s.infile = infile;
+    s.size = size;
+    s.maxsize = (uint64_t)ipod->pinfo[0].size * ipod->sector_size;
+
+    if (size > s.maxsize) {
+        fprintf(stderr,"[ERR]  Input is larger than the firmware partition, aborting.\n");
         return -1;
     }
 
-    n=ipod_write(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { 
-        fprintf(stderr,"[ERR]  Write of directory failed in delete_image.\n");
+    /* Two buffers - one being filled from the input while the other is
+       written to the device */
+    memset(&p, 0, sizeof(p));
+    p.nthreads = 0;
+    p.nslots = 2;
+    p.inbufsize = STREAM_CHUNK_SIZE;
+    p.produce = streamwrite_produce;
+    p.consume = streamwrite_consume;
+    p.ctx = &s;
+
+    fprintf(stderr,"[INFO] Writing input stream to device\n");
+
+    if (pipeline_run(&p) < 0) {
         return -1;
     }
 
+    fprintf(stderr,"[INFO] Wrote %" PRIu64 " bytes plus %" PRIu64 " bytes padding.\n",
+                   s.bytesread, s.byteswritten - s.bytesread);
     return 0;
 }
 
-int add_new_image(struct ipod_t* ipod, char* imagename, char* filename, int type)
+char* ftypename[] = { "OSOS", "RSRC", "AUPD", "HIBE", "OSBK" };
+
+/* Write the image in filename after the last image in the partition and
+   add a directory entry for it to dir */
+static int add_new_image(struct ipod_t* ipod, struct fwdir_t* dir, char* imagename,
+                         char* filename, int type)
 {
     int length;
-    int found;
     int i;
-    int x;
     int n;
     int infile;
     int newsize;
     unsigned long chksum=0;
     unsigned long filechksum=0;
     unsigned long offset;
+    uint32_t devOffset;
     unsigned char header[8];  /* Header for .ipod file */
-    unsigned char* p;
 
 #ifdef WITH_BOOTOBJS
     if (type == FILETYPE_INTERNAL) {
@@ -673,7 +971,10 @@ int add_new_image(struct ipod_t* ipod, char* imagename, char* filename, int type
         return -1;
     }
 
-    /* TODO: Check if we have enough space in the partition for the new image */
+    if (compact_find_space(dir, length - (ipod->modelnum==62 ? 0x800: 0), &devOffset) < 0) {
+        if (infile >= 0) close(infile);
+        return -1;
+    }
 
 #ifdef WITH_BOOTOBJS
     if (type == FILETYPE_INTERNAL) {
@@ -712,8 +1013,7 @@ int add_new_image(struct ipod_t* ipod, char* imagename, char* filename, int type
     }
 
 
-    offset = ipod->fwoffset + ipod->ipod_directory[ipod->nimages - 1].devOffset +
-             ipod->ipod_directory[ipod->nimages - 1].len + ipod->sector_size;
+    offset = ipod->fwoffset + devOffset;
 
     /* 2nd Gen Nano has encrypted firmware, and the sector
        preceeding the firmware contains hashes that need to be
@@ -751,46 +1051,25 @@ int add_new_image(struct ipod_t* ipod, char* imagename, char* filename, int type
          chksum += ipod_sectorbuf[i];
     }
 
-    x = ipod->diroffset % ipod->sector_size;
-
-    /* Read directory */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { return -1; }
-
-    n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { return -1; }
-
-    /* Create a new directory entry */
-
     /* Copy OSOS or OSBK details - we assume one of them exists */
-    p = ipod_sectorbuf + x;
-    found = 0;
-    for (i = 0; !found && i < ipod->nimages; i++) {
-        if ((memcmp(p + 4, "soso", 4)==0) || (memcmp(p + 4, "kbso", 4)==0)) {
-            found = 1;
-        } else {
-            p += 40;
-        }
+    i = fwdir_find(dir, "soso");
+    if (i < 0) {
+        i = fwdir_find(dir, "kbso");
     }
 
-    if (!found) {
+    if (i < 0) {
         fprintf(stderr,"[ERR]  No OSOS or OSBK image to copy directory from\n");
         return -1;
     }
 
-    /* Copy directory image */
-    memcpy(ipod_sectorbuf + x + (ipod->nimages * 40), p, 40);
-    p = ipod_sectorbuf + x + (ipod->nimages * 40);
-
-    /* Modify directory. */
-    memcpy(p + 4, imagename, 4);
-    int2le(offset - ipod->fwoffset, p + 12);                     /* devOffset */
-    int2le(length - (ipod->modelnum==62 ? 0x800: 0), p + 16);    /* len */
-    int2le(chksum, p + 28);                                      /* checksum */
+    i = fwdir_add(dir, imagename, i);
+    if (i < 0) {
+        return -1;
+    }
 
-    /* Write directory */    
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { return -1; }
-    n=ipod_write(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { return -1; }
+    fwdir_set(dir, i, FWDIR_DEVOFFSET, offset - ipod->fwoffset);
+    fwdir_set(dir, i, FWDIR_LEN, length - (ipod->modelnum==62 ? 0x800: 0));
+    fwdir_set(dir, i, FWDIR_CHKSUM, chksum);
 
     return 0;
 }
@@ -812,6 +1091,7 @@ static int add_bootloader_nano2g(struct ipod_t* ipod, char* filename, int type)
 {
     int i;
     int has_osbk = 0;
+    struct fwdir_t dir;
 
     /* Check if we already have an OSBK image */
     for (i = 0; i < ipod->nimages; i++) {
@@ -824,13 +1104,24 @@ static int add_bootloader_nano2g(struct ipod_t* ipod, char* filename, int type)
         /* First-time install - rename OSOS to OSBK and create new OSOS for bootloader */
         fprintf(stderr,"[INFO] Creating OSBK backup image of original firmware\n");
 
-        if  (rename_image(ipod, "soso", "kbso") < 0) {
+        if (fwdir_load(ipod, &dir) < 0) {
+            return -1;
+        }
+
+        if (fwdir_rename(&dir, "soso", "kbso") < 0) {
             fprintf(stderr,"[ERR]  Could not rename OSOS image\n");
+            fwdir_free(&dir);
             return -1;
         }
 
         /* Add our bootloader as a brand new image */
-        return add_new_image(ipod, "soso", filename, type);
+        if (add_new_image(ipod, &dir, "soso", filename, type) < 0) {
+            fwdir_free(&dir);
+            return -1;
+        }
+
+        /* Both changes reach the disk together, or not at all */
+        return fwdir_commit(&dir);
     } else {
         /* This is an update, just replace OSOS with our bootloader */
 
@@ -843,6 +1134,7 @@ static int delete_bootloader_nano2g(struct ipod_t* ipod)
 {
     int i;
     int has_osbk = 0;
+    struct fwdir_t dir;
 
     /* Check if we have an OSBK image */
     for (i = 0; i < ipod->nimages; i++) {
@@ -855,15 +1147,24 @@ static int delete_bootloader_nano2g(struct ipod_t* ipod)
         fprintf(stderr,"[ERR]  No OSBK image found - nothing to uninstall\n");
         return -1;
     } else {
+        if (fwdir_load(ipod, &dir) < 0) {
+            return -1;
+        }
+
         /* Delete our bootloader image */
-        if (delete_image(ipod, "soso") < 0) {
+        if (fwdir_delete(&dir, "soso") < 0) {
             fprintf(stderr,"[WARN] Could not delete OSOS image\n");
         } else {
             fprintf(stderr,"[INFO] OSOS image deleted\n");
         }
 
-        if  (rename_image(ipod, "kbso", "soso") < 0) {
+        if (fwdir_rename(&dir, "kbso", "soso") < 0) {
             fprintf(stderr,"[ERR]  Could not rename OSBK image\n");
+            fwdir_free(&dir);
+            return -1;
+        }
+
+        if (fwdir_commit(&dir) < 0) {
             return -1;
         }
 
@@ -874,20 +1175,21 @@ static int delete_bootloader_nano2g(struct ipod_t* ipod)
 }
 
 
-int add_bootloader(struct ipod_t* ipod, char* filename, int type)
+static int plan_add_bootloader(struct ipod_t* ipod, char* filename, int type)
 {
     int length;
     int i;
-    int x;
     int n;
     int infile;
     int paddedlength;
     int entryOffset;
-    int delta = 0;
+    uint32_t devOffset;
     unsigned long chksum=0;
     unsigned long filechksum=0;
     unsigned char header[8];  /* Header for .ipod file */
     unsigned char* bootloader_buf;
+    struct fwdir_t dir;
+    struct compact_plan_t plan;
 
     /* The 2nd gen Nano is installed differently */
     if (ipod->modelnum == 62) {
@@ -984,40 +1286,50 @@ int add_bootloader(struct ipod_t* ipod, char* filename, int type)
         fprintf(stderr,"[VERB] End of bootloader will be at 0x%08x\n",entryOffset+paddedlength);
     }
 
-    /* Check if we have enough space */
-    /* TODO: Check the size of the partition. */
-    if (ipod->nimages > 1) {
-        if ((ipod->ipod_directory[0].devOffset+entryOffset+paddedlength) >
-             ipod->ipod_directory[1].devOffset) {
-            fprintf(stderr,"[INFO] Moving images to create room for new firmware...\n");
-            delta = ipod->ipod_directory[0].devOffset + entryOffset+paddedlength
-                    - ipod->ipod_directory[1].devOffset + ipod->sector_size;
+    /* Check if we have enough space, moving images if we need to.  The
+       original firmware moves with image 0 if that's the cheapest way. */
+    if (fwdir_load(ipod, &dir) < 0) {
+        return -1;
+    }
 
-            if (diskmove(ipod, delta) < 0) {
-                fprintf(stderr,"[ERR]  Image movement failed.\n");
-                return -1;
-            }
-        }
+    if (compact_plan(&dir, 0, entryOffset+paddedlength, entryOffset, &plan) < 0) {
+        fwdir_free(&dir);
+        return -1;
+    }
+
+    if (plan.nmoves > 0) {
+        fprintf(stderr,"[INFO] Moving images to create room for new firmware...\n");
+        compact_print(&dir, &plan);
     }
 
+    if (compact_apply(&dir, &plan) < 0) {
+        fprintf(stderr,"[ERR]  Image movement failed.\n");
+        fwdir_free(&dir);
+        return -1;
+    }
+
+    devOffset = fwdir_get(&dir, 0, FWDIR_DEVOFFSET);
 
     /* We have moved the partitions, now we can write our bootloader */
 
     /* Firstly read the original firmware into ipod_sectorbuf */
     fprintf(stderr,"[INFO] Reading original firmware...\n");
-    if (ipod_seek(ipod, ipod->fwoffset+ipod->ipod_directory[0].devOffset) < 0) {
+    if (ipod_seek(ipod, ipod->fwoffset+devOffset) < 0) {
         fprintf(stderr,"[ERR]  Seek failed\n");
+        fwdir_free(&dir);
         return -1;
     }
 
     if ((n = ipod_read(ipod,ipod_sectorbuf,entryOffset)) < 0) {
         perror("[ERR]  Read failed\n");
+        fwdir_free(&dir);
         return -1;
     }
 
     if (n < entryOffset) {
         fprintf(stderr,"[ERR]  Short read - requested %d bytes, received %d\n"
                       ,entryOffset,n);
+        fwdir_free(&dir);
         return -1;
     }
 
@@ -1040,72 +1352,51 @@ int add_bootloader(struct ipod_t* ipod, char* filename, int type)
 
     /* Now write the combined firmware image to the disk */
 
-    if (ipod_seek(ipod, ipod->fwoffset+ipod->ipod_directory[0].devOffset) < 0) {
+    if (ipod_seek(ipod, ipod->fwoffset+devOffset) < 0) {
         fprintf(stderr,"[ERR]  Seek failed\n");
+        fwdir_free(&dir);
         return -1;
     }
 
     if ((n = ipod_write(ipod,ipod_sectorbuf,entryOffset+paddedlength)) < 0) {
         perror("[ERR]  Write failed\n");
+        fwdir_free(&dir);
         return -1;
     }
 
     if (n < (entryOffset+paddedlength)) {
         fprintf(stderr,"[ERR]  Short read - requested %d bytes, received %d\n"
                       ,entryOffset+paddedlength,n);
+        fwdir_free(&dir);
         return -1;
     }
 
     fprintf(stderr,"[INFO]  Wrote %d bytes to firmware partition\n",entryOffset+paddedlength);
 
-    x = ipod->diroffset % ipod->sector_size;
-
-    /* Read directory */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { 
-        fprintf(stderr,"[ERR]  Seek failed\n");
-        return -1;
-    }
+    /* Update entries for image 0 */
+    fwdir_set(&dir, 0, FWDIR_LEN, entryOffset+length);
+    fwdir_set(&dir, 0, FWDIR_ENTRYOFFSET, entryOffset);
+    fwdir_set(&dir, 0, FWDIR_CHKSUM, chksum);
+    fwdir_set(&dir, 0, FWDIR_LOADADDR, 0xffffffff);
 
-    n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) {
-        fprintf(stderr,"[ERR]  Directory read failed\n");
-        return -1;
-    }
+    return fwdir_commit(&dir);
+}
 
-    /* Update entries for image 0 */
-    int2le(entryOffset+length,ipod_sectorbuf+x+16);
-    int2le(entryOffset,ipod_sectorbuf+x+24);
-    int2le(chksum,ipod_sectorbuf+x+28);
-    int2le(0xffffffff,ipod_sectorbuf+x+36);  /* loadAddr */
+int add_bootloader(struct ipod_t* ipod, char* filename, int type)
+{
+    struct ioplan_t plan;
 
-    /* Update devOffset entries for other images, if we have moved them */
-    if (delta > 0) {
-        for (i=1;i<ipod->nimages;i++) {
-           int2le(le2int(ipod_sectorbuf+x+i*40+12)+delta,ipod_sectorbuf+x+i*40+12);
-        }
-    }
+    ioplan_begin(ipod, &plan);
+    return ioplan_end(ipod, &plan, plan_add_bootloader(ipod, filename, type));
+}
 
-    /* Write directory */    
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { 
-        fprintf(stderr,"[ERR]  Seek to %d failed\n", (int)(ipod->start+ipod->diroffset-x));
-        return -1;
-    }
-    n=ipod_write(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { 
-        fprintf(stderr,"[ERR]  Directory write failed\n");
-        return -1;
-    }
-
-    return 0;
-}
-
-int delete_bootloader(struct ipod_t* ipod)
+static int plan_delete_bootloader(struct ipod_t* ipod)
 {
     int length;
     int i;
-    int x;
     int n;
     unsigned long chksum=0;   /* 32 bit checksum - Rockbox .ipod style*/
+    struct fwdir_t dir;
 
     /* The 2nd gen Nano is installed differently */
     if (ipod->modelnum == 62) {
@@ -1156,41 +1447,40 @@ int delete_bootloader(struct ipod_t* ipod)
 
     fprintf(stderr,"[INFO] Updating firmware checksum\n");
 
-    x = ipod->diroffset % ipod->sector_size;
-
-    /* Read directory */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { return -1; }
-
-    n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { return -1; }
+    if (fwdir_load(ipod, &dir) < 0) {
+        return -1;
+    }
 
     /* Update entries for image 0 */
-    int2le(length,ipod_sectorbuf+x+16);
-    int2le(0,ipod_sectorbuf+x+24);
-    int2le(chksum,ipod_sectorbuf+x+28);
+    fwdir_set(&dir, 0, FWDIR_LEN, length);
+    fwdir_set(&dir, 0, FWDIR_ENTRYOFFSET, 0);
+    fwdir_set(&dir, 0, FWDIR_CHKSUM, chksum);
 
-    /* Write directory */    
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { return -1; }
-    n=ipod_write(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { return -1; }
+    return fwdir_commit(&dir);
+}
 
-    return 0;
+int delete_bootloader(struct ipod_t* ipod)
+{
+    struct ioplan_t plan;
+
+    ioplan_begin(ipod, &plan);
+    return ioplan_end(ipod, &plan, plan_delete_bootloader(ipod));
 }
 
-int write_firmware(struct ipod_t* ipod, char* filename, int type)
+static int plan_write_firmware(struct ipod_t* ipod, char* filename, int type)
 {
     int length;
     int i;
-    int x;
     int n;
     int infile;
     int newsize;
-    int bytesavailable;
+    int fromstdin = 0;
     unsigned long chksum=0;
     unsigned long filechksum=0;
     unsigned long offset;
     unsigned char header[8];  /* Header for .ipod file */
-    unsigned char* p;
+    struct fwdir_t dir;
+    struct compact_plan_t plan;
 
 #ifdef WITH_BOOTOBJS
     if (type == FILETYPE_INTERNAL) {
@@ -1202,14 +1492,19 @@ int write_firmware(struct ipod_t* ipod, char* filename, int type)
 #endif
     {
         /* First check that the input file is the correct type for this ipod. */
-        infile=open(filename,O_RDONLY);
+        if (strcmp(filename,"-")==0) {
+            infile = dup(STDIN_FILENO);
+            fromstdin = 1;
+        } else {
+            infile=open(filename,O_RDONLY);
+        }
         if (infile < 0) {
             fprintf(stderr,"[ERR]  Couldn't open input file %s\n",filename);
             return -1;
         }
     
         if (type==FILETYPE_DOT_IPOD) {
-            n = read(infile,header,8);
+            n = read_full(infile,header,8);
             if (n < 8) {
                 fprintf(stderr,"[ERR]  Failed to read header from %s\n",filename);
                 close(infile);
@@ -1224,7 +1519,24 @@ int write_firmware(struct ipod_t* ipod, char* filename, int type)
             }
     
             filechksum = be2int(header);
-    
+        }
+
+        if (fromstdin) {
+            /* We can't stat a pipe, so read it all now - it has to be
+               checked before we overwrite the current firmware anyway. */
+            fprintf(stderr,"[INFO] Reading firmware from standard input...\n");
+            length = read_full(infile,ipod_sectorbuf,BUFFER_SIZE);
+            if ((length == BUFFER_SIZE) && (read_full(infile,header,1) == 1)) {
+                fprintf(stderr,"[ERR]  Input file too big for buffer\n");
+                close(infile);
+                return -1;
+            }
+            if (length <= 0) {
+                fprintf(stderr,"[ERR]  Couldn't read input file\n");
+                close(infile);
+                return -1;
+            }
+        } else if (type==FILETYPE_DOT_IPOD) {
             length = filesize(infile)-8;
         } else {
             length = filesize(infile);
@@ -1242,18 +1554,18 @@ int write_firmware(struct ipod_t* ipod, char* filename, int type)
         return -1;
     }
 
-    /* Check if we have enough space */
-    /* TODO: Check the size of the partition. */
-    if (ipod->nimages > 1) {
-        bytesavailable=ipod->ipod_directory[1].devOffset-ipod->ipod_directory[0].devOffset;
-        if (bytesavailable < newsize) {
-            fprintf(stderr,"[INFO] Moving images to create room for new firmware...\n");
+    /* Check if we have enough space, and work out which images to move
+       if not.  Nothing is moved until we know the new image is good. */
+    if (fwdir_load(ipod, &dir) < 0) {
+        if (infile >= 0) close(infile);
+        return -1;
+    }
 
-            /* TODO: Implement image movement */
-            fprintf(stderr,"[ERR]  Image movement not yet implemented.\n");
-            close(infile);
-            return -1;
-        }
+    if (compact_plan(&dir, ipod->ososimage, length - (ipod->modelnum==62 ? 0x800: 0),
+                     0, &plan) < 0) {
+        fwdir_free(&dir);
+        if (infile >= 0) close(infile);
+        return -1;
     }
 
 #ifdef WITH_BOOTOBJS
@@ -1262,13 +1574,16 @@ int write_firmware(struct ipod_t* ipod, char* filename, int type)
     } 
     else
 #endif
-    {
+    if (fromstdin) {
+        close(infile);
+    } else {
         fprintf(stderr,"[INFO] Reading input file...\n");
         /* We now know we have enough space, so write it. */
         n = read(infile,ipod_sectorbuf,length);
         if (n < 0) {
             fprintf(stderr,"[ERR]  Couldn't read input file\n");
             close(infile);
+            fwdir_free(&dir);
             return -1;
         }
         close(infile);
@@ -1288,12 +1603,22 @@ int write_firmware(struct ipod_t* ipod, char* filename, int type)
             fprintf(stderr,"[INFO] Checksum OK in %s\n",filename);
         } else {
             fprintf(stderr,"[ERR]  Checksum in %s failed check\n",filename);
+            fwdir_free(&dir);
             return -1;
         }
     }
 
+    if (plan.nmoves > 0) {
+        fprintf(stderr,"[INFO] Moving images to create room for new firmware...\n");
+        compact_print(&dir, &plan);
+    }
 
-    offset = ipod->fwoffset+ipod->ipod_directory[ipod->ososimage].devOffset;
+    if (compact_apply(&dir, &plan) < 0) {
+        fwdir_free(&dir);
+        return -1;
+    }
+
+    offset = ipod->fwoffset+fwdir_get(&dir, ipod->ososimage, FWDIR_DEVOFFSET);
 
     if (ipod->modelnum==62) {
 
@@ -1304,23 +1629,24 @@ int write_firmware(struct ipod_t* ipod, char* filename, int type)
         */
 
         offset -= 0x800;
-
-       /* TODO: The above checks need to take into account this 0x800 bytes */
     }
 
     if (ipod_seek(ipod, offset) < 0) {
         fprintf(stderr,"[ERR]  Seek failed\n");
+        fwdir_free(&dir);
         return -1;
     }
 
     if ((n = ipod_write(ipod,ipod_sectorbuf,newsize)) < 0) {
         perror("[ERR]  Write failed\n");
+        fwdir_free(&dir);
         return -1;
     }
 
     if (n < newsize) {
         fprintf(stderr,"[ERR]  Short write - requested %d bytes, received %d\n"
                       ,newsize,n);
+        fwdir_free(&dir);
         return -1;
     }
     fprintf(stderr,"[INFO]  Wrote %d bytes to firmware partition\n",n);
@@ -1339,26 +1665,20 @@ int write_firmware(struct ipod_t* ipod, char* filename, int type)
          chksum += ipod_sectorbuf[i];
     }
 
-    x = ipod->diroffset % ipod->sector_size;
-
-    /* Read directory */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { return -1; }
-
-    n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { return -1; }
-
     /* Update entries for image */
-    p = ipod_sectorbuf + x + (ipod->ososimage * 40);    
-    int2le(length - (ipod->modelnum==62 ? 0x800: 0), p + 16);
-    int2le(0, p + 24);
-    int2le(chksum, p + 28);
+    fwdir_set(&dir, ipod->ososimage, FWDIR_LEN, length - (ipod->modelnum==62 ? 0x800: 0));
+    fwdir_set(&dir, ipod->ososimage, FWDIR_ENTRYOFFSET, 0);
+    fwdir_set(&dir, ipod->ososimage, FWDIR_CHKSUM, chksum);
 
-    /* Write directory */    
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { return -1; }
-    n=ipod_write(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { return -1; }
+    return fwdir_commit(&dir);
+}
 
-    return 0;
+int write_firmware(struct ipod_t* ipod, char* filename, int type)
+{
+    struct ioplan_t plan;
+
+    ioplan_begin(ipod, &plan);
+    return ioplan_end(ipod, &plan, plan_write_firmware(ipod, filename, type));
 }
 
 int read_firmware(struct ipod_t* ipod, char* filename, int type)
@@ -1438,134 +1758,104 @@ int read_firmware(struct ipod_t* ipod, char* filename, int type)
     return 0;
 }
 
-int read_directory(struct ipod_t* ipod)
+/* Read and check the firmware partition header (first 512 bytes of the
+   partition - but let's read a whole sector) and return the offset of
+   the directory it gives, before the 2nd gen Nano adjustment in
+   read_directory().  Returns the firmware format version, or -1 on
+   error.  Silent unless verbose is set. */
+int read_fw_header(struct ipod_t* ipod, off_t* diroffset, int verbose)
 {
     int n;
-    int x;
-    unsigned char* p;
     unsigned short version;
 
-    ipod->nimages=0;
-
-    /* Read firmware partition header (first 512 bytes of disk - but 
-       let's read a whole sector) */
-
     if (ipod_seek(ipod, ipod->start) < 0) { 
-        fprintf(stderr,"[ERR]  Seek to 0x%08x in read_directory() failed.\n",
-                       (unsigned int)(ipod->start));
+        if (verbose) {
+            fprintf(stderr,"[ERR]  Seek to 0x%08x in read_fw_header() failed.\n",
+                           (unsigned int)(ipod->start));
+        }
         return -1;
     }
 
     n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
     if (n < 0) { 
-        fprintf(stderr,"[ERR]  ipod_read(ipod,buf,0x%08x) failed in read_directory()\n", ipod->sector_size);
+        if (verbose) {
+            fprintf(stderr,"[ERR]  ipod_read(ipod,buf,0x%08x) failed in read_fw_header()\n", ipod->sector_size);
+        }
         return -1;
     }
 
     if (memcmp(ipod_sectorbuf,apple_stop_sign,sizeof(apple_stop_sign))!=0) {
-        fprintf(stderr,"[ERR]  Firmware partition doesn't contain Apple copyright, aborting.\n");
+        if (verbose) {
+            fprintf(stderr,"[ERR]  Firmware partition doesn't contain Apple copyright, aborting.\n");
+        }
         return -1;
     }
 
     if (memcmp(ipod_sectorbuf+0x100,"]ih[",4)!=0) {
-        fprintf(stderr,"[ERR]  Bad firmware directory\n");
+        if (verbose) {
+            fprintf(stderr,"[ERR]  Bad firmware directory\n");
+        }
         return -1;
     }
 
     version = le2ushort(ipod_sectorbuf+0x10a);
-    if ((version != 2) && (version != 3)) {
+    if (verbose && (version != 2) && (version != 3)) {
         fprintf(stderr,"[ERR]  Unknown firmware format version %04x\n",
                 version);
     }
-    ipod->diroffset=le2int(ipod_sectorbuf+0x104) + 0x200;
+    *diroffset=le2int(ipod_sectorbuf+0x104) + 0x200;
 
-    /* diroffset may not be sector-aligned */
-    x = ipod->diroffset % ipod->sector_size;
+    return version;
+}
+
+int read_directory(struct ipod_t* ipod)
+{
+    int x;
+    int version;
+    struct fwdir_t dir;
 
-    /* Read directory */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { 
-        fprintf(stderr,"[ERR]  Seek to diroffset (%08x) failed.\n",(unsigned)ipod->diroffset);
+    ipod->nimages=0;
+
+    version = read_fw_header(ipod, &ipod->diroffset, 1);
+    if (version < 0) {
         return -1;
     }
 
-    n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { 
-        fprintf(stderr,"[ERR]  Read of directory failed.\n");
+    if (fwdir_load(ipod, &dir) < 0) {
         return -1;
     }
 
-    p = ipod_sectorbuf + x;
+    /* A hack to detect 2nd gen Nanos - maybe there is a better way?  The
+       directory starts in the next sector. */
+    if (dir.entries[0] == 0) {
+        fwdir_free(&dir);
 
-    /* A hack to detect 2nd gen Nanos - maybe there is a better way? */
-    if (p[0] == 0)
-    {
-        /* Adjust diroffset */
+        /* Adjust diroffset - diroffset may not be sector-aligned */
+        x = ipod->diroffset % ipod->sector_size;
         ipod->diroffset += ipod->sector_size - x;
 
-        n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-        if (n < 0) { 
-            fprintf(stderr,"[ERR]  Read of directory failed.\n");
+        if (fwdir_load(ipod, &dir) < 0) {
             return -1;
         }
-        p = ipod_sectorbuf;
-    }
-
-    ipod->ososimage = -1;
-    while ((ipod->nimages < MAX_IMAGES) && (p < (ipod_sectorbuf + x + 400)) && 
-           ((memcmp(p,"!ATA",4)==0) || (memcmp(p,"DNAN",4)==0))) {
-        p+=4;
-        if (memcmp(p,"soso",4)==0) {
-            ipod->ipod_directory[ipod->nimages].ftype=FTYPE_OSOS;
-            ipod->ososimage = ipod->nimages;
-        } else if (memcmp(p,"crsr",4)==0) {
-            ipod->ipod_directory[ipod->nimages].ftype=FTYPE_RSRC;
-        } else if (memcmp(p,"dpua",4)==0) {
-            ipod->ipod_directory[ipod->nimages].ftype=FTYPE_AUPD;
-        } else if (memcmp(p,"kbso",4)==0) {
-            ipod->ipod_directory[ipod->nimages].ftype=FTYPE_OSBK;
-        } else if (memcmp(p,"ebih",4)==0) {
-            ipod->ipod_directory[ipod->nimages].ftype=FTYPE_HIBE;
-        } else {
-            fprintf(stderr,"[ERR]  Unknown image type %c%c%c%c\n",
-                           p[0],p[1],p[2],p[3]);
-        }
-        p+=4;
-        ipod->ipod_directory[ipod->nimages].id=le2int(p);
-        p+=4;
-        ipod->ipod_directory[ipod->nimages].devOffset=le2int(p);
-        p+=4;
-        ipod->ipod_directory[ipod->nimages].len=le2int(p);
-        p+=4;
-        ipod->ipod_directory[ipod->nimages].addr=le2int(p);
-        p+=4;
-        ipod->ipod_directory[ipod->nimages].entryOffset=le2int(p);
-        p+=4;
-        ipod->ipod_directory[ipod->nimages].chksum=le2int(p);
-        p+=4;
-        ipod->ipod_directory[ipod->nimages].vers=le2int(p);
-        p+=4;
-        ipod->ipod_directory[ipod->nimages].loadAddr=le2int(p);
-        p+=4;
-        ipod->nimages++;
     }
 
-    if (ipod->ososimage < 0) {
-        fprintf(stderr,"[ERR]  No OSOS image found.\n");
-        return -1;
-    }
-
-    if ((ipod->nimages > 1) && (version==2)) {
-        /* The 3g firmware image doesn't appear to have a version, so
-           let's make one up... Note that this is never written back to the
-           ipod, so it's OK to do. */
-
-        if (ipod->ipod_directory[ipod->ososimage].vers == 0) { ipod->ipod_directory[ipod->ososimage].vers = 3; }
-
+    /* The 3g firmware images are relative to the start of the partition,
+       not to the sector after it.  fwdir_parse() uses this to spot 3g
+       firmware and make up the version number it doesn't have. */
+    if ((dir.nentries > 1) && (version==2)) {
         ipod->fwoffset = ipod->start;
     } else {
         ipod->fwoffset = ipod->start + ipod->sector_size;
     }
 
+    fwdir_parse(&dir);
+    fwdir_free(&dir);
+
+    if (ipod->ososimage < 0) {
+        fprintf(stderr,"[ERR]  No OSOS image found.\n");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -1735,6 +2025,8 @@ int ipod_scan(struct ipod_t* ipod)
     struct ipod_t ipod_found;
     int denied = 0;
     int result;
+    int cached;
+    int save;
 
     printf("[INFO] Scanning disk devices...\n");
 
@@ -1769,25 +2061,36 @@ int ipod_scan(struct ipod_t* ipod)
              continue;
          }
 
-         if (read_directory(ipod) < 0) {
-             ipod_close(ipod);
-             continue;
-         }
-
-         ipod_version=(ipod->ipod_directory[ipod->ososimage].vers>>8);
-         ipod->ramsize = 0;
 #ifdef __WIN32__
          /* Windows requires the ipod in R/W mode for SCSI Inquiry.
           * ipod_reopen_rw does unmount the player on OS X so do this on
           * W32 only during scanning. */
          ipod_reopen_rw(ipod);
 #endif
-         ipod_get_xmlinfo(ipod);
-         ipod_get_ramsize(ipod);
+         ipod->serial[0] = 0;
+         cached = (devcache_load(ipod) == 0);
+
+         if (!cached && (read_directory(ipod) < 0)) {
+             ipod_close(ipod);
+             continue;
+         }
+
+         ipod_version=(ipod->ipod_directory[ipod->ososimage].vers>>8);
+         save = 0;
+         if (!cached) {
+             ipod->ramsize = 0;
+             if (ipod_get_xmlinfo(ipod) == 0) {
+                 ipod_get_ramsize(ipod);
+                 save = 1;
+             }
+         }
          if (getmodel(ipod,ipod_version) < 0) {
              ipod_close(ipod);
              continue;
          }
+         if (save) {
+             devcache_save(ipod);
+         }
 
 #ifdef __WIN32__
          printf("[INFO] Ipod found - %s (\"%s\") - disk device %d\n", 
@@ -2090,18 +2393,26 @@ static int find_key(struct ipod_t* ipod, int aupd, unsigned char* key)
     return 0;
 }
 
-int read_aupd(struct ipod_t* ipod, char* filename)
-{
-    int length;
-    int i;
-    int outfile;
-    int n;
-    int aupd;
+/* AUPD images are streamed through a three-stage pipeline - the reader
+   (the calling thread), a single worker running the RC4 cipher and the
+   checksum (so it sees the chunks in order), and the writer. */
+
+#define AUPD_CHUNK_SIZE (1024*1024)
+
+struct aupd_ctx_t {
+    struct ipod_t* ipod;
+    int fd;               /* The file being read or written */
+    uint64_t pos;         /* Offset of the image from the start of the disk */
+    uint32_t length;
+    uint32_t offset;      /* Bytes read so far */
     struct rc4_key_t rc4;
-    unsigned char key[4];
-    unsigned long chksum=0;
+    uint32_t chksum;      /* Of the unencrypted data */
+};
+
+static int find_aupd(struct ipod_t* ipod)
+{
+    int aupd = 0;
 
-    aupd = 0;
     while ((aupd < ipod->nimages) && (ipod->ipod_directory[aupd].ftype != FTYPE_AUPD))
     {
         aupd++;
@@ -2113,183 +2424,483 @@ int read_aupd(struct ipod_t* ipod, char* filename)
         return -1;
     }
 
-    length = ipod->ipod_directory[aupd].len;
+    return aupd;
+}
 
-    fprintf(stderr,"[INFO] Reading firmware (%d bytes)\n",length);
+/* Read a chunk of the image from the ipod.  slot->flags is the number of
+   bytes of image data, slot->hash its offset in the image. */
+static int aupd_read_device(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct aupd_ctx_t* a = ctx;
+    int ss = a->ipod->sector_size;
+    int len = AUPD_CHUNK_SIZE;
+    int n;
 
-    if (find_key(ipod, aupd, key) < 0)
-    {
-       return -1;
+    if (a->offset == a->length) {
+        return 0;
     }
 
-    fprintf(stderr, "[INFO] Decrypting AUPD image with key %02x%02x%02x%02x\n",key[0],key[1],key[2],key[3]);
-
-    if (ipod_seek(ipod, ipod->fwoffset+ipod->ipod_directory[aupd].devOffset) < 0) {
-        return -1;
+    if (a->length - a->offset < (uint32_t)len) {
+        len = a->length - a->offset;
     }
 
-    i = (length+ipod->sector_size-1) & ~(ipod->sector_size-1);
+    slot->flags = len;
+    slot->hash = a->offset;
+    slot->inlen = (len + ss - 1) & ~(ss - 1);
 
-    if ((n = ipod_read(ipod,ipod_sectorbuf,i)) < 0) {
+    n = ipod_read_at(a->ipod, slot->inbuf, slot->inlen, a->pos + a->offset);
+    if (n < 0) {
         return -1;
     }
 
-    if (n < i) {
+    if (n < slot->inlen) {
         fprintf(stderr,"[ERR]  Short read - requested %d bytes, received %d\n",
-                i,n);
+                slot->inlen,n);
         return -1;
     }
 
+    a->offset += len;
+    return 1;
+}
+
+static int aupd_decrypt(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct aupd_ctx_t* a = ctx;
+
     /* Perform the decryption - this is standard (A)RC4 */
-    matrixArc4Init(&rc4, key, 4);
-    matrixArc4(&rc4, ipod_sectorbuf, ipod_sectorbuf, length);
+    matrixArc4(&a->rc4, slot->inbuf, slot->inbuf, slot->flags);
+    a->chksum = chksum_update(a->chksum, slot->inbuf, slot->flags);
 
-    chksum = 0;
-    for (i = 0; i < (int)length; i++) {
-         /* add 8 unsigned bits but keep a 32 bit sum */
-         chksum += ipod_sectorbuf[i];
+    return 0;
+}
+
+static int aupd_write_file(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct aupd_ctx_t* a = ctx;
+    int n;
+
+    n = write(a->fd, slot->inbuf, slot->flags);
+    if (n != slot->flags) {
+        fprintf(stderr,"[ERR]  Write error - %d\n",n);
+        return -1;
+    }
+
+    return 0;
+}
+
+int read_aupd(struct ipod_t* ipod, char* filename)
+{
+    int aupd;
+    unsigned char key[4];
+    struct aupd_ctx_t a;
+    struct pipeline_t p;
+    int res;
+
+    aupd = find_aupd(ipod);
+    if (aupd < 0)
+    {
+        return -1;
+    }
+
+    memset(&a, 0, sizeof(a));
+    a.ipod = ipod;
+    a.pos = ipod->fwoffset+ipod->ipod_directory[aupd].devOffset;
+    a.length = ipod->ipod_directory[aupd].len;
+
+    fprintf(stderr,"[INFO] Reading firmware (%d bytes)\n",a.length);
+
+    if (find_key(ipod, aupd, key) < 0)
+    {
+       return -1;
     }
 
-    if (chksum != ipod->ipod_directory[aupd].chksum)
+    fprintf(stderr, "[INFO] Decrypting AUPD image with key %02x%02x%02x%02x\n",key[0],key[1],key[2],key[3]);
+    matrixArc4Init(&a.rc4, key, 4);
+
+    a.fd = open(filename,O_CREAT|O_TRUNC|O_WRONLY|O_BINARY,0666);
+    if (a.fd < 0) {
+        fprintf(stderr,"[ERR]  Couldn't open file %s\n",filename);
+        return -1;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.nthreads = 1;
+    p.nslots = 3;
+    p.inbufsize = AUPD_CHUNK_SIZE;
+    p.produce = aupd_read_device;
+    p.work = aupd_decrypt;
+    p.consume = aupd_write_file;
+    p.ctx = &a;
+
+    res = pipeline_run(&p);
+    close(a.fd);
+
+    if ((res == 0) && (a.chksum != ipod->ipod_directory[aupd].chksum))
     {
         fprintf(stderr,"[ERR]  Decryption failed - checksum error\n");
+        res = -1;
+    }
+
+    /* Don't leave a partial or wrongly decrypted image behind */
+    if (res < 0) {
+        unlink(filename);
         return -1;
     }
+
     fprintf(stderr,"[INFO] Decrypted OK (checksum matches header)\n");
+    return 0;
+}
 
-    outfile = open(filename,O_CREAT|O_TRUNC|O_WRONLY|O_BINARY,0666);
-    if (outfile < 0) {
-        fprintf(stderr,"[ERR]  Couldn't open file %s\n",filename);
+/* Read a chunk of the input file, padded with zeros to whole sectors.
+   As above, slot->flags is the number of bytes of image data. */
+static int aupd_read_file(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct aupd_ctx_t* a = ctx;
+    int ss = a->ipod->sector_size;
+    int len = AUPD_CHUNK_SIZE;
+    int n;
+
+    if (a->offset == a->length) {
+        return 0;
+    }
+
+    if (a->length - a->offset < (uint32_t)len) {
+        len = a->length - a->offset;
+    }
+
+    n = read_full(a->fd, slot->inbuf, len);
+    if (n < len) {
+        fprintf(stderr,"[ERR]  Couldn't read input file\n");
         return -1;
     }
 
-    n = write(outfile,ipod_sectorbuf,length);
-    if (n != length) {
-        fprintf(stderr,"[ERR]  Write error - %d\n",n);
+    slot->flags = len;
+    slot->hash = a->offset;
+    slot->inlen = (len + ss - 1) & ~(ss - 1);
+    memset(slot->inbuf + len, 0, slot->inlen - len);
+
+    a->offset += len;
+    return 1;
+}
+
+static int aupd_encrypt(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct aupd_ctx_t* a = ctx;
+
+    /* The checksum is of the data before we encrypt it */
+    a->chksum = chksum_update(a->chksum, slot->inbuf, slot->flags);
+    matrixArc4(&a->rc4, slot->inbuf, slot->inbuf, slot->flags);
+
+    if (a->ipod->verify != NULL) {
+        verify_crcs(a->ipod->sector_size, slot->inbuf, slot->inlen, slot->crcs);
     }
-    close(outfile);
 
     return 0;
 }
 
-int write_aupd(struct ipod_t* ipod, char* filename)
+static int aupd_write_device(void* ctx, struct pipeline_slot_t* slot)
 {
-    unsigned int length;
-    int i;
-    int x;
+    struct aupd_ctx_t* a = ctx;
     int n;
-    int infile;
-    int newsize;
+
+    if (a->ipod->verify != NULL) {
+        verify_expect(a->ipod->verify, slot->inbuf, slot->crcs, slot->inlen);
+    }
+
+    n = ipod_write_at(a->ipod, slot->inbuf, slot->inlen, a->pos + slot->hash);
+    if (n < 0) {
+        perror("[ERR]  Write failed\n");
+        return -1;
+    }
+
+    if (n < slot->inlen) {
+        fprintf(stderr,"[ERR]  Short write - requested %d bytes, received %d\n"
+                      ,slot->inlen,n);
+        return -1;
+    }
+
+    return 0;
+}
+
+int write_aupd(struct ipod_t* ipod, char* filename)
+{
     int aupd;
-    unsigned long chksum=0;
-    struct rc4_key_t rc4;
     unsigned char key[4];
+    struct aupd_ctx_t a;
+    struct pipeline_t p;
+    struct fwdir_t dir;
+    int res;
+
+    memset(&a, 0, sizeof(a));
+    a.ipod = ipod;
 
     /* First check that the input file is the correct type for this ipod. */
-    infile=open(filename,O_RDONLY);
-    if (infile < 0) {
+    a.fd=open(filename,O_RDONLY|O_BINARY);
+    if (a.fd < 0) {
         fprintf(stderr,"[ERR]  Couldn't open input file %s\n",filename);
         return -1;
     }
     
-    length = filesize(infile);
-    newsize=(length+ipod->sector_size-1)&~(ipod->sector_size-1);
-
-    fprintf(stderr,"[INFO] Padding input file from 0x%08x to 0x%08x bytes\n",
-            length,newsize);
-
-    if (newsize > BUFFER_SIZE) {
-        fprintf(stderr,"[ERR]  Input file too big for buffer\n");
-        if (infile >= 0) close(infile);
-        return -1;
-    }
+    a.length = filesize(a.fd);
 
     /* Find aupd image number */
-    aupd = 0;
-    while ((aupd < ipod->nimages) && (ipod->ipod_directory[aupd].ftype != FTYPE_AUPD))
-    {
-        aupd++;
-    }
-
-    if (aupd == ipod->nimages)
+    aupd = find_aupd(ipod);
+    if (aupd < 0)
     {
-        fprintf(stderr,"[ERR]  No AUPD image in firmware partition.\n");
+        close(a.fd);
         return -1;
     }
 
-    if (length != ipod->ipod_directory[aupd].len)
+    if (a.length != ipod->ipod_directory[aupd].len)
     {
         fprintf(stderr,"[ERR]  AUPD image (%d bytes) differs in size to %s (%d bytes).\n",
-                       ipod->ipod_directory[aupd].len, filename, length);
+                       ipod->ipod_directory[aupd].len, filename, a.length);
+        close(a.fd);
         return -1;
     }
 
     if (find_key(ipod, aupd, key) < 0)
     {
+       close(a.fd);
        return -1;
     }
 
     fprintf(stderr, "[INFO] Encrypting AUPD image with key %02x%02x%02x%02x\n",key[0],key[1],key[2],key[3]);
+    matrixArc4Init(&a.rc4, key, 4);
+    a.pos = ipod->fwoffset+ipod->ipod_directory[aupd].devOffset;
 
-    /* We now know we have enough space, so write it. */
+    memset(&p, 0, sizeof(p));
+    p.nthreads = 1;
+    p.nslots = 3;
+    p.inbufsize = AUPD_CHUNK_SIZE;
+    p.ncrcs = AUPD_CHUNK_SIZE / ipod->sector_size;
+    p.produce = aupd_read_file;
+    p.work = aupd_encrypt;
+    p.consume = aupd_write_device;
+    p.ctx = &a;
 
-    fprintf(stderr,"[INFO] Reading input file...\n");
-    n = read(infile,ipod_sectorbuf,length);
-    if (n < 0) {
-        fprintf(stderr,"[ERR]  Couldn't read input file\n");
-        close(infile);
+    res = pipeline_run(&p);
+    close(a.fd);
+
+    if (res < 0) {
         return -1;
     }
-    close(infile);
+    fprintf(stderr,"[INFO] Wrote %d bytes to firmware partition\n",a.length);
 
-    /* Pad the data with zeros */
-    memset(ipod_sectorbuf+length,0,newsize-length);
+    if (fwdir_load(ipod, &dir) < 0) {
+        return -1;
+    }
 
-    /* Calculate the new checksum (before we encrypt) */
-    chksum = 0;
-    for (i = 0; i < (int)length; i++) {
-         /* add 8 unsigned bits but keep a 32 bit sum */
-         chksum += ipod_sectorbuf[i];
+    /* Update checksum */
+    fprintf(stderr,"[INFO] Updating checksum to 0x%08x (was 0x%08x)\n",(unsigned int)a.chksum,fwdir_get(&dir, aupd, FWDIR_CHKSUM));
+    fwdir_set(&dir, aupd, FWDIR_CHKSUM, a.chksum);
+
+    return fwdir_commit(&dir);
+}
+
+/* Checksum every image in the firmware partition in one sweep.  The
+   images are read in disk order, summed on the worker threads and
+   compared in the consumer.  AUPD images are encrypted and their
+   checksum is of the plain text, so they are decrypted in order in the
+   consumer instead, using the key from the sector before the image. */
+
+#define CHECKALL_CHUNK_SIZE (1024*1024)
+
+/* Values of slot->hash */
+#define CHECKALL_DATA 0
+#define CHECKALL_KEY  1
+
+struct checkall_image_t {
+    int image;            /* Index in ipod_directory */
+    uint64_t pos;         /* Offset of the image from the start of the disk */
+    uint32_t len;
+    int encrypted;
+    int nokey;
+    struct rc4_key_t rc4;
+    uint32_t sum;
+    uint32_t summed;      /* Bytes summed so far */
+};
+
+struct checkall_ctx_t {
+    struct ipod_t* ipod;
+    struct checkall_image_t images[MAX_IMAGES];
+    int nimages;
+    int next;             /* Image being read */
+    uint32_t offset;      /* Bytes of it read so far */
+    int keyread;
+    int bad;
+};
+
+static int compare_checkall(const void* a, const void* b)
+{
+    const struct checkall_image_t* x = a;
+    const struct checkall_image_t* y = b;
+
+    return (x->pos < y->pos) ? -1 : (x->pos > y->pos);
+}
+
+static int checkall_produce(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct checkall_ctx_t* c = ctx;
+    struct ipod_t* ipod = c->ipod;
+    struct checkall_image_t* im;
+    uint64_t pos;
+    int len;
+    int n;
+
+    while ((c->next < c->nimages) && (c->offset == c->images[c->next].len)) {
+        c->next++;
+        c->offset = 0;
+        c->keyread = 0;
     }
 
-    /* Perform the encryption - this is standard (A)RC4 */
-    matrixArc4Init(&rc4, key, 4);
-    matrixArc4(&rc4, ipod_sectorbuf, ipod_sectorbuf, length);
+    if (c->next == c->nimages) {
+        return 0;
+    }
 
-    if (ipod_seek(ipod, ipod->fwoffset+ipod->ipod_directory[aupd].devOffset) < 0) {
-        fprintf(stderr,"[ERR]  Seek failed\n");
-        return -1;
+    im = &c->images[c->next];
+    slot->flags = c->next;
+
+    if (im->encrypted && !c->keyread) {
+        slot->hash = CHECKALL_KEY;
+        slot->inlen = ipod->sector_size;
+        pos = im->pos - ipod->sector_size;
+        c->keyread = 1;
+    } else {
+        len = CHECKALL_CHUNK_SIZE;
+        if (im->len - c->offset < (uint32_t)len) {
+            len = im->len - c->offset;
+        }
+        slot->hash = CHECKALL_DATA;
+        slot->inlen = len;
+        pos = im->pos + c->offset;
+        c->offset += len;
     }
 
-    if ((n = ipod_write(ipod,ipod_sectorbuf,newsize)) < 0) {
-        perror("[ERR]  Write failed\n");
+    /* Reads are whole sectors, only inlen bytes are summed */
+    len = (slot->inlen + ipod->sector_size - 1) & ~(ipod->sector_size - 1);
+    n = ipod_read_at(ipod, slot->inbuf, len, pos);
+    if (n != len) {
+        fprintf(stderr,"[ERR]  Read of %s image at offset 0x%08" PRIx64 " failed\n",
+                       ftypename[ipod->ipod_directory[im->image].ftype], pos);
         return -1;
     }
 
-    if (n < newsize) {
-        fprintf(stderr,"[ERR]  Short write - requested %d bytes, received %d\n"
-                      ,newsize,n);
+    return 1;
+}
+
+static int checkall_work(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct checkall_ctx_t* c = ctx;
+
+    if ((slot->hash == CHECKALL_DATA) && !c->images[slot->flags].encrypted) {
+        slot->checksum = chksum_update(0, slot->inbuf, slot->inlen);
+    }
+
+    return 0;
+}
+
+static int checkall_consume(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct checkall_ctx_t* c = ctx;
+    struct checkall_image_t* im = &c->images[slot->flags];
+    struct ipod_directory_t* entry = &c->ipod->ipod_directory[im->image];
+    unsigned char key[4];
+
+    if (slot->hash == CHECKALL_KEY) {
+        if (GetSecurityBlockKey(slot->inbuf, key) != 1) {
+            fprintf(stderr,"[ERR]  AUPD: no key in security block - can not check\n");
+            im->nokey = 1;
+            c->bad = 1;
+        } else {
+            matrixArc4Init(&im->rc4, key, 4);
+        }
+        return 0;
+    }
+
+    if (im->encrypted) {
+        if (!im->nokey) {
+            matrixArc4(&im->rc4, slot->inbuf, slot->inbuf, slot->inlen);
+            im->sum = chksum_update(im->sum, slot->inbuf, slot->inlen);
+        }
+    } else {
+        im->sum += slot->checksum;
+    }
+
+    im->summed += slot->inlen;
+    if ((im->summed < im->len) || im->nokey) {
+        return 0;
+    }
+
+    if (im->sum == entry->chksum) {
+        fprintf(stderr,"[INFO] %s: checksum OK (0x%08x)\n",
+                       ftypename[entry->ftype], im->sum);
+    } else {
+        fprintf(stderr,"[ERR]  %s: checksum mismatch - directory has 0x%08x, image sums to 0x%08x\n",
+                       ftypename[entry->ftype], entry->chksum, im->sum);
+        c->bad = 1;
+    }
+
+    if ((entry->ftype == FTYPE_OSOS) && (entry->entryOffset != 0)) {
+        fprintf(stderr,"[INFO] %s:   (includes the bootloader at offset 0x%08x)\n",
+                       ftypename[entry->ftype], entry->entryOffset);
+    }
+
+    return 0;
+}
+
+int verify_all_images(struct ipod_t* ipod)
+{
+    struct checkall_ctx_t c;
+    struct checkall_image_t* im;
+    struct pipeline_t p;
+    uint64_t total = 0;
+    int i;
+
+    if (ipod->modelnum == 62) {
+        /* See write_firmware() - these are sums of the unencrypted images */
+        fprintf(stderr,"[ERR]  The 2nd Gen Nano's checksums can not be checked\n");
         return -1;
     }
-    fprintf(stderr,"[INFO] Wrote %d bytes to firmware partition\n",n);
 
-    x = ipod->diroffset % ipod->sector_size;
+    memset(&c, 0, sizeof(c));
+    c.ipod = ipod;
+
+    for (i = 0; i < ipod->nimages; i++) {
+        if (ipod->ipod_directory[i].len == 0) {
+            continue;
+        }
+        im = &c.images[c.nimages++];
+        im->image = i;
+        im->pos = ipod->fwoffset + ipod->ipod_directory[i].devOffset;
+        im->len = ipod->ipod_directory[i].len;
+        im->encrypted = (ipod->ipod_directory[i].ftype == FTYPE_AUPD);
+        total += im->len;
+    }
+
+    /* Keep the sweep sequential */
+    qsort(c.images, c.nimages, sizeof(struct checkall_image_t), compare_checkall);
 
-    /* Read directory */
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { return -1; }
+    memset(&p, 0, sizeof(p));
+    p.nthreads = pipeline_default_threads();
+    p.inbufsize = CHECKALL_CHUNK_SIZE;
+    p.produce = checkall_produce;
+    p.work = checkall_work;
+    p.consume = checkall_consume;
+    p.ctx = &c;
 
-    n=ipod_read(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { return -1; }
+    fprintf(stderr,"[INFO] Checking %d images (%" PRIu64 " bytes)\n", c.nimages, total);
 
-    /* Update checksum */
-    fprintf(stderr,"[INFO] Updating checksum to 0x%08x (was 0x%08x)\n",(unsigned int)chksum,le2int(ipod_sectorbuf + x + aupd*40 + 28));
-    int2le(chksum,ipod_sectorbuf+x+aupd*40+28);
+    if (pipeline_run(&p) < 0) {
+        return -1;
+    }
 
-    /* Write directory */    
-    if (ipod_seek(ipod, ipod->start + ipod->diroffset - x) < 0) { return -1; }
-    n=ipod_write(ipod, ipod_sectorbuf, ipod->sector_size);
-    if (n < 0) { return -1; }
+    if (c.bad) {
+        fprintf(stderr,"[ERR]  Some images failed the checksum test\n");
+        return -1;
+    }
 
+    fprintf(stderr,"[INFO] All images OK\n");
     return 0;
 }
 
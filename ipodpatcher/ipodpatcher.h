@@ -27,6 +27,7 @@ extern "C" {
 #endif
 
 #include "ipodio.h"
+#include "manifest.h"
 
 /* Size of buffer for disk I/O - 8MB is large enough for any version
    of the Apple firmware, but not the Nano's RSRC image. */
@@ -42,13 +43,17 @@ extern int ipod_verbose;
 
 char* get_parttype(int pt);
 int read_partinfo(struct ipod_t* ipod, int silent);
-int read_partition(struct ipod_t* ipod, int outfile);
+int read_partition(struct ipod_t* ipod, int outfile, struct manifest_t* manifest);
+int read_partition_compressed(struct ipod_t* ipod, int outfile,
+                              struct manifest_t* manifest);
 int write_partition(struct ipod_t* ipod, int infile);
-int diskmove(struct ipod_t* ipod, int delta);
+int write_partition_diff(struct ipod_t* ipod, int infile, struct manifest_t* manifest);
+int write_partition_stream(struct ipod_t* ipod, int infile, uint64_t size);
 int add_bootloader(struct ipod_t* ipod, char* filename, int type);
 int delete_bootloader(struct ipod_t* ipod);
 int write_firmware(struct ipod_t* ipod, char* filename, int type);
 int read_firmware(struct ipod_t* ipod, char* filename, int type);
+int read_fw_header(struct ipod_t* ipod, off_t* diroffset, int verbose);
 int read_directory(struct ipod_t* ipod);
 int list_images(struct ipod_t* ipod);
 int getmodel(struct ipod_t* ipod, int ipod_version);
@@ -58,6 +63,7 @@ int ipod_get_xmlinfo(struct ipod_t* ipod);
 void ipod_get_ramsize(struct ipod_t* ipod);
 int read_aupd(struct ipod_t* ipod, char* filename);
 int write_aupd(struct ipod_t* ipod, char* filename);
+int verify_all_images(struct ipod_t* ipod);
 off_t filesize(int fd);
 
 #ifdef __cplusplus
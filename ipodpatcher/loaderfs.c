@@ -0,0 +1,442 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+
+#include "ipodpatcher.h"
+#include "ipodio.h"
+#include "loaderfs.h"
+
+/* From ipodloader2, built with ONPC set */
+#include "bootloader.h"
+#include "minilibc.h"
+#include "ata2.h"
+#include "vfs.h"
+#include "macpartitions.h"
+
+/* Size of the reads used by loaderfs_extract() */
+#define EXTRACT_CHUNK (1024*1024)
+
+#define MAX_PATH_LEN 512
+
+static struct ipod_t* fs_ipod = NULL;
+
+/* Aligned buffer for reads that don't cover whole disk sectors */
+static unsigned char* bouncebuf = NULL;
+static int bouncesize = 0;
+
+/* The parts of minilibc the filesystem drivers use, on top of the C
+   library.  minilibc itself can't be used on the host - its printf walks
+   the stack by hand. */
+
+void* mlc_malloc(size_t num)
+{
+    void* p = malloc(num);
+
+    if (p == NULL) {
+        fprintf(stderr,"[ERR]  Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+size_t mlc_strlen(const char* s) { return strlen(s); }
+int mlc_strcmp(const char* s1, const char* s2) { return strcmp(s1, s2); }
+int mlc_strcasecmp(const char* s1, const char* s2) { return strcasecmp(s1, s2); }
+char* mlc_strchr(const char* s, int c) { return strchr(s, c); }
+
+int mlc_strncmp(const char* s1, const char* s2, size_t maxlen)
+{
+    return strncmp(s1, s2, maxlen);
+}
+
+int mlc_strncasecmp(const char* s1, const char* s2, size_t maxlen)
+{
+    return strncasecmp(s1, s2, maxlen);
+}
+
+size_t mlc_strlcpy(char* dest, const char* src, size_t count)
+{
+    size_t len = strlen(src);
+
+    if (count > 0) {
+        size_t n = (len >= count) ? count - 1 : len;
+        memcpy(dest, src, n);
+        dest[n] = 0;
+    }
+    return len;
+}
+
+size_t mlc_strlcat(char* dest, const char* src, size_t count)
+{
+    size_t len = strlen(dest);
+
+    if (len >= count) {
+        return len + strlen(src);
+    }
+    return len + mlc_strlcpy(dest + len, src, count - len);
+}
+
+void* mlc_memcpy(void* dest, const void* src, size_t n)
+{
+    return memcpy(dest, src, n);
+}
+
+void* mlc_memset(void* dest, int c, size_t n)
+{
+    return memset(dest, c, n);
+}
+
+int mlc_memcmp(const void* sv1, const void* sv2, size_t length)
+{
+    return memcmp(sv1, sv2, length);
+}
+
+/* The drivers report what they find; only show it with -v */
+int mlc_printf(const char* fmt, ...)
+{
+    va_list ap;
+    int n = 0;
+
+    if (ipod_verbose) {
+        va_start(ap, fmt);
+        n = vfprintf(stderr, fmt, ap);
+        va_end(ap);
+    }
+    return n;
+}
+
+void mlc_hexdump(void* addr, int len)
+{
+    unsigned char* p = addr;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        mlc_printf("%02x%s", p[i], ((i % 8) == 7) ? "\n" : "");
+    }
+}
+
+void mlc_show_critical_error()
+{
+}
+
+void mlc_show_fatal_error()
+{
+    fprintf(stderr,"[ERR]  The filesystem driver gave up\n");
+    exit(1);
+}
+
+/* The loader's disk access: 512-byte sectors from the start of the disk,
+   whatever the sector size of the ipod */
+
+int ata_readblocks(void* dst, uint32 sector, uint32 count)
+{
+    uint64_t pos = (uint64_t)sector * 512;
+    uint64_t len = (uint64_t)count * 512;
+    uint64_t start, end;
+    int n;
+
+    start = pos - (pos % fs_ipod->sector_size);
+    end = pos + len;
+    if (end % fs_ipod->sector_size) {
+        end += fs_ipod->sector_size - (end % fs_ipod->sector_size);
+    }
+    n = end - start;
+
+    if (n > bouncesize) {
+        if (bouncebuf != NULL) {
+            ipod_free_buffer(bouncebuf);
+        }
+        bouncesize = 0;
+        if (ipod_alloc_buffer(&bouncebuf, n) < 0) {
+            fprintf(stderr,"[ERR]  Buffer allocation failed\n");
+            exit(1);
+        }
+        bouncesize = n;
+    }
+
+    if (ipod_read_at(fs_ipod, bouncebuf, n, start) != n) {
+        /* The drivers don't check for errors, so don't hand them junk */
+        fprintf(stderr,"[ERR]  Read of %d bytes at %llu failed\n",
+                n, (unsigned long long)start);
+        exit(1);
+    }
+
+    memcpy(dst, bouncebuf + (pos - start), len);
+
+    /* The partition table counts in disk sectors.  On the ipod the loader
+       finds out their size from a hint that ipodpatcher doesn't write, so
+       hand it the table in 512-byte sectors instead. */
+    if ((sector == 0) && (fs_ipod->sector_size != 512)) {
+        mbr_t* mbr = dst;
+        int mult = fs_ipod->sector_size / 512;
+        int i;
+
+        if (mbr->MBR_signature == 0xAA55) {
+            for (i = 0; i < 4; i++) {
+                mbr->partition_table[i].lba_offset *= mult;
+                mbr->partition_table[i].lba_size *= mult;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ata_readblock(void* dst, uint32 sector)
+{
+    return ata_readblocks(dst, sector, 1);
+}
+
+/* macpartitions.cc (HFS+) is C++ and isn't built into ipodpatcher */
+void check_mac_partitions(uint8* blk0)
+{
+    (void)blk0;
+    fprintf(stderr,"[ERR]  Reading files from a Mac formatted ipod is not supported\n");
+}
+
+int loaderfs_init(struct ipod_t* ipod)
+{
+    fs_ipod = ipod;
+    vfs_init();
+    return 0;
+}
+
+/* Turn a path from the command line into one for the vfs layer */
+static int make_path(char* buf, const char* path)
+{
+    int len;
+
+    if ((path[0] == '[') || (path[0] == '(')) {
+        len = snprintf(buf, MAX_PATH_LEN, "%s", path);
+    } else {
+        len = snprintf(buf, MAX_PATH_LEN, "[fat]%s%s",
+                       (path[0] == '/') ? "" : "/", path);
+    }
+
+    if (len >= MAX_PATH_LEN) {
+        fprintf(stderr,"[ERR]  Path too long - %s\n", path);
+        return -1;
+    }
+
+    /* Not all the drivers cope with a trailing / */
+    while ((len > 0) && (buf[len-1] == '/')) {
+        buf[--len] = 0;
+    }
+
+    return 0;
+}
+
+static int print_entry(void* ctx, vfs_dirent* entry)
+{
+    (void)ctx;
+
+    if (entry->isdir) {
+        printf("%12s  %s/\n", "<dir>", entry->name);
+    } else {
+        printf("%12lu  %s\n", (unsigned long)entry->size, entry->name);
+    }
+    return 0;
+}
+
+int loaderfs_list(const char* path)
+{
+    char dir[MAX_PATH_LEN];
+
+    if (make_path(dir, path) < 0) {
+        return -1;
+    }
+
+    if (vfs_listdir(dir, print_entry, NULL) < 0) {
+        fprintf(stderr,"[ERR]  Can't list %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct find_ctx_t {
+    const char* name;
+    int found;
+    uint32 size;
+    int isdir;
+};
+
+static int find_entry(void* ctx, vfs_dirent* entry)
+{
+    struct find_ctx_t* f = ctx;
+
+    /* FAT is case insensitive, ext2 isn't - an exact match wins */
+    if (strcasecmp(entry->name, f->name) == 0) {
+        if ((f->found == 0) || (strcmp(entry->name, f->name) == 0)) {
+            f->found = 1;
+            f->size = entry->size;
+            f->isdir = entry->isdir;
+        }
+    }
+    return 0;
+}
+
+/* Look a file up in the listing of its directory, which is the one way
+   of getting its size and type that works for all the drivers */
+static int find_file(const char* path, char* fullpath, struct find_ctx_t* f)
+{
+    char dir[MAX_PATH_LEN];
+    char* p;
+
+    if (make_path(fullpath, path) < 0) {
+        return -1;
+    }
+
+    strcpy(dir, fullpath);
+    p = strrchr(dir, '/');
+    if ((p == NULL) || (strchr(p, ']') != NULL) || (strchr(p, ')') != NULL)) {
+        /* Just the name of the partition */
+        p = strchr(dir, (dir[0] == '[') ? ']' : ')');
+        if ((p == NULL) || (p[1] == 0)) {
+            fprintf(stderr,"[ERR]  %s is not a file\n", path);
+            return -1;
+        }
+        p++;
+        f->name = fullpath + (p - dir);
+    } else {
+        f->name = fullpath + (p - dir) + 1;
+    }
+    *p = 0;
+
+    f->found = 0;
+    if (vfs_listdir(dir, find_entry, f) < 0) {
+        fprintf(stderr,"[ERR]  Can't list the directory of %s\n", path);
+        return -1;
+    }
+
+    if (!f->found) {
+        fprintf(stderr,"[ERR]  %s not found\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int loaderfs_stat(const char* path)
+{
+    char fullpath[MAX_PATH_LEN];
+    struct find_ctx_t f;
+    long chksum;
+    int fd;
+
+    if (find_file(path, fullpath, &f) < 0) {
+        return -1;
+    }
+
+    printf("[INFO] %s\n", fullpath);
+    printf("[INFO] Type: %s\n", f.isdir ? "directory" : "file");
+    if (f.isdir) {
+        return 0;
+    }
+    printf("[INFO] Size: %lu bytes\n", (unsigned long)f.size);
+
+    /* Only the firmware partition has a checksum for each file */
+    fd = vfs_open(fullpath);
+    if (fd >= 0) {
+        if (vfs_getinfo(fd, &chksum) == 0) {
+            printf("[INFO] Checksum: 0x%08lx\n", (unsigned long)chksum);
+        }
+        vfs_close(fd);
+    }
+
+    return 0;
+}
+
+int loaderfs_extract(const char* path, const char* filename)
+{
+    char fullpath[MAX_PATH_LEN];
+    struct find_ctx_t f;
+    unsigned char* buf;
+    FILE* out;
+    uint32 done, n;
+    size_t got;
+    int fd;
+    int res = -1;
+
+    if (find_file(path, fullpath, &f) < 0) {
+        return -1;
+    }
+    if (f.isdir) {
+        fprintf(stderr,"[ERR]  %s is a directory\n", path);
+        return -1;
+    }
+
+    fd = vfs_open(fullpath);
+    if (fd < 0) {
+        fprintf(stderr,"[ERR]  Can't open %s\n", path);
+        return -1;
+    }
+
+    buf = malloc(EXTRACT_CHUNK);
+    if (buf == NULL) {
+        fprintf(stderr,"[ERR]  Buffer allocation failed\n");
+        vfs_close(fd);
+        return -1;
+    }
+
+    out = fopen(filename, "wb");
+    if (out == NULL) {
+        fprintf(stderr,"[ERR]  Can't open %s for writing\n", filename);
+        free(buf);
+        vfs_close(fd);
+        return -1;
+    }
+
+    for (done = 0; done < f.size; done += n) {
+        n = f.size - done;
+        if (n > EXTRACT_CHUNK) {
+            n = EXTRACT_CHUNK;
+        }
+
+        got = vfs_read(buf, 1, n, fd);
+        if (got != n) {
+            fprintf(stderr,"[ERR]  Short read from %s at offset %lu\n",
+                    path, (unsigned long)done);
+            goto error;
+        }
+
+        if (fwrite(buf, 1, n, out) != n) {
+            fprintf(stderr,"[ERR]  Write to %s failed\n", filename);
+            goto error;
+        }
+    }
+
+    res = 0;
+    fprintf(stderr,"[INFO] Extracted %lu bytes from %s\n",
+            (unsigned long)f.size, fullpath);
+
+error:
+    if (fclose(out) != 0 && res == 0) {
+        fprintf(stderr,"[ERR]  Write to %s failed\n", filename);
+        res = -1;
+    }
+    free(buf);
+    vfs_close(fd);
+    return res;
+}
@@ -0,0 +1,39 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __LOADERFS_H
+#define __LOADERFS_H
+
+#include "ipodio.h"
+
+/* Read-only access to the files on the ipod, through the filesystem
+   drivers of ipodloader2 (FAT32, ext2 and the firmware partition).
+
+   Paths are given the way loader.cfg gives them, e.g. "[fat]/notes" or
+   "(hd0,1)/notes".  A path without a partition prefix is looked up on
+   the FAT partition. */
+
+/* Scan the partition table and mount everything the loader can read */
+int loaderfs_init(struct ipod_t* ipod);
+
+int loaderfs_list(const char* path);
+int loaderfs_stat(const char* path);
+int loaderfs_extract(const char* path, const char* filename);
+
+#endif
@@ -0,0 +1,247 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+/*
+   Each compressed block is a sequence of:
+
+       token          - high nibble literal count, low nibble match length-4
+       [length bytes] - 255,255,...,n added to a nibble of 15
+       literals
+       offset         - 16 bit little-endian distance back to the match
+       [length bytes] - for the match length
+
+   The final sequence has literals only and ends the block.
+*/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS  14
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned int lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Emit the continuation bytes for a length whose nibble was 15 */
+static unsigned char* put_length(unsigned char* op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static unsigned char* put_sequence(unsigned char* op, unsigned char* oend,
+                                   const unsigned char* literals, int litlen,
+                                   int offset, int matchlen)
+{
+    unsigned char* token;
+
+    /* Worst case size of this sequence */
+    if (oend - op < 1 + litlen + litlen/255 + 1 + 2 + matchlen/255 + 1) {
+        return NULL;
+    }
+
+    token = op++;
+    if (litlen >= 15) {
+        *token = 15 << 4;
+        op = put_length(op, litlen - 15);
+    } else {
+        *token = litlen << 4;
+    }
+
+    memcpy(op, literals, litlen);
+    op += litlen;
+
+    if (matchlen == 0) {
+        /* Final literal-only sequence */
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = (offset >> 8) & 0xff;
+
+    matchlen -= LZ_MIN_MATCH;
+    if (matchlen >= 15) {
+        *token |= 15;
+        op = put_length(op, matchlen - 15);
+    } else {
+        *token |= matchlen;
+    }
+
+    return op;
+}
+
+int lz_compress(const unsigned char* src, int srclen,
+                unsigned char* dst, int dstcap)
+{
+    int table[1 << LZ_HASH_BITS];
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;
+    const unsigned char* iend = src + srclen;
+    const unsigned char* ref;
+    const unsigned char* p;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + dstcap;
+    uint32_t seq;
+    unsigned int h;
+    int offset;
+
+    memset(table, 0xff, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= iend) {
+        seq = read32(ip);
+        h = lz_hash(seq);
+        ref = (table[h] < 0) ? NULL : src + table[h];
+        table[h] = ip - src;
+
+        if ((ref == NULL) || (ip - ref > LZ_MAX_OFFSET) || (read32(ref) != seq)) {
+            ip++;
+            continue;
+        }
+
+        offset = ip - ref;
+
+        /* Extend the match as far as it goes */
+        p = ip + LZ_MIN_MATCH;
+        ref += LZ_MIN_MATCH;
+        while ((p < iend) && (*p == *ref)) {
+            p++;
+            ref++;
+        }
+
+        op = put_sequence(op, oend, anchor, ip - anchor, offset, p - ip);
+        if (op == NULL) {
+            return 0;
+        }
+
+        ip = p;
+        anchor = p;
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+
+    return op - dst;
+}
+
+/* Read the continuation bytes of a length, returns -1 on truncated input */
+static int get_length(const unsigned char** ip, const unsigned char* iend)
+{
+    int len = 0;
+    unsigned char b;
+
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+
+    return len;
+}
+
+int lz_decompress(const unsigned char* src, int srclen,
+                  unsigned char* dst, int dstcap)
+{
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + srclen;
+    const unsigned char* ref;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + dstcap;
+    unsigned char token;
+    int litlen;
+    int matchlen;
+    int offset;
+    int n;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        litlen = token >> 4;
+        if (litlen == 15) {
+            if ((n = get_length(&ip, iend)) < 0) {
+                return -1;
+            }
+            litlen += n;
+        }
+
+        if ((litlen > iend - ip) || (litlen > oend - op)) {
+            return -1;
+        }
+
+        memcpy(op, ip, litlen);
+        ip += litlen;
+        op += litlen;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if ((offset == 0) || (offset > op - dst)) {
+            return -1;
+        }
+
+        matchlen = token & 15;
+        if (matchlen == 15) {
+            if ((n = get_length(&ip, iend)) < 0) {
+                return -1;
+            }
+            matchlen += n;
+        }
+        matchlen += LZ_MIN_MATCH;
+
+        if (matchlen > oend - op) {
+            return -1;
+        }
+
+        /* Byte copy - the match may overlap the output */
+        ref = op - offset;
+        while (matchlen--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - dst;
+}
@@ -0,0 +1,36 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __LZ_H
+#define __LZ_H
+
+/* A small byte-oriented LZ77 codec (LZ4-style sequences) used for the
+   chunks of compressed partition backups. */
+
+/* Compress srclen bytes from src into dst.  Returns the compressed length,
+   or 0 if the result would not fit in dstcap bytes. */
+int lz_compress(const unsigned char* src, int srclen,
+                unsigned char* dst, int dstcap);
+
+/* Decompress srclen bytes from src into dst.  Returns the decompressed
+   length, or -1 if the input is corrupt or doesn't fit in dstcap bytes. */
+int lz_decompress(const unsigned char* src, int srclen,
+                  unsigned char* dst, int dstcap);
+
+#endif
@@ -30,6 +30,17 @@
 
 #include "ipodpatcher.h"
 #include "ipodio.h"
+#include "backup.h"
+#include "manifest.h"
+#include "verify.h"
+#include "compact.h"
+#include "ioplan.h"
+#include "loaderfs.h"
+#include "devcache.h"
+
+#ifdef __WIN32__
+#include <io.h>
+#endif
 
 #ifdef RELEASE
 #undef VERSION
@@ -52,10 +63,17 @@ enum {
    READ_AUPD,
    WRITE_AUPD,
    READ_PARTITION,
+   READ_PARTITION_COMPRESSED,
    WRITE_PARTITION,
+   WRITE_PARTITION_STREAM,
    FORMAT_PARTITION,
    DUMP_XML,
-   CONVERT_TO_FAT32
+   CONVERT_TO_FAT32,
+   COMPACT_PARTITION,
+   VERIFY_ALL,
+   FS_LIST,
+   FS_STAT,
+   FS_EXTRACT
 };
 
 void print_macpod_warning(void)
@@ -71,6 +89,7 @@ void print_macpod_warning(void)
 void print_usage(void)
 {
     fprintf(stderr,"Usage: ipodpatcher --scan\n");
+    fprintf(stderr,"    or ipodpatcher --backup-extract bootpartition.ipbk name filename.bin\n");
 #ifdef __WIN32__
     fprintf(stderr,"    or ipodpatcher [DISKNO] [action]\n");
 #else
@@ -83,6 +102,7 @@ void print_usage(void)
 #endif
     fprintf(stderr,"  -l,   --list\n");
     fprintf(stderr,"  -r,   --read-partition     bootpartition.bin\n");
+    fprintf(stderr,"  -rc,  --read-partition-compressed bootpartition.ipbk\n");
     fprintf(stderr,"  -w,   --write-partition    bootpartition.bin\n");
     fprintf(stderr,"  -rf,  --read-firmware      filename.ipod[x]\n");
     fprintf(stderr,"  -rfb, --read-firmware-bin  filename.bin\n");
@@ -99,8 +119,65 @@ void print_usage(void)
     fprintf(stderr,"        --read-aupd          filename.bin\n");
     fprintf(stderr,"        --write-aupd         filename.bin\n");
     fprintf(stderr,"  -x    --dump-xml           filename.xml\n");
+    fprintf(stderr,"        --compact            [--dry-run]\n");
+    fprintf(stderr,"        --verify-all\n");
+    fprintf(stderr,"        --fs-list            path\n");
+    fprintf(stderr,"        --fs-stat            path\n");
+    fprintf(stderr,"        --fs-extract         path filename\n");
+    fprintf(stderr,"\n");
+    fprintf(stderr,"Options for --read-partition and --write-partition:\n");
+    fprintf(stderr,"        --manifest           filename.sums\n");
+    fprintf(stderr,"        --diff\n");
+    fprintf(stderr,"        --size               bytes\n");
+    fprintf(stderr,"\n");
+    fprintf(stderr,"Options for --format and --convert:\n");
+    fprintf(stderr,"        --align              bytes\n");
+    fprintf(stderr,"        --populate           directory\n");
+    fprintf(stderr,"\n");
+    fprintf(stderr,"Options for all actions that write to the ipod:\n");
+    fprintf(stderr,"        --verify\n");
+    fprintf(stderr,"        --dry-run\n");
     fprintf(stderr,"\n");
 
+    fprintf(stderr,"--manifest saves a hash of each 1MB chunk when reading the partition.  When\n");
+    fprintf(stderr,"writing, only the chunks whose hash differs from the manifest are written,\n");
+    fprintf(stderr,"and the manifest is updated to match.  It can only be used with the ipod it\n");
+    fprintf(stderr,"was made from.\n");
+    fprintf(stderr,"--diff does the same by reading back the partition instead.\n\n");
+
+    fprintf(stderr,"Use - as the filename for --write-partition and --write-firmware to read\n");
+    fprintf(stderr,"from standard input.  --size gives the length of the partition image; without\n");
+    fprintf(stderr,"it the image is read until end of file.\n\n");
+
+    fprintf(stderr,"--compact moves the firmware images together to remove any gaps between\n");
+    fprintf(stderr,"them.  With --dry-run it only reports what would be moved.\n\n");
+
+    fprintf(stderr,"--align starts the FATs and the data area of the new FAT32 filesystem on a\n");
+    fprintf(stderr,"multiple of the given size, e.g. the flash erase block size.  By default the\n");
+    fprintf(stderr,"disk's physical sector size is used.\n\n");
+
+    fprintf(stderr,"--populate copies a directory tree into the new filesystem as part of the\n");
+    fprintf(stderr,"format, without mounting it.\n\n");
+
+    fprintf(stderr,"--verify reads back every sector written, bypassing the OS cache, and\n");
+    fprintf(stderr,"reports the first one that doesn't match.\n\n");
+
+    fprintf(stderr,"--verify-all checks every image in the firmware partition against the\n");
+    fprintf(stderr,"checksum in the firmware directory.\n\n");
+
+    fprintf(stderr,"--fs-list, --fs-stat and --fs-extract read files from the ipod through the\n");
+    fprintf(stderr,"bootloader's own filesystem drivers, without mounting it.  Paths are given\n");
+    fprintf(stderr,"as in loader.cfg, e.g. [fat]/notes, (hd0,1)/boot or (hd0,0)/osos for an image\n");
+    fprintf(stderr,"in the firmware partition.  A path without a partition is on the FAT partition.\n\n");
+
+    fprintf(stderr,"--dry-run plans the action without writing anything, then lists the reads\n");
+    fprintf(stderr,"made while planning and the writes the plan would make, and estimates how\n");
+    fprintf(stderr,"long they take.\n\n");
+
+    fprintf(stderr,"Information about each ipod is cached by serial number in\n");
+    fprintf(stderr,"$XDG_CACHE_HOME/ipodpatcher (~/.cache/ipodpatcher), and checked against the\n");
+    fprintf(stderr,"partition table and firmware directory before it is used.\n\n");
+
     fprintf(stderr,"The .ipodx extension is used for encrypted images for the 2nd Gen Nano.\n\n");
 
 #ifdef __WIN32__
@@ -122,6 +199,44 @@ void print_usage(void)
 #endif
 }
 
+/* Actions after which the device cache is saved again, as they change
+   the firmware directory */
+static int changes_directory(int action)
+{
+    switch (action) {
+#ifdef WITH_BOOTOBJS
+        case INSTALL:
+        case INTERACTIVE:
+#endif
+        case DELETE_BOOTLOADER:
+        case ADD_BOOTLOADER:
+        case WRITE_FIRMWARE:
+        case COMPACT_PARTITION:
+            return 1;
+    }
+    return 0;
+}
+
+/* Actions that --dry-run plans without running the plan */
+static int writes_to_ipod(int action)
+{
+    switch (action) {
+#ifdef WITH_BOOTOBJS
+        case INSTALL:
+#endif
+        case DELETE_BOOTLOADER:
+        case ADD_BOOTLOADER:
+        case WRITE_FIRMWARE:
+        case WRITE_AUPD:
+        case WRITE_PARTITION:
+        case WRITE_PARTITION_STREAM:
+        case FORMAT_PARTITION:
+        case CONVERT_TO_FAT32:
+            return 1;
+    }
+    return 0;
+}
+
 void display_partinfo(struct ipod_t* ipod)
 {
     int i;
@@ -149,11 +264,27 @@ int main(int argc, char* argv[])
     int n;
     int infile, outfile;
     unsigned int inputsize;
+    uint64_t imagesize;
+    char* manifestfile = NULL;
+    int diffwrite = 0;
+    uint64_t streamsize = 0;
+    struct manifest_t manifest;
+    int verifywrites = 0;
+    int dryrun = 0;
+    int align = 0;
+    int cached;  /* The device cache is up to date for this ipod */
+    char* populatedir = NULL;
+    char* fspath = NULL;
+    struct verify_t verifier;
+    struct ioplan_t plan;
+    double throughput = 0;
     char* filename;
     int action = SHOW_INFO;
     int type;
     struct ipod_t ipod;
 
+    memset(&ipod, 0, sizeof(ipod));
+
     fprintf(stderr,"ipodpatcher " VERSION "\n");
     fprintf(stderr,"(C) Dave Chapman 2006-2009\n");
     fprintf(stderr,"This is free software; see the source for copying conditions.  There is NO\n");
@@ -174,6 +305,37 @@ int main(int argc, char* argv[])
         return 0;
     }
 
+    /* Pull one image (e.g. osos) out of a -rc backup, without an ipod */
+    if ((argc > 1) && (strcmp(argv[1],"--backup-extract")==0)) {
+        if (argc != 5) {
+            print_usage();
+            return 1;
+        }
+
+        infile = open(argv[2],O_RDONLY|O_BINARY);
+        if (infile < 0) {
+            fprintf(stderr,"[ERR]  Couldn't open input file %s\n",argv[2]);
+            return 1;
+        }
+
+        outfile = open(argv[4],O_CREAT|O_TRUNC|O_WRONLY|O_BINARY,S_IREAD|S_IWRITE);
+        if (outfile < 0) {
+            fprintf(stderr,"[ERR]  Couldn't open file %s\n",argv[4]);
+            close(infile);
+            return 1;
+        }
+
+        n = backup_extract_image(infile, argv[3], outfile);
+        close(infile);
+        if ((close(outfile) < 0) || (n < 0)) {
+            fprintf(stderr,"[ERR]  Extract failed.\n");
+            return 1;
+        }
+
+        fprintf(stderr,"[INFO] Extracted %s to %s.\n",argv[3],argv[4]);
+        return 0;
+    }
+
     /* If the first parameter doesn't start with -, then we interpret it as a device */
     if ((argc > 1) && (argv[1][0] != '-')) {
         ipod.diskname[0]=0;
@@ -297,12 +459,48 @@ int main(int argc, char* argv[])
             if (i == argc) { print_usage(); return 1; }
             filename=argv[i];
             i++;
+        } else if ((strcmp(argv[i],"-rc")==0) || 
+                   (strcmp(argv[i],"--read-partition-compressed")==0)) {
+            action = READ_PARTITION_COMPRESSED;
+            i++;
+            if (i == argc) { print_usage(); return 1; }
+            filename=argv[i];
+            i++;
         } else if ((strcmp(argv[i],"-w")==0) || 
                    (strcmp(argv[i],"--write-partition")==0)) {
             action = WRITE_PARTITION;
             i++;
             if (i == argc) { print_usage(); return 1; }
             filename=argv[i];
+            if (strcmp(filename,"-")==0) {
+                action = WRITE_PARTITION_STREAM;
+            }
+            i++;
+        } else if (strcmp(argv[i],"--manifest")==0) {
+            i++;
+            if (i == argc) { print_usage(); return 1; }
+            manifestfile=argv[i];
+            i++;
+        } else if (strcmp(argv[i],"--size")==0) {
+            i++;
+            if (i == argc) { print_usage(); return 1; }
+            streamsize = strtoull(argv[i], NULL, 0);
+            i++;
+        } else if (strcmp(argv[i],"--align")==0) {
+            i++;
+            if (i == argc) { print_usage(); return 1; }
+            align = strtol(argv[i], NULL, 0);
+            i++;
+        } else if (strcmp(argv[i],"--populate")==0) {
+            i++;
+            if (i == argc) { print_usage(); return 1; }
+            populatedir = argv[i];
+            i++;
+        } else if (strcmp(argv[i],"--diff")==0) {
+            diffwrite = 1;
+            i++;
+        } else if (strcmp(argv[i],"--verify")==0) {
+            verifywrites = 1;
             i++;
         } else if ((strcmp(argv[i],"-v")==0) || 
                    (strcmp(argv[i],"--verbose")==0)) {
@@ -335,6 +533,34 @@ int main(int argc, char* argv[])
                    (strcmp(argv[i],"--convert")==0)) {
             action = CONVERT_TO_FAT32;
             i++;
+        } else if (strcmp(argv[i],"--verify-all")==0) {
+            action = VERIFY_ALL;
+            i++;
+        } else if (strcmp(argv[i],"--fs-list")==0) {
+            action = FS_LIST;
+            i++;
+            if (i == argc) { print_usage(); return 1; }
+            fspath=argv[i];
+            i++;
+        } else if (strcmp(argv[i],"--fs-stat")==0) {
+            action = FS_STAT;
+            i++;
+            if (i == argc) { print_usage(); return 1; }
+            fspath=argv[i];
+            i++;
+        } else if (strcmp(argv[i],"--fs-extract")==0) {
+            action = FS_EXTRACT;
+            i++;
+            if (i + 1 >= argc) { print_usage(); return 1; }
+            fspath=argv[i];
+            filename=argv[i+1];
+            i+=2;
+        } else if (strcmp(argv[i],"--compact")==0) {
+            action = COMPACT_PARTITION;
+            i++;
+        } else if (strcmp(argv[i],"--dry-run")==0) {
+            dryrun = 1;
+            i++;
         } else {
             print_usage(); return 1;
         }
@@ -349,6 +575,16 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    if (dryrun && writes_to_ipod(action)) {
+        /* Nothing is written, so there is nothing to verify */
+        verifywrites = 0;
+    }
+
+    if (verifywrites) {
+        verify_init(&verifier);
+        ipod.verify = &verifier;
+    }
+
     fprintf(stderr,"[INFO] Reading partition table from %s\n",ipod.diskname);
     fprintf(stderr,"[INFO] Sector size is %d bytes\n",ipod.sector_size);
 
@@ -364,7 +600,19 @@ int main(int argc, char* argv[])
         return 3;
     }
 
-    read_directory(&ipod);
+#ifdef __WIN32__
+    /* Windows requires the ipod in R/W mode for SCSI Inquiry */
+    if (ipod_reopen_rw(&ipod) < 0) {
+        return 5;
+    }
+#endif
+
+    /* The XML info for --dump-xml isn't cached */
+    cached = (action != DUMP_XML) && (devcache_load(&ipod) == 0);
+
+    if (!cached) {
+        read_directory(&ipod);
+    }
 
     if (ipod.nimages <= 0) {
         fprintf(stderr,"[ERR]  Failed to read firmware directory - nimages=%d\n",ipod.nimages);
@@ -377,21 +625,17 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-#ifdef __WIN32__
-    /* Windows requires the ipod in R/W mode for SCSI Inquiry */
-    if (ipod_reopen_rw(&ipod) < 0) {
-        return 5;
-    }
-#endif
-
-
     /* Read the XML info, and if successful, look for the ramsize 
        (only available for some models - set to 0 if not known) */
 
-    ipod.ramsize = 0;
+    if (!cached) {
+        ipod.ramsize = 0;
 
-    if (ipod_get_xmlinfo(&ipod) == 0) {
-        ipod_get_ramsize(&ipod);
+        if (ipod_get_xmlinfo(&ipod) == 0) {
+            ipod_get_ramsize(&ipod);
+            devcache_save(&ipod);
+            cached = 1;
+        }
     }
 
     printf("[INFO] Ipod model: %s ",ipod.modelstr);
@@ -401,6 +645,12 @@ int main(int argc, char* argv[])
     if (ipod.macpod) {
         print_macpod_warning();
     }
+
+    if (dryrun && writes_to_ipod(action)) {
+        throughput = ioplan_measure(&ipod);
+        ioplan_init(&plan, 1);
+        ipod.plan = &plan;
+    }
   
     if (action==LIST_IMAGES) {
         list_images(&ipod);
@@ -474,6 +724,12 @@ int main(int argc, char* argv[])
             return 5;
         }
 
+#ifdef __WIN32__
+        if (strcmp(filename,"-")==0) {
+            setmode(STDIN_FILENO, O_BINARY);
+        }
+#endif
+
         if (write_firmware(&ipod, filename,type)==0) {
             fprintf(stderr,"[INFO] Firmware %s written to device.\n",filename);
         } else {
@@ -519,17 +775,33 @@ int main(int argc, char* argv[])
             fprintf(stderr,"[INFO] XML info written to %s.\n",filename);
         }
         close(outfile);
-    } else if (action==READ_PARTITION) {
+    } else if ((action==READ_PARTITION) || (action==READ_PARTITION_COMPRESSED)) {
         outfile = open(filename,O_CREAT|O_TRUNC|O_WRONLY|O_BINARY,S_IREAD|S_IWRITE);
         if (outfile < 0) {
            perror(filename);
            return 4;
         }
 
-        if (read_partition(&ipod, outfile) < 0) {
+        if (manifestfile != NULL) {
+            if (manifest_init(&manifest, (uint64_t)ipod.pinfo[0].size*ipod.sector_size) < 0) {
+                return 1;
+            }
+            manifest_set_device(&manifest, &ipod);
+        }
+
+        if (action==READ_PARTITION_COMPRESSED) {
+            n = read_partition_compressed(&ipod, outfile, manifestfile ? &manifest : NULL);
+        } else {
+            n = read_partition(&ipod, outfile, manifestfile ? &manifest : NULL);
+        }
+
+        if (n < 0) {
             fprintf(stderr,"[ERR]  --read-partition failed.\n");
         } else {
             fprintf(stderr,"[INFO] Partition extracted to %s.\n",filename);
+            if (manifestfile != NULL) {
+                manifest_save(&manifest, manifestfile);
+            }
         }
         close(outfile);
     } else if (action==WRITE_PARTITION) {
@@ -543,12 +815,34 @@ int main(int argc, char* argv[])
             return 2;
         }
 
-        /* Check filesize is <= partition size */
-        inputsize=filesize(infile);
+        /* Check filesize is <= partition size - for compressed backups
+           this is the size of the partition image they contain */
+        if (backup_probe(infile, &imagesize) == 1) {
+            inputsize = imagesize;
+        } else {
+            inputsize = filesize(infile);
+        }
         if (inputsize > 0) {
             if (inputsize <= (ipod.pinfo[0].size*ipod.sector_size)) {
                 fprintf(stderr,"[INFO] Input file is %u bytes\n",inputsize);
-                if (write_partition(&ipod,infile) < 0) {
+                if (manifestfile != NULL) {
+                    if ((manifest_load(&manifest, manifestfile) < 0) ||
+                        (manifest_check_device(&manifest, &ipod) < 0)) {
+                        return 1;
+                    }
+                    n = write_partition_diff(&ipod, infile, &manifest);
+
+                    /* Keep the manifest in step with the device, unless
+                       nothing was really written */
+                    if ((n == 0) && !dryrun) {
+                        manifest_save(&manifest, manifestfile);
+                    }
+                } else if (diffwrite) {
+                    n = write_partition_diff(&ipod, infile, NULL);
+                } else {
+                    n = write_partition(&ipod, infile);
+                }
+                if (n < 0) {
                     fprintf(stderr,"[ERR]  --write-partition failed.\n");
                 } else {
                     fprintf(stderr,"[INFO] %s restored to partition\n",filename);
@@ -559,33 +853,90 @@ int main(int argc, char* argv[])
         }
 
         close(infile);
+    } else if (action==WRITE_PARTITION_STREAM) {
+        if ((manifestfile != NULL) || diffwrite) {
+            fprintf(stderr,"[ERR]  --manifest and --diff can't be used when writing from standard input\n");
+            return 1;
+        }
+
+        if (ipod_reopen_rw(&ipod) < 0) {
+            return 5;
+        }
+
+#ifdef __WIN32__
+        setmode(STDIN_FILENO, O_BINARY);
+#endif
+
+        if (write_partition_stream(&ipod, STDIN_FILENO, streamsize) < 0) {
+            fprintf(stderr,"[ERR]  --write-partition failed.\n");
+        } else {
+            fprintf(stderr,"[INFO] Standard input restored to partition\n");
+        }
     } else if (action==FORMAT_PARTITION) {
-        printf("WARNING!!! YOU ARE ABOUT TO USE AN EXPERIMENTAL FEATURE.\n");
-        printf("ALL DATA ON YOUR IPOD WILL BE ERASED.\n");
-        printf("Are you sure you want to format your ipod? (y/n):");
+        if (dryrun) {
+            strcpy(yesno, "y");
+        } else {
+            printf("WARNING!!! YOU ARE ABOUT TO USE AN EXPERIMENTAL FEATURE.\n");
+            printf("ALL DATA ON YOUR IPOD WILL BE ERASED.\n");
+            printf("Are you sure you want to format your ipod? (y/n):");
+        }
         
-        if (fgets(yesno,4,stdin)) {
+        if (dryrun || fgets(yesno,4,stdin)) {
             if (yesno[0]=='y') {
                 if (ipod_reopen_rw(&ipod) < 0) {
                     return 5;
                 }
 
-                if (format_partition(&ipod,1) < 0) {
+                if (format_partition(&ipod,1,align,populatedir) < 0) {
                     fprintf(stderr,"[ERR]  Format failed.\n");
                 }
             } else {
                 fprintf(stderr,"[INFO] Format cancelled.\n");
             }
         }
+    } else if (action==COMPACT_PARTITION) {
+        if (!dryrun && (ipod_reopen_rw(&ipod) < 0)) {
+            return 5;
+        }
+
+        if (compact_partition(&ipod, dryrun) < 0) {
+            fprintf(stderr,"[ERR]  --compact failed.\n");
+        }
+    } else if (action==VERIFY_ALL) {
+        if (verify_all_images(&ipod) < 0) {
+            ipod_close(&ipod);
+            return 1;
+        }
+    } else if ((action==FS_LIST) || (action==FS_STAT) ||
+               (action==FS_EXTRACT)) {
+        int res;
+
+        loaderfs_init(&ipod);
+        if (action==FS_LIST) {
+            res = loaderfs_list(fspath);
+        } else if (action==FS_STAT) {
+            res = loaderfs_stat(fspath);
+        } else {
+            res = loaderfs_extract(fspath, filename);
+        }
+
+        if (res < 0) {
+            ipod_close(&ipod);
+            return 1;
+        }
     } else if (action==CONVERT_TO_FAT32) {
         if (!ipod.macpod) {
             printf("[ERR]  Ipod is already FAT32, aborting\n");
         } else {
-            printf("WARNING!!! YOU ARE ABOUT TO USE AN EXPERIMENTAL FEATURE.\n");
-            printf("ALL DATA ON YOUR IPOD WILL BE ERASED.\n");
-            printf("Are you sure you want to convert your ipod to FAT32? (y/n):");
+            if (dryrun) {
+                strcpy(yesno, "y");
+            } else {
+                printf("WARNING!!! YOU ARE ABOUT TO USE AN EXPERIMENTAL FEATURE.\n");
+                printf("ALL DATA ON YOUR IPOD WILL BE ERASED.\n");
+                printf("Are you sure you want to convert your ipod to FAT32? (y/n):");
+            }
         
-            if (fgets(yesno,4,stdin)) {
+            if (dryrun || fgets(yesno,4,stdin)) {
                 if (yesno[0]=='y') {
                     if (ipod_reopen_rw(&ipod) < 0) {
                         return 5;
@@ -595,7 +946,7 @@ int main(int argc, char* argv[])
                         fprintf(stderr,"[ERR]  Partition conversion failed.\n");
                     }
 
-                    if (format_partition(&ipod,1) < 0) {
+                    if (format_partition(&ipod,1,align,populatedir) < 0) {
                         fprintf(stderr,"[ERR]  Format failed.\n");
                     }
                 } else {
@@ -605,6 +956,23 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (cached && !dryrun && changes_directory(action)) {
+        devcache_save(&ipod);
+    }
+
+    if (ipod.plan != NULL) {
+        ipod.plan = NULL;
+        ioplan_print(&ipod, &plan, throughput);
+        ioplan_free(&plan);
+    }
+
+    n = 0;
+    if (verifywrites) {
+        ipod.verify = NULL;
+        n = verify_run(&ipod, &verifier);
+        verify_free(&verifier);
+    }
+
     ipod_close(&ipod);
 
 #ifdef WITH_BOOTOBJS
@@ -614,5 +982,5 @@ int main(int argc, char* argv[])
     }
 #endif
 
-    return 0;
+    return (n < 0) ? 1 : 0;
 }
@@ -0,0 +1,237 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "manifest.h"
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t get_uint64le(const unsigned char* p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+           ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) | 
+           ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) |
+           ((uint64_t)p[7] << 56);
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+uint64_t manifest_hash(const unsigned char* buf, int len)
+{
+    unsigned char tail[8];
+    uint64_t h = len;
+    uint64_t k;
+    int i;
+
+    for (i = 0; i < len; i += 8) {
+        if (len - i < 8) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, buf + i, len - i);
+            k = get_uint64le(tail);
+        } else {
+            k = get_uint64le(buf + i);
+        }
+
+        k *= 0x87c37b91114253d5ULL;
+        k = rotl64(k, 31);
+        k *= 0x4cf5ad432745937fULL;
+
+        h ^= k;
+        h = rotl64(h, 27) * 5 + 0x52dce729;
+    }
+
+    return fmix64(h ^ len);
+}
+
+int manifest_init(struct manifest_t* m, uint64_t size)
+{
+    memset(m, 0, sizeof(*m));
+    m->chunksize = MANIFEST_CHUNK_SIZE;
+    m->size = size;
+    m->nchunks = (size + m->chunksize - 1) / m->chunksize;
+    m->hashes = calloc(m->nchunks + 1, sizeof(uint64_t));
+
+    if (m->hashes == NULL) {
+        fprintf(stderr,"[ERR]  Could not allocate memory for manifest\n");
+        return -1;
+    }
+    return 0;
+}
+
+void manifest_free(struct manifest_t* m)
+{
+    free(m->hashes);
+    m->hashes = NULL;
+    m->nchunks = 0;
+}
+
+void manifest_add(struct manifest_t* m, uint64_t offset,
+                  const unsigned char* buf, int len)
+{
+    uint32_t i = offset / m->chunksize;
+    int n;
+
+    while ((len > 0) && (i < m->nchunks)) {
+        n = (len > (int)m->chunksize) ? (int)m->chunksize : len;
+        m->hashes[i++] = manifest_hash(buf, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+void manifest_set_device(struct manifest_t* m, struct ipod_t* ipod)
+{
+    snprintf(m->device, sizeof(m->device), "%s", ipod->serial);
+    m->sector_size = ipod->sector_size;
+    m->start = ipod->start;
+}
+
+int manifest_check_device(struct manifest_t* m, struct ipod_t* ipod)
+{
+    if ((m->device[0] != 0) && (ipod->serial[0] != 0) &&
+        (strcmp(m->device, ipod->serial) != 0)) {
+        fprintf(stderr,"[ERR]  Manifest was made from a different ipod (%s)\n",
+                       m->device);
+        return -1;
+    }
+
+    if ((m->sector_size != ipod->sector_size) ||
+        (m->start != (uint64_t)ipod->start) ||
+        (m->size != (uint64_t)ipod->pinfo[0].size * ipod->sector_size)) {
+        fprintf(stderr,"[ERR]  Manifest doesn't match the firmware partition - read the partition again\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int manifest_save(struct manifest_t* m, const char* filename)
+{
+    FILE* f;
+    uint32_t i;
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    fprintf(f, "# ipodpatcher partition manifest\n");
+    fprintf(f, "version 2\n");
+    fprintf(f, "chunksize %u\n", (unsigned int)m->chunksize);
+    fprintf(f, "size %" PRIu64 "\n", m->size);
+    fprintf(f, "device %s\n", (m->device[0] != 0) ? m->device : "-");
+    fprintf(f, "sector_size %d\n", m->sector_size);
+    fprintf(f, "start %" PRIu64 "\n", m->start);
+    for (i = 0; i < m->nchunks; i++) {
+        fprintf(f, "%016" PRIx64 "\n", m->hashes[i]);
+    }
+
+    if (fclose(f) != 0) {
+        perror(filename);
+        return -1;
+    }
+
+    fprintf(stderr,"[INFO] Wrote %d chunk hashes to %s\n", m->nchunks, filename);
+    return 0;
+}
+
+int manifest_load(struct manifest_t* m, const char* filename)
+{
+    FILE* f;
+    char line[128];
+    char device[64];
+    unsigned int version;
+    unsigned int chunksize;
+    int sector_size;
+    uint64_t size;
+    uint64_t start;
+    uint32_t i;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    /* Skip the comment line */
+    if ((fgets(line, sizeof(line), f) == NULL) ||
+        (fscanf(f, "version %u\n", &version) != 1)) {
+        fprintf(stderr,"[ERR]  %s is not a valid manifest\n", filename);
+        fclose(f);
+        return -1;
+    }
+
+    /* Version 1 didn't say which ipod it came from */
+    if (version != 2) {
+        fprintf(stderr,"[ERR]  %s was made by a different version of ipodpatcher - read the partition again\n",
+                       filename);
+        fclose(f);
+        return -1;
+    }
+
+    if ((fscanf(f, "chunksize %u\n", &chunksize) != 1) ||
+        (chunksize != MANIFEST_CHUNK_SIZE) ||
+        (fscanf(f, "size %" SCNu64 "\n", &size) != 1) ||
+        (fscanf(f, "device %63s\n", device) != 1) ||
+        (fscanf(f, "sector_size %d\n", &sector_size) != 1) ||
+        (fscanf(f, "start %" SCNu64 "\n", &start) != 1)) {
+        fprintf(stderr,"[ERR]  %s is not a valid manifest\n", filename);
+        fclose(f);
+        return -1;
+    }
+
+    if (manifest_init(m, size) < 0) {
+        fclose(f);
+        return -1;
+    }
+
+    if (strcmp(device, "-") != 0) {
+        snprintf(m->device, sizeof(m->device), "%s", device);
+    }
+    m->sector_size = sector_size;
+    m->start = start;
+
+    for (i = 0; i < m->nchunks; i++) {
+        if (fscanf(f, "%" SCNx64 "\n", &m->hashes[i]) != 1) {
+            fprintf(stderr,"[ERR]  Manifest %s is truncated\n", filename);
+            manifest_free(m);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
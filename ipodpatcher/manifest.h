@@ -0,0 +1,67 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __MANIFEST_H
+#define __MANIFEST_H
+
+#include <stdint.h>
+
+#include "ipodio.h"
+
+/* Per-chunk hashes of a partition image, used to find out which parts
+   of the firmware partition actually need rewriting. */
+
+#define MANIFEST_CHUNK_SIZE (1024*1024)
+
+struct manifest_t {
+    uint32_t chunksize;
+    uint64_t size;        /* Bytes covered by the manifest */
+    uint32_t nchunks;
+    uint64_t* hashes;
+
+    /* The partition the manifest describes */
+    char device[64];      /* Serial number of the ipod - empty if unknown */
+    int sector_size;
+    uint64_t start;       /* Offset in bytes of the partition */
+};
+
+/* A 64-bit non-cryptographic hash (MurmurHash3-style mixing) */
+uint64_t manifest_hash(const unsigned char* buf, int len);
+
+int manifest_init(struct manifest_t* m, uint64_t size);
+void manifest_free(struct manifest_t* m);
+
+/* Hash len bytes of image data at offset.  offset must be a multiple of
+   the chunk size and len either a multiple of it or the rest of the
+   image. */
+void manifest_add(struct manifest_t* m, uint64_t offset,
+                  const unsigned char* buf, int len);
+
+/* Record which ipod and partition the manifest describes */
+void manifest_set_device(struct manifest_t* m, struct ipod_t* ipod);
+
+/* Returns 0 if the manifest describes the firmware partition of ipod,
+   -1 (with a message) if it was made from a different ipod or the
+   partition has been moved or resized since */
+int manifest_check_device(struct manifest_t* m, struct ipod_t* ipod);
+
+int manifest_save(struct manifest_t* m, const char* filename);
+int manifest_load(struct manifest_t* m, const char* filename);
+
+#endif
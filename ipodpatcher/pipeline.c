@@ -0,0 +1,280 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ipodio.h"
+#include "pipeline.h"
+
+#define MAX_THREADS 16
+
+enum slotstate_t {
+    SLOT_FREE = 0,
+    SLOT_FILLED,
+    SLOT_WORKING,
+    SLOT_DONE
+};
+
+struct pipeline_state_t {
+    struct pipeline_t* p;
+    struct pipeline_slot_t* slots;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t produced;    /* Number of slots filled by produce() */
+    uint64_t next_work;   /* Next slot for a worker to pick up */
+    int eof;
+    int error;
+};
+
+int pipeline_default_threads(void)
+{
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    if (n < 1) {
+        n = 1;
+    } else if (n > MAX_THREADS) {
+        n = MAX_THREADS;
+    }
+    return n;
+}
+
+static void set_error(struct pipeline_state_t* s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->error = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void* worker_thread(void* arg)
+{
+    struct pipeline_state_t* s = arg;
+    struct pipeline_slot_t* slot;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (!s->error && !s->eof && (s->next_work == s->produced)) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+
+        if (s->error || (s->next_work == s->produced)) {
+            break;
+        }
+
+        slot = &s->slots[s->next_work % s->p->nslots];
+        s->next_work++;
+        slot->state = SLOT_WORKING;
+        pthread_mutex_unlock(&s->lock);
+
+        if (s->p->work(s->p->ctx, slot) < 0) {
+            set_error(s);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void* consumer_thread(void* arg)
+{
+    struct pipeline_state_t* s = arg;
+    struct pipeline_slot_t* slot;
+    int ready = (s->p->nthreads > 0) ? SLOT_DONE : SLOT_FILLED;
+    uint64_t seq;
+
+    for (seq = 0; ; seq++) {
+        slot = &s->slots[seq % s->p->nslots];
+
+        pthread_mutex_lock(&s->lock);
+        while (!s->error && (slot->state != ready) && 
+               !(s->eof && (seq == s->produced))) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->error || (slot->state != ready)) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if ((ready == SLOT_FILLED) && (s->p->work != NULL) && 
+            (s->p->work(s->p->ctx, slot) < 0)) {
+            set_error(s);
+            break;
+        }
+
+        if (s->p->consume(s->p->ctx, slot) < 0) {
+            set_error(s);
+            break;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return NULL;
+}
+
+int pipeline_run(struct pipeline_t* p)
+{
+    struct pipeline_state_t s;
+    struct pipeline_slot_t* slot;
+    pthread_t workers[MAX_THREADS];
+    pthread_t consumer;
+    int nworkers = 0;
+    int consumer_started = 0;
+    int i;
+    int res;
+    int error;
+    uint64_t seq;
+
+    if (p->work == NULL) {
+        p->nthreads = 0;
+    } else if (p->nthreads > MAX_THREADS) {
+        p->nthreads = MAX_THREADS;
+    }
+
+    if (p->nslots <= 0) {
+        /* Enough to keep every worker busy while the producer and
+           consumer are each holding one */
+        p->nslots = 2 * p->nthreads + 2;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.p = p;
+    s.slots = calloc(p->nslots, sizeof(struct pipeline_slot_t));
+    if (s.slots == NULL) {
+        fprintf(stderr,"[ERR]  Could not allocate pipeline\n");
+        return -1;
+    }
+
+    for (i = 0; i < p->nslots; i++) {
+        if ((ipod_alloc_buffer(&s.slots[i].inbuf, p->inbufsize) < 0) ||
+            ((p->outbufsize > 0) && 
+             (ipod_alloc_buffer(&s.slots[i].outbuf, p->outbufsize) < 0)) ||
+            ((p->ncrcs > 0) &&
+             ((s.slots[i].crcs = malloc(p->ncrcs * sizeof(uint32_t))) == NULL))) {
+            fprintf(stderr,"[ERR]  Could not allocate pipeline buffers\n");
+            s.error = 1;
+            goto cleanup;
+        }
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    for (i = 0; i < p->nthreads; i++) {
+        if (pthread_create(&workers[i], NULL, worker_thread, &s) != 0) {
+            break;
+        }
+        nworkers++;
+    }
+
+    if (nworkers == 0) {
+        /* No worker threads at all - let the consumer do the work */
+        p->nthreads = 0;
+    }
+
+    if (pthread_create(&consumer, NULL, consumer_thread, &s) != 0) {
+        fprintf(stderr,"[ERR]  Could not start pipeline thread\n");
+        set_error(&s);
+    } else {
+        consumer_started = 1;
+    }
+
+    /* The producer runs here */
+    for (seq = 0; consumer_started; seq++) {
+        slot = &s.slots[seq % p->nslots];
+
+        pthread_mutex_lock(&s.lock);
+        while (!s.error && (slot->state != SLOT_FREE)) {
+            pthread_cond_wait(&s.cond, &s.lock);
+        }
+        error = s.error;
+        pthread_mutex_unlock(&s.lock);
+
+        if (error) {
+            break;
+        }
+
+        slot->seq = seq;
+        slot->inlen = 0;
+        slot->outlen = 0;
+        slot->flags = 0;
+        slot->checksum = 0;
+        slot->hash = 0;
+
+        res = p->produce(p->ctx, slot);
+
+        pthread_mutex_lock(&s.lock);
+        if (res < 0) {
+            s.error = 1;
+        } else if (res == 0) {
+            s.eof = 1;
+        } else {
+            slot->state = SLOT_FILLED;
+            s.produced++;
+        }
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+
+        if (res <= 0) {
+            break;
+        }
+    }
+
+    /* Make sure everyone wakes up and exits */
+    pthread_mutex_lock(&s.lock);
+    s.eof = 1;
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+
+    if (consumer_started) {
+        pthread_join(consumer, NULL);
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+
+cleanup:
+    for (i = 0; i < p->nslots; i++) {
+        if (s.slots[i].inbuf) ipod_free_buffer(s.slots[i].inbuf);
+        if (s.slots[i].outbuf) ipod_free_buffer(s.slots[i].outbuf);
+        free(s.slots[i].crcs);
+    }
+    free(s.slots);
+
+    return s.error ? -1 : 0;
+}
@@ -0,0 +1,73 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stdint.h>
+
+/* A bounded producer -> workers -> consumer pipeline over a ring of
+   buffers, used to keep the disk busy while data is being compressed,
+   hashed or encrypted.
+
+   produce() runs in the calling thread and fills slots in order,
+   work() runs on up to nthreads worker threads in any order, and
+   consume() runs on its own thread and sees the slots in the order
+   they were produced.  Each stage returns 0 on success or -1 to abort
+   the pipeline, and produce() returns 1 for "slot filled" and 0 for
+   end of input.
+
+   With a single worker thread, work() also sees the slots in order, so
+   a stage that keeps state between slots (e.g. a stream cipher) can run
+   there, overlapped with both the producer and the consumer.
+*/
+
+struct pipeline_slot_t {
+    unsigned char* inbuf;
+    unsigned char* outbuf;
+    int inlen;
+    int outlen;
+    int flags;            /* For use by the stages */
+    uint32_t checksum;    /* For use by the stages */
+    uint64_t hash;        /* For use by the stages */
+    uint32_t* crcs;       /* For use by the stages - ncrcs entries */
+    uint64_t seq;         /* Sequence number, starting at 0 */
+    int state;            /* Private */
+};
+
+typedef int (*pipeline_stage_fn)(void* ctx, struct pipeline_slot_t* slot);
+
+struct pipeline_t {
+    int nthreads;         /* Worker threads - 0 runs work() in the consumer */
+    int nslots;           /* Buffers in flight - 0 for a default */
+    int inbufsize;
+    int outbufsize;       /* 0 if the stages don't need an output buffer */
+    int ncrcs;            /* Size of each slot's crcs array, 0 for none */
+    pipeline_stage_fn produce;
+    pipeline_stage_fn work;     /* May be NULL */
+    pipeline_stage_fn consume;
+    void* ctx;
+};
+
+/* Number of worker threads to use by default - one per CPU */
+int pipeline_default_threads(void);
+
+int pipeline_run(struct pipeline_t* p);
+
+#endif
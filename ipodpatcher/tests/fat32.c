@@ -0,0 +1,916 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+/* Test for fat32format.c and fat32write.c on an image file.
+
+   A small tree is written to a temporary directory, and a partition
+   with a misaligned start is formatted and populated from it, with
+   512 and 4096 byte sectors, and once more without the tree.  The
+   image is then read back by hand: the boot sector and its backup, the
+   FSInfo sector, the position and alignment of the FATs and the data
+   area, the two FAT copies, the long and short names in the
+   directories and the file contents.  Every write is recorded with
+   --verify's recorder and read back, and must fail to verify once a
+   byte of the boot sector, which is zeroed and then written, has been
+   changed behind its back.
+
+   The populated images are also read through ipodloader2's drivers
+   with loaderfs.c, as --fs-list and --fs-extract do: the listings, the
+   extracted files, and reads at unaligned offsets and across the end
+   of each file are compared with the tree.
+
+   Run with -v to see what format_partition() and the drivers print. */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ipodpatcher.h"
+#include "ipodio.h"
+#include "verify.h"
+#include "loaderfs.h"
+
+/* From ipodloader2 */
+#include "bootloader.h"
+#include "vfs.h"
+
+/* Normally in ipodpatcher.c and main.c */
+unsigned char* ipod_sectorbuf = NULL;
+int ipod_verbose = 0;
+
+#define PART_START  63       /* In sectors - deliberately misaligned */
+#define PART_SIZE   70000    /* In sectors */
+
+#define LONGNAME "a very long file name that needs several lfn entries, more than two.txt"
+
+struct testfile_t {
+    const char* path;        /* Relative to the source directory */
+    const char* name;        /* The name in its FAT directory */
+    const char* shortname;   /* The expected 8.3 name */
+    int haslfn;
+    int size;
+};
+
+static const struct testfile_t files[] = {
+    { "README.TXT",        "README.TXT",  "README  TXT", 0, 1000 },
+    { LONGNAME,            LONGNAME,      "AVERYL~1TXT", 1, 5000 },
+    { "lower.txt",         "lower.txt",   "LOWER   TXT", 1, 10 },
+    { "empty",             "empty",       "EMPTY      ", 1, 0 },
+    { "Music/song 1.mp3",  "song 1.mp3",  "SONG1~1 MP3", 1, 300000 },
+};
+#define NFILES (int)(sizeof(files) / sizeof(files[0]))
+
+/* Differs from README.TXT only in case, so it must be skipped */
+#define CASECLASH "Readme.txt"
+
+static int errors;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); errors++; } \
+} while (0)
+
+static unsigned int get16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* The contents of file i, different for every file and position */
+static unsigned char file_byte(int i, int pos)
+{
+    return (pos * 7 + i * 31 + (pos >> 9)) & 0xff;
+}
+
+static int make_tree(const char* dir)
+{
+    char path[4096];
+    FILE* f;
+    int i, j;
+
+    snprintf(path, sizeof(path), "%s/Music", dir);
+    if (mkdir(path, 0700) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < NFILES; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i].path);
+        f = fopen(path, "wb");
+        if (f == NULL) {
+            return -1;
+        }
+        for (j = 0; j < files[i].size; j++) {
+            fputc(file_byte(i, j), f);
+        }
+        fclose(f);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, CASECLASH);
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    fputs("clash", f);
+    fclose(f);
+    return 0;
+}
+
+/* Send fd to the file at path, returning a copy of the old fd for
+   restore_fd() */
+static int redirect_fd(int fd, const char* path)
+{
+    int saved, newfd;
+
+    fflush((fd == 1) ? stdout : stderr);
+    saved = dup(fd);
+    newfd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if ((saved < 0) || (newfd < 0)) {
+        if (saved >= 0) {
+            close(saved);
+        }
+        if (newfd >= 0) {
+            close(newfd);
+        }
+        return -1;
+    }
+    dup2(newfd, fd);
+    close(newfd);
+    return saved;
+}
+
+static void restore_fd(int fd, int saved)
+{
+    if (saved >= 0) {
+        fflush((fd == 1) ? stdout : stderr);
+        dup2(saved, fd);
+        close(saved);
+    }
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag,
+                        struct FTW* ftw)
+{
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+/* The image as read back */
+struct image_t {
+    int fd;
+    uint64_t base;           /* Byte offset of the partition */
+    uint32_t bps;
+    uint32_t cluster_bytes;
+    uint64_t fat1, fat2, data;
+    uint32_t clusters;
+    uint32_t* fat;
+};
+
+static int read_at(struct image_t* img, void* buf, size_t len, uint64_t pos)
+{
+    return (pread(img->fd, buf, len, pos) == (ssize_t)len) ? 0 : -1;
+}
+
+/* Read a cluster chain into a malloc'd buffer, returning its length */
+static unsigned char* read_chain(struct image_t* img, uint32_t cluster,
+                                 uint32_t* len)
+{
+    unsigned char* buf = NULL;
+    uint32_t n = 0;
+
+    while ((cluster >= 2) && (cluster < img->clusters + 2)) {
+        buf = realloc(buf, (n + 1) * img->cluster_bytes);
+        if (read_at(img, buf + n * img->cluster_bytes, img->cluster_bytes,
+                    img->data + (uint64_t)(cluster - 2) * img->cluster_bytes) < 0) {
+            free(buf);
+            return NULL;
+        }
+        n++;
+        cluster = img->fat[cluster] & 0x0fffffff;
+    }
+
+    CHECK(cluster >= 0x0ffffff8 || n == 0,
+          "cluster chain ends in 0x%08x, not an end of chain marker", cluster);
+    *len = n * img->cluster_bytes;
+    return buf;
+}
+
+static uint8_t lfn_checksum(const unsigned char* sn)
+{
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + sn[i];
+    }
+    return sum;
+}
+
+/* Find name in the directory at cluster, checking its LFN entries on the
+   way.  Returns a pointer to the short entry in *dirbuf, or NULL. */
+static unsigned char* find_entry(struct image_t* img, uint32_t cluster,
+                                 const char* name, unsigned char** dirbuf,
+                                 int* nlfn)
+{
+    static const int offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20,
+                                     22, 24, 28, 30 };
+    char lfn[256];
+    int lfnparts = 0;
+    int expect = 0;
+    uint8_t sum = 0;
+    unsigned char* p;
+    uint32_t len, off;
+    int i, seq, ended;
+
+    *dirbuf = read_chain(img, cluster, &len);
+    if (*dirbuf == NULL) {
+        return NULL;
+    }
+
+    for (off = 0; off < len; off += 32) {
+        p = *dirbuf + off;
+        if (p[0] == 0) {
+            break;
+        }
+
+        if (p[11] == 0x0f) {
+            seq = p[0] & 0x3f;
+            if (p[0] & 0x40) {
+                memset(lfn, 0, sizeof(lfn));
+                lfnparts = seq;
+                expect = seq;
+                sum = p[13];
+            }
+            CHECK((seq == expect) && (seq >= 1) && (p[13] == sum),
+                  "LFN entries out of order before \"%s\"", lfn);
+            for (i = 0, ended = 0; i < 13; i++) {
+                unsigned int ch = get16(p + offsets[i]);
+                if (ended) {
+                    /* After the terminating 0 the name is padded with 0xffff */
+                    CHECK(ch == 0xffff, "LFN of \"%s\" padded with 0x%04x", lfn, ch);
+                } else if ((seq - 1) * 13 + i < 255) {
+                    lfn[(seq - 1) * 13 + i] = (ch < 0x80) ? ch : '?';
+                }
+                if (ch == 0) {
+                    ended = 1;
+                }
+            }
+            expect--;
+            continue;
+        }
+
+        if (lfnparts) {
+            CHECK(expect == 0, "LFN for \"%s\" is missing entries", lfn);
+            CHECK(lfn_checksum(p) == sum,
+                  "LFN checksum of \"%s\" doesn't match its short name", lfn);
+        }
+
+        if (lfnparts ? !strcmp(lfn, name) :
+                       !strncmp((char*)p, name, 11)) {
+            *nlfn = lfnparts;
+            return p;
+        }
+        lfnparts = 0;
+    }
+
+    return NULL;
+}
+
+static int valid_short_name(const unsigned char* sn)
+{
+    int i;
+
+    for (i = 0; i < 11; i++) {
+        if ((sn[i] >= 'a') && (sn[i] <= 'z'))
+            return 0;
+        if ((sn[i] < 0x20) || strchr("\"*+,./:;<=>?[\\]|", sn[i]))
+            return 0;
+    }
+    return sn[0] != ' ';
+}
+
+static void check_file(struct image_t* img, uint32_t dircluster, int i)
+{
+    unsigned char* dirbuf;
+    unsigned char* p;
+    unsigned char* data;
+    uint32_t cluster, len;
+    int nlfn = 0;
+    int j;
+
+    p = find_entry(img, dircluster, files[i].name, &dirbuf, &nlfn);
+
+    /* Names without an LFN are looked up by their 8.3 name */
+    if ((p == NULL) && !files[i].haslfn) {
+        free(dirbuf);
+        p = find_entry(img, dircluster, files[i].shortname, &dirbuf, &nlfn);
+    }
+    if (p == NULL) {
+        CHECK(0, "\"%s\" not found", files[i].path);
+        free(dirbuf);
+        return;
+    }
+
+    CHECK(valid_short_name(p), "\"%s\" has an invalid short name \"%.11s\"",
+          files[i].path, p);
+    CHECK(!memcmp(p, files[i].shortname, 11),
+          "\"%s\" has the short name \"%.11s\", not \"%s\"",
+          files[i].path, p, files[i].shortname);
+    CHECK((nlfn != 0) == files[i].haslfn, "\"%s\" %s an LFN", files[i].path,
+          nlfn ? "has" : "doesn't have");
+    CHECK(nlfn == 0 || nlfn == ((int)strlen(files[i].name) + 12) / 13,
+          "\"%s\" has %d LFN entries", files[i].path, nlfn);
+    CHECK(p[11] == 0x20, "\"%s\" has attributes 0x%02x", files[i].path, p[11]);
+    CHECK((int)get32(p + 28) == files[i].size, "\"%s\" has size %u, not %d",
+          files[i].path, get32(p + 28), files[i].size);
+
+    cluster = (get16(p + 20) << 16) | get16(p + 26);
+    free(dirbuf);
+
+    if (files[i].size == 0) {
+        CHECK(cluster == 0, "empty \"%s\" has cluster %u", files[i].path, cluster);
+        return;
+    }
+
+    data = read_chain(img, cluster, &len);
+    if ((data == NULL) || (len < (uint32_t)files[i].size) ||
+        (len - files[i].size >= img->cluster_bytes)) {
+        CHECK(0, "\"%s\" has %u bytes of clusters for %d bytes", files[i].path,
+              len, files[i].size);
+        free(data);
+        return;
+    }
+
+    for (j = 0; j < files[i].size; j++) {
+        if (data[j] != file_byte(i, j)) {
+            CHECK(0, "\"%s\" differs at byte %d", files[i].path, j);
+            break;
+        }
+    }
+    free(data);
+}
+
+/* The files and directories written from the test tree */
+static void check_tree(struct image_t* img)
+{
+    unsigned char* dirbuf;
+    unsigned char* p;
+    int nlfn, n;
+
+    /* The root directory */
+    for (n = 0; n < NFILES; n++) {
+        if (strchr(files[n].path, '/') == NULL) {
+            check_file(img, 2, n);
+        }
+    }
+
+    p = find_entry(img, 2, CASECLASH, &dirbuf, &nlfn);
+    CHECK(p == NULL, "\"%s\" was written next to \"%s\"", CASECLASH, files[0].name);
+    free(dirbuf);
+
+    p = find_entry(img, 2, "Music", &dirbuf, &nlfn);
+    if (p == NULL) {
+        CHECK(0, "directory \"Music\" not found");
+    } else {
+        uint32_t cluster = (get16(p + 20) << 16) | get16(p + 26);
+        unsigned char* sub;
+        uint32_t len;
+
+        CHECK(p[11] == 0x10, "\"Music\" has attributes 0x%02x", p[11]);
+        CHECK(!memcmp(p, "MUSIC      ", 11), "\"Music\" has the short name \"%.11s\"", p);
+
+        sub = read_chain(img, cluster, &len);
+        if (sub != NULL) {
+            CHECK(!memcmp(sub, ".          ", 11) &&
+                  ((get16(sub + 20) << 16) | get16(sub + 26)) == cluster,
+                  "bad \".\" entry in \"Music\"");
+            CHECK(!memcmp(sub + 32, "..         ", 11) &&
+                  ((get16(sub + 52) << 16) | get16(sub + 58)) == 0,
+                  "bad \"..\" entry in \"Music\"");
+            free(sub);
+        }
+
+        for (n = 0; n < NFILES; n++) {
+            if (!strncmp(files[n].path, "Music/", 6)) {
+                check_file(img, cluster, n);
+            }
+        }
+    }
+    free(dirbuf);
+}
+
+/* Returns the number of clusters */
+static uint32_t check_image(const char* imgpath, int ss, int align, int populated)
+{
+    struct image_t img;
+    unsigned char mbr[512];
+    unsigned char* bs;
+    unsigned char* backup;
+    unsigned char* fat2;
+    unsigned char* root;
+    unsigned char* p;
+    uint32_t rsv, nfats, fatsize, spc, used, i;
+
+    memset(&img, 0, sizeof(img));
+    img.fd = open(imgpath, O_RDONLY);
+    if (img.fd < 0) {
+        CHECK(0, "can't open %s", imgpath);
+        return 0;
+    }
+
+    img.base = (uint64_t)PART_START * ss;
+    bs = malloc(2 * ss);
+    backup = malloc(2 * ss);
+    read_at(&img, mbr, sizeof(mbr), 0);
+    read_at(&img, bs, 2 * ss, img.base);
+
+    /* The boot sector */
+    img.bps = get16(bs + 11);
+    spc = bs[13];
+    rsv = get16(bs + 14);
+    nfats = bs[16];
+    fatsize = get32(bs + 36);
+    CHECK(img.bps == (uint32_t)ss, "%u bytes per sector", img.bps);
+    CHECK(spc && !(spc & (spc - 1)) && (spc * img.bps <= 32768),
+          "%u sectors per cluster", spc);
+    CHECK(nfats == 2, "%u FATs", nfats);
+    CHECK(get16(bs + 17) == 0 && get16(bs + 19) == 0 && get16(bs + 22) == 0,
+          "FAT12/16 fields are set");
+    CHECK(get32(bs + 28) == PART_START, "hidden sectors %u", get32(bs + 28));
+    CHECK(get32(bs + 32) == PART_SIZE, "total sectors %u", get32(bs + 32));
+    CHECK(get32(bs + 44) == 2, "root directory in cluster %u", get32(bs + 44));
+    CHECK(get16(bs + 48) == 1 && get16(bs + 50) == 6,
+          "FSInfo in sector %u, backup boot sector in %u",
+          get16(bs + 48), get16(bs + 50));
+    CHECK(bs[66] == 0x29 && !memcmp(bs + 82, "FAT32   ", 8),
+          "no FAT32 extended boot signature");
+    CHECK(bs[510] == 0x55 && bs[511] == 0xaa, "no boot sector signature");
+
+    read_at(&img, backup, 2 * ss, img.base + 6 * ss);
+    CHECK(!memcmp(bs, backup, 2 * ss), "backup boot sector differs");
+
+    /* Where the FATs and the data area are, and that they are aligned on
+       the disk, not just in the partition */
+    img.cluster_bytes = spc * img.bps;
+    img.fat1 = img.base + (uint64_t)rsv * img.bps;
+    img.fat2 = img.fat1 + (uint64_t)fatsize * img.bps;
+    img.data = img.fat1 + (uint64_t)nfats * fatsize * img.bps;
+    img.clusters = (PART_SIZE - rsv - nfats * fatsize) / spc;
+    CHECK(rsv >= 32, "only %u reserved sectors", rsv);
+    CHECK(img.fat1 % align == 0, "first FAT at %llu, not aligned to %d",
+          (unsigned long long)img.fat1, align);
+    CHECK(img.fat2 % align == 0, "second FAT at %llu, not aligned to %d",
+          (unsigned long long)img.fat2, align);
+    CHECK(img.data % align == 0, "data area at %llu, not aligned to %d",
+          (unsigned long long)img.data, align);
+    CHECK((uint64_t)fatsize * img.bps / 4 >= img.clusters + 2,
+          "FAT of %u sectors is too small for %u clusters", fatsize, img.clusters);
+
+    /* Both FATs */
+    img.fat = malloc((size_t)fatsize * img.bps);
+    fat2 = malloc((size_t)fatsize * img.bps);
+    read_at(&img, img.fat, (size_t)fatsize * img.bps, img.fat1);
+    read_at(&img, fat2, (size_t)fatsize * img.bps, img.fat2);
+    CHECK(!memcmp(img.fat, fat2, (size_t)fatsize * img.bps), "the FATs differ");
+    free(fat2);
+
+    CHECK(img.fat[0] == 0x0ffffff8 && img.fat[1] == 0x0fffffff,
+          "reserved FAT entries are 0x%08x 0x%08x", img.fat[0], img.fat[1]);
+
+    /* Everything was allocated from cluster 2 without gaps */
+    for (used = 0; (used < img.clusters) && img.fat[used + 2]; used++)
+        ;
+    for (i = used; i < img.clusters; i++) {
+        if (img.fat[i + 2]) {
+            CHECK(0, "cluster %u in use after free cluster %u", i + 2, used + 2);
+            break;
+        }
+    }
+
+    /* The FSInfo sector */
+    p = bs + ss;
+    CHECK(get32(p) == 0x41615252 && get32(p + 484) == 0x61417272 &&
+          get32(p + 508) == 0xaa550000, "bad FSInfo signatures");
+    CHECK(get32(p + 488) == img.clusters - used,
+          "FSInfo says %u free clusters, the FAT %u", get32(p + 488),
+          img.clusters - used);
+    CHECK(get32(p + 492) == used + 2, "FSInfo next free cluster %u, not %u",
+          get32(p + 492), used + 2);
+
+    if (!populated) {
+        /* Only the root directory is in use, and it is empty */
+        CHECK(used == 1, "%u clusters in use, not just the root directory", used);
+        CHECK(img.fat[2] == 0x0fffffff, "root directory FAT entry 0x%08x", img.fat[2]);
+        root = malloc(img.cluster_bytes);
+        read_at(&img, root, img.cluster_bytes, img.data);
+        for (i = 0; (i < img.cluster_bytes) && (root[i] == 0); i++)
+            ;
+        CHECK(i == img.cluster_bytes, "root directory not empty at byte %u", i);
+        free(root);
+    } else {
+        check_tree(&img);
+    }
+
+    free(img.fat);
+    free(bs);
+    free(backup);
+    close(img.fd);
+    return img.clusters;
+}
+
+static int format_image(const char* imgpath, const char* srcdir, int ss,
+                        int align, int verbose)
+{
+    struct ipod_t ipod;
+    struct verify_t v;
+    unsigned char c;
+    int fd, olderr = -1, res;
+
+    fd = open(imgpath, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if ((fd < 0) ||
+        (ftruncate(fd, (off_t)(PART_START + PART_SIZE) * ss) < 0)) {
+        return -1;
+    }
+    close(fd);
+
+    memset(&ipod, 0, sizeof(ipod));
+    snprintf(ipod.diskname, sizeof(ipod.diskname), "%s", imgpath);
+    if ((ipod_open(&ipod, 1) < 0) || (ipod_reopen_rw(&ipod) < 0)) {
+        return -1;
+    }
+
+    /* An image file has no sector size of its own */
+    ipod.sector_size = ss;
+    ipod.phys_sector_size = ss;
+    ipod.sectors_per_track = 63;
+    ipod.num_heads = 255;
+    ipod.pinfo[1].start = PART_START;
+    ipod.pinfo[1].size = PART_SIZE;
+    ipod.pinfo[1].type = 0x0b;
+
+    if (!verbose) {
+        olderr = redirect_fd(2, "/dev/null");
+    }
+
+    verify_init(&v);
+    ipod.verify = &v;
+    res = format_partition(&ipod, 1, align, srcdir);
+    ipod.verify = NULL;
+
+    if ((res == 0) && (verify_run(&ipod, &v) < 0)) {
+        printf("FAIL: the writes don't verify\n");
+        errors++;
+    }
+
+    /* Change a byte of the boot sector - that must be caught */
+    fd = open(imgpath, O_RDWR);
+    if ((res == 0) && (fd >= 0) &&
+        (pread(fd, &c, 1, (off_t)PART_START * ss + 3) == 1)) {
+        c ^= 0xff;
+        pwrite(fd, &c, 1, (off_t)PART_START * ss + 3);
+        if (verify_run(&ipod, &v) == 0) {
+            printf("FAIL: a changed boot sector verifies\n");
+            errors++;
+        }
+        c ^= 0xff;
+        pwrite(fd, &c, 1, (off_t)PART_START * ss + 3);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    verify_free(&v);
+
+    restore_fd(2, olderr);
+
+    ipod_close(&ipod);
+    return res;
+}
+
+/* Reading the image through ipodloader2's drivers */
+
+/* The drivers find the partition through the partition table, which
+   format_partition() doesn't write.  It is the second entry, as on an
+   ipod. */
+static int write_mbr(const char* imgpath)
+{
+    unsigned char mbr[512];
+    unsigned char* p = mbr + 446 + 16;
+    int fd, res;
+
+    memset(mbr, 0, sizeof(mbr));
+    p[4] = 0x0b;
+    p[8] = PART_START & 0xff;
+    p[9] = (PART_START >> 8) & 0xff;
+    p[12] = PART_SIZE & 0xff;
+    p[13] = (PART_SIZE >> 8) & 0xff;
+    p[14] = (PART_SIZE >> 16) & 0xff;
+    mbr[510] = 0x55;
+    mbr[511] = 0xaa;
+
+    fd = open(imgpath, O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    res = (pwrite(fd, mbr, sizeof(mbr), 0) == sizeof(mbr)) ? 0 : -1;
+    close(fd);
+    return res;
+}
+
+/* Whether the len bytes in buf are bytes pos onwards of file i */
+static int same_data(const unsigned char* buf, int i, int pos, int len)
+{
+    int j;
+
+    for (j = 0; j < len; j++) {
+        if (buf[j] != file_byte(i, pos + j)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* What loaderfs_list() prints for path, in a malloc'd string */
+static char* list_dir(const char* path, const char* outpath)
+{
+    char* buf;
+    FILE* f;
+    size_t n;
+    int saved, res;
+
+    saved = redirect_fd(1, outpath);
+    if (saved < 0) {
+        return NULL;
+    }
+    res = loaderfs_list(path);
+    restore_fd(1, saved);
+
+    f = fopen(outpath, "rb");
+    buf = malloc(65536);
+    if ((res < 0) || (f == NULL) || (buf == NULL)) {
+        CHECK(0, "can't list \"%s\"", path);
+        if (f != NULL) {
+            fclose(f);
+        }
+        free(buf);
+        return NULL;
+    }
+    n = fread(buf, 1, 65535, f);
+    buf[n] = 0;
+    fclose(f);
+    return buf;
+}
+
+static void check_listing(const char* outpath)
+{
+    char line[300];
+    char* root;
+    char* music;
+    int i;
+
+    root = list_dir("/", outpath);
+    music = list_dir("[fat]/music", outpath);
+    if ((root == NULL) || (music == NULL)) {
+        free(root);
+        free(music);
+        return;
+    }
+
+    for (i = 0; i < NFILES; i++) {
+        const char* name = strrchr(files[i].path, '/');
+
+        snprintf(line, sizeof(line), "%12d  %s\n", files[i].size,
+                 name ? name + 1 : files[i].path);
+        CHECK(strstr(name ? music : root, line) != NULL,
+              "\"%s\" isn't listed with size %d", files[i].path, files[i].size);
+    }
+    CHECK(strstr(root, "       <dir>  Music/\n") != NULL, "\"Music\" isn't listed");
+    CHECK(strstr(root, "  " CASECLASH "\n") == NULL, "\"%s\" is listed", CASECLASH);
+
+    free(root);
+    free(music);
+}
+
+/* Extract file i under the name path, and compare it with the tree */
+static void check_extract(const char* path, int i, const char* outpath)
+{
+    unsigned char* buf;
+    FILE* f;
+    size_t n = 0;
+
+    if (loaderfs_extract(path, outpath) < 0) {
+        CHECK(0, "can't extract \"%s\"", path);
+        return;
+    }
+
+    buf = malloc(files[i].size + 1);
+    f = fopen(outpath, "rb");
+    if ((buf != NULL) && (f != NULL)) {
+        n = fread(buf, 1, files[i].size + 1, f);
+    }
+    CHECK((int)n == files[i].size && same_data(buf, i, 0, n),
+          "\"%s\" extracted as %d bytes, %s", path, (int)n,
+          ((int)n == files[i].size) ? "with different contents" : "not the file");
+    if (f != NULL) {
+        fclose(f);
+    }
+    free(buf);
+}
+
+/* Reads at offsets that aren't aligned to sectors or clusters, reads
+   that run past the end of file i, and a sequential read in odd-sized
+   pieces.  Offsets below zero count back from the end of the file. */
+static void check_reads(int i)
+{
+    static const int offsets[] = { 0, 1, 511, 513, 4095, 4097, 32767, 32769,
+                                   65537, -4097, -5, -1 };
+    static const int lengths[] = { 1, 100, 4099, 70001 };
+    char path[300];
+    unsigned char* buf;
+    int size = files[i].size;
+    int fd, k, l, pos, want;
+    size_t got;
+
+    snprintf(path, sizeof(path), "[fat]/%s", files[i].path);
+    fd = vfs_open(path);
+    if (fd < 0) {
+        CHECK(0, "can't open \"%s\"", path);
+        return;
+    }
+    buf = malloc(70001);
+
+    for (k = 0; k < (int)(sizeof(offsets) / sizeof(offsets[0])); k++) {
+        pos = (offsets[k] < 0) ? size + offsets[k] : offsets[k];
+        if ((pos < 0) || (pos > size)) {
+            continue;
+        }
+        for (l = 0; l < (int)(sizeof(lengths) / sizeof(lengths[0])); l++) {
+            want = (lengths[l] < size - pos) ? lengths[l] : size - pos;
+            CHECK(vfs_seek(fd, pos, VFS_SEEK_SET) == 0,
+                  "can't seek to %d in \"%s\"", pos, path);
+            got = vfs_read(buf, 1, lengths[l], fd);
+            CHECK((int)got == want, "read of %d bytes at %d in \"%s\" gave %d, not %d",
+                  lengths[l], pos, path, (int)got, want);
+            CHECK(((int)got != want) || same_data(buf, i, pos, want),
+                  "read of %d bytes at %d in \"%s\" differs", lengths[l], pos, path);
+            CHECK(vfs_tell(fd) == pos + want, "read at %d in \"%s\" left the position at %ld",
+                  pos, path, vfs_tell(fd));
+        }
+    }
+
+    /* Nothing is left at the end, and there is nothing beyond it */
+    CHECK(vfs_seek(fd, 0, VFS_SEEK_END) == 0 && vfs_read(buf, 1, 100, fd) == 0,
+          "read at the end of \"%s\" returned data", path);
+    CHECK(vfs_seek(fd, 1, VFS_SEEK_END) != 0, "seek past the end of \"%s\" worked", path);
+
+    vfs_seek(fd, 0, VFS_SEEK_SET);
+    for (pos = 0; pos < size; pos += got) {
+        got = vfs_read(buf, 1, 777, fd);
+        want = (777 < size - pos) ? 777 : size - pos;
+        if (((int)got != want) || !same_data(buf, i, pos, want)) {
+            CHECK(0, "sequential read of \"%s\" went wrong at %d", path, pos);
+            break;
+        }
+    }
+
+    vfs_close(fd);
+    free(buf);
+}
+
+static void check_loaderfs(const char* imgpath, const char* tmpdir, int ss,
+                           int verbose)
+{
+    struct ipod_t ipod;
+    char outpath[4096];
+    char path[300];
+    int olderr = -1;
+    int i;
+
+    if (write_mbr(imgpath) < 0) {
+        CHECK(0, "can't write the partition table");
+        return;
+    }
+
+    memset(&ipod, 0, sizeof(ipod));
+    snprintf(ipod.diskname, sizeof(ipod.diskname), "%s", imgpath);
+    if (ipod_open(&ipod, 1) < 0) {
+        CHECK(0, "can't open %s", imgpath);
+        return;
+    }
+    ipod.sector_size = ss;
+    ipod.phys_sector_size = ss;
+
+    snprintf(outpath, sizeof(outpath), "%s/out", tmpdir);
+    if (!verbose) {
+        olderr = redirect_fd(2, "/dev/null");
+    }
+    ipod_verbose = verbose;
+
+    loaderfs_init(&ipod);
+    check_listing(outpath);
+
+    for (i = 0; i < NFILES; i++) {
+        snprintf(path, sizeof(path), "/%s", files[i].path);
+        check_extract(path, i, outpath);
+        check_reads(i);
+    }
+
+    /* FAT names are looked up without regard to case */
+    check_extract("[fat]/readme.txt", 0, outpath);
+    CHECK(loaderfs_extract("/missing", outpath) < 0, "\"/missing\" was extracted");
+
+    ipod_verbose = 0;
+    restore_fd(2, olderr);
+    ipod_close(&ipod);
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct { int ss, align, populate; } layouts[] = {
+        { 512,  4096,      0 },
+        { 512,  4096,      1 },
+        { 512,  1024*1024, 1 },
+        { 4096, 0,         1 },
+        { 4096, 64*1024,   1 },
+    };
+    char tmpdir[1024], srcdir[4096], imgpath[4096];
+    const char* base;
+    int verbose = (argc > 1) && !strcmp(argv[1], "-v");
+    uint32_t clusters;
+    int i, align;
+
+    if (ipod_alloc_buffer(&ipod_sectorbuf, BUFFER_SIZE) < 0) {
+        fprintf(stderr,"Failed to allocate memory buffer\n");
+        return 1;
+    }
+
+    base = getenv("TMPDIR");
+    snprintf(tmpdir, sizeof(tmpdir), "%s/fat32test.XXXXXX",
+             (base && base[0]) ? base : "/tmp");
+    if (mkdtemp(tmpdir) == NULL) {
+        perror(tmpdir);
+        return 1;
+    }
+    snprintf(srcdir, sizeof(srcdir), "%s/src", tmpdir);
+    snprintf(imgpath, sizeof(imgpath), "%s/fat32.img", tmpdir);
+
+    if ((mkdir(srcdir, 0700) < 0) || (make_tree(srcdir) < 0)) {
+        printf("FAIL: can't create the test tree in %s\n", srcdir);
+        errors++;
+    }
+
+    for (i = 0; !errors && i < (int)(sizeof(layouts) / sizeof(layouts[0])); i++) {
+        align = layouts[i].align ? layouts[i].align : layouts[i].ss;
+        if (format_image(imgpath, layouts[i].populate ? srcdir : NULL,
+                         layouts[i].ss, layouts[i].align, verbose) < 0) {
+            printf("FAIL: format_partition() failed with %d byte sectors\n",
+                   layouts[i].ss);
+            errors++;
+            break;
+        }
+        clusters = check_image(imgpath, layouts[i].ss, align, layouts[i].populate);
+
+        /* The loader, like any FAT driver, takes a volume of fewer than
+           65525 clusters for FAT16 - only the small test images have so
+           few */
+        if (!errors && layouts[i].populate && (clusters >= 65525)) {
+            check_loaderfs(imgpath, tmpdir, layouts[i].ss, verbose);
+        }
+        if (errors) {
+            printf("(with %d byte sectors, aligned to %d%s)\n",
+                   layouts[i].ss, align, layouts[i].populate ? ", populated" : "");
+        }
+    }
+
+    nftw(tmpdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    if (errors) {
+        printf("fat32: %d errors\n", errors);
+        return 1;
+    }
+    printf("fat32: OK\n");
+    return 0;
+}
@@ -0,0 +1,198 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+/* Test for ioplan.c on an image file.
+
+   Writes, zeros, a flush and a deferred write are planned through the
+   ipodio layer.  While planning, the image must be untouched and reads
+   must see the planned data.  Once the plan is run, the image must hold
+   exactly what was planned.  A plan whose planning failed, and a plan
+   made inside another one (as --dry-run does), must write nothing. */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ipodpatcher.h"
+#include "ipodio.h"
+#include "ioplan.h"
+
+/* Normally in ipodpatcher.c and main.c */
+unsigned char* ipod_sectorbuf = NULL;
+int ipod_verbose = 0;
+
+#define SS       512
+#define NSECTORS 64
+#define OLD      0xaa
+
+static int errors;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); errors++; } \
+} while (0)
+
+/* What each sector of the image should hold - one byte value per sector */
+static int want[NSECTORS];
+
+static void check_image(const char* imgpath, const char* when)
+{
+    unsigned char buf[SS];
+    int fd = open(imgpath, O_RDONLY);
+    int i, j;
+
+    for (i = 0; i < NSECTORS; i++) {
+        if (pread(fd, buf, SS, (off_t)i * SS) != SS) {
+            CHECK(0, "%s: can't read sector %d", when, i);
+            break;
+        }
+        for (j = 0; (j < SS) && (buf[j] == want[i]); j++);
+        CHECK(j == SS, "%s: sector %d holds 0x%02x, not 0x%02x", when, i, buf[j], want[i]);
+    }
+    close(fd);
+}
+
+static int sector_is(unsigned char* buf, int value)
+{
+    int j;
+
+    for (j = 0; (j < SS) && (buf[j] == value); j++);
+    return j == SS;
+}
+
+static int deferred_write(struct ipod_t* ipod, void* ctx)
+{
+    unsigned char* buf = ctx;
+
+    return (ipod_write_at(ipod, buf, 2 * SS, 20 * SS) == 2 * SS) ? 0 : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    struct ipod_t ipod;
+    struct ioplan_t plan, outer;
+    unsigned char* buf;
+    unsigned char* deferbuf;
+    char imgpath[4096];
+    const char* base;
+    int fd, i;
+
+    (void)argc; (void)argv;
+
+    base = getenv("TMPDIR");
+    snprintf(imgpath, sizeof(imgpath), "%s/ioplantest.XXXXXX",
+             (base && base[0]) ? base : "/tmp");
+    fd = mkstemp(imgpath);
+    if ((fd < 0) || (ipod_alloc_buffer(&buf, 8 * SS) < 0) ||
+        (ipod_alloc_buffer(&deferbuf, 2 * SS) < 0)) {
+        printf("FAIL: can't create %s\n", imgpath);
+        return 1;
+    }
+    memset(buf, OLD, SS);
+    for (i = 0; i < NSECTORS; i++) {
+        if (write(fd, buf, SS) != SS) {
+            printf("FAIL: can't write %s\n", imgpath);
+            return 1;
+        }
+        want[i] = OLD;
+    }
+    close(fd);
+
+    memset(&ipod, 0, sizeof(ipod));
+    snprintf(ipod.diskname, sizeof(ipod.diskname), "%s", imgpath);
+    if ((ipod_open(&ipod, 1) < 0) || (ipod_reopen_rw(&ipod) < 0)) {
+        printf("FAIL: can't open %s\n", imgpath);
+        return 1;
+    }
+    ipod.sector_size = SS;
+
+    /* Plan: sectors 2-3 = 0x11, 3-5 zeroed, 10 = 0x22, a flush, and 20-21
+       = 0x33 by a deferred write */
+    ioplan_begin(&ipod, &plan);
+    CHECK(ipod.plan == &plan, "ioplan_begin() didn't start a plan");
+
+    memset(buf, 0x11, 2 * SS);
+    CHECK(ipod_write_at(&ipod, buf, 2 * SS, 2 * SS) == 2 * SS, "planned write failed");
+    CHECK(ipod_zero_range(&ipod, 3, 3) == 0, "planned zero failed");
+    memset(buf, 0x22, SS);
+    CHECK((ipod_seek(&ipod, 10 * SS) == 0) && (ipod_write(&ipod, buf, SS) == SS),
+          "planned sequential write failed");
+    CHECK(ipod_sync(&ipod) == 0, "planned flush failed");
+    memset(deferbuf, 0x33, 2 * SS);
+    CHECK(ioplan_defer(ipod.plan, 20 * SS, 2 * SS, deferred_write, deferbuf) == 0,
+          "planned deferred write failed");
+
+    /* Nothing written yet, but reads see the plan */
+    check_image(imgpath, "while planning");
+
+    CHECK(ipod_read_at(&ipod, buf, 6 * SS, SS) == 6 * SS, "read while planning failed");
+    CHECK(sector_is(buf, OLD) && sector_is(buf + SS, 0x11) &&
+          sector_is(buf + 2 * SS, 0) && sector_is(buf + 4 * SS, 0) &&
+          sector_is(buf + 5 * SS, OLD), "read of sectors 1-6 doesn't see the planned data");
+    CHECK((ipod_seek(&ipod, 10 * SS) == 0) && (ipod_read(&ipod, buf, SS) == SS) &&
+          sector_is(buf, 0x22), "sequential read doesn't see the planned data");
+
+    CHECK(plan.total[IOPLAN_WRITE] == 3 * SS, "%d bytes of writes planned, not %d",
+          (int)plan.total[IOPLAN_WRITE], 3 * SS);
+    CHECK(plan.total[IOPLAN_ZERO] == 3 * SS, "%d bytes of zeros planned, not %d",
+          (int)plan.total[IOPLAN_ZERO], 3 * SS);
+    CHECK(plan.total[IOPLAN_READ] == 7 * SS, "%d bytes of reads planned, not %d",
+          (int)plan.total[IOPLAN_READ], 7 * SS);
+
+    CHECK(ioplan_end(&ipod, &plan, 0) == 0, "running the plan failed");
+    CHECK(ipod.plan == NULL, "ioplan_end() left the plan set");
+
+    want[2] = 0x11;
+    want[3] = want[4] = want[5] = 0;
+    want[10] = 0x22;
+    want[20] = want[21] = 0x33;
+    check_image(imgpath, "after running the plan");
+
+    /* Planning failed - nothing may be written */
+    ioplan_begin(&ipod, &plan);
+    memset(buf, 0x44, SS);
+    ipod_write_at(&ipod, buf, SS, 30 * SS);
+    CHECK(ioplan_end(&ipod, &plan, -1) == -1, "failed planning didn't fail");
+    check_image(imgpath, "after failed planning");
+
+    /* A plan inside a dry run's plan is left to the dry run */
+    ioplan_init(&outer, 1);
+    ipod.plan = &outer;
+    ioplan_begin(&ipod, &plan);
+    ipod_write_at(&ipod, buf, SS, 30 * SS);
+    CHECK(ioplan_end(&ipod, &plan, 0) == 0, "nested plan failed");
+    CHECK(ipod.plan == &outer, "nested plan replaced the outer one");
+    CHECK(outer.total[IOPLAN_WRITE] == SS, "nested write not in the outer plan");
+    ipod.plan = NULL;
+    ioplan_free(&outer);
+    check_image(imgpath, "after a dry run");
+
+    ipod_close(&ipod);
+    unlink(imgpath);
+
+    if (errors) {
+        printf("ioplan: %d errors\n", errors);
+        return 1;
+    }
+    printf("ioplan: OK\n");
+    return 0;
+}
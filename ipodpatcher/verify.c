@@ -0,0 +1,405 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "ipodio.h"
+#include "verify.h"
+#include "pipeline.h"
+#include "crc32.h"
+
+/* Size of the read requests used to read back the disk */
+#define VERIFY_READ_SIZE (4*1024*1024)
+
+/* CRCs in each block of the CRC store - 4MB a block */
+#define VERIFY_CRC_BLOCK (1024*1024)
+
+struct verify_ctx_t {
+    struct ipod_t* ipod;
+    struct verify_t* v;
+    uint64_t next;        /* Next run to read back */
+    uint64_t nextpos;     /* and the next sector within it */
+    uint32_t zerocrc;
+    uint64_t verified;
+};
+
+void verify_init(struct verify_t* v)
+{
+    memset(v, 0, sizeof(*v));
+}
+
+void verify_free(struct verify_t* v)
+{
+    uint64_t i;
+
+    for (i = 0; i < v->nblocks; i++) {
+        free(v->crcblocks[i]);
+    }
+    free(v->crcblocks);
+    free(v->runs);
+    memset(v, 0, sizeof(*v));
+}
+
+void verify_crcs(int sector_size, const unsigned char* buf, int len,
+                 uint32_t* crcs)
+{
+    int i;
+
+    for (i = 0; i < len / sector_size; i++) {
+        crcs[i] = crc32_update(0, buf + i * sector_size, sector_size);
+    }
+}
+
+void verify_expect(struct verify_t* v, const unsigned char* buf,
+                   const uint32_t* crcs, uint64_t len)
+{
+    v->expectbuf = buf;
+    v->expect = crcs;
+    v->expectlen = len;
+}
+
+static uint32_t* crc_at(struct verify_t* v, uint64_t i)
+{
+    return &v->crcblocks[i / VERIFY_CRC_BLOCK][i % VERIFY_CRC_BLOCK];
+}
+
+/* Make room for n more CRCs in the store.  The blocks never move, so
+   this costs no copying however much is written. */
+static int reserve_crcs(struct verify_t* v, uint64_t n)
+{
+    uint64_t needed = (v->ncrcs + n + VERIFY_CRC_BLOCK - 1) / VERIFY_CRC_BLOCK;
+    uint32_t** blocks;
+
+    if (needed <= v->nblocks) {
+        return 0;
+    }
+
+    blocks = realloc(v->crcblocks, needed * sizeof(uint32_t*));
+    if (blocks == NULL) {
+        return -1;
+    }
+    v->crcblocks = blocks;
+
+    while (v->nblocks < needed) {
+        blocks[v->nblocks] = malloc(VERIFY_CRC_BLOCK * sizeof(uint32_t));
+        if (blocks[v->nblocks] == NULL) {
+            return -1;
+        }
+        v->nblocks++;
+    }
+
+    return 0;
+}
+
+static int add_run(struct verify_t* v, uint64_t sector, uint64_t count,
+                   uint64_t crc)
+{
+    struct verify_run_t* r;
+    uint64_t newsize;
+
+    if (v->nruns == v->allocated) {
+        newsize = (v->allocated == 0) ? 1024 : v->allocated * 2;
+        if (newsize > SIZE_MAX / sizeof(struct verify_run_t)) {
+            return -1;
+        }
+        r = realloc(v->runs, newsize * sizeof(struct verify_run_t));
+        if (r == NULL) {
+            return -1;
+        }
+        v->runs = r;
+        v->allocated = newsize;
+    }
+
+    r = &v->runs[v->nruns++];
+    r->sector = sector;
+    r->count = count;
+    r->crc = crc;
+    return 0;
+}
+
+/* Forget whatever was recorded for sectors first to end-1, which are
+   about to be written again */
+static int forget_sectors(struct verify_t* v, uint64_t first, uint64_t end)
+{
+    struct verify_run_t* r;
+    uint64_t runend;
+    uint64_t skip;
+    uint64_t i = 0;
+
+    while (i < v->nruns) {
+        r = &v->runs[i];
+        runend = r->sector + r->count;
+
+        if ((runend <= first) || (r->sector >= end)) {
+            i++;
+        } else if ((r->sector < first) && (runend > end)) {
+            /* The new write is in the middle of this run - split it.  The
+               runs don't overlap, so nothing else can be affected. */
+            skip = end - r->sector;
+            r->count = first - r->sector;
+            return add_run(v, end, runend - end,
+                           (r->crc == VERIFY_ZEROS) ? VERIFY_ZEROS : r->crc + skip);
+        } else if (r->sector < first) {
+            r->count = first - r->sector;
+            i++;
+        } else if (runend > end) {
+            skip = end - r->sector;
+            r->sector = end;
+            r->count -= skip;
+            if (r->crc != VERIFY_ZEROS) {
+                r->crc += skip;
+            }
+            i++;
+        } else {
+            /* All of it is being rewritten */
+            *r = v->runs[--v->nruns];
+        }
+    }
+
+    return 0;
+}
+
+void verify_add(struct verify_t* v, int sector_size, uint64_t pos,
+                const unsigned char* buf, uint64_t len)
+{
+    struct verify_run_t* last;
+    const uint32_t* crcs = NULL;
+    uint64_t first = pos / sector_size;
+    uint64_t n = len / sector_size;
+    uint64_t crc;
+    uint64_t i;
+
+    /* Only ever use the CRCs from verify_expect() for the write they
+       were meant for */
+    if ((v->expect != NULL) && (buf == v->expectbuf) && (len == v->expectlen)) {
+        crcs = v->expect;
+    }
+    v->expect = NULL;
+
+    /* We only ever write whole sectors, but don't record anything we
+       couldn't read back */
+    if (v->failed || ((pos % sector_size) != 0) || (n == 0)) {
+        return;
+    }
+
+    if ((first < v->end) && (forget_sectors(v, first, first + n) < 0)) {
+        v->failed = 1;
+        return;
+    }
+
+    if (buf == NULL) {
+        crc = VERIFY_ZEROS;
+    } else {
+        if (reserve_crcs(v, n) < 0) {
+            v->failed = 1;
+            return;
+        }
+        crc = v->ncrcs;
+        for (i = 0; i < n; i++) {
+            if (crcs != NULL) {
+                *crc_at(v, crc + i) = crcs[i];
+            } else {
+                *crc_at(v, crc + i) = crc32_update(0, buf + i * sector_size, sector_size);
+            }
+        }
+        v->ncrcs += n;
+    }
+
+    if (first + n > v->end) {
+        v->end = first + n;
+    }
+
+    /* Carry on the last run if this write follows on from it */
+    if (v->nruns > 0) {
+        last = &v->runs[v->nruns - 1];
+        if ((last->sector + last->count == first) &&
+            (((crc == VERIFY_ZEROS) && (last->crc == VERIFY_ZEROS)) ||
+             ((crc != VERIFY_ZEROS) && (last->crc != VERIFY_ZEROS) &&
+              (last->crc + last->count == crc)))) {
+            last->count += n;
+            return;
+        }
+    }
+
+    if (add_run(v, first, n, crc) < 0) {
+        v->failed = 1;
+    }
+}
+
+static int compare_runs(const void* a, const void* b)
+{
+    const struct verify_run_t* x = a;
+    const struct verify_run_t* y = b;
+
+    return (x->sector < y->sector) ? -1 : (x->sector > y->sector);
+}
+
+/* Read the next piece of a run (up to VERIFY_READ_SIZE), with the CRCs
+   it should have in slot->crcs */
+static int verify_produce(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct verify_ctx_t* c = ctx;
+    struct verify_t* v = c->v;
+    struct verify_run_t* r;
+    int ss = c->ipod->sector_size;
+    uint64_t sector;
+    uint64_t n;
+    uint64_t i;
+
+    if (c->next == v->nruns) {
+        return 0;
+    }
+
+    r = &v->runs[c->next];
+    n = r->count - c->nextpos;
+    if (n > (uint64_t)(VERIFY_READ_SIZE / ss)) {
+        n = VERIFY_READ_SIZE / ss;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (r->crc == VERIFY_ZEROS) {
+            slot->crcs[i] = c->zerocrc;
+        } else {
+            slot->crcs[i] = *crc_at(v, r->crc + c->nextpos + i);
+        }
+    }
+
+    sector = r->sector + c->nextpos;
+    slot->hash = sector;
+    slot->inlen = n * ss;
+
+    c->nextpos += n;
+    if (c->nextpos == r->count) {
+        c->next++;
+        c->nextpos = 0;
+    }
+
+    if (ipod_read_at(c->ipod, slot->inbuf, slot->inlen, sector * ss) != slot->inlen) {
+        fprintf(stderr,"[ERR]  Verify: read of sector %" PRIu64 " failed\n", sector);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Compare each sector, remembering the first mismatch (+1) in flags */
+static int verify_work(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct verify_ctx_t* c = ctx;
+    int ss = c->ipod->sector_size;
+    int i;
+
+    for (i = 0; i < slot->inlen / ss; i++) {
+        if (crc32_update(0, slot->inbuf + i * ss, ss) != slot->crcs[i]) {
+            slot->flags = i + 1;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int verify_consume(void* ctx, struct pipeline_slot_t* slot)
+{
+    struct verify_ctx_t* c = ctx;
+    uint64_t sector;
+
+    if (slot->flags) {
+        sector = slot->hash + slot->flags - 1;
+        fprintf(stderr,"[ERR]  Verify failed - first mismatch at sector %" PRIu64 
+                       " (byte offset 0x%08" PRIx64 ")\n",
+                       sector, sector * c->ipod->sector_size);
+        return -1;
+    }
+
+    c->verified += slot->inlen / c->ipod->sector_size;
+    return 0;
+}
+
+int verify_run(struct ipod_t* ipod, struct verify_t* v)
+{
+    struct verify_ctx_t c;
+    struct pipeline_t p;
+    struct ipod_t uncached;
+    unsigned char* zeros;
+    uint64_t sectors = 0;
+    uint64_t i;
+    int res;
+
+    if (v->failed) {
+        fprintf(stderr,"[ERR]  Out of memory recording writes - can not verify\n");
+        return -1;
+    }
+
+    if (v->nruns == 0) {
+        fprintf(stderr,"[INFO] Nothing written - nothing to verify\n");
+        return 0;
+    }
+
+    /* The runs don't overlap, so reading them in order of sector reads
+       the disk from start to end */
+    qsort(v->runs, v->nruns, sizeof(struct verify_run_t), compare_runs);
+    for (i = 0; i < v->nruns; i++) {
+        sectors += v->runs[i].count;
+    }
+
+    if (ipod_sync(ipod) < 0) {
+        fprintf(stderr,"[ERR]  Could not flush writes to disk\n");
+        return -1;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.v = v;
+
+    zeros = calloc(1, ipod->sector_size);
+    if (zeros == NULL) {
+        fprintf(stderr,"[ERR]  Out of memory\n");
+        return -1;
+    }
+    c.zerocrc = crc32_update(0, zeros, ipod->sector_size);
+    free(zeros);
+
+    if (ipod_open_uncached(ipod, &uncached) < 0) {
+        return -1;
+    }
+    c.ipod = &uncached;
+
+    memset(&p, 0, sizeof(p));
+    p.nthreads = pipeline_default_threads();
+    p.inbufsize = VERIFY_READ_SIZE;
+    p.ncrcs = VERIFY_READ_SIZE / 512;
+    p.produce = verify_produce;
+    p.work = verify_work;
+    p.consume = verify_consume;
+    p.ctx = &c;
+
+    fprintf(stderr,"[INFO] Verifying %" PRIu64 " sectors...\n", sectors);
+
+    res = pipeline_run(&p);
+    ipod_close(&uncached);
+
+    if (res == 0) {
+        fprintf(stderr,"[INFO] Verified %" PRIu64 " sectors OK\n", c.verified);
+    }
+
+    return res;
+}
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#ifndef __VERIFY_H
+#define __VERIFY_H
+
+#include <stdint.h>
+
+#include "ipodio.h"
+
+/* Verify-after-write: every sector written while ipod->verify is set is
+   recorded with a CRC-32 of the data, and verify_run() reads them all
+   back from the disk and compares.
+
+   Writes are kept as runs of consecutive sectors, so a long sequential
+   write is one run however big it is.  The CRCs of the sectors in the
+   runs are kept in a separate store, 4 bytes per sector, and runs of
+   zeros need no CRCs at all.  A later write to a sector replaces the
+   earlier one, so the runs never overlap. */
+
+#define VERIFY_ZEROS UINT64_MAX   /* crc of a run of zeros */
+
+struct verify_run_t {
+    uint64_t sector;
+    uint64_t count;
+    uint64_t crc;        /* Index of the first sector's CRC in the store */
+};
+
+struct verify_t {
+    struct verify_run_t* runs;
+    uint64_t nruns;
+    uint64_t allocated;
+    uint64_t end;        /* Sector after the end of the furthest run */
+
+    uint32_t** crcblocks;    /* The CRC store, VERIFY_CRC_BLOCK to a block */
+    uint64_t nblocks;
+    uint64_t ncrcs;
+
+    int failed;          /* Ran out of memory recording writes */
+
+    /* CRCs worked out in advance for the next write - see verify_expect() */
+    const unsigned char* expectbuf;
+    const uint32_t* expect;
+    uint64_t expectlen;
+};
+
+void verify_init(struct verify_t* v);
+void verify_free(struct verify_t* v);
+
+/* Record a write of len bytes at byte offset pos.  buf may be NULL for a
+   range of zeros. */
+void verify_add(struct verify_t* v, int sector_size, uint64_t pos,
+                const unsigned char* buf, uint64_t len);
+
+/* The CRC of each sector of buf, as verify_add() would record them.
+   This is the expensive part of recording a write, so the pipelines call
+   it on a worker thread rather than leaving it to the thread writing. */
+void verify_crcs(int sector_size, const unsigned char* buf, int len,
+                 uint32_t* crcs);
+
+/* Tell verify_add() that the next write of len bytes from buf has the
+   sector CRCs crcs, which must stay valid until that write. */
+void verify_expect(struct verify_t* v, const unsigned char* buf,
+                   const uint32_t* crcs, uint64_t len);
+
+/* Read back everything recorded so far and compare.  Returns 0 if it all
+   matches, -1 otherwise (after reporting the first bad sector). */
+int verify_run(struct ipod_t* ipod, struct verify_t* v);
+
+#endif